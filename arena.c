@@ -0,0 +1,70 @@
+#include "shell.h"
+
+/* Bump allocator for data that lives as long as a single command line.
+ * Chunks are never returned to malloc, reset just rewinds to the first one,
+ * so after a few lines evaluation runs without calling malloc at all. */
+
+#define ARENA_CHUNK 4096
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+    struct arena_chunk* next; /* next chunk, possibly used before reset */
+    size_t size;              /* number of bytes in data */
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+void* arena_alloc(arena_t* arena, size_t n) {
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    while (arena->cur == NULL || arena->used + n > arena->cur->size) {
+        struct arena_chunk* next = arena->cur ? arena->cur->next : arena->first;
+
+        /* Insert a big enough chunk, if the one we'd move to is too small. */
+        if (next == NULL || next->size < n) {
+            size_t size = max(n, (size_t)ARENA_CHUNK);
+            struct arena_chunk* chunk =
+                malloc(sizeof(struct arena_chunk) + size);
+            chunk->size = size;
+            chunk->next = next;
+            if (arena->cur)
+                arena->cur->next = chunk;
+            else
+                arena->first = chunk;
+            next = chunk;
+        }
+
+        arena->cur = next;
+        arena->used = 0;
+    }
+
+    void* ptr = arena->cur->data + arena->used;
+    arena->used += n;
+    return ptr;
+}
+
+char* arena_strndup(arena_t* arena, const char* s, size_t n) {
+    char* copy = arena_alloc(arena, n + 1);
+    memcpy(copy, s, n);
+    copy[n] = '\0';
+    return copy;
+}
+
+char* arena_strdup(arena_t* arena, const char* s) {
+    return arena_strndup(arena, s, strlen(s));
+}
+
+/* Release all memory allocated from the arena in O(1). */
+void arena_reset(arena_t* arena) {
+    arena->cur = NULL;
+    arena->used = 0;
+}
+
+arena_mark_t arena_mark(arena_t* arena) {
+    return (arena_mark_t){arena->cur, arena->used};
+}
+
+/* Release memory allocated since mark was taken, chunks stay for reuse. */
+void arena_release(arena_t* arena, arena_mark_t mark) {
+    arena->cur = mark.cur;
+    arena->used = mark.used;
+}
@@ -0,0 +1,206 @@
+#include "csapp.h"
+
+/* Runs scripted workloads through a non-interactive shell and reports its
+ * throughput, latency of starting commands and peak memory usage. Latencies
+ * are taken from trace of the shell itself, i.e. SHELL_STATS=trace, so they
+ * include neither parsing nor waiting for children. Startup workload runs
+ * 'shell -c true' repeatedly and measures whole invocations instead. */
+
+typedef struct {
+    const char* name;
+    void (*generate)(FILE* script, int scale);
+} workload_t;
+
+static void sequential(FILE* script, int scale) {
+    for (int i = 0; i < 2000 * scale; i++)
+        fprintf(script, "true\n");
+}
+
+static void pipeline(FILE* script, int scale) {
+    for (int i = 0; i < 100 * scale; i++) {
+        fprintf(script, "echo x");
+        for (int j = 0; j < 25; j++)
+            fprintf(script, " | cat");
+        fprintf(script, " > /dev/null\n");
+    }
+}
+
+static void background(FILE* script, int scale) {
+    for (int i = 0; i < 2000 * scale; i++)
+        fprintf(script, "true &\n");
+}
+
+static void arguments(FILE* script, int scale) {
+    for (int i = 0; i < 100 * scale; i++) {
+        fprintf(script, "true");
+        for (int j = 0; j < 10000; j++)
+            fprintf(script, " argument%d", j);
+        fprintf(script, "\n");
+    }
+}
+
+static const workload_t workloads[] = {
+    {"sequential", sequential},
+    {"pipeline", pipeline},
+    {"background", background},
+    {"arguments", arguments},
+    {NULL, NULL},
+};
+
+typedef struct {
+    uint64_t* ns;
+    size_t n, size;
+} samples_t;
+
+static void addsample(samples_t* s, uint64_t ns) {
+    if (s->n == s->size) {
+        s->size = s->size ? s->size * 2 : 1024;
+        s->ns = realloc(s->ns, sizeof(uint64_t) * s->size);
+    }
+    s->ns[s->n++] = ns;
+}
+
+static int compare(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(samples_t* s, int p) {
+    if (s->n == 0)
+        return 0;
+    return s->ns[(s->n - 1) * p / 100];
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void run(const char* shell, const workload_t* w, int scale) {
+    char path[] = "/tmp/shell-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        unix_error("mkstemp error");
+    FILE* script = fdopen(fd, "w");
+    w->generate(script, scale);
+    fclose(script);
+
+    int fds[2];
+    Pipe(fds);
+
+    double start = now();
+    pid_t pid = Fork();
+    if (pid == 0) {
+        int devnull = Open("/dev/null", O_WRONLY, 0);
+        Dup2(devnull, STDOUT_FILENO);
+        Dup2(fds[1], STDERR_FILENO);
+        Close(devnull);
+        Close(fds[0]);
+        Close(fds[1]);
+        setenv("SHELL_STATS", "trace", 1);
+        execl(shell, shell, path, NULL);
+        unix_error("execl error");
+    }
+    Close(fds[1]);
+
+    /* Spawn covers exec, fork doesn't. */
+    samples_t spawn = {};
+    uint64_t fork = 0;
+    char line[256];
+    FILE* trace = fdopen(fds[0], "r");
+    while (fgets(line, sizeof(line), trace)) {
+        unsigned long ns;
+        if (sscanf(line, "trace: spawn %luns", &ns) == 1) {
+            addsample(&spawn, ns);
+        } else if (sscanf(line, "trace: fork %luns", &ns) == 1) {
+            fork = ns;
+        } else if (sscanf(line, "trace: exec %luns", &ns) == 1) {
+            addsample(&spawn, fork + ns);
+        }
+    }
+    fclose(trace);
+
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) < 0)
+        unix_error("wait4 error");
+    double elapsed = now() - start;
+    unlink(path);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+        app_error("%s: shell failed", w->name);
+
+    qsort(spawn.ns, spawn.n, sizeof(uint64_t), compare);
+    printf("%-12s %8zu %10.0f %10.1f %10.1f %10ld\n", w->name, spawn.n,
+           spawn.n / elapsed, percentile(&spawn, 50) / 1e3,
+           percentile(&spawn, 99) / 1e3, ru.ru_maxrss);
+    free(spawn.ns);
+}
+
+static void startup(const char* shell, int scale) {
+    samples_t wall = {};
+    long maxrss = 0;
+    double start = now();
+
+    for (int i = 0; i < 200 * scale; i++) {
+        double began = now();
+        pid_t pid = Fork();
+        if (pid == 0) {
+            execl(shell, shell, "-c", "true", NULL);
+            unix_error("execl error");
+        }
+
+        int status;
+        struct rusage ru;
+        if (wait4(pid, &status, 0, &ru) < 0)
+            unix_error("wait4 error");
+        if (!WIFEXITED(status) || WEXITSTATUS(status))
+            app_error("startup: shell failed");
+
+        addsample(&wall, (now() - began) * 1e9);
+        if (ru.ru_maxrss > maxrss)
+            maxrss = ru.ru_maxrss;
+    }
+    double elapsed = now() - start;
+
+    qsort(wall.ns, wall.n, sizeof(uint64_t), compare);
+    printf("%-12s %8zu %10.0f %10.1f %10.1f %10ld\n", "startup", wall.n,
+           wall.n / elapsed, percentile(&wall, 50) / 1e3,
+           percentile(&wall, 99) / 1e3, maxrss);
+    free(wall.ns);
+}
+
+static bool selected(int argc, char* argv[], const char* name) {
+    bool selected = argc <= 3;
+    for (int i = 3; i < argc; i++)
+        selected |= !strcmp(argv[i], name);
+    return selected;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2)
+        app_error("usage: %s shell [scale] [workload...]", argv[0]);
+
+    int scale = argc > 2 ? atoi(argv[2]) : 1;
+    if (scale < 1)
+        app_error("scale must be positive");
+
+    printf("%-12s %8s %10s %10s %10s %10s\n", "workload", "commands",
+           "cmds/s", "p50 us", "p99 us", "rss kB");
+    fflush(stdout);
+
+    if (selected(argc, argv, "startup")) {
+        startup(argv[1], scale);
+        fflush(stdout);
+    }
+
+    for (const workload_t* w = workloads; w->name; w++) {
+        if (selected(argc, argv, w->name)) {
+            run(argv[1], w, scale);
+            fflush(stdout);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,154 @@
+#include "csapp.h"
+#include "hashtab.h"
+#include "tree.h"
+
+/* Compares hash tables of hashtab.h with red-black trees of tree.h, keyed by
+ * strings like names of variables or commands. Each run inserts n keys,
+ * looks up each of them, then as many keys that aren't there, and removes
+ * them all. Reports nanoseconds per operation. */
+
+typedef struct entry {
+    char* key;
+    RB_ENTRY(entry) link;
+} entry_t;
+
+static int entrycmp(const entry_t* a, const entry_t* b) {
+    return strcmp(a->key, b->key);
+}
+
+static void entryhash(const entry_t* e, uint32_t h[2]) {
+    HT_HASH(e->key, strlen(e->key), h);
+}
+
+RB_HEAD(entrytree, entry);
+RB_GENERATE_STATIC(entrytree, entry, link, entrycmp);
+
+HT_HEAD(entrytab, entry);
+HT_GENERATE_STATIC(entrytab, entry, entryhash, entrycmp);
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Keys of all entries come from a single block, as they would from an arena,
+ * present ones first, then those that are looked up and missed. */
+static entry_t* mkentries(int n, char** textp) {
+    entry_t* entries = malloc(sizeof(entry_t) * 2 * n);
+    char* text = malloc((size_t)2 * n * 32);
+    char* p = text;
+    for (int i = 0; i < 2 * n; i++) {
+        entries[i].key = p;
+        p += sprintf(p, "%s_%08x_%d", i < n ? "var" : "nil",
+                     jenkins_hash(&i, sizeof(i), HASHINIT), i) + 1;
+    }
+    *textp = text;
+    return entries;
+}
+
+typedef struct {
+    double insert, hit, miss, remove;
+} timing_t;
+
+static void tree(entry_t* entries, int n, timing_t* t) {
+    struct entrytree head = RB_INITIALIZER(&head);
+    double start = now();
+    for (int i = 0; i < n; i++)
+        RB_INSERT(entrytree, &head, &entries[i]);
+    t->insert = now() - start;
+
+    start = now();
+    for (int i = 0; i < n; i++)
+        if (RB_FIND(entrytree, &head, &entries[i]) != &entries[i])
+            app_error("tree: key %s lost", entries[i].key);
+    t->hit = now() - start;
+
+    start = now();
+    for (int i = n; i < 2 * n; i++)
+        if (RB_FIND(entrytree, &head, &entries[i]) != NULL)
+            app_error("tree: key %s found", entries[i].key);
+    t->miss = now() - start;
+
+    start = now();
+    for (int i = 0; i < n; i++)
+        RB_REMOVE(entrytree, &head, &entries[i]);
+    t->remove = now() - start;
+}
+
+static void table(entry_t* entries, int n, timing_t* t) {
+    struct entrytab head = HT_INITIALIZER(&head);
+    double start = now();
+    for (int i = 0; i < n; i++)
+        HT_INSERT(entrytab, &head, &entries[i]);
+    t->insert = now() - start;
+
+    start = now();
+    for (int i = 0; i < n; i++)
+        if (HT_FIND(entrytab, &head, &entries[i]) != &entries[i])
+            app_error("table: key %s lost", entries[i].key);
+    t->hit = now() - start;
+
+    start = now();
+    for (int i = n; i < 2 * n; i++)
+        if (HT_FIND(entrytab, &head, &entries[i]) != NULL)
+            app_error("table: key %s found", entries[i].key);
+    t->miss = now() - start;
+
+    start = now();
+    for (int i = 0; i < n; i++)
+        if (HT_REMOVE(entrytab, &head, &entries[i]) != &entries[i])
+            app_error("table: key %s not removed", entries[i].key);
+    t->remove = now() - start;
+
+    if (HT_COUNT(&head) != 0)
+        app_error("table: %u keys left", HT_COUNT(&head));
+    HT_FREE(entrytab, &head);
+}
+
+static void report(const char* name, int n, timing_t* t) {
+    double ns = 1e9 / n;
+    printf("%-6s %8d %10.1f %10.1f %10.1f %10.1f\n", name, n, t->insert * ns,
+           t->hit * ns, t->miss * ns, t->remove * ns);
+}
+
+/* Total time spent is kept about the same for all sizes. */
+static void bench(int n, int scale) {
+    char* text;
+    entry_t* entries = mkentries(n, &text);
+    int rounds = max(1, scale * 1000000 / n);
+    timing_t best[2];
+
+    for (int r = 0; r < rounds; r++) {
+        timing_t t[2];
+        tree(entries, n, &t[0]);
+        table(entries, n, &t[1]);
+        for (int k = 0; k < 2; k++) {
+            if (r == 0 || t[k].insert < best[k].insert)
+                best[k].insert = t[k].insert;
+            if (r == 0 || t[k].hit < best[k].hit)
+                best[k].hit = t[k].hit;
+            if (r == 0 || t[k].miss < best[k].miss)
+                best[k].miss = t[k].miss;
+            if (r == 0 || t[k].remove < best[k].remove)
+                best[k].remove = t[k].remove;
+        }
+    }
+
+    report("tree", n, &best[0]);
+    report("table", n, &best[1]);
+    free(entries);
+    free(text);
+}
+
+int main(int argc, char* argv[]) {
+    int scale = argc > 1 ? atoi(argv[1]) : 1;
+    if (scale < 1)
+        app_error("usage: %s [scale]", argv[0]);
+
+    printf("%-6s %8s %10s %10s %10s %10s\n", "", "keys", "insert", "hit",
+           "miss", "remove");
+    for (int n = 16; n <= 1000000; n *= 8)
+        bench(n, scale);
+    return 0;
+}
@@ -0,0 +1,379 @@
+#include "csapp.h"
+#include "queue.h"
+#include "rio.h"
+#include "tree.h"
+
+#include <sched.h>
+
+#ifdef LINUX
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+/* Measures primitives of libcsapp the shell leans on: jenkins_hash at key
+ * sizes of 4 to 4096 bytes, reading lines and blocks with rio from a file of
+ * scale gigabytes, safe_printf formatting and red-black trees of 1k to 1M
+ * nodes along with tail queues. The process is pinned to the CPU it starts
+ * on. Each case is warmed up while the number of iterations that take at
+ * least 50ms times scale is found, then the best of a few runs is reported
+ * with cycles and instructions per operation if perf counters can be read. */
+
+#define RUNS 5
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int scale = 1;
+static volatile uint64_t sink; /* results go here, so work isn't elided */
+
+/* Counters of cycles and instructions spent in user mode, read as a group. */
+static int perf_fd = -1;
+
+#ifdef LINUX
+static int perfopen(uint64_t config, int group) {
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(attr),
+        .config = config,
+        .disabled = group < 0,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+        .read_format = PERF_FORMAT_GROUP,
+    };
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static void startperf(void) {
+    if ((perf_fd = perfopen(PERF_COUNT_HW_CPU_CYCLES, -1)) < 0)
+        return;
+    if (perfopen(PERF_COUNT_HW_INSTRUCTIONS, perf_fd) < 0) {
+        close(perf_fd);
+        perf_fd = -1;
+    }
+}
+
+static void resetperf(void) {
+    if (perf_fd < 0)
+        return;
+    (void)ioctl(perf_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    (void)ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+/* Cycles and instructions since resetperf, false if they aren't known. */
+static bool readperf(uint64_t* cycles, uint64_t* insns) {
+    struct {
+        uint64_t nr, values[2];
+    } data;
+    if (perf_fd < 0)
+        return false;
+    (void)ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    if (read(perf_fd, &data, sizeof(data)) != sizeof(data) || data.nr != 2)
+        return false;
+    *cycles = data.values[0];
+    *insns = data.values[1];
+    return true;
+}
+#else
+static void startperf(void) {
+}
+
+static void resetperf(void) {
+}
+
+static bool readperf(uint64_t* cycles, uint64_t* insns) {
+    return false;
+}
+#endif
+
+/* Each iteration of a case does ops operations over bytes bytes, bytes may
+ * be 0 if throughput makes no sense. */
+typedef struct {
+    const char* name;
+    long ops;
+    size_t bytes;
+    void (*run)(void* arg, long iters);
+    void* arg;
+} case_t;
+
+static void measure(const case_t* c) {
+    long iters = 1;
+    double elapsed;
+
+    /* Warm up caches, branch predictors and CPU frequency, then find how
+     * many iterations take long enough. */
+    c->run(c->arg, iters);
+    while (true) {
+        double start = now();
+        c->run(c->arg, iters);
+        elapsed = now() - start;
+        if (elapsed >= 0.05 * scale)
+            break;
+        iters = elapsed < 0.005 ? iters * 10 : iters * 2;
+    }
+
+    double best = 0;
+    uint64_t cycles = 0, insns = 0;
+    bool counted = false;
+    for (int r = 0; r < RUNS; r++) {
+        uint64_t cy = 0, in = 0;
+        resetperf();
+        double start = now();
+        c->run(c->arg, iters);
+        elapsed = now() - start;
+        bool ok = readperf(&cy, &in);
+        if (r == 0 || elapsed < best) {
+            best = elapsed;
+            counted = ok;
+            cycles = cy, insns = in;
+        }
+    }
+
+    double ops = (double)c->ops * iters;
+    printf("%-20s %12.2f", c->name, best * 1e9 / ops);
+    if (c->bytes)
+        printf(" %12.1f", c->bytes * iters / best / 1e6);
+    else
+        printf(" %12s", "-");
+    if (counted)
+        printf(" %10.1f %10.1f\n", cycles / ops, insns / ops);
+    else
+        printf(" %10s %10s\n", "-", "-");
+    fflush(stdout);
+}
+
+/* jenkins_hash over keys of a given size, aligned as the shell's are. */
+typedef struct {
+    size_t size;
+    char* key;
+} hash_t;
+
+static void runhash(void* arg, long iters) {
+    hash_t* h = arg;
+    uint32_t hash = HASHINIT;
+    for (long i = 0; i < iters; i++)
+        hash = jenkins_hash(h->key, h->size, hash);
+    sink += hash;
+}
+
+static void benchhash(void) {
+    static const size_t sizes[] = {4, 16, 64, 256, 1024, 4096};
+    char* key = malloc(4096);
+    for (int i = 0; i < 4096; i++)
+        key[i] = 'a' + i % 26;
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        char name[32];
+        hash_t h = {sizes[i], key};
+        snprintf(name, sizeof(name), "hash/%zu", sizes[i]);
+        measure(&(case_t){name, 1, sizes[i], runhash, &h});
+    }
+    free(key);
+}
+
+/* Lines of the input file vary in length like those of scripts do. */
+typedef struct {
+    int fd;
+    size_t size;
+    long nlines;
+} input_t;
+
+static bool mkinput(input_t* in) {
+    char path[] = "/tmp/shell-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        unix_error("mkstemp error");
+    unlink(path);
+
+    char block[1 << 16];
+    size_t len = 0;
+    *in = (input_t){.fd = fd};
+    for (int i = 0; len < sizeof(block) - 200; i++) {
+        int n = 8 + jenkins_hash(&i, sizeof(i), HASHINIT) % 120;
+        memset(block + len, 'x', n);
+        block[len + n] = '\n';
+        len += n + 1;
+        in->nlines++;
+    }
+
+    size_t target = (size_t)scale << 30;
+    long perblock = in->nlines;
+    in->nlines = 0;
+    for (; in->size < target; in->size += len, in->nlines += perblock)
+        if (rio_writen(in->fd, block, len) < 0) {
+            fprintf(stderr, "rio: input file: %s\n", strerror(errno));
+            Close(in->fd);
+            return false;
+        }
+    return true;
+}
+
+static void runlines(void* arg, long iters) {
+    input_t* in = arg;
+    static rio_t rio;
+    char line[256];
+    for (long i = 0; i < iters; i++) {
+        Lseek(in->fd, 0, SEEK_SET);
+        rio_readinitb(&rio, in->fd);
+        ssize_t n;
+        while ((n = rio_readlineb(&rio, line, sizeof(line))) > 0)
+            sink += n;
+    }
+}
+
+static void runblocks(void* arg, long iters) {
+    input_t* in = arg;
+    static rio_t rio;
+    static char block[1 << 16];
+    for (long i = 0; i < iters; i++) {
+        Lseek(in->fd, 0, SEEK_SET);
+        rio_readinitb(&rio, in->fd);
+        ssize_t n;
+        while ((n = rio_readnb(&rio, block, sizeof(block))) > 0)
+            sink += n;
+    }
+}
+
+/* Input is read from page cache, it's read once ahead. */
+static void benchrio(void) {
+    input_t in;
+    if (!mkinput(&in))
+        return;
+    runblocks(&in, 1);
+    measure(&(case_t){"rio/readlineb", in.nlines, in.size, runlines, &in});
+    measure(&(case_t){"rio/readnb-64k", (in.size + 65535) >> 16, in.size,
+                      runblocks, &in});
+    Close(in.fd);
+}
+
+static void runsnprintf(void* arg, long iters) {
+    char buf[128];
+    for (long i = 0; i < iters; i++)
+        sink += safe_snprintf(buf, sizeof(buf), "[%d] %s '%s', status=%d\n",
+                              (int)i, "exited", "sleep 10", (int)(i & 255));
+}
+
+static void rundprintf(void* arg, long iters) {
+    int fd = *(int*)arg;
+    for (long i = 0; i < iters; i++)
+        safe_dprintf(fd, "[%ld] %lx %s\n", i, (unsigned long)i, "running");
+}
+
+static void benchprintf(void) {
+    int fd = Open("/dev/null", O_WRONLY, 0);
+    measure(&(case_t){"safe_snprintf", 1, 0, runsnprintf, NULL});
+    measure(&(case_t){"safe_dprintf", 1, 0, rundprintf, &fd});
+    Close(fd);
+}
+
+typedef struct node {
+    RB_ENTRY(node) link;
+    TAILQ_ENTRY(node) queue;
+    uint32_t key;
+} node_t;
+
+static int nodecmp(const node_t* a, const node_t* b) {
+    return a->key < b->key ? -1 : a->key > b->key;
+}
+
+RB_HEAD(nodetree, node);
+RB_GENERATE_STATIC(nodetree, node, link, nodecmp);
+
+/* Nodes have distinct keys in no particular order. */
+typedef struct {
+    node_t* nodes;
+    int n;
+    struct nodetree tree;
+} nodes_t;
+
+static void runinsert(void* arg, long iters) {
+    nodes_t* t = arg;
+    for (long i = 0; i < iters; i++) {
+        RB_INIT(&t->tree);
+        for (int j = 0; j < t->n; j++)
+            RB_INSERT(nodetree, &t->tree, &t->nodes[j]);
+    }
+}
+
+static void runfind(void* arg, long iters) {
+    nodes_t* t = arg;
+    for (long i = 0; i < iters; i++)
+        for (int j = 0; j < t->n; j++)
+            sink += RB_FIND(nodetree, &t->tree, &t->nodes[j]) != NULL;
+}
+
+static void runqueue(void* arg, long iters) {
+    nodes_t* t = arg;
+    TAILQ_HEAD(, node) queue = TAILQ_HEAD_INITIALIZER(queue);
+    for (long i = 0; i < iters; i++) {
+        for (int j = 0; j < t->n; j++)
+            TAILQ_INSERT_TAIL(&queue, &t->nodes[j], queue);
+        while (!TAILQ_EMPTY(&queue))
+            TAILQ_REMOVE(&queue, TAILQ_FIRST(&queue), queue);
+    }
+}
+
+static void benchtree(void) {
+    for (int n = 1000; n <= 1000000; n *= 10) {
+        nodes_t t = {malloc(sizeof(node_t) * n), n};
+        for (int i = 0; i < n; i++)
+            t.nodes[i].key = jenkins_hash(&i, sizeof(i), HASHINIT) ^ i;
+
+        char name[32];
+        snprintf(name, sizeof(name), "rb-insert/%d", n);
+        measure(&(case_t){name, n, 0, runinsert, &t});
+        snprintf(name, sizeof(name), "rb-find/%d", n);
+        measure(&(case_t){name, n, 0, runfind, &t});
+        free(t.nodes);
+    }
+
+    nodes_t t = {malloc(sizeof(node_t) * 1024), 1024};
+    measure(&(case_t){"tailq-push-pop/1024", 2 * t.n, 0, runqueue, &t});
+    free(t.nodes);
+}
+
+typedef struct {
+    const char* name;
+    void (*run)(void);
+} group_t;
+
+static const group_t groups[] = {
+    {"hash", benchhash},
+    {"rio", benchrio},
+    {"printf", benchprintf},
+    {"tree", benchtree},
+    {NULL, NULL},
+};
+
+static bool selected(int argc, char* argv[], const char* name) {
+    bool selected = argc <= 2;
+    for (int i = 2; i < argc; i++)
+        selected |= !strcmp(argv[i], name);
+    return selected;
+}
+
+int main(int argc, char* argv[]) {
+    scale = argc > 1 ? atoi(argv[1]) : 1;
+    if (scale < 1)
+        app_error("usage: %s [scale] [hash|rio|printf|tree...]", argv[0]);
+
+#ifdef LINUX
+    cpu_set_t cpus;
+    int cpu = sched_getcpu();
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (cpu < 0 || sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+        fprintf(stderr, "not pinned to a CPU: %s\n", strerror(errno));
+#endif
+    startperf();
+
+    printf("%-20s %12s %12s %10s %10s\n", "case", "ns/op", "MB/s",
+           "cycles/op", "insns/op");
+    for (const group_t* g = groups; g->name; g++)
+        if (selected(argc, argv, g->name))
+            g->run();
+    return 0;
+}
@@ -1,10 +1,14 @@
 #include "shell.h"
+#include "queue.h"
+#include <poll.h>
 
 typedef int (*func_t)(char** argv);
 
 typedef struct {
     const char* name;
     func_t func;
+    bool filter; /* consumes standard input */
+    char** (*wrapped)(char** argv); /* command run by builtin or NULL */
 } command_t;
 
 static int do_quit(char** argv) {
@@ -20,7 +24,11 @@ static int do_quit(char** argv) {
 static int do_chdir(char** argv) {
     char* path = argv[0];
     if (path == NULL)
-        path = getenv("HOME");
+        path = (char*)getvar("HOME");
+    if (path == NULL) {
+        msg("cd: HOME not set\n");
+        return 1;
+    }
     int rc = chdir(path);
     if (rc < 0) {
         msg("cd: %s: %s\n", strerror(errno), path);
@@ -29,11 +37,41 @@ static int do_chdir(char** argv) {
     return 0;
 }
 
+/*
+ * Replace the shell with a command.
+ * 'exec' - keep redirections of the command for the rest of the shell's life
+ * 'exec command...' - execute command in place of the shell
+ */
+static int do_exec(char** argv) {
+    if (!argv[0])
+        return 0;
+
+    /* Shell carries on if there's nothing to execute. */
+    if (!index(argv[0], '/') && !lookupcmd(argv[0])) {
+        msg("exec: %s: not found\n", argv[0]);
+        return EXIT_NOTFOUND;
+    }
+    replaceshell(argv, builtin_envp ? builtin_envp : envblock());
+}
+
 /*
  * Displays all stopped or running jobs.
+ * 'jobs -v' - also show time & memory used by each process
+ * 'jobs --format=binary|json' - write records of jobs and their processes
+ * for programs that monitor the shell, see jobshdr_t
  */
 static int do_jobs(char** argv) {
-    watchjobs(ALL);
+    if (argv[0] && !strncmp(argv[0], "--format=", 9)) {
+        const char* format = argv[0] + 9;
+        if (!strcmp(format, "binary") || !strcmp(format, "json")) {
+            exportjobs(!strcmp(format, "json") ? JOBS_JSON : JOBS_BINARY);
+            return 0;
+        }
+        msg("jobs: unknown format: %s\n", format);
+        return 2;
+    }
+    bool verbose = argv[0] && !strcmp(argv[0], "-v");
+    listjobs(verbose);
     return 0;
 }
 
@@ -70,20 +108,27 @@ static int do_bg(char** argv) {
 }
 
 /*
- * Make stopped background job running.
- * 'bg' choose highest numbered job
- * 'bg n' choose job number n
+ * Terminate background job.
+ * 'kill %n' choose job number n
+ * 'kill pgid' choose job running in process group pgid
  */
 static int do_kill(char** argv) {
-    if (!argv[0])
-        return -1;
-    if (*argv[0] != '%')
+    if (!argv[0] || argv[1])
         return -1;
 
-    int j = atoi(argv[0] + 1);
+    bool pgid = *argv[0] != '%';
+    if (pgid && strspn(argv[0], "0123456789") != strlen(argv[0]))
+        return -1;
 
     sigset_t mask;
     Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+    int j = pgid ? pgidjob(atoi(argv[0])) : atoi(argv[0] + 1);
+    if (pgid && j < 0) {
+        Sigprocmask(SIG_SETMASK, &mask, NULL);
+        return -1;
+    }
+
     if (!killjob(j))
         msg("kill: job not found: %s\n", argv[0]);
     Sigprocmask(SIG_SETMASK, &mask, NULL);
@@ -91,44 +136,1090 @@ static int do_kill(char** argv) {
     return 0;
 }
 
+static void printtimes(struct rusage* ru) {
+    long user = ru->ru_utime.tv_sec * 1000 + ru->ru_utime.tv_usec / 1000;
+    long sys = ru->ru_stime.tv_sec * 1000 + ru->ru_stime.tv_usec / 1000;
+    safe_dprintf(STDOUT_FILENO, "%ldm%ld.%03lds %ldm%ld.%03lds\n",
+                 user / 60000, user / 1000 % 60, user % 1000, sys / 60000,
+                 sys / 1000 % 60, sys % 1000);
+}
+
+/*
+ * Display user & system time used by the shell, then by its children that
+ * have finished.
+ */
+static int do_times(char** argv) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printtimes(&ru);
+    getrusage(RUSAGE_CHILDREN, &ru);
+    printtimes(&ru);
+    return 0;
+}
+
+/*
+ * Display latency histograms of phases of command execution, collected if
+ * SHELL_STATS is set in the environment.
+ */
+static int do_shellstats(char** argv) {
+    if (!tracing) {
+        msg("shellstats: not enabled, set SHELL_STATS\n");
+        return 1;
+    }
+    dumpstats(STDOUT_FILENO);
+    return 0;
+}
+
+/*
+ * Remember or display locations of commands.
+ * 'hash' - list remembered commands
+ * 'hash -r' - forget all remembered locations
+ * 'hash name...' - look up names in PATH and remember them
+ */
+static int do_hash(char** argv) {
+    if (!argv[0]) {
+        listcmds();
+        return 0;
+    }
+
+    if (!strcmp(argv[0], "-r")) {
+        flushcmds();
+        argv++;
+    }
+
+    int rc = 0;
+    for (; *argv; argv++) {
+        if (index(*argv, '/') || builtin_p(*argv))
+            continue;
+        if (!lookupcmd(*argv)) {
+            msg("hash: %s: not found\n", *argv);
+            rc = 1;
+        }
+    }
+    return rc;
+}
+
+/*
+ * Set capacity of pipes created for pipelines.
+ * 'pipesize' - display current setting, 0 stands for system default
+ * 'pipesize n[k|m]' - use pipes of n bytes, kilobytes or megabytes
+ */
+static int do_pipesize(char** argv) {
+    if (!argv[0]) {
+        safe_dprintf(STDOUT_FILENO, "%d\n", pipe_capacity);
+        return 0;
+    }
+
+    char* end;
+    long size = strtol(argv[0], &end, 10);
+    if (*end == 'k' || *end == 'K')
+        size <<= 10, end++;
+    else if (*end == 'm' || *end == 'M')
+        size <<= 20, end++;
+
+    if (end == argv[0] || *end || size < 0 || size > INT_MAX) {
+        msg("pipesize: invalid size: %s\n", argv[0]);
+        return 1;
+    }
+
+    pipe_capacity = size;
+    return 0;
+}
+
+#define RELAY_CHUNK 65536
+
+/* Copy data through a buffer, used when none of descriptors is a pipe. */
+static int copydata(int input, int output) {
+    char buf[RELAY_CHUNK];
+    ssize_t n;
+
+    while ((n = read(input, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (sigint_received)
+            return 0;
+        for (char* p = buf; n > 0;) {
+            ssize_t written = write(output, p, n);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            p += written, n -= written;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Copy standard input to standard output within shell's process, i.e.
+ * 'producer | relay > file'. If either end is a pipe, data is moved by
+ * splice, so it never gets copied into user space.
+ */
+static int do_relay(char** argv) {
+    int rc = 0;
+
+    /* Reads and splices that wait for input must return once ^C is hit,
+     * rather than be restarted by the handler. */
+    struct sigaction sa, old;
+    Sigaction(SIGINT, NULL, &old);
+    sa = old;
+    sa.sa_flags &= ~SA_RESTART;
+    Sigaction(SIGINT, &sa, NULL);
+
+#ifdef LINUX
+    ssize_t n = 0;
+    while (!sigint_received &&
+           (n = splice(STDIN_FILENO, NULL, STDOUT_FILENO, NULL, RELAY_CHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_MORE)) != 0) {
+        if (n < 0 && errno != EINTR)
+            break;
+        if (sigint_received)
+            break;
+    }
+    /* Splice needs a pipe on at least one side. */
+    if (n < 0 && errno == EINVAL)
+        rc = copydata(STDIN_FILENO, STDOUT_FILENO);
+    else if (n < 0)
+        rc = -1;
+#else
+    rc = copydata(STDIN_FILENO, STDOUT_FILENO);
+#endif
+    Sigaction(SIGINT, &old, NULL);
+
+    if (sigint_received)
+        return 128 + SIGINT;
+    if (rc < 0 && errno == EPIPE)
+        return 128 + SIGPIPE;
+    if (rc < 0) {
+        msg("relay: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Wait for background jobs to finish and collect them.
+ * 'wait' - wait for all jobs, except those that are stopped
+ * 'wait %n...' - wait for given jobs, exit code is that of the last one
+ * 'wait -n [%n...]' - wait for any (of given) jobs, exit code is its one
+ */
+static int do_wait(char** argv) {
+    bool any = argv[0] && !strcmp(argv[0], "-n");
+    if (any)
+        argv++;
+
+    sigset_t mask;
+    Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+    int n;
+    int* js = bgjobs(&n);
+    int last = -1; /* job whose exit code becomes ours */
+    int rc = 0;
+
+    /* Keep requested jobs only, in place. */
+    if (*argv) {
+        int nwanted = 0;
+        for (; *argv; argv++) {
+            int j = **argv == '%' ? atoi(*argv + 1) : 0;
+            int i = 0;
+            while (i < n && js[i] != j)
+                i++;
+            /* Job given again is already wanted. */
+            if (j >= BG && i < nwanted) {
+                last = j;
+                continue;
+            }
+            if (j < BG || i == n) {
+                msg("wait: job not found: %s\n", *argv);
+                rc = EXIT_NOTFOUND;
+                continue;
+            }
+            js[i] = js[nwanted];
+            js[nwanted++] = j;
+            last = j;
+        }
+        n = nwanted;
+    }
+
+    if (any && n == 0)
+        rc = EXIT_NOTFOUND;
+
+    /* Stopped jobs would never finish while we wait, unless they're asked
+     * for, so plain 'wait' skips them. */
+    bool all = !any && last < 0;
+    while (n > 0) {
+        int i = waitany(js, n, &mask, all);
+        if (i < 0) {
+            rc = 128 + SIGINT;
+            break;
+        }
+
+        int status;
+        if (jobstate(js[i], &status) == STOPPED) {
+            js[i] = js[--n];
+            continue;
+        }
+        int code = WIFSIGNALED(status) ? 128 + WTERMSIG(status)
+                                       : WEXITSTATUS(status);
+        if (any || js[i] == last) {
+            rc = code;
+            if (any)
+                break;
+        }
+        js[i] = js[--n];
+    }
+
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+    free(js);
+    return rc;
+}
+
+/*
+ * Mark variables to be passed to children, possibly setting them as well.
+ * 'export' - display exported variables
+ * 'export name[=value]...' - export given variables, unset ones become empty
+ */
+static int do_export(char** argv) {
+    if (!argv[0]) {
+        listvars(true);
+        return 0;
+    }
+
+    int rc = 0;
+    for (; *argv; argv++) {
+        if (assignment_p(*argv)) {
+            assign(*argv, true);
+        } else if (varname_p(*argv)) {
+            const char* value = getvar(*argv);
+            setvar(*argv, value ? value : "", true);
+        } else {
+            msg("export: not a valid identifier: %s\n", *argv);
+            rc = 1;
+        }
+    }
+    return rc;
+}
+
+/*
+ * Remove variables, which are no longer passed to children.
+ * 'unset name...'
+ * 'unset -f name...' - remove functions instead
+ */
+static int do_unset(char** argv) {
+    bool funcs = argv[0] && !strcmp(argv[0], "-f");
+    int rc = 0;
+    for (argv += funcs; *argv; argv++) {
+        if (funcs) {
+            (void)unsetfunc(*argv);
+        } else if (varname_p(*argv)) {
+            unsetvar(*argv);
+        } else {
+            msg("unset: not a valid identifier: %s\n", *argv);
+            rc = 1;
+        }
+    }
+    return rc;
+}
+
+/*
+ * Set shell variables, i.e. 'name=value...' given as a command by itself.
+ * Ones that are exported stay so.
+ */
+static int do_assign(char** argv) {
+    for (; *argv; argv++)
+        assign(*argv, false);
+    return 0;
+}
+
+typedef struct item {
+    TAILQ_ENTRY(item) ready;
+    char* word;
+} item_t;
+
+/* Build arguments of command for an item, '{}' stands for the item. */
+static void mkargs(char** args, char** cmd, int ncmd, char* word) {
+    bool replaced = false;
+
+    for (int i = 0; i < ncmd; i++) {
+        if (!strcmp(cmd[i], "{}")) {
+            args[i] = word;
+            replaced = true;
+        } else {
+            args[i] = cmd[i];
+        }
+    }
+    args[ncmd] = replaced ? NULL : word;
+    args[ncmd + 1] = NULL;
+}
+
+/*
+ * Run a command for each of items as background jobs, at most n at once.
+ * 'pjobs [-j n] command... ::: items...' - item replaces '{}' among words
+ * of command or gets appended. By default n is the number of online CPUs.
+ * Exit code is the number of jobs that failed, up to 100.
+ */
+static int do_pjobs(char** argv) {
+    long limit = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (argv[0] && !strcmp(argv[0], "-j")) {
+        char* end = NULL;
+        if (argv[1])
+            limit = strtol(argv[1], &end, 10);
+        if (!argv[1] || *end || limit < 1 || limit > INT_MAX) {
+            msg("pjobs: invalid number of jobs: %s\n", argv[1] ? argv[1] : "");
+            return 2;
+        }
+        argv += 2;
+    }
+    limit = max(limit, 1L);
+
+    char** items = argv;
+    while (*items && strcmp(*items, ":::"))
+        items++;
+    if (items == argv || *items == NULL) {
+        msg("pjobs: usage: pjobs [-j n] command... ::: items...\n");
+        return 2;
+    }
+    int ncmd = items++ - argv;
+
+    int nitems = 0;
+    while (items[nitems])
+        nitems++;
+    limit = min(limit, (long)max(nitems, 1));
+
+    TAILQ_HEAD(, item) ready = TAILQ_HEAD_INITIALIZER(ready);
+    item_t* item = malloc(sizeof(item_t) * nitems);
+    for (int i = 0; i < nitems; i++) {
+        item[i].word = items[i];
+        TAILQ_INSERT_TAIL(&ready, &item[i], ready);
+    }
+
+    char** args = malloc(sizeof(char*) * (ncmd + 2));
+    int* running = malloc(sizeof(int) * limit);
+    int nrunning = 0, nfailed = 0;
+    bool interrupted = false;
+
+    sigset_t mask;
+    Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+
+    while (true) {
+        while (nrunning < limit && !TAILQ_EMPTY(&ready) && !interrupted) {
+            item_t* next = TAILQ_FIRST(&ready);
+            TAILQ_REMOVE(&ready, next, ready);
+            mkargs(args, argv, ncmd, next->word);
+            running[nrunning++] = spawnjob(args, -1, -1, &mask);
+        }
+        if (nrunning == 0)
+            break;
+
+        int i = waitany(running, nrunning, &mask, false);
+        if (i < 0) {
+            /* Stop starting jobs and terminate those still running. */
+            interrupted = true;
+            sigint_received = 0;
+            for (int j = 0; j < nrunning; j++)
+                killjob(running[j]);
+            continue;
+        }
+
+        int status;
+        char* command = strdup(jobcmd(running[i]));
+        (void)jobstate(running[i], &status);
+        if (WIFSIGNALED(status)) {
+            msg("pjobs: killed '%s' by signal %d\n", command, WTERMSIG(status));
+            nfailed++;
+        } else if (WEXITSTATUS(status)) {
+            msg("pjobs: exited '%s', status=%d\n", command, WEXITSTATUS(status));
+            nfailed++;
+        }
+        free(command);
+        running[i] = running[--nrunning];
+    }
+
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    free(running);
+    free(args);
+    free(item);
+    return interrupted ? 128 + SIGINT : min(nfailed, 100);
+}
+
+/* Number of background job given as '%n' or as its process group, -1 if
+ * there's none. SIGCHLD must be blocked. */
+static int jobarg(const char* arg) {
+    const char* digits = arg + (*arg == '%');
+    if (!*digits || strspn(digits, "0123456789") != strlen(digits))
+        return -1;
+    return *arg == '%' ? atoi(digits) : pgidjob(atoi(digits));
+}
+
+/* Apply limits to jobs given by arguments, or with '-b' to background jobs
+ * started from now on. */
+static int limitjobs(char** argv, const limits_t* lim, bool bg,
+                     const char* name, const char* usage) {
+    if (bg == (argv[0] != NULL)) {
+        msg("%s\n", usage);
+        return 2;
+    }
+    if (bg) {
+        limitbg(lim);
+        return 0;
+    }
+
+    sigset_t mask;
+    Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+    int rc = 0;
+    for (; *argv; argv++) {
+        int j = jobarg(*argv);
+        if (j < 0 || !limitjob(j, lim)) {
+            msg("%s: %s: %s\n", name, *argv,
+                j < 0 || errno == ESRCH ? "job not found" : strerror(errno));
+            rc = 1;
+        }
+    }
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+    return rc;
+}
+
+/*
+ * Change niceness of all processes of jobs.
+ * 'renice n %j|pgid...' - of given jobs
+ * 'renice -b n' - of background jobs started from now on
+ */
+static int do_renice(char** argv) {
+    static const char usage[] = "usage: renice [-b] n [%job|pgid...]";
+    limits_t lim = nolimits;
+    bool bg = argv[0] && !strcmp(argv[0], "-b");
+
+    argv += bg;
+    char* end = NULL;
+    long n = argv[0] ? strtol(argv[0], &end, 10) : 0;
+    if (!end || *end || end == argv[0] || n < -20 || n > 19) {
+        msg("%s\n", usage);
+        return 2;
+    }
+    lim.nice = n;
+    return limitjobs(argv + 1, &lim, bg, "renice", usage);
+}
+
+#define IOPRIO_CLASS_SHIFT 13
+
+/*
+ * Change I/O scheduling class and level of all processes of jobs.
+ * 'ionice -c class [-n level] %j|pgid...' - of given jobs, class is one of
+ *   'realtime', 'best-effort' or 'idle' (1 to 3), level goes from 0 to 7
+ * 'ionice -b -c class [-n level]' - of background jobs started from now on
+ */
+static int do_ionice(char** argv) {
+    static const char usage[] =
+        "usage: ionice [-b] -c class [-n level] [%job|pgid...]";
+    static const char* classes[] = {"", "realtime", "best-effort", "idle"};
+    limits_t lim = nolimits;
+    bool bg = argv[0] && !strcmp(argv[0], "-b");
+    int class = -1, level = 4;
+
+    for (argv += bg; argv[0] && argv[0][0] == '-' && argv[1]; argv += 2) {
+        if (!strcmp(argv[0], "-c")) {
+            for (int i = 1; i < 4; i++)
+                if (!strcmp(argv[1], classes[i]) ||
+                    (argv[1][0] == '0' + i && !argv[1][1]))
+                    class = i;
+        } else if (!strcmp(argv[0], "-n") && isdigit((uint8_t)argv[1][0]) &&
+                   !argv[1][1] && argv[1][0] <= '7') {
+            level = argv[1][0] - '0';
+        } else {
+            break;
+        }
+    }
+    if (class < 0 || (argv[0] && argv[0][0] == '-')) {
+        msg("%s\n", usage);
+        return 2;
+    }
+
+    lim.ioprio = class << IOPRIO_CLASS_SHIFT | (class == 3 ? 0 : level);
+    return limitjobs(argv, &lim, bg, "ionice", usage);
+}
+
+/* Parse 'N%' or 'max' for 'limit cpu=', size with optional k, m or g
+ * suffix or 'max' for 'limit mem='. Returns 0 if value is invalid. */
+static int64_t limitvalue(const char* s, bool percent) {
+    if (!strcmp(s, "max"))
+        return -1;
+
+    char* end;
+    int64_t n = strtoll(s, &end, 10);
+    if (end == s || n <= 0 || n > INT_MAX)
+        return 0;
+    if (percent)
+        return !strcmp(end, "%") ? n : 0;
+
+    int shift = 0;
+    if (*end == 'k' || *end == 'K')
+        shift = 10, end++;
+    else if (*end == 'm' || *end == 'M')
+        shift = 20, end++;
+    else if (*end == 'g' || *end == 'G')
+        shift = 30, end++;
+    return *end ? 0 : n << shift;
+}
+
+/*
+ * Confine jobs to a cgroup of their own, which limits CPU time and memory
+ * of all their processes. Needs cgroup v2 hierarchy delegated to the user.
+ * 'limit [cpu=N%|max] [mem=SIZE|max] %j|pgid...' - limit given jobs, CPU
+ *   time is a percentage of one CPU, size may have k, m or g suffix
+ * 'limit -b [cpu=N%|max] [mem=SIZE|max]' - background jobs started from now
+ */
+static int do_limit(char** argv) {
+    static const char usage[] =
+        "usage: limit [-b] [cpu=N%|max] [mem=SIZE|max] [%job|pgid...]";
+    limits_t lim = nolimits;
+    bool bg = argv[0] && !strcmp(argv[0], "-b");
+
+    for (argv += bg; *argv && index(*argv, '='); argv++) {
+        int64_t value = 0;
+        if (!strncmp(*argv, "cpu=", 4))
+            value = lim.cpumax = limitvalue(*argv + 4, true);
+        else if (!strncmp(*argv, "mem=", 4))
+            value = lim.memmax = limitvalue(*argv + 4, false);
+        if (value == 0) {
+            msg("limit: invalid limit: %s\n", *argv);
+            return 2;
+        }
+    }
+    if (!lim.cpumax && !lim.memmax) {
+        msg("%s\n", usage);
+        return 2;
+    }
+    return limitjobs(argv, &lim, bg, "limit", usage);
+}
+
+/* Returns command that follows options and CPU list of 'affinity' or NULL.
+ * Arguments are checked once the builtin runs. */
+static char** affinitycmd(char** argv) {
+    while (*argv && (!strcmp(*argv, "-s") || !strcmp(*argv, "-m")))
+        argv += argv[0][1] == 'm' && argv[1] ? 2 : 1;
+    if (*argv && (isdigit((uint8_t)**argv) || !strcmp(*argv, "all")))
+        argv++;
+    return *argv ? argv : NULL;
+}
+
+static void showplacement(void) {
+    safe_dprintf(STDOUT_FILENO, "affinity%s", placement.spread ? " -s" : "");
+    if (placement.local) {
+        safe_dprintf(STDOUT_FILENO, " -m local");
+    } else if (placement.nodes) {
+        safe_dprintf(STDOUT_FILENO, " -m ");
+        printset(STDOUT_FILENO, &placement.nodes, MAXNODES);
+    }
+    safe_dprintf(STDOUT_FILENO, " ");
+    if (placement.ncpus > 0)
+        printset(STDOUT_FILENO, placement.cpus, MAXCPUS);
+    else
+        safe_dprintf(STDOUT_FILENO, "all");
+    safe_dprintf(STDOUT_FILENO, "\n");
+}
+
+/*
+ * Place jobs on CPUs and NUMA nodes, a placement is inherited by subshells.
+ * 'affinity' - display placement of jobs
+ * 'affinity [-s] [-m nodes|local|all] cpus|all' - jobs started from now on
+ *   run on given CPUs, e.g. '0-3,8', with memory allocated from given nodes
+ *   or from the one they run on. With '-s' stages of each pipeline get CPUs
+ *   of their own, so that adjacent ones share caches.
+ * 'affinity [-m nodes|local|all] cpus|all command...' - run a command with
+ *   given placement
+ */
+static int do_affinity(char** argv) {
+    placement_t pl = placement;
+    uint64_t allowed[MAXCPUS / 64];
+    char** command = affinitycmd(argv);
+
+    if (!argv[0]) {
+        showplacement();
+        return 0;
+    }
+    if (allowedcpus(allowed) == 0) {
+        msg("affinity: not supported\n");
+        return 1;
+    }
+
+    pl.spread = false;
+    for (; *argv && **argv == '-'; argv++) {
+        if (!strcmp(*argv, "-s")) {
+            pl.spread = true;
+        } else if (!strcmp(*argv, "-m") && argv[1]) {
+            char* nodes = *++argv;
+            pl.local = !strcmp(nodes, "local");
+            pl.nodes = 0;
+            if (!pl.local && strcmp(nodes, "all") &&
+                (!parseset(nodes, &pl.nodes, MAXNODES) || !pl.nodes)) {
+                msg("affinity: invalid list of nodes: %s\n", nodes);
+                return 2;
+            }
+        } else {
+            msg("affinity: usage: affinity [-s] [-m nodes|local|all] "
+                "cpus|all [command...]\n");
+            return 2;
+        }
+    }
+
+    if (*argv && !strcmp(*argv, "all")) {
+        pl.ncpus = 0;
+    } else if (*argv && argv != command) {
+        if (!parseset(*argv, pl.cpus, MAXCPUS)) {
+            msg("affinity: invalid list of CPUs: %s\n", *argv);
+            return 2;
+        }
+        pl.ncpus = 0;
+        for (int i = 0; i < MAXCPUS / 64; i++) {
+            if (pl.cpus[i] & ~allowed[i]) {
+                msg("affinity: CPUs not available: %s\n", *argv);
+                return 1;
+            }
+            pl.ncpus += __builtin_popcountll(pl.cpus[i]);
+        }
+    }
+
+    setplacement(&pl);
+    if (command == NULL)
+        return 0;
+
+    /* Builtin runs in a forked child when it's given a command. */
+    applyplacement(0, 1);
+    external_command(command, builtin_envp ? builtin_envp : envblock());
+}
+
+/*
+ * Display output of a job that went into a ring buffer with '&>ring'.
+ * 'joblog [%n]' - what's left of output of given job, or of the most
+ *   recently started one that had a ring
+ * 'joblog -f [%n]' - then keep displaying it as it comes, till processes of
+ *   the job are gone or ^C is hit
+ */
+static int do_joblog(char** argv) {
+    bool follow = argv[0] && !strcmp(argv[0], "-f");
+    int num = -1;
+
+    argv += follow;
+    if (argv[0] && (argv[1] || *argv[0] != '%' || (num = jobarg(*argv)) < 0)) {
+        msg("usage: joblog [-f] [%%job]\n");
+        return 2;
+    }
+
+    /* Bring rings up to date with what's been written so far. */
+    jobevents();
+    ring_t* ring = findring(num);
+    if (ring == NULL) {
+        msg("joblog: no output in a ring: %s\n", argv[0] ? argv[0] : "");
+        return 1;
+    }
+
+    /* Rings and jobs are waited for together, waking up drains the ring. */
+    struct pollfd pfd = {.fd = jobsfd(), .events = POLLIN};
+    uint64_t pos = 0;
+    while (showring(ring, STDOUT_FILENO, &pos) && follow && !sigint_received)
+        if (poll(&pfd, 1, -1) > 0)
+            jobevents();
+    return 0;
+}
+
+#define MEMO_TTL 3600 /* seconds results of 'memo' are kept by default */
+
+/*
+ * Run an idempotent command or serve its standard output and exit code
+ * from cache, if it's been run the same way before. It's the same if words,
+ * working directory, variables given and file on standard input all match.
+ * 'memo [-t seconds] [-e name]... command...' - results expire after given
+ *   time, an hour by default
+ * 'memo -c' - clear the cache
+ */
+static int do_memo(char** argv) {
+    static const char usage[] =
+        "usage: memo [-t seconds] [-e name]... command... | memo -c";
+    long ttl = MEMO_TTL;
+    int nenv = 0, nwords = 0;
+
+    while (argv[nwords])
+        nwords++;
+    char** env = malloc(sizeof(char*) * (nwords + 1));
+
+    if (argv[0] && !strcmp(argv[0], "-c") && !argv[1]) {
+        free(env);
+        if (memoclear())
+            return 0;
+        msg("memo: %s\n", strerror(errno));
+        return 1;
+    }
+
+    for (; argv[0] && argv[0][0] == '-' && argv[1]; argv += 2) {
+        if (!strcmp(argv[0], "-e")) {
+            env[nenv++] = argv[1];
+        } else if (!strcmp(argv[0], "-t")) {
+            char* end;
+            ttl = strtol(argv[1], &end, 10);
+            if (*end || end == argv[1] || ttl < 0) {
+                msg("memo: invalid time to live: %s\n", argv[1]);
+                free(env);
+                return 2;
+            }
+        } else {
+            break;
+        }
+    }
+    env[nenv] = NULL;
+    if (!argv[0] || argv[0][0] == '-') {
+        msg("%s\n", usage);
+        free(env);
+        return 2;
+    }
+
+    int exitcode = memorun(argv, env, ttl);
+    free(env);
+    return exitcode;
+}
+
+/* Parse duration like '10', '1.5s', '100ms', '2m' or '1h' into nanoseconds,
+ * returns 0 if it's invalid. */
+static uint64_t parseduration(const char* s) {
+    static const struct {
+        const char* suffix;
+        double scale;
+    } units[] = {{"", 1e9}, {"s", 1e9}, {"ms", 1e6}, {"m", 60e9}, {"h", 3600e9}};
+
+    char* end;
+    double n = strtod(s, &end);
+    if (end == s || !isdigit((uint8_t)*s) || n <= 0)
+        return 0;
+    for (size_t i = 0; i < sizeof(units) / sizeof(units[0]); i++)
+        if (!strcmp(end, units[i].suffix))
+            return max(n * units[i].scale, 1.0);
+    return 0;
+}
+
+/* Signal given by number or by name, with or without 'SIG' prefix. */
+static int parsesignal(const char* s) {
+    static const struct {
+        const char* name;
+        int sig;
+    } signals[] = {{"HUP", SIGHUP},   {"INT", SIGINT},   {"QUIT", SIGQUIT},
+                   {"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"USR2", SIGUSR2},
+                   {"ALRM", SIGALRM}, {"TERM", SIGTERM}};
+
+    char* end;
+    long n = strtol(s, &end, 10);
+    if (end != s && *end == '\0')
+        return n > 0 && n < NSIG ? n : -1;
+    if (!strncmp(s, "SIG", 3))
+        s += 3;
+    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+        if (!strcmp(s, signals[i].name))
+            return signals[i].sig;
+    return -1;
+}
+
+/* Parse options and duration of 'timeout' into t and return the command that
+ * follows them, or NULL if they're invalid or there's no command. The shell
+ * runs the command as a job with a deadline. */
+char** parsetimeout(char** argv, timeout_t* t) {
+    *t = (timeout_t){.sig = SIGTERM};
+
+    for (; *argv && **argv == '-' && argv[1]; argv += 2) {
+        if (!strcmp(*argv, "-s")) {
+            if ((t->sig = parsesignal(argv[1])) < 0)
+                return NULL;
+        } else if (!strcmp(*argv, "-k")) {
+            if ((t->killafter = parseduration(argv[1])) == 0)
+                return NULL;
+        } else {
+            return NULL;
+        }
+    }
+    if (!*argv || (t->after = parseduration(*argv)) == 0)
+        return NULL;
+    return argv[1] ? argv + 1 : NULL;
+}
+
+/*
+ * Run a command as a job that's signalled once given time has passed.
+ * 'timeout [-s signal] [-k duration] duration command...' - signal is TERM
+ *   unless given, it's followed by KILL after the -k duration. Durations are
+ *   in seconds unless suffixed with ms, s, m or h. Job that's timed out
+ *   exits with status 124, or 137 if it had to be killed with KILL.
+ * Shell sets up the deadline itself, builtins and functions run in a forked
+ * copy of it then. The builtin only runs when arguments are wrong.
+ */
+static int do_timeout(char** argv) {
+    timeout_t t;
+    char** command = parsetimeout(argv, &t);
+
+    if (command == NULL)
+        msg("usage: timeout [-s signal] [-k duration] duration command...\n");
+    else
+        msg("timeout: %s: runs within the shell\n", command[0]);
+    return 125;
+}
+
+/*
+ * Start a helper command once and talk to it over a socket.
+ * 'coproc name command...' - command runs as a background job, '>&name'
+ *   writes to its standard input and '<&name' reads its standard output
+ * 'coproc -c name' - let it see end of input, its output can still be read
+ * 'coproc -d name' - forget it and close the shell's end of its socket
+ * 'coproc' - list coprocesses and their jobs
+ */
+static int do_coproc(char** argv) {
+    if (argv[0] == NULL) {
+        listcoprocs();
+        return 0;
+    }
+
+    if (!strcmp(argv[0], "-c") || !strcmp(argv[0], "-d")) {
+        bool drop = argv[0][1] == 'd';
+        if (!argv[1] || argv[2]) {
+            msg("usage: coproc %s name\n", argv[0]);
+            return 2;
+        }
+        if (!(drop ? dropcoproc(argv[1]) : endcoproc(argv[1]))) {
+            msg("coproc: no such coprocess: %s\n", argv[1]);
+            return 1;
+        }
+        return 0;
+    }
+
+    if (!argv[1] || !varname_p(argv[0])) {
+        msg("usage: coproc name command...\n");
+        return 2;
+    }
+
+    sigset_t mask;
+    Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+    announcejob(startcoproc(argv[0], argv + 1, &mask));
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+    return 0;
+}
+
+/*
+ * Run a command on many hosts at once, over ssh connections kept open.
+ * 'fanout hostfile -- command...' - hosts are named by the first word of
+ *   each line of hostfile, '#' starts a comment. Output of each host is
+ *   prefixed with its name. Exit code is the number of hosts where command
+ *   has failed.
+ * Shell starts the job itself, the builtin only runs when it can't.
+ */
+static int do_fanout(char** argv) {
+    if (fanoutcmd(argv) == NULL) {
+        msg("usage: fanout hostfile -- command...\n");
+        return 2;
+    }
+    msg("fanout: must be run as a command of its own\n");
+    return 1;
+}
+
+/* Number of loops that 'break n' or 'continue n' applies to. */
+static int loopcount(char** argv, const char* name) {
+    if (flow.loops == 0) {
+        msg("%s: only meaningful in a loop\n", name);
+        return 0;
+    }
+
+    char* end = NULL;
+    long n = argv[0] ? strtol(argv[0], &end, 10) : 1;
+    if ((end && *end) || n < 1) {
+        msg("%s: loop count out of range: %s\n", name, argv[0]);
+        return -1;
+    }
+    return min(n, (long)flow.loops);
+}
+
+/*
+ * Leave enclosing loops.
+ * 'break' - leave innermost loop
+ * 'break n' - leave n innermost loops
+ */
+static int do_break(char** argv) {
+    int n = loopcount(argv, "break");
+    if (n <= 0)
+        return n < 0;
+    flow.breaks = n;
+    flow.next = false;
+    return 0;
+}
+
+/*
+ * Go on with next iteration of enclosing loop.
+ * 'continue' - of innermost loop
+ * 'continue n' - of n-th innermost loop
+ */
+static int do_continue(char** argv) {
+    int n = loopcount(argv, "continue");
+    if (n <= 0)
+        return n < 0;
+    flow.breaks = n;
+    flow.next = true;
+    return 0;
+}
+
+/*
+ * Leave function being executed.
+ * 'return' - exit code is that of last command
+ * 'return n' - exit code is n
+ */
+static int do_return(char** argv) {
+    if (flow.funcs == 0) {
+        msg("return: can only be used in a function\n");
+        return 1;
+    }
+    flow.ret = true;
+    return argv[0] ? atoi(argv[0]) & 255 : last_exitcode;
+}
+
+/* Commands that do nothing but succeed or fail. */
+static int do_true(char** argv) {
+    return 0;
+}
+
+static int do_false(char** argv) {
+    return 1;
+}
+
 static command_t builtins[] = {
-    {"quit", do_quit}, {"cd", do_chdir}, {"jobs", do_jobs}, {"fg", do_fg},
-    {"bg", do_bg}, {"kill", do_kill}, {NULL, NULL},
+    {"quit", do_quit},   {"cd", do_chdir},
+    {"jobs", do_jobs},   {"fg", do_fg},
+    {"bg", do_bg},       {"kill", do_kill},
+    {"hash", do_hash},   {"pipesize", do_pipesize},
+    {"relay", do_relay, true},
+    {"times", do_times}, {"shellstats", do_shellstats},
+    {"pjobs", do_pjobs}, {"wait", do_wait},
+    {"export", do_export}, {"unset", do_unset},
+    {"exec", do_exec},   {"break", do_break},
+    {"continue", do_continue}, {"return", do_return},
+    {"true", do_true},   {"false", do_false},
+    {":", do_true},      {"affinity", do_affinity, false, affinitycmd},
+    {"renice", do_renice}, {"ionice", do_ionice},
+    {"limit", do_limit}, {"timeout", do_timeout},
+    {"joblog", do_joblog}, {"memo", do_memo},
+    {"fanout", do_fanout}, {"coproc", do_coproc},
+    {NULL, NULL},
 };
 
+/* Command that consists of assignments, which isn't found by name. */
+static command_t assignment = {"=", do_assign};
+
+/* Builtins are found through a collision free hash table, so looking up
+ * a name costs a single hash and strcmp. Seed of the hash function is
+ * chosen when the table is first needed. */
+/* Table is kept at least 8 times larger than the number of builtins, then
+ * about one seed in ten leaves no collisions, and it grows ever slower
+ * with more of them. */
+#define BUILTIN_SLOTS 256 /* must be a power of two */
+#define BUILTIN_SEEDS 4096 /* tried before giving up */
+
+static command_t* builtin_slot[BUILTIN_SLOTS];
+static uint32_t builtin_seed = 0; /* 0 if table hasn't been built yet */
+
+static inline unsigned builtin_hash(const char* name, uint32_t seed) {
+    return jenkins_hash(name, strlen(name), seed) & (BUILTIN_SLOTS - 1);
+}
+
+static void mkbuiltins(void) {
+    assert(8 * (sizeof(builtins) / sizeof(builtins[0]) - 1) <= BUILTIN_SLOTS);
+
+    for (uint32_t seed = HASHINIT; seed != HASHINIT + BUILTIN_SEEDS; seed++) {
+        memset(builtin_slot, 0, sizeof(builtin_slot));
+
+        command_t* cmd;
+        for (cmd = builtins; cmd->name; cmd++) {
+            command_t** slotp = &builtin_slot[builtin_hash(cmd->name, seed)];
+            if (*slotp)
+                break;
+            *slotp = cmd;
+        }
+
+        if (cmd->name == NULL) {
+            builtin_seed = seed;
+            return;
+        }
+    }
+    app_error("no collision free seed for table of builtins");
+}
+
+static command_t* findbuiltin(const char* name) {
+    if (assignment_p(name))
+        return &assignment;
+
+    /* Names of builtins never contain a slash. */
+    if (index(name, '/'))
+        return NULL;
+
+    if (!builtin_seed)
+        mkbuiltins();
+
+    command_t* cmd = builtin_slot[builtin_hash(name, builtin_seed)];
+    if (cmd && !strcmp(name, cmd->name))
+        return cmd;
+    return NULL;
+}
+
+/* Returns name of i-th builtin or NULL past the last one. */
+const char* builtinname(int i) {
+    return builtins[i].name;
+}
+
 int builtin_command(char** argv) {
-    for (command_t* cmd = builtins; cmd->name; cmd++) {
-        if (strcmp(argv[0], cmd->name))
-            continue;
+    command_t* cmd = findbuiltin(argv[0]);
+    if (cmd == &assignment)
+        return cmd->func(argv);
+    if (cmd)
         return cmd->func(&argv[1]);
-    }
 
     errno = ENOENT;
     return -1;
 }
 
-noreturn void external_command(char** argv) {
-    const char* path = getenv("PATH");
+bool builtin_p(const char* name) {
+    return findbuiltin(name) != NULL;
+}
 
-    if (!index(argv[0], '/') && path) {
-        /* DONE: For all paths in PATH construct an absolute path and execve it. */
-        do {
-            size_t len = strcspn(path, ":");
-            if (!len) {
-                break;
-            }
-            char* abs_path = strndup(path, len);
-            strapp(&abs_path, "/");
-            strapp(&abs_path, argv[0]);
-            execve(abs_path, argv, environ);
-            free(abs_path);
-            path += len;
-        } while (*(path++));
+/* Does the builtin read its standard input? */
+bool filter_p(const char* name) {
+    command_t* cmd = findbuiltin(name);
+    return cmd && cmd->filter;
+}
 
-    } else {
-        (void)execve(argv[0], argv, environ);
+/* Is it a builtin that runs a command given by its arguments, which must be
+ * forked rather than run within the shell? */
+bool wrapper_p(char** argv) {
+    command_t* cmd = findbuiltin(argv[0]);
+    return cmd && cmd->wrapped && cmd->wrapped(argv + 1);
+}
+
+/* Path of the command is normally resolved by the parent before it forks, so
+ * lookupcmd finds it in the table and we do exactly one execve. */
+noreturn void external_command(char** argv, char** envp) {
+    const char* path = argv[0];
+
+    if (!index(argv[0], '/')) {
+        path = lookupcmd(argv[0]);
+        errno = ENOENT;
     }
 
+#ifdef LINUX
+    /* Directory is already open, so kernel doesn't walk its path again.
+     * Scripts fail with ENOENT, as their interpreter couldn't reopen them
+     * through a close-on-exec descriptor, and execve takes over. */
+    int dirfd = path != argv[0] ? cmddirfd(argv[0]) : -1;
+    if (dirfd >= 0)
+        (void)execveat(dirfd, argv[0], argv, envp, 0);
+#endif
+    if (path)
+        (void)execve(path, argv, envp);
+
     msg("%s: %s\n", argv[0], strerror(errno));
-    exit(EXIT_FAILURE);
+    exit(errno == ENOENT ? EXIT_NOTFOUND : EXIT_FAILURE);
 }
@@ -0,0 +1,60 @@
+#include "shell.h"
+
+/* Generators of completions in the fashion readline expects: first call has
+ * state 0 and finds matching names in a sorted index, subsequent calls
+ * return them one by one. Returned strings must be freed by the caller. */
+
+static dirlist_t* matches;
+static int next, last;
+
+static char* nextmatch(const char* dir, size_t dirlen, bool hidden) {
+    while (next < last) {
+        const char* name = matches->ent[next++].name;
+        /* Hidden files are completed only if asked for explicitly. */
+        if (name[0] == '.' && !hidden)
+            continue;
+
+        size_t len = strlen(name);
+        char* match = malloc(dirlen + len + 1);
+        memcpy(match, dir, dirlen);
+        memcpy(match + dirlen, name, len + 1);
+        return match;
+    }
+    return NULL;
+}
+
+static void findmatches(dirlist_t* dl, const char* prefix) {
+    int count = 0;
+    matches = dl;
+    next = dl ? prefixrange(dl, prefix, &count) : 0;
+    last = next + count;
+}
+
+/* Complete name of a builtin or a command found in PATH. */
+char* completecmd(const char* text, int state) {
+    if (state == 0)
+        findmatches(commandlist(), text);
+    return nextmatch("", 0, true);
+}
+
+/* Complete path relative to current directory or an absolute one. */
+char* completefile(const char* text, int state) {
+    const char* slash = strrchr(text, '/');
+    const char* base = slash ? slash + 1 : text;
+    size_t dirlen = base - text;
+
+    if (state == 0) {
+        char dir[PATH_MAX];
+        if (dirlen == 0) {
+            strcpy(dir, ".");
+        } else if (dirlen < sizeof(dir)) {
+            memcpy(dir, text, dirlen);
+            dir[dirlen] = '\0';
+        } else {
+            findmatches(NULL, base);
+            return NULL;
+        }
+        findmatches(cachedir(dir), base);
+    }
+    return nextmatch(text, dirlen, base[0] == '.');
+}
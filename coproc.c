@@ -0,0 +1,96 @@
+#include "shell.h"
+
+#include <sys/socket.h>
+
+/* Coprocess is a background job started by 'coproc NAME command...' whose
+ * standard input and output are both connected to a socket that the shell
+ * holds the other end of. Redirections '>&NAME' and '<&NAME' make that end
+ * standard output or input of later commands, so a helper like bc is asked
+ * one question after another without being started for each of them. */
+
+typedef struct coproc {
+    struct coproc* next;
+    char* name;
+    int fd;  /* shell's end of the socket */
+    int job; /* number of job running the command */
+} coproc_t;
+
+static coproc_t* coprocs = NULL; /* most recently started first */
+
+static coproc_t** findcoproc(const char* name) {
+    coproc_t** cp = &coprocs;
+    while (*cp && strcmp((*cp)->name, name))
+        cp = &(*cp)->next;
+    return cp;
+}
+
+/* Descriptor of shell's end of socket of named coprocess, or -1. */
+int coprocfd(const char* name) {
+    coproc_t* co = *findcoproc(name);
+    return co ? co->fd : -1;
+}
+
+/* Start command as a coprocess with given name, which must be a valid name
+ * of a variable. Coprocess that had the name sees end of input. Returns the
+ * job number. SIGCHLD must be blocked. */
+int startcoproc(const char* name, char** argv, sigset_t* mask) {
+    int sv[2];
+    Socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    /* Shell's end mustn't be inherited by other commands, or coprocess
+     * wouldn't see end of input once the shell lets go of it. */
+    (void)fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+    (void)fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+
+    int job = spawnjob(argv, sv[1], sv[1], mask);
+    Close(sv[1]);
+
+    coproc_t** cp = findcoproc(name);
+    coproc_t* co = *cp;
+    if (co) {
+        *cp = co->next;
+        Close(co->fd);
+    } else {
+        co = malloc(sizeof(coproc_t));
+        co->name = strdup(name);
+    }
+    co->fd = sv[0];
+    co->job = job;
+    co->next = coprocs;
+    coprocs = co;
+    return job;
+}
+
+/* Let named coprocess see end of input, what it's written can still be
+ * read. Returns false if there's no such coprocess. */
+bool endcoproc(const char* name) {
+    coproc_t* co = *findcoproc(name);
+    if (co == NULL)
+        return false;
+    (void)shutdown(co->fd, SHUT_WR);
+    return true;
+}
+
+/* Forget named coprocess and close shell's end of its socket. */
+bool dropcoproc(const char* name) {
+    coproc_t** cp = findcoproc(name);
+    coproc_t* co = *cp;
+    if (co == NULL)
+        return false;
+    *cp = co->next;
+    Close(co->fd);
+    free(co->name);
+    free(co);
+    return true;
+}
+
+/* Forked copy of the shell has no jobs, thus neither coprocesses. Their
+ * sockets are closed, or they wouldn't see end of input until it exits. */
+void resetcoprocs(void) {
+    while (coprocs)
+        (void)dropcoproc(coprocs->name);
+}
+
+void listcoprocs(void) {
+    for (coproc_t* co = coprocs; co; co = co->next)
+        safe_printf("%s\t[%d]\n", co->name, co->job);
+}
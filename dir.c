@@ -0,0 +1,172 @@
+#include "shell.h"
+#include "queue.h"
+
+/* Directories are read with getdents in big batches and their entries are
+ * kept sorted, so that names starting with a given prefix are found with
+ * binary search. Listings used for completion are cached until modification
+ * time of the directory changes, thus completing in huge directories doesn't
+ * read them over and over again. */
+
+#define DIRCACHE_SIZE 32      /* number of remembered directories */
+
+static int compare(const void* a, const void* b) {
+    return strcmp(((const dentry_t*)a)->name, ((const dentry_t*)b)->name);
+}
+
+/* Listing is built by adding entries with names collected in a string
+ * buffer. Entries remember offsets of names until the buffer stops moving. */
+void addentry(dirlist_t* dl, strbuf_t* names, const char* name, int type) {
+    if (dl->nent == dl->size) {
+        dl->size = dl->size ? dl->size * 2 : 64;
+        dl->ent = realloc(dl->ent, sizeof(dentry_t) * dl->size);
+    }
+    dentry_t* ent = &dl->ent[dl->nent++];
+    ent->name = (char*)names->len;
+    ent->type = type;
+    strappn(names, name, strlen(name) + 1);
+}
+
+/* Sort entries and drop ones with duplicate names. */
+void finishlist(dirlist_t* dl, strbuf_t* names) {
+    for (int i = 0; i < dl->nent; i++)
+        dl->ent[i].name = names->str + (size_t)dl->ent[i].name;
+    dl->names = names->str;
+
+    qsort(dl->ent, dl->nent, sizeof(dentry_t), compare);
+
+    int n = 0;
+    for (int i = 0; i < dl->nent; i++)
+        if (n == 0 || strcmp(dl->ent[n - 1].name, dl->ent[i].name))
+            dl->ent[n++] = dl->ent[i];
+    dl->nent = n;
+}
+
+/* Read entries of directory except '.' and '..' with getdents into buf of
+ * DENTS_BUF bytes. Returns false if it can't be opened. */
+bool readdirbuf(int dirfd, const char* path, dirlist_t* dl, char* buf) {
+    int fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    *dl = (dirlist_t){};
+    if (fd < 0)
+        return false;
+
+    strbuf_t names = {};
+    int n;
+
+    while ((n = Getdents(fd, (struct linux_dirent*)buf, DENTS_BUF)) > 0) {
+        for (int pos = 0; pos < n;) {
+            struct linux_dirent* d = (struct linux_dirent*)(buf + pos);
+            const char* name = d->d_name;
+            pos += d->d_reclen;
+
+            if (name[0] == '.' &&
+                (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+
+            /* Type of entry is stored in its last byte. */
+            addentry(dl, &names, name, *((char*)d + d->d_reclen - 1));
+        }
+    }
+    Close(fd);
+
+    finishlist(dl, &names);
+    return true;
+}
+
+/* Same, with a buffer of the shell's own thread. */
+bool readdirlist(int dirfd, const char* path, dirlist_t* dl) {
+    static char* buf = NULL;
+    if (buf == NULL)
+        buf = malloc(DENTS_BUF);
+    return readdirbuf(dirfd, path, dl, buf);
+}
+
+void freedirlist(dirlist_t* dl) {
+    free(dl->ent);
+    free(dl->names);
+    *dl = (dirlist_t){};
+}
+
+/* Returns index of the first entry whose name starts with prefix and sets
+ * count of such entries, which follow one another. */
+int prefixrange(dirlist_t* dl, const char* prefix, int* countp) {
+    size_t len = strlen(prefix);
+    int lo = 0, hi = dl->nent;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(dl->ent[mid].name, prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    int first = lo;
+    hi = dl->nent;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strncmp(dl->ent[mid].name, prefix, len) == 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *countp = lo - first;
+    return first;
+}
+
+typedef struct cacheddir {
+    TAILQ_ENTRY(cacheddir) lru; /* most recently used directories first */
+    char* path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime; /* modification time when listing was read */
+    dirlist_t list;
+} cacheddir_t;
+
+static TAILQ_HEAD(dirlru, cacheddir) dircache =
+    TAILQ_HEAD_INITIALIZER(dircache);
+static int ncached = 0;
+
+/* Returns cached listing of directory, which stays valid until next call,
+ * or NULL if it can't be read. */
+dirlist_t* cachedir(const char* path) {
+    struct stat sb;
+    if (stat(path, &sb) < 0 || !S_ISDIR(sb.st_mode))
+        return NULL;
+
+    cacheddir_t* cd;
+    TAILQ_FOREACH(cd, &dircache, lru)
+        if (!strcmp(cd->path, path))
+            break;
+
+    if (cd) {
+        TAILQ_REMOVE(&dircache, cd, lru);
+        TAILQ_INSERT_HEAD(&dircache, cd, lru);
+        /* Same path may refer to another directory by now. */
+        if (cd->dev == sb.st_dev && cd->ino == sb.st_ino &&
+            cd->mtime.tv_sec == sb.st_mtim.tv_sec &&
+            cd->mtime.tv_nsec == sb.st_mtim.tv_nsec)
+            return &cd->list;
+        freedirlist(&cd->list);
+    } else {
+        if (ncached == DIRCACHE_SIZE) {
+            cd = TAILQ_LAST(&dircache, dirlru);
+            TAILQ_REMOVE(&dircache, cd, lru);
+            freedirlist(&cd->list);
+            free(cd->path);
+        } else {
+            cd = malloc(sizeof(cacheddir_t));
+            ncached++;
+        }
+        cd->path = strdup(path);
+        TAILQ_INSERT_HEAD(&dircache, cd, lru);
+    }
+
+    cd->dev = sb.st_dev;
+    cd->ino = sb.st_ino;
+    cd->mtime = sb.st_mtim;
+    /* Unreadable directory is remembered as an empty one. */
+    (void)readdirlist(AT_FDCWD, path, &cd->list);
+    return &cd->list;
+}
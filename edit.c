@@ -0,0 +1,132 @@
+#include "shell.h"
+#include <dlfcn.h>
+#include <poll.h>
+#include <stdio.h> // to remove compilation errors from readline.h on Arch
+#include <readline/readline.h>
+#include <readline/history.h>
+
+/* Loading readline together with terminfo library takes longer than the rest
+ * of shell's startup, and non-interactive shells never need them. Hence the
+ * library is opened only once the first prompt is about to be shown. If it
+ * can't be found, lines are read without editing. */
+
+static const char* library[] = {
+#ifdef MACOS
+    "libreadline.dylib",
+#else
+    "libreadline.so.8",
+    "libreadline.so",
+#endif
+    NULL,
+};
+
+/* Lines of persistent history given to readline, which searches them all. */
+#define HISTLOAD 10000
+
+static bool loaded = false;
+static __typeof__(readline)* readline_fn;
+static __typeof__(add_history)* add_history_fn;
+static __typeof__(rl_initialize)* rl_initialize_fn;
+static __typeof__(rl_completion_matches)* rl_completion_matches_fn;
+static __typeof__(rl_getc)* rl_getc_fn;
+static char** rl_line_buffer_p;
+static int* rl_attempted_completion_over_p;
+static int* rl_filename_completion_desired_p;
+
+/* First word and ones following an operator are commands, unless they
+ * contain a slash. Everything else is a path. Readline's own completion,
+ * which reads directories entry by entry, is never used. */
+static char** complete(const char* text, int start, int end) {
+    const char* line = *rl_line_buffer_p;
+    int i = start;
+
+    while (i > 0 && (line[i - 1] == ' ' || line[i - 1] == '\t'))
+        i--;
+    bool command = i == 0 || strchr("|&;(", line[i - 1]);
+
+    *rl_attempted_completion_over_p = 1;
+    if (command && !strchr(text, '/'))
+        return rl_completion_matches_fn(text, completecmd);
+
+    *rl_filename_completion_desired_p = 1;
+    return rl_completion_matches_fn(text, completefile);
+}
+
+/* Jobs are looked after while a line is being edited, so that their
+ * deadlines pass on time rather than once the line is done. */
+static int getkey(FILE* stream) {
+    struct pollfd pfd[2] = {{.fd = fileno(stream), .events = POLLIN},
+                            {.fd = jobsfd(), .events = POLLIN}};
+
+    /* Readline takes care of signals that interrupt the wait. */
+    while (poll(pfd, 2, -1) > 0 && !pfd[0].revents)
+        if (pfd[1].revents)
+            jobevents();
+    return rl_getc_fn(stream);
+}
+
+static void* lookup(void* lib, const char* name) {
+    void* sym = dlsym(lib, name);
+    if (sym == NULL)
+        app_error("readline: %s", dlerror());
+    return sym;
+}
+
+static void initedit(void) {
+    if (loaded)
+        return;
+    loaded = true;
+    openhistory();
+
+    void* lib = NULL;
+    for (const char** name = library; *name && !lib; name++)
+        lib = dlopen(*name, RTLD_NOW | RTLD_LOCAL);
+    if (lib == NULL) {
+        msg("readline: %s, line editing disabled\n", dlerror());
+        return;
+    }
+
+    readline_fn = lookup(lib, "readline");
+    add_history_fn = lookup(lib, "add_history");
+    rl_initialize_fn = lookup(lib, "rl_initialize");
+    rl_completion_matches_fn = lookup(lib, "rl_completion_matches");
+    rl_line_buffer_p = lookup(lib, "rl_line_buffer");
+    rl_attempted_completion_over_p = lookup(lib, "rl_attempted_completion_over");
+    rl_filename_completion_desired_p =
+        lookup(lib, "rl_filename_completion_desired");
+    *(rl_completion_func_t**)lookup(lib, "rl_attempted_completion_function") =
+        complete;
+    if (jobsfd() >= 0) {
+        rl_getc_fn = lookup(lib, "rl_getc");
+        *(rl_getc_func_t**)lookup(lib, "rl_getc_function") = getkey;
+    }
+    rl_initialize_fn();
+    loadhistory(add_history_fn, HISTLOAD);
+}
+
+/* Returns line read from terminal without newline or NULL at end of input.
+ * Caller must free it. */
+char* editline(const char* prompt) {
+    initedit();
+    if (readline_fn)
+        return readline_fn(prompt);
+
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t n;
+
+    msg("%s", prompt);
+    if ((n = getline(&line, &size, stdin)) < 0) {
+        free(line);
+        return NULL;
+    }
+    if (n > 0 && line[n - 1] == '\n')
+        line[n - 1] = '\0';
+    return line;
+}
+
+void addhistory(const char* line) {
+    if (add_history_fn)
+        add_history_fn(line);
+    savehistory(line);
+}
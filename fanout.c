@@ -0,0 +1,319 @@
+#include "shell.h"
+
+#include <poll.h>
+
+/* 'fanout HOSTFILE -- command...' runs command on every host named in the
+ * file at once. Each host gets an ssh process of a single job, so 'jobs',
+ * 'kill' and 'wait' see the whole run as one. Connections are multiplexed
+ * over masters that ssh keeps for a while after the first run, so later
+ * runs skip the handshake. Output of each host comes through a pipe that
+ * the shell drains whenever it waits for jobs or for input, and goes out
+ * line by line, prefixed with the host's name, in batches of a single
+ * writev. Linux only, since the pipes are watched by epoll of jobs. */
+
+#define LINEMAX 4096  /* longer lines are split */
+#define FANOUT_IOV 96 /* entries written by one writev, three per line */
+
+typedef struct {
+    char* prefix; /* "host: " */
+    int fd;       /* read end of pipe, -1 once ssh and its children exit */
+    size_t len;   /* bytes in buffer */
+    size_t done;  /* bytes that went out, the rest is an incomplete line */
+    char buf[LINEMAX];
+} stream_t;
+
+struct fleet {
+    struct fleet* next;
+    int fd;       /* where output goes */
+    int nstreams;
+    int nopen;    /* streams that haven't seen end of file */
+    struct iovec iov[FANOUT_IOV];
+    int niov;
+    stream_t* streams;
+};
+
+static fleet_t* fleets = NULL;
+
+/* Words of command given to 'fanout HOSTFILE -- command...', or NULL if
+ * arguments don't look like that. */
+char** fanoutcmd(char** argv) {
+    if (!argv[0] || !argv[1] || strcmp(argv[1], "--") || !argv[2])
+        return NULL;
+    return argv + 2;
+}
+
+/* Read names of hosts, the first word of each line, skipping empty lines
+ * and comments. Returns an array ending with NULL that is freed at once,
+ * or NULL with errno set. */
+char** readhosts(const char* path, int* countp) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    strbuf_t sb = {};
+    char buf[4096];
+    ssize_t n;
+    strappn(&sb, "", 0);
+    while ((n = read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR))
+        if (n > 0)
+            strappn(&sb, buf, n);
+    int error = errno;
+    close(fd);
+    if (n < 0) {
+        free(sb.str);
+        errno = error;
+        return NULL;
+    }
+
+    /* Names are moved to the front of the text, one after another. */
+    char* out = sb.str;
+    char* end = sb.str + sb.len;
+    int count = 0;
+    for (char* line = sb.str; line < end;) {
+        char* eol = memchr(line, '\n', end - line);
+        if (eol == NULL)
+            eol = end;
+        char* word = line + strspn(line, " \t\r");
+        size_t len = min((size_t)(eol - word), strcspn(word, " \t\r\n#"));
+        if (word < eol && *word != '#' && len > 0) {
+            memmove(out, word, len);
+            out[len] = '\0';
+            out += len + 1;
+            count++;
+        }
+        line = eol + 1;
+    }
+
+    size_t textlen = out - sb.str;
+    char** hosts = malloc(sizeof(char*) * (count + 1) + textlen);
+    char* text = (char*)(hosts + count + 1);
+    memcpy(text, sb.str, textlen);
+    for (int i = 0; i < count; i++) {
+        hosts[i] = text;
+        text += strlen(text) + 1;
+    }
+    hosts[count] = NULL;
+    free(sb.str);
+
+    *countp = count;
+    return hosts;
+}
+
+/* Directory that holds control sockets of ssh masters. It must belong to
+ * the user and be closed to others, or connections aren't multiplexed. */
+static bool controldir(char* buf, size_t size) {
+    const char* runtime = getvar("XDG_RUNTIME_DIR");
+
+    if (runtime)
+        safe_snprintf(buf, size, "%s/shell-fanout", runtime);
+    else
+        safe_snprintf(buf, size, "/tmp/shell-fanout-%u", (unsigned)getuid());
+    if (mkdir(buf, 0700) < 0 && errno != EEXIST)
+        return false;
+
+    struct stat sb;
+    return lstat(buf, &sb) == 0 && S_ISDIR(sb.st_mode) &&
+           sb.st_uid == getuid() && (sb.st_mode & 077) == 0;
+}
+
+/* Words of ssh that runs command on host, the array is freed at once. */
+char** sshargv(const char* host, char** cmd) {
+    static char controlpath[PATH_MAX + 16];
+
+    if (controlpath[0] == '\0') {
+        char dir[PATH_MAX];
+        if (controldir(dir, sizeof(dir)))
+            safe_snprintf(controlpath, sizeof(controlpath),
+                          "ControlPath=%s/%%C", dir);
+    }
+
+    int ncmd = 0;
+    while (cmd[ncmd])
+        ncmd++;
+
+    char** argv = malloc(sizeof(char*) * (ncmd + 16));
+    int n = 0;
+    argv[n++] = "ssh";
+    argv[n++] = "-n";
+    argv[n++] = "-o";
+    argv[n++] = "BatchMode=yes";
+    /* Run without a master if there's no safe place for its socket. */
+    if (controlpath[0] != '\0') {
+        argv[n++] = "-o";
+        argv[n++] = "ControlMaster=auto";
+        argv[n++] = "-o";
+        argv[n++] = "ControlPersist=600";
+        argv[n++] = "-o";
+        argv[n++] = controlpath;
+    }
+    argv[n++] = "--";
+    argv[n++] = (char*)host;
+    memcpy(argv + n, cmd, sizeof(char*) * (ncmd + 1));
+    return argv;
+}
+
+/* Fleet of nhosts hosts, which writes into fd and closes it once the
+ * last of its streams has ended. */
+fleet_t* mkfleet(int fd, int nhosts) {
+    fleet_t* fleet = malloc(sizeof(fleet_t));
+    *fleet = (fleet_t){.fd = fd, .next = fleets};
+    fleet->streams = malloc(sizeof(stream_t) * nhosts);
+    fleets = fleet;
+    return fleet;
+}
+
+#ifdef LINUX
+/* Returns descriptor that process of host writes into, which the caller
+ * has to close, or -1 with errno set. */
+int fleetpipe(fleet_t* fleet, const char* host) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return -1;
+    (void)fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+    stream_t* s = &fleet->streams[fleet->nstreams++];
+    size_t len = strlen(host);
+    s->prefix = malloc(len + 3);
+    memcpy(s->prefix, host, len);
+    memcpy(s->prefix + len, ": ", 3);
+    s->fd = fds[0];
+    s->len = s->done = 0;
+    fleet->nopen++;
+    watchfd(s->fd);
+    return fds[1];
+}
+#else
+int fleetpipe(fleet_t* fleet, const char* host) {
+    errno = ENOSYS;
+    return -1;
+}
+#endif
+
+static void flushfleet(fleet_t* fleet) {
+    writeiov(fleet->fd, fleet->iov, fleet->niov);
+    fleet->niov = 0;
+}
+
+static void queue(fleet_t* fleet, const char* data, size_t len) {
+    fleet->iov[fleet->niov++] = (struct iovec){(char*)data, len};
+}
+
+/* Line goes out with prefix of its stream, newline is added if missing. */
+static void queueline(fleet_t* fleet, stream_t* s, const char* line,
+                      size_t len) {
+    if (fleet->niov + 3 > FANOUT_IOV)
+        flushfleet(fleet);
+    queue(fleet, s->prefix, strlen(s->prefix));
+    queue(fleet, line, len);
+    if (line[len - 1] != '\n')
+        queue(fleet, "\n", 1);
+}
+
+/* Read what's in the pipe once and queue complete lines. Line that fills
+ * the buffer, or is cut short by end of file, is queued as it is. */
+static void drainstream(fleet_t* fleet, stream_t* s) {
+    ssize_t n = read(s->fd, s->buf + s->len, LINEMAX - s->len);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    bool eof = n <= 0;
+    s->len += max(n, (ssize_t)0);
+
+    char* line = s->buf;
+    char* end = s->buf + s->len;
+    for (char* nl; (nl = memchr(line, '\n', end - line)); line = nl + 1)
+        queueline(fleet, s, line, nl + 1 - line);
+    if (line < end && ((line == s->buf && s->len == LINEMAX) || eof)) {
+        queueline(fleet, s, line, end - line);
+        line = end;
+    }
+    s->done = line - s->buf;
+
+    if (eof) {
+        unwatchfd(s->fd);
+        Close(s->fd);
+        s->fd = -1;
+        fleet->nopen--;
+    }
+}
+
+static void freefleet(fleet_t* fleet) {
+    for (int i = 0; i < fleet->nstreams; i++) {
+        if (fleet->streams[i].fd >= 0) {
+            unwatchfd(fleet->streams[i].fd);
+            Close(fleet->streams[i].fd);
+        }
+        free(fleet->streams[i].prefix);
+    }
+    free(fleet->streams);
+    Close(fleet->fd);
+    free(fleet);
+}
+
+/* Called when some pipe of a fleet became readable. Output of all streams
+ * of a fleet goes out in one go, then what's left of their lines is moved
+ * to the start of buffers. */
+void drainfleets(void) {
+    for (fleet_t** fp = &fleets; *fp;) {
+        fleet_t* fleet = *fp;
+
+        for (int i = 0; i < fleet->nstreams; i++)
+            if (fleet->streams[i].fd >= 0)
+                drainstream(fleet, &fleet->streams[i]);
+        flushfleet(fleet);
+
+        for (int i = 0; i < fleet->nstreams; i++) {
+            stream_t* s = &fleet->streams[i];
+            memmove(s->buf, s->buf + s->done, s->len - s->done);
+            s->len -= s->done;
+            s->done = 0;
+        }
+
+        if (fleet->nopen == 0) {
+            *fp = fleet->next;
+            freefleet(fleet);
+        } else {
+            fp = &fleet->next;
+        }
+    }
+}
+
+static bool livefleet_p(fleet_t* fleet) {
+    for (fleet_t* f = fleets; f; f = f->next)
+        if (f == fleet)
+            return true;
+    return false;
+}
+
+/* Foreground job of fleet has finished, what its processes left in pipes
+ * goes out before the shell moves on, unless ^C is hit meanwhile. Then
+ * the rest comes along with later jobs. Fleet is freed once all of its
+ * streams have ended. */
+void endfleet(fleet_t* fleet) {
+    drainfleets();
+    while (livefleet_p(fleet) && !sigint_received) {
+        struct pollfd* pfd = malloc(sizeof(struct pollfd) * fleet->nopen);
+        int n = 0;
+        for (int i = 0; i < fleet->nstreams; i++)
+            if (fleet->streams[i].fd >= 0)
+                pfd[n++] = (struct pollfd){fleet->streams[i].fd, POLLIN, 0};
+        int ready = poll(pfd, n, -1);
+        free(pfd);
+        if (ready > 0)
+            drainfleets();
+    }
+}
+
+/* Forked copy of the shell has no jobs, thus neither their fleets. Pipes
+ * are still watched by the parent, so they're just closed. */
+void resetfleets(void) {
+    while (fleets) {
+        fleet_t* fleet = fleets;
+        fleets = fleet->next;
+        for (int i = 0; i < fleet->nstreams; i++) {
+            if (fleet->streams[i].fd >= 0)
+                Close(fleet->streams[i].fd);
+            fleet->streams[i].fd = -1;
+        }
+        freefleet(fleet);
+    }
+}
@@ -0,0 +1,73 @@
+#include "shell.h"
+
+/* Shell functions live in a hash table keyed by name. Body of a function is
+ * the tree of its compound command, which stays in cache of syntax trees
+ * while the function is defined, see compile. Lookup happens for the first
+ * word of every command, so it costs nothing while there are no functions. */
+
+#define FUNC_BUCKETS 64 /* must be a power of two */
+
+typedef struct function {
+    struct function* next; /* next function in the same bucket */
+    uint32_t hash;         /* jenkins_hash of name */
+    char* name;
+    ast_t* body;
+} function_t;
+
+static function_t* buckets[FUNC_BUCKETS];
+static int nfuncs = 0;
+
+static function_t** lookup(const char* name) {
+    uint32_t hash = jenkins_hash(name, strlen(name), HASHINIT);
+    function_t** fp = &buckets[hash & (FUNC_BUCKETS - 1)];
+    for (; *fp; fp = &(*fp)->next)
+        if ((*fp)->hash == hash && !strcmp((*fp)->name, name))
+            break;
+    return fp;
+}
+
+/* Define or redefine a function. Old body is released, unless it's being
+ * executed, which keeps it alive till it returns. */
+void definefunc(const char* name, ast_t* body) {
+    function_t** fp = lookup(name);
+    function_t* f = *fp;
+
+    body->busy++;
+    if (f) {
+        f->body->busy--;
+        f->body = body;
+        return;
+    }
+
+    f = malloc(sizeof(function_t));
+    f->next = NULL;
+    f->hash = jenkins_hash(name, strlen(name), HASHINIT);
+    f->name = strdup(name);
+    f->body = body;
+    *fp = f;
+    nfuncs++;
+}
+
+/* Returns body of function or NULL if there's no such function. */
+ast_t* findfunc(const char* name) {
+    if (nfuncs == 0)
+        return NULL;
+    function_t* f = *lookup(name);
+    return f ? f->body : NULL;
+}
+
+bool unsetfunc(const char* name) {
+    if (nfuncs == 0)
+        return false;
+    function_t** fp = lookup(name);
+    function_t* f = *fp;
+    if (f == NULL)
+        return false;
+
+    *fp = f->next;
+    f->body->busy--;
+    free(f->name);
+    free(f);
+    nfuncs--;
+    return true;
+}
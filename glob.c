@@ -0,0 +1,376 @@
+#include "shell.h"
+
+/* Pathname expansion. Lexer marks words containing unquoted '*', '?' or '['
+ * and escapes quoted ones with a backslash. Such words have their variables
+ * substituted first, see expandvars. Each component of the pattern is
+ * compiled into a sequence of operations, which is matched without recursion:
+ * after a mismatch only the most recent star has to take one more character.
+ * Directories are listed in bulk and kept sorted, so a literal prefix of the
+ * component narrows candidates down with binary search, and are cached until
+ * the next command line is evaluated. Expanded words live in the line arena. */
+
+typedef enum { OP_LIT, OP_ANY, OP_CLASS, OP_STAR } opkind_t;
+
+typedef struct {
+    opkind_t kind;
+    char* lit;            /* NUL-terminated text for OP_LIT */
+    size_t len;           /* its length */
+    uint8_t set[256 / 8]; /* characters matched by OP_CLASS */
+} op_t;
+
+/* Component of a pattern between slashes. */
+typedef struct {
+    op_t* op;
+    int nop;
+    bool wild;  /* has any operation besides OP_LIT */
+    char* text; /* unescaped text if component isn't wild */
+} segment_t;
+
+typedef struct {
+    arena_t* arena;
+    segment_t* seg;
+    int nseg;
+    char** match; /* names found so far */
+    int nmatch;
+    int size;
+} glob_t;
+
+#define GLOBDIR_BUCKETS 64 /* must be a power of two */
+
+/* Listings of directories read while expanding current command line. */
+typedef struct globdir {
+    struct globdir* next; /* next in the same bucket */
+    struct globdir* all;  /* next directory read */
+    uint32_t hash;
+    char* path;
+    dirlist_t list;
+} globdir_t;
+
+static globdir_t* globdirs[GLOBDIR_BUCKETS];
+static globdir_t* allglobdirs = NULL;
+
+/* Forget listings, called when evaluation of a line starts. Entries come
+ * from the arena, so only listings have to be freed. */
+void flushglobs(void) {
+    for (globdir_t* gd = allglobdirs; gd; gd = gd->all)
+        freedirlist(&gd->list);
+    allglobdirs = NULL;
+    memset(globdirs, 0, sizeof(globdirs));
+}
+
+static dirlist_t* listdir(arena_t* arena, const char* path) {
+    uint32_t hash = jenkins_hash(path, strlen(path), HASHINIT);
+    globdir_t** bucket = &globdirs[hash & (GLOBDIR_BUCKETS - 1)];
+
+    for (globdir_t* gd = *bucket; gd; gd = gd->next)
+        if (gd->hash == hash && !strcmp(gd->path, path))
+            return &gd->list;
+
+    globdir_t* gd = arena_alloc(arena, sizeof(globdir_t));
+    gd->hash = hash;
+    gd->path = arena_strdup(arena, path);
+    /* Directory that can't be read has no matching entries. */
+    (void)readdirlist(AT_FDCWD, path, &gd->list);
+    gd->next = *bucket;
+    *bucket = gd;
+    gd->all = allglobdirs;
+    allglobdirs = gd;
+    return &gd->list;
+}
+
+/* Drop backslashes of a pattern that turned out to be a plain word. */
+char* unescape(arena_t* arena, const char* s, size_t len) {
+    char* text = arena_alloc(arena, len + 1);
+    char* t = text;
+
+    for (const char* end = s + len; s < end; s++) {
+        if (*s == '\\' && s + 1 < end)
+            s++;
+        *t++ = *s;
+    }
+    *t = '\0';
+    return text;
+}
+
+static op_t* addop(arena_t* arena, segment_t* seg, int* size, opkind_t kind) {
+    if (seg->nop == *size) {
+        op_t* old = seg->op;
+        *size *= 2;
+        seg->op = arena_alloc(arena, sizeof(op_t) * *size);
+        memcpy(seg->op, old, sizeof(op_t) * seg->nop);
+    }
+    op_t* op = &seg->op[seg->nop++];
+    op->kind = kind;
+    return op;
+}
+
+/* Parse bracket expression that follows '['. Returns position after closing
+ * bracket or NULL if there's none, in which case '[' stands for itself. */
+static const char* parseclass(const char* p, const char* end, uint8_t* set) {
+    bool negate = p < end && (*p == '!' || *p == '^');
+    if (negate)
+        p++;
+
+    memset(set, 0, 256 / 8);
+    for (bool first = true; p < end && (*p != ']' || first); first = false) {
+        unsigned lo = (uint8_t)(*p == '\\' && p + 1 < end ? *++p : *p);
+        unsigned hi = lo;
+        p++;
+        if (p + 1 < end && *p == '-' && p[1] != ']') {
+            p++;
+            hi = (uint8_t)(*p == '\\' && p + 1 < end ? *++p : *p);
+            p++;
+        }
+        for (unsigned c = lo; c <= hi; c++)
+            set[c / 8] |= 1 << (c % 8);
+    }
+
+    if (p == end)
+        return NULL;
+    if (negate)
+        for (int i = 0; i < 256 / 8; i++)
+            set[i] = ~set[i];
+    return p + 1;
+}
+
+static void compileseg(arena_t* arena, segment_t* seg, const char* p,
+                       const char* end) {
+    int size = 4;
+    strbuf_t lit = {};
+
+    seg->op = arena_alloc(arena, sizeof(op_t) * size);
+    seg->nop = 0;
+    seg->wild = false;
+
+    while (p < end) {
+        uint8_t set[256 / 8];
+        const char* next;
+        opkind_t kind;
+
+        if (*p == '*') {
+            kind = OP_STAR;
+            next = p + 1;
+        } else if (*p == '?') {
+            kind = OP_ANY;
+            next = p + 1;
+        } else if (*p == '[' && (next = parseclass(p + 1, end, set))) {
+            kind = OP_CLASS;
+        } else {
+            if (*p == '\\' && p + 1 < end)
+                p++;
+            strappn(&lit, p++, 1);
+            continue;
+        }
+
+        if (lit.len) {
+            op_t* op = addop(arena, seg, &size, OP_LIT);
+            op->lit = arena_strndup(arena, lit.str, lit.len);
+            op->len = lit.len;
+            lit.len = 0;
+        }
+        /* Consecutive stars match the same as one does. */
+        if (kind != OP_STAR || !seg->nop || seg->op[seg->nop - 1].kind != OP_STAR) {
+            op_t* op = addop(arena, seg, &size, kind);
+            if (kind == OP_CLASS)
+                memcpy(op->set, set, sizeof(set));
+        }
+        seg->wild = true;
+        p = next;
+    }
+
+    if (lit.len) {
+        op_t* op = addop(arena, seg, &size, OP_LIT);
+        op->lit = arena_strndup(arena, lit.str, lit.len);
+        op->len = lit.len;
+    }
+    seg->text = arena_strndup(arena, lit.str ? lit.str : "", lit.len);
+    free(lit.str);
+}
+
+static bool matchop(op_t* op, const char* s, size_t* lenp) {
+    uint8_t c = *s;
+
+    switch (op->kind) {
+        case OP_LIT:
+            *lenp = op->len;
+            return !strncmp(s, op->lit, op->len);
+        case OP_ANY:
+            *lenp = 1;
+            return c != '\0';
+        case OP_CLASS:
+            *lenp = 1;
+            return c != '\0' && (op->set[c / 8] & (1 << (c % 8)));
+        default:
+            return false;
+    }
+}
+
+static bool match(segment_t* seg, const char* name) {
+    const char* s = name;
+    const char* mark = NULL; /* where string matched by last star ends */
+    int star = -1;           /* operation that follows last star */
+    int i = 0;
+
+    /* Hidden files have to be asked for explicitly. */
+    if (name[0] == '.' && (seg->op[0].kind != OP_LIT || seg->op[0].lit[0] != '.'))
+        return false;
+
+    while (true) {
+        size_t len;
+        if (i < seg->nop && seg->op[i].kind == OP_STAR) {
+            star = ++i;
+            mark = s;
+            continue;
+        }
+        if (i == seg->nop) {
+            if (*s == '\0')
+                return true;
+        } else if (matchop(&seg->op[i], s, &len)) {
+            s += len;
+            i++;
+            continue;
+        }
+        /* Let the last star take one more character and try again. */
+        if (star < 0 || *mark == '\0')
+            return false;
+        s = ++mark;
+        i = star;
+    }
+}
+
+static void addmatch(glob_t* g, const char* path) {
+    if (g->nmatch == g->size) {
+        char** old = g->match;
+        g->size = g->size ? g->size * 2 : 16;
+        g->match = arena_alloc(g->arena, sizeof(char*) * g->size);
+        if (old)
+            memcpy(g->match, old, sizeof(char*) * g->nmatch);
+    }
+    g->match[g->nmatch++] = arena_strdup(g->arena, path);
+}
+
+static bool isdir(const char* path, int type) {
+    struct stat sb;
+    if (type == DT_DIR)
+        return true;
+    if (type != DT_LNK && type != DT_UNKNOWN)
+        return false;
+    return fstatat(AT_FDCWD, path, &sb, 0) == 0 && S_ISDIR(sb.st_mode);
+}
+
+/* Path holds directory matched by preceding components, with a slash. */
+static void walk(glob_t* g, char* path, size_t len, int i) {
+    segment_t* seg = &g->seg[i];
+    bool last = i == g->nseg - 1;
+    struct stat sb;
+
+    if (!seg->wild) {
+        size_t n = strlen(seg->text);
+        if (len + n + 2 > PATH_MAX)
+            return;
+        memcpy(path + len, seg->text, n + 1);
+        if (last) {
+            if (fstatat(AT_FDCWD, path, &sb, AT_SYMLINK_NOFOLLOW) == 0)
+                addmatch(g, path);
+        } else {
+            strcpy(path + len + n, "/");
+            walk(g, path, len + n + 1, i + 1);
+        }
+        return;
+    }
+
+    path[len] = '\0';
+    dirlist_t* dl = listdir(g->arena, len ? path : ".");
+    int first = 0, count = dl->nent;
+    if (seg->op[0].kind == OP_LIT)
+        first = prefixrange(dl, seg->op[0].lit, &count);
+
+    for (int e = first; e < first + count; e++) {
+        dentry_t* ent = &dl->ent[e];
+        size_t n = strlen(ent->name);
+        if (len + n + 2 > PATH_MAX || !match(seg, ent->name))
+            continue;
+        memcpy(path + len, ent->name, n + 1);
+        if (last) {
+            addmatch(g, path);
+        } else if (isdir(path, ent->type)) {
+            strcpy(path + len + n, "/");
+            walk(g, path, len + n + 1, i + 1);
+        }
+    }
+}
+
+/* Does the word contain unescaped pattern characters? */
+static bool wild_p(const char* s) {
+    for (; *s; s++) {
+        if (*s == '\\' && s[1])
+            s++;
+        else if (*s == '*' || *s == '?' || *s == '[')
+            return true;
+    }
+    return false;
+}
+
+/* Expand a word into names allocated from arena. If it's not a pattern or
+ * nothing matches, the word stands for itself. Returns number of words put
+ * into matchp. */
+static int expand(arena_t* arena, const char* word, char*** matchp) {
+    glob_t g = {.arena = arena};
+    const char* pattern = expandvars(arena, word);
+    size_t patlen = strlen(pattern);
+    const char* p = pattern;
+    const char* end = pattern + patlen;
+
+    if (wild_p(pattern)) {
+        g.nseg = 1;
+        for (const char* s = p; *s; s++)
+            g.nseg += *s == '/';
+        g.seg = arena_alloc(arena, sizeof(segment_t) * g.nseg);
+
+        /* Absolute pattern begins with an empty component. */
+        for (int i = 0; i < g.nseg; i++) {
+            const char* slash = memchr(p, '/', end - p);
+            const char* stop = slash ? slash : end;
+            compileseg(arena, &g.seg[i], p, stop);
+            p = stop + 1;
+        }
+
+        char path[PATH_MAX];
+        walk(&g, path, 0, 0);
+    }
+
+    if (g.nmatch == 0) {
+        *matchp = arena_alloc(arena, sizeof(char*));
+        (*matchp)[0] = unescape(arena, pattern, patlen);
+        return 1;
+    }
+    *matchp = g.match;
+    return g.nmatch;
+}
+
+/* Returns argv of a command with words expanded and sets argcp. */
+char** expandwords(arena_t* arena, cmd_t* cmd, int* argcp) {
+    char*** words = arena_alloc(arena, sizeof(char**) * cmd->nexpand);
+    int* nwords = arena_alloc(arena, sizeof(int) * cmd->nexpand);
+    int argc = cmd->argc;
+
+    for (int i = 0; i < cmd->nexpand; i++) {
+        nwords[i] = expand(arena, cmd->argv[cmd->expand[i]], &words[i]);
+        argc += nwords[i] - 1;
+    }
+
+    char** argv = arena_alloc(arena, sizeof(char*) * (argc + 1));
+    int n = 0;
+    for (int w = 0, i = 0; w < cmd->argc; w++) {
+        if (i < cmd->nexpand && cmd->expand[i] == w) {
+            memcpy(&argv[n], words[i], sizeof(char*) * nwords[i]);
+            n += nwords[i++];
+        } else {
+            argv[n++] = cmd->argv[w];
+        }
+    }
+    argv[n] = NULL;
+
+    *argcp = argc;
+    return argv;
+}
@@ -0,0 +1,237 @@
+#include "shell.h"
+#include <sys/file.h>
+
+/* History is kept in a file that all interactive shells map into memory. It
+ * holds a ring of records, newest of which overwrite the oldest ones, and a
+ * hash index of record texts. Shells append under an exclusive lock. Each
+ * record ends with its size, so that latest ones can be found by walking the
+ * ring backwards, thus startup doesn't depend on the size of the history.
+ * When a line is entered again, its older record is marked dead, hence
+ * walking back yields every command once.
+ *
+ * Positions of records are logical, i.e. they count bytes ever appended.
+ * Record at logical position pos lives at pos % HIST_RING of the ring and is
+ * valid as long as pos + size >= end - HIST_RING. Records never wrap around,
+ * remaining space at the end of the ring is taken by a filler record. */
+
+#define HIST_MAGIC 0x31545348534c4853ULL /* "SHLSHST1" */
+#define HIST_HDR (64 << 10)              /* header padded to whole pages */
+#define HIST_RING (64 << 20)             /* bytes of records */
+#define HIST_SLOTS (1 << 21)             /* entries of index, power of two */
+#define HIST_PROBE 64 /* index entries examined before eviction */
+
+typedef struct {
+    uint64_t magic;
+    uint64_t end; /* logical position where next record goes */
+} histhdr_t;
+
+/* Followed by NUL-terminated text padded to 8 bytes and size as uint32_t. */
+typedef struct {
+    uint32_t size; /* of whole record, multiple of 8, with flags */
+    uint32_t hash; /* jenkins_hash of text */
+    uint64_t pos;  /* logical position of the record */
+} histrec_t;
+
+#define REC_DEAD 0x80000000U   /* same line was entered again later */
+#define REC_FILLER 0x40000000U /* padding up to the end of the ring */
+#define REC_SIZE(r) ((r)->size & ~(REC_DEAD | REC_FILLER))
+
+/* Index entry points at the latest record having hash of its text. */
+typedef struct {
+    uint32_t hash;
+    uint32_t where; /* offset into ring divided by 8, plus 1; 0 if free */
+} histent_t;
+
+#define HIST_FILE \
+    (HIST_HDR + HIST_RING + sizeof(histent_t) * HIST_SLOTS)
+
+static int hist_fd = -1;
+static histhdr_t* hdr;
+static char* ring;
+static histent_t* slots;
+
+static inline histrec_t* recat(uint64_t pos) {
+    return (histrec_t*)(ring + pos % HIST_RING);
+}
+
+static inline uint32_t trailer(char* end) {
+    return ((uint32_t*)end)[-1];
+}
+
+static inline char* rectext(histrec_t* rec) {
+    return (char*)(rec + 1);
+}
+
+/* Index entries become stale when their records are overwritten. Since they
+ * may point into the middle of newer ones, the record is verified as well. */
+static histrec_t* entryrec(histent_t* ent) {
+    if (ent->where == 0)
+        return NULL;
+
+    uint64_t off = (uint64_t)(ent->where - 1) * 8;
+    if (off + sizeof(histrec_t) > HIST_RING)
+        return NULL;
+
+    histrec_t* rec = (histrec_t*)(ring + off);
+    uint32_t size = REC_SIZE(rec);
+    if (rec->size & (REC_DEAD | REC_FILLER) || rec->hash != ent->hash ||
+        rec->pos % HIST_RING != off || size > HIST_RING - off ||
+        rec->pos + HIST_RING < hdr->end || rec->pos >= hdr->end)
+        return NULL;
+    return rec;
+}
+
+static bool sametext(histrec_t* rec, const char* line, size_t len) {
+    size_t room = REC_SIZE(rec) - sizeof(histrec_t) - sizeof(uint32_t);
+    return len < room && !memcmp(rectext(rec), line, len + 1);
+}
+
+/* Returns index entry for a line, which is either the one of its latest
+ * record, a free one or one that may be reused. */
+static histent_t* findentry(const char* line, size_t len, uint32_t hash) {
+    histent_t* reuse = NULL;
+
+    for (int i = 0; i < HIST_PROBE; i++) {
+        histent_t* ent = &slots[(hash + i) & (HIST_SLOTS - 1)];
+        histrec_t* rec = entryrec(ent);
+        if (rec && rec->hash == hash && sametext(rec, line, len))
+            return ent;
+        if (rec == NULL && reuse == NULL)
+            reuse = ent;
+        if (ent->where == 0)
+            break;
+    }
+
+    /* All entries are taken, evict the one at home position. */
+    return reuse ? reuse : &slots[hash & (HIST_SLOTS - 1)];
+}
+
+static void putrec(uint64_t pos, uint32_t size, uint32_t flags,
+                   uint32_t hash) {
+    histrec_t* rec = recat(pos);
+    rec->size = size | flags;
+    if (size >= sizeof(histrec_t)) {
+        rec->hash = hash;
+        rec->pos = pos;
+    }
+    ((uint32_t*)((char*)rec + size))[-1] = size;
+}
+
+/* Open history file and map it into memory. Without it, history is only
+ * kept by readline until the shell exits. */
+void openhistory(void) {
+    const char* path = getvar("HISTFILE");
+    char buf[PATH_MAX];
+
+    if (path == NULL) {
+        const char* home = getvar("HOME");
+        if (home == NULL)
+            return;
+        safe_snprintf(buf, sizeof(buf), "%s/.shell_history", home);
+        path = buf;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        msg("history: %s: %s\n", path, strerror(errno));
+        return;
+    }
+
+    flock(fd, LOCK_EX);
+    struct stat sb;
+    Fstat(fd, &sb);
+    if (sb.st_size == 0)
+        Ftruncate(fd, HIST_FILE);
+
+    if (sb.st_size != 0 && sb.st_size != HIST_FILE) {
+        msg("history: %s: not a history file\n", path);
+        flock(fd, LOCK_UN);
+        Close(fd);
+        return;
+    }
+
+    char* base = Mmap(NULL, HIST_FILE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    hdr = (histhdr_t*)base;
+    ring = base + HIST_HDR;
+    slots = (histent_t*)(ring + HIST_RING);
+    if (hdr->magic == 0)
+        hdr->magic = HIST_MAGIC;
+    flock(fd, LOCK_UN);
+
+    if (hdr->magic != HIST_MAGIC) {
+        msg("history: %s: not a history file\n", path);
+        Munmap(base, HIST_FILE);
+        Close(fd);
+        return;
+    }
+
+    /* Lookups hit random pages of the index. */
+    Madvise(slots, sizeof(histent_t) * HIST_SLOTS, MADV_RANDOM);
+    hist_fd = fd;
+}
+
+/* Pass at most max latest lines to add, oldest first. */
+void loadhistory(void (*add)(const char*), int max) {
+    if (hist_fd < 0)
+        return;
+
+    char** lines = malloc(sizeof(char*) * max);
+    int n = 0;
+
+    flock(hist_fd, LOCK_SH);
+    uint64_t end = hdr->end;
+    uint64_t start = end > HIST_RING ? end - HIST_RING : 0;
+
+    while (n < max && end > start) {
+        /* Record that ends at the beginning of the ring starts at its end. */
+        char* tail = ring + (end - 1) % HIST_RING + 1;
+        uint32_t size = trailer(tail);
+        if (size == 0 || size % 8 || size > end - start)
+            break;
+        end -= size;
+
+        histrec_t* rec = recat(end);
+        if (!(rec->size & (REC_DEAD | REC_FILLER)))
+            lines[n++] = strdup(rectext(rec));
+    }
+    flock(hist_fd, LOCK_UN);
+
+    while (n > 0) {
+        add(lines[--n]);
+        free(lines[n]);
+    }
+    free(lines);
+}
+
+/* Append a line to history file, burying its previous occurrence. */
+void savehistory(const char* line) {
+    if (hist_fd < 0)
+        return;
+
+    size_t len = strlen(line);
+    uint32_t size = (sizeof(histrec_t) + len + 1 + sizeof(uint32_t) + 7) & ~7;
+    if (size > HIST_RING / 16)
+        return;
+
+    uint32_t hash = jenkins_hash(line, len, HASHINIT);
+
+    flock(hist_fd, LOCK_EX);
+    uint64_t pos = hdr->end;
+    uint32_t room = HIST_RING - pos % HIST_RING;
+    if (room < size) {
+        putrec(pos, room, REC_FILLER, 0);
+        pos += room;
+    }
+
+    histent_t* ent = findentry(line, len, hash);
+    histrec_t* old = entryrec(ent);
+    if (old && old->hash == hash && sametext(old, line, len))
+        old->size |= REC_DEAD;
+
+    putrec(pos, size, 0, hash);
+    memcpy(rectext(recat(pos)), line, len + 1);
+    ent->hash = hash;
+    ent->where = pos % HIST_RING / 8 + 1;
+    hdr->end = pos + size;
+    flock(hist_fd, LOCK_UN);
+}
@@ -1,302 +1,1557 @@
 #include "shell.h"
+#include "tree.h"
 
+#ifdef LINUX
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#endif
+
+/* Processes of a job are kept as a structure of arrays. Identifiers and
+ * states, which are all that walks over processes look at, are packed in
+ * arrays of their own, and the rest lives in proc_t. */
 typedef struct proc {
-    pid_t pid;    /* process identifier */
-    int state;    /* RUNNING or STOPPED or FINISHED */
-    int exitcode; /* -1 if exit status not yet received */
+    int exitcode;            /* -1 if exit status not yet received */
+    bool helper;             /* runs process substitution of the command */
+    bool timedout;           /* was alive when deadline of its job passed */
+    struct timespec started; /* when process was added to its job */
+    struct timespec ended;   /* when it was buried */
+    struct rusage rusage;    /* resources used, valid once FINISHED */
 } proc_t;
 
+/* Most pipelines are short, so their processes are stored in job_t itself.
+ * Longer ones spill over to arrays on the heap. */
+#define NPROC_INLINE 4
+
 typedef struct job {
     pid_t pgid;       /* 0 if slot is free */
-    proc_t* proc;     /* array of processes running in as a job */
+    pid_t* pid;       /* identifiers of processes running in as a job */
+    uint8_t* pstate;  /* RUNNING or STOPPED or FINISHED of each process */
+    proc_t* proc;     /* remaining data of each process */
     int nproc;        /* number of processes */
+    int nprocmax;     /* number of slots in process arrays */
     int state;        /* changes when live processes have same state */
-    char* command;    /* textual representation of command line */
+    bool dirty;       /* processes changed state since it was computed */
+    strbuf_t command; /* textual representation of command line */
+    int nextfree;     /* next slot on free list, valid if slot is free */
+    int num;          /* job number seen by user, stays when slot changes */
+    int slot;         /* index into jobs table */
+    bool has_tmodes;  /* terminal modes were saved when job got stopped */
+    struct termios tmodes; /* modes restored when job is resumed in fg */
+    limits_t limits;  /* applied to each process as it's added */
+    char* cgroup;     /* directory of job's cgroup or NULL */
+    ring_t* ring;     /* buffer its output goes into or NULL */
+    bool fleet;       /* processes run one command on many hosts */
+    int deadline;     /* index into heap of deadlines or -1 */
+    int timeoutsig;   /* signal sent once deadline passes */
+    uint64_t killafter; /* nanoseconds till SIGKILL follows it, 0 if never */
+    RB_ENTRY(job) bynum;  /* entry in index ordered by job number */
+    RB_ENTRY(job) bypgid; /* entry in index ordered by process group */
+    pid_t ipid[NPROC_INLINE];      /* inline storage for process arrays */
+    uint8_t ipstate[NPROC_INLINE];
+    proc_t iproc[NPROC_INLINE];
 } job_t;
 
-static job_t* jobs = NULL; /* array of all jobs */
-static int njobmax = 1;    /* number of slots in jobs array */
+/* Jobs table is split into chunks of geometrically growing size, so that
+ * adding slots does not move existing ones. Chunk c holds JOBCHUNK << c
+ * slots, thus slot j lives in chunk floor(log2(j / JOBCHUNK + 1)). */
+#define JOBCHUNK 8
+#define MAXCHUNKS 24
+
+static job_t* jobs[MAXCHUNKS]; /* chunks of jobs table */
+static int nchunks = 0;        /* number of allocated chunks */
+static int njobmax = 1;        /* number of slots used since compaction */
+static int freejob = -1;       /* first slot on free list or -1 if empty */
 static int tty_fd = -1;    /* controlling terminal file descriptor */
+static bool jobctl;        /* are jobs put into their own process groups? */
+static struct termios shell_tmodes; /* modes of terminal while shell has it */
+static limits_t bglimits = {.nice = NONICE, .ioprio = -1}; /* of new '&' jobs */
 
-static void sigchld_handler(int sig) {
-    int old_errno = errno;
-    int status;
-    /* DONE: Change state (FINISHED, RUNNING, STOPPED) of processes and jobs.
-     * Bury all children that finished saving their status in jobs. */
-    for (size_t j = 0; j < njobmax; j++) {
-        job_t* job = &jobs[j];
-        if (!job->pgid) {
+#ifdef LINUX
+/* SIGCHLD stays blocked for the whole life of the shell. Notifications are
+ * received through signalfd and children are buried in normal context. */
+static int sigchld_fd = -1; /* signalfd for SIGCHLD */
+static int timer_fd = -1;   /* expires when earliest deadline passes */
+static int epoll_fd = -1;   /* waits for sigchld_fd, timer_fd, tty_fd and
+                             * pipes of rings */
+#endif
+
+/* Jobs started by 'timeout' have deadlines, which are kept in a binary heap
+ * ordered by time, so that thousands of them cost a single timer. Entries
+ * refer to slots of jobs, each job knows where its entry is. */
+typedef struct {
+    uint64_t when; /* CLOCK_MONOTONIC time in nanoseconds */
+    int slot;
+} deadline_t;
+
+static deadline_t* deadlines = NULL;
+static int ndeadlines = 0;
+static int deadlines_size = 0;
+
+static inline job_t* getjob(int j) {
+    int c = 31 - __builtin_clz(j / JOBCHUNK + 1);
+    return &jobs[c][j - JOBCHUNK * ((1 << c) - 1)];
+}
+
+/* Live background jobs are indexed by number and by process group, so that
+ * finding a job or walking through them doesn't touch free slots, which may
+ * be plenty after a burst of jobs. The index also maps job numbers onto
+ * slots, which change when the table gets compacted. Entries are embedded in
+ * slots and moved with them. Groups aren't unique without job control, hence
+ * ties are broken by job number. */
+static int jobnumcmp(job_t* a, job_t* b) {
+    return a->num < b->num ? -1 : a->num > b->num;
+}
+
+static int jobpgidcmp(job_t* a, job_t* b) {
+    if (a->pgid != b->pgid)
+        return a->pgid < b->pgid ? -1 : 1;
+    return jobnumcmp(a, b);
+}
+
+static RB_HEAD(numtree, job) numtree = RB_INITIALIZER(&numtree);
+static RB_HEAD(pgidtree, job) pgidtree = RB_INITIALIZER(&pgidtree);
+static int nlive = 0; /* number of indexed jobs */
+
+RB_GENERATE_STATIC(numtree, job, bynum, jobnumcmp);
+RB_GENERATE_STATIC(pgidtree, job, bypgid, jobpgidcmp);
+
+static void indexjob(int j) {
+    job_t* job = getjob(j);
+    RB_INSERT(numtree, &numtree, job);
+    RB_INSERT(pgidtree, &pgidtree, job);
+    nlive++;
+}
+
+static void unindexjob(int j) {
+    job_t* job = getjob(j);
+    RB_REMOVE(numtree, &numtree, job);
+    RB_REMOVE(pgidtree, &pgidtree, job);
+    nlive--;
+}
+
+/* Returns live background job of given number or NULL. */
+static job_t* findjob(int j) {
+    job_t key = {.num = j};
+    return RB_FIND(numtree, &numtree, &key);
+}
+
+/* Translates job number given by the rest of the shell. */
+static job_t* numjob(int j) {
+    job_t* job = j == FG ? getjob(FG) : findjob(j);
+    assert(job != NULL);
+    return job;
+}
+
+/* Jobs get numbers higher than any live job, like in other shells. */
+static int nextnum(void) {
+    job_t* last = RB_MAX(numtree, &numtree);
+    return last ? last->num + 1 : BG;
+}
+
+/* Maps pid of every unfinished process onto its slot in jobs table, so that
+ * buried children are matched with jobs without scanning the table. Open
+ * addressing with linear probing; deletion shifts entries back, hence no
+ * tombstones. */
+typedef struct {
+    pid_t pid; /* 0 if entry is free */
+    int job;   /* index into jobs table */
+    int proc;  /* index into job's process arrays */
+} pident_t;
+
+static pident_t* pidtab = NULL; /* hash table of pid entries */
+static int pidtab_size = 0;     /* number of entries, power of two */
+static int pidtab_used = 0;     /* number of occupied entries */
+
+static inline unsigned pidslot(pid_t pid) {
+    return jenkins_hash(&pid, sizeof(pid), HASHINIT) & (pidtab_size - 1);
+}
+
+static pident_t* findpid(pid_t pid) {
+    if (pidtab_size == 0)
+        return NULL;
+    for (unsigned i = pidslot(pid);; i = (i + 1) & (pidtab_size - 1)) {
+        if (pidtab[i].pid == pid)
+            return &pidtab[i];
+        if (pidtab[i].pid == 0)
+            return NULL;
+    }
+}
+
+static void insertpid(pid_t pid, int job, int proc);
+
+static void resizepidtab(int size) {
+    pident_t* old = pidtab;
+    int oldsize = pidtab_size;
+
+    pidtab_size = size;
+    pidtab = calloc(pidtab_size, sizeof(pident_t));
+    pidtab_used = 0;
+
+    for (int i = 0; i < oldsize; i++)
+        if (old[i].pid)
+            insertpid(old[i].pid, old[i].job, old[i].proc);
+    free(old);
+}
+
+/* Must be called with SIGCHLD blocked, since it may reallocate the table. */
+static void insertpid(pid_t pid, int job, int proc) {
+    if (2 * (pidtab_used + 1) > pidtab_size)
+        resizepidtab(pidtab_size ? pidtab_size * 2 : 16);
+
+    unsigned i = pidslot(pid);
+    while (pidtab[i].pid != 0 && pidtab[i].pid != pid)
+        i = (i + 1) & (pidtab_size - 1);
+
+    if (pidtab[i].pid == 0)
+        pidtab_used++;
+    pidtab[i] = (pident_t){.pid = pid, .job = job, .proc = proc};
+}
+
+/* Safe to call from signal handler, as it neither allocates nor frees. */
+static void removepid(pident_t* ent) {
+    unsigned mask = pidtab_size - 1;
+    unsigned i = ent - pidtab;
+    unsigned j = i;
+
+    while (true) {
+        j = (j + 1) & mask;
+        if (pidtab[j].pid == 0)
+            break;
+        /* Move entry at j into the hole at i unless its home slot lies
+         * cyclically within (i, j]. */
+        unsigned home = pidslot(pidtab[j].pid);
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
             continue;
-        }
+        pidtab[i] = pidtab[j];
+        i = j;
+    }
 
-        bool has_running = false;
-        bool has_stopped = false;
+    pidtab[i].pid = 0;
+    pidtab_used--;
+}
 
-        for (size_t p = 0; p < job->nproc; p++) {
-            proc_t* proc = &job->proc[p];
-            if (proc->state == FINISHED) {
-                continue;
-            }
+/* Recompute job's state from states of its processes. */
+static void updatejob(job_t* job) {
+    /* States are bytes, so memchr goes through many of them at once. */
+    if (memchr(job->pstate, RUNNING, job->nproc)) {
+        job->state = RUNNING;
+    } else if (memchr(job->pstate, STOPPED, job->nproc)) {
+        job->state = STOPPED;
+    } else {
+        job->state = FINISHED;
+    }
+    job->dirty = false;
+}
 
-            int wait_res = waitpid(
-                proc->pid,
-                &status,
-                WNOHANG | WUNTRACED | WCONTINUED
-            );
-
-            if (wait_res > 0) {
-                if (WIFEXITED(status) || WIFSIGNALED(status)) {
-                    proc->state = FINISHED;
-                    proc->exitcode = status;
-                } else if (WIFCONTINUED(status)) {
-                    proc->state = RUNNING;
-                } else if (WIFSTOPPED(status)) {
-                    proc->state = STOPPED;
-                }
-            }
+/* State of a job is only recomputed when somebody looks at it, thus a whole
+ * pipeline exiting at once costs a single walk over its processes. */
+static int getstate(job_t* job) {
+    if (job->dirty)
+        updatejob(job);
+    return job->state;
+}
 
-            if (proc->state == RUNNING) {
-                has_running = true;
-            } else if (proc->state == STOPPED) {
-                has_stopped = true;
-            }
+static uint64_t monotonic(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void placedeadline(int i, deadline_t d) {
+    deadlines[i] = d;
+    getjob(d.slot)->deadline = i;
+}
+
+static void siftup(int i) {
+    deadline_t d = deadlines[i];
+    while (i > 0 && deadlines[(i - 1) / 2].when > d.when) {
+        placedeadline(i, deadlines[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    placedeadline(i, d);
+}
+
+static void siftdown(int i) {
+    deadline_t d = deadlines[i];
+    while (2 * i + 1 < ndeadlines) {
+        int c = 2 * i + 1;
+        if (c + 1 < ndeadlines && deadlines[c + 1].when < deadlines[c].when)
+            c++;
+        if (deadlines[c].when >= d.when)
+            break;
+        placedeadline(i, deadlines[c]);
+        i = c;
+    }
+    placedeadline(i, d);
+}
+
+/* Timer goes off when the earliest deadline passes. */
+static void armtimer(void) {
+#ifdef LINUX
+    struct itimerspec its = {};
+    if (ndeadlines > 0) {
+        uint64_t when = deadlines[0].when;
+        its.it_value.tv_sec = when / 1000000000;
+        its.it_value.tv_nsec = max(when % 1000000000, (uint64_t)1);
+    }
+    (void)timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+#else
+    struct itimerval itv = {};
+    if (ndeadlines > 0) {
+        uint64_t now = monotonic(), when = deadlines[0].when;
+        uint64_t usec = when > now ? (when - now + 999) / 1000 : 1;
+        itv.it_value.tv_sec = usec / 1000000;
+        itv.it_value.tv_usec = usec % 1000000;
+    }
+    (void)setitimer(ITIMER_REAL, &itv, NULL);
+#endif
+}
+
+static void pushdeadline(int slot, uint64_t when) {
+    if (ndeadlines == deadlines_size) {
+        deadlines_size = max(2 * deadlines_size, 16);
+        deadlines = realloc(deadlines, sizeof(deadline_t) * deadlines_size);
+    }
+    deadlines[ndeadlines++] = (deadline_t){when, slot};
+    siftup(ndeadlines - 1);
+    if (getjob(slot)->deadline == 0)
+        armtimer();
+}
+
+static void removedeadline(job_t* job) {
+    int i = job->deadline;
+    if (i < 0)
+        return;
+
+    job->deadline = -1;
+    if (--ndeadlines > i) {
+        placedeadline(i, deadlines[ndeadlines]);
+        siftup(i);
+        siftdown(i);
+    }
+    if (i == 0)
+        armtimer();
+}
+
+static void signaljob(job_t* job, int sig);
+
+/* Signal jobs whose deadlines have passed. Ones that are given a while to
+ * exit get SIGKILL once it's over. */
+static void expiredeadlines(void) {
+    if (ndeadlines == 0)
+        return;
+#ifdef LINUX
+    uint64_t ticks;
+    (void)read(timer_fd, &ticks, sizeof(ticks));
+#endif
+
+    uint64_t now = monotonic();
+    bool expired = false;
+    while (ndeadlines > 0 && deadlines[0].when <= now) {
+        job_t* job = getjob(deadlines[0].slot);
+        int sig = job->timeoutsig;
+
+        expired = true;
+        job->deadline = -1;
+        if (--ndeadlines > 0) {
+            placedeadline(0, deadlines[ndeadlines]);
+            siftdown(0);
+        }
+        /* Finished job just hasn't been collected yet. */
+        if (getstate(job) == FINISHED)
+            continue;
+
+        debug("[%d] deadline of '%s' passed\n", job->num, job->command.str);
+        for (int p = 0; p < job->nproc; p++)
+            if (job->pstate[p] != FINISHED)
+                job->proc[p].timedout = true;
+        signaljob(job, sig);
+        if (sig != SIGKILL && sig != SIGCONT)
+            signaljob(job, SIGCONT);
+        if (job->killafter) {
+            job->timeoutsig = SIGKILL;
+            pushdeadline(job->slot, now + job->killafter);
+            job->killafter = 0;
         }
+    }
+    if (expired)
+        armtimer();
+}
+
+/* Children are buried into a ring, possibly by the signal handler, and their
+ * statuses are applied to jobs later in normal context. There's one producer
+ * and one consumer, each owning its index, so the ring needs no locks. */
+#define REAPRING 64 /* number of entries, power of two */
+
+typedef struct {
+    pid_t pid;
+    int status;
+    struct rusage rusage;
+    struct timespec ended;
+} reaped_t;
 
-        if (has_running) {
-            job->state = RUNNING;
-        } else if (has_stopped) {
-            job->state = STOPPED;
-        } else {
-            job->state = FINISHED;
+static reaped_t reapring[REAPRING];
+static unsigned reap_head = 0; /* next entry to be filled by producer */
+static unsigned reap_tail = 0; /* next entry to be applied by consumer */
+static volatile sig_atomic_t reap_full = 0; /* children were left unburied */
+
+/* Bury children until there are no more or the ring is full, in which case
+ * returns false. Async-signal-safe. */
+static bool reapchildren(void) {
+    unsigned head = reap_head;
+
+    while (head - __atomic_load_n(&reap_tail, __ATOMIC_ACQUIRE) < REAPRING) {
+        reaped_t* r = &reapring[head & (REAPRING - 1)];
+        r->pid = wait4(-1, &r->status, WNOHANG | WUNTRACED | WCONTINUED,
+                       &r->rusage);
+        if (r->pid <= 0)
+            return true;
+        clock_gettime(CLOCK_MONOTONIC, &r->ended);
+        __atomic_store_n(&reap_head, ++head, __ATOMIC_RELEASE);
+    }
+
+    reap_full = 1;
+    return false;
+}
+
+/* Change state (FINISHED, RUNNING, STOPPED) of processes buried so far.
+ * Jobs are only marked as dirty. */
+static void applyreaped(void) {
+    unsigned tail = reap_tail;
+
+    for (; tail != __atomic_load_n(&reap_head, __ATOMIC_ACQUIRE); tail++) {
+        reaped_t* r = &reapring[tail & (REAPRING - 1)];
+        pident_t* ent = findpid(r->pid);
+        if (ent == NULL)
+            continue;
+
+        job_t* job = getjob(ent->job);
+        proc_t* proc = &job->proc[ent->proc];
+        uint8_t* state = &job->pstate[ent->proc];
+
+        if (WIFEXITED(r->status) || WIFSIGNALED(r->status)) {
+            *state = FINISHED;
+            /* Process killed for missing deadline exits like one run by
+             * timeout(1), whatever the signal did to it, unless it took
+             * SIGKILL, which timeout(1) reports as it is. */
+            bool killed =
+                WIFSIGNALED(r->status) && WTERMSIG(r->status) == SIGKILL;
+            proc->exitcode = proc->timedout && !killed ? EXIT_TIMEDOUT << 8
+                                                       : r->status;
+            proc->rusage = r->rusage;
+            proc->ended = r->ended;
+            /* Once buried, the pid may be reused by the kernel. */
+            removepid(ent);
+        } else if (WIFCONTINUED(r->status)) {
+            *state = RUNNING;
+        } else if (WIFSTOPPED(r->status)) {
+            *state = STOPPED;
         }
+
+        job->dirty = true;
     }
 
+    __atomic_store_n(&reap_tail, tail, __ATOMIC_RELEASE);
+}
 
+/* Bury all children that changed their state. SIGCHLD must be blocked. */
+static void burychildren(void) {
+    reap_full = 0;
+    while (!reapchildren())
+        applyreaped();
+    applyreaped();
+}
+
+#ifndef LINUX
+static void sigchld_handler(int sig) {
+    int old_errno = errno;
+    (void)reapchildren();
     errno = old_errno;
 }
 
-/* When pipeline is done, its exitcode is fetched from the last process. */
+static void sigalrm_handler(int sig) {
+}
+#endif
+
+/* Bring state of jobs up to date with children that were buried by the
+ * signal handler or have a pending notification. SIGCHLD must be blocked. */
+static void pollchildren(void) {
+#ifdef LINUX
+    struct signalfd_siginfo si[16];
+    bool pending = false;
+
+    while (read(sigchld_fd, si, sizeof(si)) > 0)
+        pending = true;
+
+    if (pending)
+        burychildren();
+#else
+    /* Handler that ran out of ring space won't be called again for children
+     * it left behind, their notifications have already been delivered. */
+    if (reap_full)
+        burychildren();
+    else
+        applyreaped();
+#endif
+    expiredeadlines();
+}
+
+#ifdef LINUX
+/* Wait up to timeout milliseconds for children or timer, then bring jobs up
+ * to date. SIGCHLD must be blocked. */
+static void handleevents(int timeout) {
+    struct epoll_event ev[3];
+    int n = epoll_wait(epoll_fd, ev, 3, timeout);
+
+    bool output = false;
+    for (int i = 0; i < n; i++) {
+        int fd = ev[i].data.fd;
+        if (fd != tty_fd) {
+            output = output || (fd != sigchld_fd && fd != timer_fd);
+            continue;
+        }
+        /* Terminal hung up: pass the news to foreground job and stop
+         * watching the terminal, otherwise we would be woken up forever. */
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, tty_fd, NULL);
+        if (getjob(FG)->pgid)
+            (void)kill(-getjob(FG)->pgid, SIGHUP);
+    }
+
+    if (output) {
+        drainrings();
+        drainfleets();
+    }
+    pollchildren();
+}
+#endif
+
+/* Descriptors that jobs write into are waited for along with the jobs. */
+void watchfd(int fd) {
+#ifdef LINUX
+    struct epoll_event ev = {.events = EPOLLIN};
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+#endif
+}
+
+void unwatchfd(int fd) {
+#ifdef LINUX
+    (void)epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+}
+
+/* Descriptor that becomes readable when jobs need attention, so that the
+ * line editor can wait for it along with input, or -1 if there's none. */
+int jobsfd(void) {
+#ifdef LINUX
+    return epoll_fd;
+#else
+    return -1;
+#endif
+}
+
+/* Handle what made jobsfd readable, without waiting. */
+void jobevents(void) {
+    sigset_t mask;
+    Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+#ifdef LINUX
+    handleevents(0);
+#else
+    pollchildren();
+#endif
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+/* Sleep until some child changes its state. SIGCHLD must be blocked.
+ * Callers may be nested in critical sections, so mask could have SIGCHLD
+ * blocked as well, but the signal must be let in while we're asleep. */
+static void waitchildren(sigset_t* mask) {
+#ifdef LINUX
+    handleevents(-1);
+#else
+    sigset_t waitmask = *mask;
+    sigdelset(&waitmask, SIGCHLD);
+    Sigsuspend(&waitmask);
+    pollchildren();
+#endif
+}
+
+/* Send a signal to all processes of a job. Without job control they share
+ * process group with the shell, so they must be signalled one by one. */
+static void signaljob(job_t* job, int sig) {
+    if (jobctl) {
+        Kill(-job->pgid, sig);
+        return;
+    }
+
+    for (int p = 0; p < job->nproc; p++)
+        if (job->pstate[p] != FINISHED)
+            (void)kill(job->pid[p], sig);
+}
+
+/* Fleet fails with the number of its processes that failed, like 'pjobs'.
+ * It's seen as interrupted if any of them was, and as killed if all were. */
+static int fleetcode(job_t* job) {
+    int nfailed = 0, nkilled = 0, nprocs = 0, killed = 0;
+    for (int p = 0; p < job->nproc; p++) {
+        int status = job->proc[p].exitcode;
+        if (job->proc[p].helper)
+            continue;
+        nprocs++;
+        if (status == 0)
+            continue;
+        if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+            return status;
+        if (WIFSIGNALED(status))
+            nkilled++, killed = status;
+        nfailed++;
+    }
+    if (nkilled == nprocs)
+        return killed;
+    return min(nfailed, 100) << 8;
+}
+
+/* When pipeline is done, its exitcode is fetched from the last process,
+ * unless it's a helper started for the command that runs within the shell. */
 static int exitcode(job_t* job) {
+    if (job->fleet)
+        return fleetcode(job);
+    for (int p = job->nproc - 1; p >= 0; p--)
+        if (!job->proc[p].helper)
+            return job->proc[p].exitcode;
     return job->proc[job->nproc - 1].exitcode;
 }
 
+/* Statuses were saved when processes were buried, so copying them is all
+ * that's needed to tell how each stage of a pipeline has finished. */
+static void stagestatus(job_t* job, int* statuses) {
+    int n = 0;
+    for (int p = 0; p < job->nproc; p++)
+        if (!job->proc[p].helper)
+            statuses[n++] = job->proc[p].exitcode;
+}
+
 static int allocjob(void) {
-    /* Find empty slot for background job. */
-    for (int j = BG; j < njobmax; j++)
-        if (jobs[j].pgid == 0)
-            return j;
+    /* Reuse slot of a job that has been deleted. */
+    if (freejob >= 0) {
+        int j = freejob;
+        freejob = getjob(j)->nextfree;
+        return j;
+    }
 
-    /* If none found, allocate new one. */
-    jobs = realloc(jobs, sizeof(job_t) * (njobmax + 1));
+    /* If none found, take next unused one, adding a chunk if necessary. */
+    if (njobmax == JOBCHUNK * ((1 << nchunks) - 1)) {
+        if (nchunks == MAXCHUNKS)
+            app_error("Too many jobs");
+        jobs[nchunks] = calloc(JOBCHUNK << nchunks, sizeof(job_t));
+        nchunks++;
+    }
     return njobmax++;
 }
 
-static int allocproc(int j) {
-    job_t* job = &jobs[j];
-    job->proc = realloc(job->proc, sizeof(proc_t) * (job->nproc + 1));
+/* Put empty slot of background job on free list. */
+static void freeslot(int j) {
+    if (j == FG)
+        return;
+    job_t* job = getjob(j);
+    assert(job->pgid == 0);
+    job->nextfree = freejob;
+    freejob = j;
+}
+
+static void* growarray(void* array, void* inline_array, size_t size,
+                       int n) {
+    if (array != inline_array)
+        return realloc(array, size * n);
+    void* grown = malloc(size * n);
+    memcpy(grown, inline_array, size * NPROC_INLINE);
+    return grown;
+}
+
+static int allocproc(job_t* job) {
+    if (job->nproc == job->nprocmax) {
+        int n = job->nprocmax * 2;
+        job->pid = growarray(job->pid, job->ipid, sizeof(pid_t), n);
+        job->pstate = growarray(job->pstate, job->ipstate, sizeof(uint8_t), n);
+        job->proc = growarray(job->proc, job->iproc, sizeof(proc_t), n);
+        job->nprocmax = n;
+    }
+
     return job->nproc++;
 }
 
-int addjob(pid_t pgid, int bg) {
+/* Returns slot of a new job. */
+static int mkjob(pid_t pgid, int bg) {
     int j = bg ? allocjob() : FG;
-    job_t* job = &jobs[j];
+    job_t* job = getjob(j);
     /* Initial state of a job. */
+    job->num = bg ? nextnum() : FG;
+    job->slot = j;
     job->pgid = pgid;
     job->state = RUNNING;
-    job->command = NULL;
-    job->proc = NULL;
+    job->dirty = false;
+    job->has_tmodes = false;
+    job->command = (strbuf_t){};
+    job->pid = job->ipid;
+    job->pstate = job->ipstate;
+    job->proc = job->iproc;
     job->nproc = 0;
+    job->nprocmax = NPROC_INLINE;
+    job->limits = bg ? bglimits : nolimits;
+    job->cgroup = NULL;
+    job->deadline = -1;
+    job->ring = NULL;
+    job->fleet = false;
+    /* Output of a deleted job that had the number is gone with it. */
+    if (bg)
+        dropring(job->num);
+    if (!setcgroup(&job->cgroup, job->num, &job->limits))
+        msg("[%d] cgroup: %s\n", job->num, strerror(errno));
+    /* Stopped foreground job gets its group once it's moved in. */
+    if (bg && pgid)
+        indexjob(j);
     return j;
 }
 
-static void deljob(job_t* job) {
-    assert(job->state == FINISHED);
-    free(job->command);
-    free(job->proc);
+/* Returns number of a new job. */
+int addjob(pid_t pgid, int bg) {
+    return getjob(mkjob(pgid, bg))->num;
+}
+
+/* Release memory owned by a job. */
+static void releasejob(job_t* job) {
+    free(job->command.str);
+    free(job->cgroup);
+    if (job->proc != job->iproc) {
+        free(job->pid);
+        free(job->pstate);
+        free(job->proc);
+    }
+}
+
+static void deljob(int j) {
+    job_t* job = getjob(j);
+    assert(getstate(job) == FINISHED);
+    if (j != FG)
+        unindexjob(j);
+    if (job->cgroup)
+        rmcgroup(job->cgroup);
+    removedeadline(job);
+    if (job->ring)
+        endring(job->ring);
+    releasejob(job);
     job->pgid = 0;
-    job->command = NULL;
+    job->command = (strbuf_t){};
+    job->pid = NULL;
+    job->pstate = NULL;
     job->proc = NULL;
     job->nproc = 0;
+    job->cgroup = NULL;
+    job->ring = NULL;
+    freeslot(j);
 }
 
 static void movejob(int from, int to) {
-    assert(jobs[to].pgid == 0);
-    memcpy(&jobs[to], &jobs[from], sizeof(job_t));
-    memset(&jobs[from], 0, sizeof(job_t));
+    job_t* job = getjob(to);
+    assert(job->pgid == 0);
+    if (from != FG)
+        unindexjob(from);
+    /* Job takes number of the slot when it's moved in or out of foreground,
+     * but keeps its own when the table is compacted. */
+    int num = from != FG && to != FG ? getjob(from)->num : job->num;
+    memcpy(job, getjob(from), sizeof(job_t));
+    job->num = num;
+    job->slot = to;
+    if (job->proc == getjob(from)->iproc) {
+        job->pid = job->ipid;
+        job->pstate = job->ipstate;
+        job->proc = job->iproc;
+    }
+    memset(getjob(from), 0, sizeof(job_t));
+    freeslot(from);
+    if (to != FG)
+        indexjob(to);
+    if (job->deadline >= 0)
+        deadlines[job->deadline].slot = to;
+    if (job->ring)
+        numberring(job->ring, num);
+
+    /* Let pid index know where unfinished processes went. */
+    for (int p = 0; p < job->nproc; p++) {
+        if (job->pstate[p] == FINISHED)
+            continue;
+        pident_t* ent = findpid(job->pid[p]);
+        assert(ent != NULL);
+        ent->job = to;
+    }
 }
 
-static void mkcommand(char** cmdp, char** argv) {
-    if (*cmdp)
-        strapp(cmdp, " | ");
+/* After a burst of background jobs most slots are free, but they would still
+ * take memory and be visited by walks over the table. Once less than a
+ * quarter of slots is in use, live jobs are moved down to lowest ones and
+ * chunks that aren't needed are released. The table keeps room for twice as
+ * many jobs as are alive, so that it doesn't grow right after shrinking. */
+static void compactjobs(void) {
+    if (njobmax <= JOBCHUNK || 4 * (nlive + 1) > njobmax)
+        return;
 
-    for (strapp(cmdp, *argv++); *argv; argv++) {
-        strapp(cmdp, " ");
-        strapp(cmdp, *argv);
+    /* Slots below 'to' are taken, thus the one at 'to' is free. */
+    int to = BG;
+    for (int from = BG; from < njobmax; from++) {
+        if (getjob(from)->pgid == 0)
+            continue;
+        if (from != to)
+            movejob(from, to);
+        to++;
+    }
+    njobmax = to;
+    freejob = -1;
+
+    while (nchunks > 1 && JOBCHUNK * ((1 << (nchunks - 1)) - 1) >= 2 * njobmax)
+        free(jobs[--nchunks]);
+
+    /* Same goes for pid index, which only needs to hold live processes. */
+    int size = pidtab_size;
+    while (size > 16 && 8 * pidtab_used < size)
+        size /= 2;
+    if (size != pidtab_size)
+        resizepidtab(size);
+}
+
+static void mkcommand(strbuf_t* cmd, char** argv) {
+    if (cmd->len)
+        strapp(cmd, " | ");
+
+    for (strapp(cmd, *argv++); *argv; argv++) {
+        strapp(cmd, " ");
+        strapp(cmd, *argv);
     }
 }
 
 void addproc(int j, pid_t pid, char** argv) {
-    assert(j < njobmax);
-    job_t* job = &jobs[j];
+    job_t* job = numjob(j);
 
-    int p = allocproc(j);
+    int p = allocproc(job);
     proc_t* proc = &job->proc[p];
     /* Initial state of a process. */
-    proc->pid = pid;
-    proc->state = RUNNING;
+    job->pid[p] = pid;
+    job->pstate[p] = RUNNING;
     proc->exitcode = -1;
-    mkcommand(&job->command, argv);
+    proc->helper = argv == NULL;
+    proc->timedout = false;
+    clock_gettime(CLOCK_MONOTONIC, &proc->started);
+    insertpid(pid, job->slot, p);
+    if (limited_p(&job->limits))
+        (void)applylimits(pid, &job->limits, job->cgroup);
+    /* Helper processes, i.e. process substitutions, have no argv. */
+    if (argv)
+        mkcommand(&job->command, argv);
 }
 
-/* Returns job's state.
- * If it's finished, delete it and return exitcode through statusp. */
-int jobstate(int j, int* statusp) {
-    assert(j < njobmax);
-    job_t* job = &jobs[j];
-    int state = job->state;
+/* If job has finished, put statuses of its stages into statuses, unless
+ * it's NULL, then delete it and return exitcode through statusp. */
+static int collectjob(job_t* job, int* statusp, int* statuses) {
+    pollchildren();
+    int state = getstate(job);
 
     /* DONE: Handle case where job has finished. */
-    if (jobs->state == FINISHED) {
+    if (state == FINISHED) {
         *statusp = exitcode(job);
-        deljob(job);
+        if (statuses)
+            stagestatus(job, statuses);
+        deljob(job->slot);
     }
 
     return state;
 }
 
+/* Returns job's state.
+ * If it's finished, delete it and return exitcode through statusp. */
+int jobstate(int j, int* statusp) {
+    return collectjob(numjob(j), statusp, NULL);
+}
+
+/* Returns number of the background job whose process group is pgid, being
+ * the highest numbered one if there's more, or -1 if there's none. */
+int pgidjob(pid_t pgid) {
+    job_t key = {.pgid = pgid, .num = INT_MAX};
+    job_t* job = RB_NFIND(pgidtree, &pgidtree, &key);
+
+    job = job ? RB_PREV(pgidtree, &pgidtree, job)
+              : RB_MAX(pgidtree, &pgidtree);
+    return job && job->pgid == pgid ? job->num : -1;
+}
+
 char* jobcmd(int j) {
-    assert(j < njobmax);
-    job_t* job = &jobs[j];
-    return job->command;
+    return numjob(j)->command.str;
 }
 
 /* Continues a job that has been stopped. If move to foreground was requested,
  * then move the job to foreground and start monitoring it. */
 bool resumejob(int j, int bg, sigset_t* mask) {
+    pollchildren();
+
+    job_t* job;
     if (j < 0) {
-        for (j = njobmax - 1; j > 0 && jobs[j].state == FINISHED; j--)
-            continue;
+        job = RB_MAX(numtree, &numtree);
+        while (job && getstate(job) == FINISHED)
+            job = RB_PREV(numtree, &numtree, job);
+    } else {
+        job = findjob(j);
     }
 
-    if (j >= njobmax || jobs[j].state == FINISHED)
+    if (job == NULL || getstate(job) == FINISHED)
         return false;
 
     /* DONE: Continue stopped job. Possibly move job to foreground slot. */
-    job_t* job = &jobs[j];
-    Kill(-job->pgid, SIGCONT);
+    signaljob(job, SIGCONT);
 
     if (!bg) {
-        movejob(j, FG);
-        monitorjob(mask);
+        movejob(job->slot, FG);
+        monitorjob(mask, NULL);
     }
 
     return true;
 }
 
+/* Change priorities or limits of a background job, they apply to processes
+ * it has and those it gets later. Returns false and sets errno on failure,
+ * ESRCH if there's no such job. */
+bool limitjob(int j, const limits_t* lim) {
+    pollchildren();
+
+    job_t* job = findjob(j);
+    if (job == NULL || getstate(job) == FINISHED) {
+        errno = ESRCH;
+        return false;
+    }
+
+    mergelimits(&job->limits, lim);
+    if (!setcgroup(&job->cgroup, job->num, lim))
+        return false;
+
+    bool ok = true;
+    for (int p = 0; p < job->nproc; p++) {
+        if (job->pstate[p] == FINISHED)
+            continue;
+        if (!applylimits(job->pid[p], lim, job->cgroup))
+            ok = false;
+    }
+    return ok;
+}
+
+/* Job gets signalled once the time given has passed, the shell keeps the
+ * deadline itself, so no helper process sits in the pipeline. */
+void setdeadline(int j, const timeout_t* t) {
+    if (t->after == 0)
+        return;
+
+    job_t* job = numjob(j);
+    removedeadline(job);
+    job->timeoutsig = t->sig;
+    job->killafter = t->killafter;
+    pushdeadline(job->slot, monotonic() + t->after);
+}
+
+/* Job that was just started writes into the ring, unless it's NULL. */
+void ringjob(int j, ring_t* ring) {
+    if (ring == NULL)
+        return;
+    numjob(j)->ring = ring;
+    numberring(ring, j);
+}
+
+/* Job that was just started runs command given by argv on many hosts, its
+ * command is shown as it was typed rather than as processes run it. */
+void fleetjob(int j, char** argv) {
+    job_t* job = numjob(j);
+    job->fleet = true;
+    job->command.len = 0;
+    job->command.str[0] = '\0';
+    mkcommand(&job->command, argv);
+}
+
+/* Set priorities or limits of background jobs started from now on. */
+void limitbg(const limits_t* lim) {
+    mergelimits(&bglimits, lim);
+}
+
+static void terminate(job_t* job) {
+    signaljob(job, SIGTERM);
+    signaljob(job, SIGCONT);
+}
+
 /* Kill the job by sending it a SIGTERM. */
 bool killjob(int j) {
-    if (j >= njobmax || jobs[j].state == FINISHED)
+    pollchildren();
+
+    job_t* job = findjob(j);
+    if (job == NULL || getstate(job) == FINISHED)
         return false;
-    debug("[%d] killing '%s'\n", j, jobs[j].command);
+    debug("[%d] killing '%s'\n", j, job->command.str);
 
     /* DONE: I love the smell of napalm in the morning. */
-    job_t* job = &jobs[j];
-    if (!job->pgid) {
-        return false;
+    terminate(job);
+
+    return true;
+}
+
+/* Reports about jobs are gathered and written out with a single writev, so
+ * listing lots of jobs doesn't cost a few system calls per line. Commands are
+ * not copied, thus finished jobs are only deleted once they've been written.
+ * Errors are ignored, listing into a closed descriptor must not kill us. */
+#define REPORT_IOV 48   /* entries of iovec array */
+#define REPORT_BUF 2048 /* space for formatted parts of lines */
+#define REPORT_TEXT 64  /* longest formatted part */
+
+typedef struct {
+    int fd;
+    struct iovec iov[REPORT_IOV];
+    int niov;
+    char buf[REPORT_BUF];
+    size_t used;
+    int dead[REPORT_IOV]; /* slots of reported jobs to delete after writing */
+    int ndead;
+} report_t;
+
+/* Write out all of n iovec entries, which get modified on a short write. */
+void writeiov(int fd, struct iovec* iov, int n) {
+    while (n > 0) {
+        ssize_t written = writev(fd, iov, n);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            break;
+        /* Resume after a short write. */
+        for (; n > 0 && (size_t)written >= iov->iov_len; iov++, n--)
+            written -= iov->iov_len;
+        if (n > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
     }
+}
 
-    Kill(-job->pgid, SIGTERM);
-    Kill(-job->pgid, SIGCONT);
+static void flushreport(report_t* r) {
+    writeiov(r->fd, r->iov, r->niov);
+    r->niov = 0;
+    r->used = 0;
+    for (int i = 0; i < r->ndead; i++)
+        deljob(r->dead[i]);
+    r->ndead = 0;
+}
 
-    return true;
+static void addtext(report_t* r, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void addtext(report_t* r, const char* fmt, ...) {
+    if (r->niov == REPORT_IOV || r->used + REPORT_TEXT > REPORT_BUF)
+        flushreport(r);
+
+    va_list ap;
+    va_start(ap, fmt);
+    size_t n = safe_vsnprintf(r->buf + r->used, REPORT_TEXT, fmt, ap);
+    va_end(ap);
+
+    r->iov[r->niov++] = (struct iovec){r->buf + r->used, n};
+    r->used += n;
+}
+
+/* String must stay intact until the report is flushed. */
+static void addstr(report_t* r, const char* s) {
+    if (r->niov == REPORT_IOV)
+        flushreport(r);
+    r->iov[r->niov++] = (struct iovec){(char*)s, strlen(s)};
+}
+
+/* Append time in seconds with millisecond precision. */
+static void addtime(report_t* r, const char* label, time_t sec, long usec) {
+    addtext(r, "  %s %ld.%03lds", label, (long)sec, usec / 1000);
+}
+
+/* Nanoseconds process p of a job has been running, or ran for. */
+static int64_t realtime(job_t* job, int p, struct timespec now) {
+    proc_t* proc = &job->proc[p];
+    struct timespec end = job->pstate[p] == FINISHED ? proc->ended : now;
+    return (int64_t)(end.tv_sec - proc->started.tv_sec) * 1000000000 +
+           (end.tv_nsec - proc->started.tv_nsec);
+}
+
+/* Per process statistics of a job, one line for each. */
+static void reportprocs(report_t* r, job_t* job) {
+    static const char* state[] = {
+        [RUNNING] = "running", [STOPPED] = "stopped", [FINISHED] = "finished"};
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (int p = 0; p < job->nproc; p++) {
+        proc_t* proc = &job->proc[p];
+        bool finished = job->pstate[p] == FINISHED;
+        int64_t real = realtime(job, p, now);
+        time_t sec = real / 1000000000;
+        long nsec = real % 1000000000;
+
+        addtext(r, "    pid %-7d %-8s", job->pid[p], state[job->pstate[p]]);
+        addtime(r, "real", sec, nsec / 1000);
+        if (finished) {
+            struct rusage* ru = &proc->rusage;
+            addtime(r, "user", ru->ru_utime.tv_sec, ru->ru_utime.tv_usec);
+            addtime(r, "sys", ru->ru_stime.tv_sec, ru->ru_stime.tv_usec);
+            addtext(r, "  rss %ldkB  csw %ld/%ld", ru->ru_maxrss, ru->ru_nvcsw,
+                    ru->ru_nivcsw);
+        }
+        addtext(r, "\n");
+    }
+}
+
+static void reportjob(report_t* r, job_t* job, bool verbose) {
+    addtext(r, "[%d] ", job->num);
+    switch (getstate(job)) {
+        case FINISHED: {
+            int status = exitcode(job);
+            if (WIFEXITED(status)) {
+                addtext(r, "exited '");
+                addstr(r, job->command.str);
+                addtext(r, "', status=%d\n", WEXITSTATUS(status));
+            } else if (WIFSIGNALED(status)) {
+                addtext(r, "killed '");
+                addstr(r, job->command.str);
+                addtext(r, "' by signal %d\n", WTERMSIG(status));
+            }
+            r->dead[r->ndead++] = job->slot;
+            break;
+        }
+        case STOPPED:
+            addtext(r, "suspended '");
+            addstr(r, job->command.str);
+            addtext(r, "'\n");
+            break;
+        case RUNNING:
+            addtext(r, "running '");
+            addstr(r, job->command.str);
+            addtext(r, "'\n");
+            break;
+    }
+
+    if (verbose)
+        reportprocs(r, job);
+}
+
+static void reportjobs(int which, bool verbose) {
+    /* Listing requested by jobs builtin is its output, the rest is
+     * notification about background jobs. */
+    report_t report = {.fd = which == ALL ? STDOUT_FILENO : STDERR_FILENO};
+
+    pollchildren();
+
+    /* Reported jobs may be deleted as soon as the report gets flushed. */
+    job_t *job, *next;
+    RB_FOREACH_SAFE(job, numtree, &numtree, next) {
+        /* DONE: Report job number, state, command and exit code or signal. */
+        if (which == ALL || getstate(job) == which)
+            reportjob(&report, job, verbose);
+    }
+
+    flushreport(&report);
+    compactjobs();
 }
 
 /* Report state of requested background jobs. Clean up finished jobs. */
 void watchjobs(int which) {
-    for (int j = BG; j < njobmax; j++) {
-        if (jobs[j].pgid == 0)
+    reportjobs(which, false);
+}
+
+/* List all background jobs, verbose listing includes resources used by each
+ * of their processes. */
+void listjobs(bool verbose) {
+    reportjobs(ALL, verbose);
+}
+
+static int64_t microseconds(struct timeval tv) {
+    return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void exportbinary(strbuf_t* out, job_t* job, struct timespec now) {
+    jobrec_t rec = {
+        .size = sizeof(jobrec_t) + sizeof(procrec_t) * job->nproc +
+                job->command.len,
+        .num = job->num,
+        .pgid = job->pgid,
+        .state = getstate(job),
+        .nproc = job->nproc,
+        .cmdlen = job->command.len,
+    };
+    strappn(out, (char*)&rec, sizeof(rec));
+
+    for (int p = 0; p < job->nproc; p++) {
+        proc_t* proc = &job->proc[p];
+        procrec_t pr = {
+            .pid = job->pid[p],
+            .state = job->pstate[p],
+            .status = job->pstate[p] == FINISHED ? proc->exitcode : -1,
+            .realns = realtime(job, p, now),
+        };
+        if (job->pstate[p] == FINISHED) {
+            struct rusage* ru = &proc->rusage;
+            pr.userus = microseconds(ru->ru_utime);
+            pr.sysus = microseconds(ru->ru_stime);
+            pr.maxrsskb = ru->ru_maxrss;
+            pr.nvcsw = ru->ru_nvcsw;
+            pr.nivcsw = ru->ru_nivcsw;
+        }
+        strappn(out, (char*)&pr, sizeof(pr));
+    }
+    strappn(out, job->command.str ? job->command.str : "", job->command.len);
+}
+
+static void appendf(strbuf_t* out, const char* fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void appendf(strbuf_t* out, const char* fmt, ...) {
+    char buf[REPORT_TEXT * 2];
+    va_list ap;
+    va_start(ap, fmt);
+    size_t n = safe_vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    strappn(out, buf, n);
+}
+
+/* Append string as JSON string literal. Bytes that aren't ASCII are passed
+ * on as they are, commands are expected to be UTF-8. */
+static void appendjson(strbuf_t* out, const char* s) {
+    strappn(out, "\"", 1);
+    for (const char* run = s;; s++) {
+        unsigned char c = *s;
+        if (c != '\0' && c != '"' && c != '\\' && c >= 0x20)
             continue;
-    /* DONE: Report job number, state, command and exit code or signal. */
-        job_t* job = &jobs[j];
-        if (which == ALL || job->state == which) {
-            msg("[%d] ", j);            
-            switch (job->state) {
-                case FINISHED: {
-
-                    int status = exitcode(job);
-                    if (WIFEXITED(status)) {
-                        status = WEXITSTATUS(status);
-                        msg(
-                            "exited '%s', status=%d\n",
-                            job->command,
-                            status
-                        );
-                    } else if (WIFSIGNALED(status)) {
-                        int signal = WTERMSIG(status);
-                        msg(
-                            "killed '%s' by signal %d\n",
-                            job->command,
-                            signal
-                        );
-                    }
-
-                    deljob(job);
-                    break;
-                }
-                case STOPPED: {
-                    msg("suspended '%s'\n", job->command);
-                    break;
-                }
-                case RUNNING: {
-                    msg("running '%s'\n", job->command);
-                    break;
-                }
-            }
+        strappn(out, run, s - run);
+        if (c == '\0')
+            break;
+        if (c == '"' || c == '\\')
+            appendf(out, "\\%c", c);
+        else if (c == '\n')
+            strappn(out, "\\n", 2);
+        else if (c == '\t')
+            strappn(out, "\\t", 2);
+        else
+            appendf(out, "\\u%04x", c);
+        run = s + 1;
+    }
+    strappn(out, "\"", 1);
+}
+
+static void exportjson(strbuf_t* out, job_t* job, struct timespec now) {
+    static const char* state[] = {
+        [RUNNING] = "running", [STOPPED] = "stopped", [FINISHED] = "finished"};
+
+    appendf(out, "{\"job\":%d,\"pgid\":%d,\"state\":\"%s\",\"command\":",
+            job->num, job->pgid, state[getstate(job)]);
+    appendjson(out, job->command.str ? job->command.str : "");
+    strapp(out, ",\"procs\":[");
+
+    for (int p = 0; p < job->nproc; p++) {
+        proc_t* proc = &job->proc[p];
+        appendf(out, "%s{\"pid\":%d,\"state\":\"%s\",\"realns\":%ld",
+                p ? "," : "", job->pid[p], state[job->pstate[p]],
+                (long)realtime(job, p, now));
+        if (job->pstate[p] == FINISHED) {
+            int status = proc->exitcode;
+            struct rusage* ru = &proc->rusage;
+            if (WIFSIGNALED(status))
+                appendf(out, ",\"signal\":%d", WTERMSIG(status));
+            else
+                appendf(out, ",\"exit\":%d", WEXITSTATUS(status));
+            appendf(out, ",\"userus\":%ld,\"sysus\":%ld",
+                    (long)microseconds(ru->ru_utime),
+                    (long)microseconds(ru->ru_stime));
+            appendf(out, ",\"maxrsskb\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld",
+                    ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw);
         }
+        strappn(out, "}", 1);
+    }
+    strapp(out, "]}\n");
+}
+
+/* Write state of all background jobs to stdout for programs that monitor
+ * the shell, see jobshdr_t. Unlike listing, it leaves finished jobs to be
+ * reported to the user as usual. */
+void exportjobs(int format) {
+    strbuf_t out = {};
+    struct timespec now;
+    job_t* job;
+
+    pollchildren();
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (format == JOBS_BINARY) {
+        jobshdr_t hdr = {
+            .magic = JOBS_MAGIC,
+            .version = JOBS_VERSION,
+            .procsize = sizeof(procrec_t),
+            .njobs = 0,
+            .jobsize = sizeof(jobrec_t),
+        };
+        RB_FOREACH(job, numtree, &numtree)
+            hdr.njobs++;
+        strappn(&out, (char*)&hdr, sizeof(hdr));
     }
+
+    RB_FOREACH(job, numtree, &numtree) {
+        if (format == JOBS_BINARY)
+            exportbinary(&out, job, now);
+        else
+            exportjson(&out, job, now);
+    }
+
+    struct iovec iov = {out.str, out.len};
+    writeiov(STDOUT_FILENO, &iov, out.str ? 1 : 0);
+    free(out.str);
+}
+
+/* Let user know that a job has been started in the background. */
+void announcejob(int j) {
+    report_t report = {.fd = STDERR_FILENO};
+    reportjob(&report, numjob(j), false);
+    flushreport(&report);
+}
+
+/* Returns number of background jobs, including those that have finished but
+ * weren't reported yet. */
+int countjobs(void) {
+    return nlive;
+}
+
+/* Returns array of numbers of background jobs, including those that have
+ * finished but weren't reported yet. Caller must free it. */
+int* bgjobs(int* countp) {
+    int* js = malloc(sizeof(int) * (nlive + 1));
+    int n = 0;
+    job_t* job;
+
+    pollchildren();
+    RB_FOREACH(job, numtree, &numtree)
+        js[n++] = job->num;
+
+    *countp = n;
+    return js;
+}
+
+/* Sleep until one of given background jobs finishes, or gets stopped if
+ * stopped is set, and return its position in the array, or -1 if user hit
+ * ^C in the meantime. Only the given jobs
+ * are checked when a child changes its state. SIGCHLD must be blocked. */
+int waitany(int* js, int n, sigset_t* mask, bool stopped) {
+    pollchildren();
+
+    while (true) {
+        for (int i = 0; i < n; i++) {
+            int state = getstate(numjob(js[i]));
+            if (state == FINISHED || (stopped && state == STOPPED))
+                return i;
+        }
+        if (sigint_received)
+            return -1;
+        waitchildren(mask);
+    }
+}
+
+/* Terminal was handed to the foreground job before it's monitored. */
+static bool handedoff = false;
+
+static void handoff(job_t* job) {
+    Tcgetattr(tty_fd, &shell_tmodes);
+    if (job->has_tmodes)
+        Tcsetattr(tty_fd, TCSADRAIN, &job->tmodes);
+    Tcsetpgrp(tty_fd, job->pgid);
+    handedoff = true;
+}
+
+/* Give the terminal to the foreground job early, while builtins of its
+ * pipeline run within the shell, so its processes can read it meanwhile.
+ * It's taken back once monitorjob is done with the job. */
+void handoffjob(void) {
+    job_t* fg_job = getjob(FG);
+    if (jobctl && fg_job->pgid && !handedoff && getstate(fg_job) != FINISHED)
+        handoff(fg_job);
 }
 
 /* Monitor job execution. If it gets stopped move it to background.
- * When a job has finished or has been stopped move shell to foreground. */
-int monitorjob(sigset_t* mask) {
+ * When a job has finished or has been stopped move shell to foreground.
+ * Statuses of pipeline stages are stored in statuses unless it's NULL, in
+ * order they were started, if the job has finished. */
+int monitorjob(sigset_t* mask, int* statuses) {
     int exitcode, state;
+    uint64_t start = stamp();
+    bool notified = false;
 
     /* DONE: Following code requires use of Tcsetpgrp of tty_fd. */
-    job_t* fg_job = &jobs[FG];
+    job_t* fg_job = getjob(FG);
     assert(fg_job->pgid);
-    Tcsetpgrp(tty_fd, fg_job->pgid);
     exitcode = -1;
 
-    Kill(-fg_job->pgid, SIGCONT);
+    /* Commands that end in microseconds are often gone by now, then the
+     * terminal needn't be handed over and back. */
+    burychildren();
+    if (!handedoff && jobctl && getstate(fg_job) != FINISHED) {
+        handoff(fg_job);
+        burychildren();
+    }
+    bool handoff = handedoff;
+    handedoff = false;
 
+    /* Processes that touched the terminal before receiving it got stopped.
+     * Don't send SIGCONT to others, they may be in the middle of exiting. */
+    bool continued = getstate(fg_job) == STOPPED;
+    if (continued)
+        signaljob(fg_job, SIGCONT);
+
+    /* Builtins of a pipeline run before it's monitored and may have already
+     * buried its processes, so the job is checked before going to sleep.
+     * Job that was just continued is still seen as stopped until then. */
     while (true) {
-        Sigsuspend(mask);
-        state = jobstate(FG, &exitcode);
-        if (state == STOPPED) {
-            int bg = addjob(0, BG);
-            movejob(FG, bg);
+        state = collectjob(fg_job, &exitcode, statuses);
+        if (state == STOPPED && !continued) {
+            /* Job gets the modes it was left in when it's resumed. */
+            if (handoff) {
+                Tcgetattr(tty_fd, &fg_job->tmodes);
+                fg_job->has_tmodes = true;
+            }
+            movejob(FG, mkjob(0, BG));
             break;
         } else if (state == FINISHED) {
             break;
         }
+        waitchildren(mask);
+        continued = false;
+        if (!notified) {
+            record(PH_SIGCHLD, start);
+            notified = true;
+        }
     }
 
-    Tcsetpgrp(tty_fd, getpgrp());
+    if (handoff) {
+        Tcsetpgrp(tty_fd, getpgrp());
+        Tcsetattr(tty_fd, TCSADRAIN, &shell_tmodes);
+    }
 
+    record(PH_MONITOR, start);
     return exitcode;
 }
 
-/* Called just at the beginning of shell's life. */
-void initjobs(void) {
+/* Called just at the beginning of shell's life. Job control can only be
+ * enabled if the shell is interactive. */
+#ifdef LINUX
+static void initsigchld(void) {
+    Sigprocmask(SIG_BLOCK, &sigchld_mask, NULL);
+    if ((sigchld_fd = signalfd(-1, &sigchld_mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0)
+        unix_error("signalfd error");
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create1 error");
+
+    if ((timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                   TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+        unix_error("timerfd_create error");
+
+    struct epoll_event ev = {.events = EPOLLIN};
+    ev.data.fd = sigchld_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sigchld_fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    ev.data.fd = timer_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    /* Hangups and errors are always reported, we don't ask for input. */
+    if (tty_fd >= 0) {
+        ev = (struct epoll_event){.events = 0};
+        ev.data.fd = tty_fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tty_fd, &ev) < 0)
+            unix_error("epoll_ctl error");
+    }
+}
+#endif
+
+void initjobs(bool jobcontrol) {
+#ifndef LINUX
     Signal(SIGCHLD, sigchld_handler);
-    jobs = calloc(sizeof(job_t), 1);
+    /* Only needs to interrupt the wait for children once a deadline passes. */
+    Signal(SIGALRM, sigalrm_handler);
+#endif
+    /* Spawn server must be forked before anything else is set up. */
+    initzygote();
+    jobs[nchunks++] = calloc(JOBCHUNK, sizeof(job_t));
+    jobctl = jobcontrol;
+
+    /* In interactive mode move us to foreground. Duplicate terminal fd,
+     * but do not leak it to subprocesses that execve. */
+    if (jobctl) {
+        assert(isatty(STDIN_FILENO));
+        tty_fd = Dup(STDIN_FILENO);
+        fcntl(tty_fd, F_SETFD, FD_CLOEXEC);
+        Tcsetpgrp(tty_fd, getpgrp());
+    }
+
+#ifdef LINUX
+    initsigchld();
+#endif
+}
+
+/* Used in a forked copy of the shell that evaluates commands of its own, i.e.
+ * a subshell. Jobs of the parent aren't its children, so they're forgotten.
+ * The copy does no job control and doesn't talk to the spawn server, whose
+ * children would become those of the parent. Notifications of SIGCHLD are
+ * set up anew, since an epoll instance is shared across fork. */
+void resetjobs(void) {
+    for (int j = 0; j < njobmax; j++)
+        if (getjob(j)->pgid)
+            releasejob(getjob(j));
+    while (nchunks > 0)
+        free(jobs[--nchunks]);
+    jobs[nchunks++] = calloc(JOBCHUNK, sizeof(job_t));
+    njobmax = 1;
+    freejob = -1;
+    RB_INIT(&numtree);
+    RB_INIT(&pgidtree);
+    nlive = 0;
+
+    free(pidtab);
+    pidtab = NULL;
+    pidtab_size = pidtab_used = 0;
+    reap_head = reap_tail = 0;
+    reap_full = 0;
+
+    free(deadlines);
+    deadlines = NULL;
+    ndeadlines = deadlines_size = 0;
+    resetrings();
+    resetfleets();
+    resetcoprocs();
+
+    dropzygote();
+    if (tty_fd >= 0)
+        Close(tty_fd);
+    tty_fd = -1;
+    jobctl = false;
 
-    /* Assume we're running in interactive mode, so move us to foreground.
-     * Duplicate terminal fd, but do not leak it to subprocesses that execve. */
-    assert(isatty(STDIN_FILENO));
-    tty_fd = Dup(STDIN_FILENO);
-    fcntl(tty_fd, F_SETFL, O_CLOEXEC);
-    Tcsetpgrp(tty_fd, getpgrp());
+#ifdef LINUX
+    Close(epoll_fd);
+    Close(sigchld_fd);
+    Close(timer_fd);
+    initsigchld();
+#else
+    armtimer();
+#endif
+}
+
+static void killwait(job_t* job, sigset_t* mask) {
+    if (getstate(job) == FINISHED)
+        return;
+
+    terminate(job);
+    while (getstate(job) != FINISHED) {
+        waitchildren(mask);
+    }
 }
 
 /* Called just before the shell finishes. */
@@ -305,21 +1560,27 @@ void shutdownjobs(void) {
     Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
 
     /* DONE: Kill remaining jobs and wait for them to finish. */
-    for (size_t j = 0; j < njobmax; j++) {
-        job_t* job = &jobs[j];
-        if (!job->pgid || job->state == FINISHED) {
-            continue;
-        }
-     
-        killjob(j);
-        while (job->state != FINISHED) {
-            Sigsuspend(&mask);
-        }
-    }
+    pollchildren();
+    /* Foreground slot isn't indexed, so it's taken care of first. */
+    if (getjob(FG)->pgid)
+        killwait(getjob(FG), &mask);
+
+    job_t* job;
+    RB_FOREACH(job, numtree, &numtree)
+        killwait(job, &mask);
 
     watchjobs(FINISHED);
 
+    if (tracing)
+        dumpstats(STDERR_FILENO);
+
     Sigprocmask(SIG_SETMASK, &mask, NULL);
 
-    Close(tty_fd);
+#ifdef LINUX
+    Close(epoll_fd);
+    Close(sigchld_fd);
+    Close(timer_fd);
+#endif
+    if (tty_fd >= 0)
+        Close(tty_fd);
 }
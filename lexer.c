@@ -1,75 +1,601 @@
 #include "shell.h"
 
-void strapp(char** dstp, const char* src) {
-    assert(dstp != NULL);
-
-    if (*dstp == NULL) {
-        *dstp = strdup(src);
-    } else {
-        size_t s = strlen(*dstp) + strlen(src) + 1;
-        *dstp = realloc(*dstp, s);
-        strcat(*dstp, src);
+void strappn(strbuf_t* sb, const char* src, size_t n) {
+    assert(sb != NULL);
+
+    if (sb->len + n + 1 > sb->size) {
+        sb->size = max(sb->size * 2, sb->len + n + 1);
+        sb->str = realloc(sb->str, sb->size);
+    }
+
+    memcpy(sb->str + sb->len, src, n);
+    sb->len += n;
+    sb->str[sb->len] = '\0';
+}
+
+void strapp(strbuf_t* sb, const char* src) {
+    strappn(sb, src, strlen(src));
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Classes of characters as seen by the lexer. */
+enum {
+    C_WORD = 0, /* part of a word */
+    C_SPACE,    /* separates words */
+    C_OPER,     /* starts an operator, also separates words */
+    C_QUOTE,    /* starts quoted part of a word */
+    C_ESCAPE,   /* quotes next character */
+    C_END,      /* end of line */
+};
+
+static const uint8_t charclass[256] = {
+    ['\0'] = C_END,   [' '] = C_SPACE,  ['\t'] = C_SPACE, ['\n'] = C_SPACE,
+    ['\v'] = C_SPACE, ['\f'] = C_SPACE, ['\r'] = C_SPACE, ['|'] = C_OPER,
+    ['&'] = C_OPER,   ['<'] = C_OPER,   ['>'] = C_OPER,   [';'] = C_OPER,
+    ['('] = C_OPER,   [')'] = C_OPER,   ['"'] = C_QUOTE,  ['\''] = C_QUOTE,
+    ['\\'] = C_ESCAPE,
+};
+
+#define cclass(c) charclass[(uint8_t)(c)]
+
+/* Returns number of plain word characters at the beginning of s. With SSE2
+ * we look at 16 characters at once, as long as they're before the end. */
+static size_t wordspan(const char* s, const char* end) {
+    const char* p = s;
+
+#ifdef __SSE2__
+    const __m128i ctl_base = _mm_set1_epi8('\t');
+    const __m128i ctl_span = _mm_set1_epi8('\r' - '\t');
+    static const char special[] = " |&<>;()\"'\\";
+
+    for (; end - p >= 16; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        /* Control whitespace is a range, so test it with unsigned min. */
+        __m128i d = _mm_sub_epi8(v, ctl_base);
+        __m128i m = _mm_cmpeq_epi8(_mm_min_epu8(d, ctl_span), d);
+        for (const char* c = special; *c; c++)
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(*c)));
+        int mask = _mm_movemask_epi8(m);
+        if (mask)
+            return p - s + __builtin_ctz(mask);
+    }
+#endif
+
+    while (cclass(*p) == C_WORD)
+        p++;
+    return p - s;
+}
+
+/* Returns position of parenthesis that closes the one just before s, skipping
+ * over quoted text, or NULL if there's none. */
+static char* matchparen(char* s) {
+    int depth = 1;
+
+    for (; *s; s++) {
+        if (*s == '\\' && s[1]) {
+            s++;
+        } else if (*s == '\'' || *s == '"') {
+            char quote = *s;
+            while (*++s != quote) {
+                if (*s == 0)
+                    return NULL;
+                if (quote == '"' && *s == '\\' && s[1])
+                    s++;
+            }
+        } else if (*s == '(') {
+            depth++;
+        } else if (*s == ')' && --depth == 0) {
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+#define wordend_p(c) \
+    (cclass(c) != C_WORD && cclass(c) != C_QUOTE && (c) != '\\')
+
+/* Reserved words are only recognized where a command may start: those that
+ * open compound commands, those that separate their lists and those that
+ * close them. */
+static const char* const openers[] = {"{", "if", "while", "until", "for", NULL};
+static const char* const middles[] = {"then", "elif", "else", "do", NULL};
+static const char* const closers[] = {"}", "fi", "done", NULL};
+
+/* Returns entry of list equal to n characters at s or NULL. */
+static const char* findword(const char* const* list, const char* s, size_t n) {
+    for (; *list; list++)
+        if (strlen(*list) == n && !memcmp(*list, s, n))
+            return *list;
+    return NULL;
+}
+
+/* Length of word at s if it's unquoted and ends where a word does, i.e. it
+ * could be a reserved word, 0 otherwise. */
+static size_t barelen(const char* s) {
+    size_t n = 0;
+    while (cclass(s[n]) == C_WORD)
+        n++;
+    return wordend_p(s[n]) ? n : 0;
+}
+
+static bool reserved_p(const char* s, size_t n) {
+    return findword(openers, s, n) || findword(middles, s, n) ||
+           findword(closers, s, n);
+}
+
+/* Walks over text of a list, skipping quoted text and parenthesized lists,
+ * and stops at each reserved word. */
+typedef struct {
+    char* s;     /* where scanning goes on */
+    bool cmdpos; /* command may start at s */
+    bool broken; /* text ended within quotes or parentheses */
+} scan_t;
+
+/* Returns length of next reserved word, which sc points to, or 0 at end. */
+static size_t nextreserved(scan_t* sc) {
+    char* s = sc->s;
+    bool cmdpos = sc->cmdpos;
+    size_t n;
+
+    while (*s) {
+        if (cclass(*s) == C_SPACE) {
+            if (*s++ == '\n')
+                cmdpos = true;
+            continue;
+        }
+        if (cmdpos && (n = barelen(s)) > 0) {
+            if (reserved_p(s, n)) {
+                sc->s = s;
+                return n;
+            }
+            /* Words 'time' and '!' may prefix a command. */
+            cmdpos = (n == 4 && !memcmp(s, "time", 4)) ||
+                     (n == 1 && *s == '!');
+            s += n;
+            continue;
+        }
+        if (*s == '(') {
+            char* close = matchparen(s + 1);
+            if (close == NULL)
+                break;
+            /* Body of function follows blank parentheses. */
+            cmdpos = s + 1 + strspn(s + 1, " \t") == close;
+            s = close + 1;
+            continue;
+        }
+        if (*s == '<' || *s == '>') {
+            /* Command never starts right after redirection. */
+            while (s[1] == '<' || s[1] == '>' || s[1] == '&')
+                s++;
+            cmdpos = false;
+        } else if (*s == '\\' && s[1]) {
+            s++;
+            cmdpos = false;
+        } else if (*s == '\'' || *s == '"') {
+            char quote = *s;
+            while (*++s != quote) {
+                if (*s == 0) {
+                    sc->s = s;
+                    sc->broken = true;
+                    return 0;
+                }
+                if (quote == '"' && *s == '\\' && s[1])
+                    s++;
+            }
+            cmdpos = false;
+        } else {
+            cmdpos = cclass(*s) == C_OPER;
+        }
+        s++;
     }
+
+    sc->s = s;
+    sc->broken = *s != '\0';
+    if (sc->broken)
+        sc->s += strlen(s);
+    return 0;
+}
+
+/* Step over reserved word of length n that sc points to. */
+static void skipreserved(scan_t* sc, size_t n) {
+    sc->cmdpos = !findword(closers, sc->s, n) &&
+                 !(n == 3 && !memcmp(sc->s, "for", 3));
+    sc->s += n;
 }
 
-token_t* tokenize(char* s, int* tokc_p) {
+/* Returns length of next reserved word that separates lists of a compound
+ * command or closes it, skipping over nested compound commands. */
+static size_t nextpart(scan_t* sc) {
+    int depth = 0;
+    size_t n;
+
+    while ((n = nextreserved(sc)) > 0) {
+        bool open = findword(openers, sc->s, n);
+        if (depth == 0 && !open)
+            return n;
+        depth += open ? 1 : findword(closers, sc->s, n) ? -1 : 0;
+        skipreserved(sc, n);
+    }
+    return 0;
+}
+
+/* Tells if text of a command line goes on with the next line, as it ends
+ * within quotes, parentheses or a compound command. */
+bool continued_p(const char* line) {
+    scan_t sc = {.s = (char*)line, .cmdpos = true};
+    int depth = 0;
+    size_t n;
+
+    while ((n = nextreserved(&sc)) > 0) {
+        if (findword(openers, sc.s, n))
+            depth++;
+        else if (depth > 0 && findword(closers, sc.s, n))
+            depth--;
+        skipreserved(&sc, n);
+    }
+    return sc.broken || depth > 0;
+}
+
+/* Compound command may only start where a command does, i.e. at the beginning
+ * of a line, after an operator that separates commands, after name of a
+ * function that's being defined or after 'time'. */
+static bool cmdpos_p(token_t* tokvec, int ntoks) {
+    if (ntoks == 0)
+        return true;
+    token_t last = tokvec[ntoks - 1];
+    if (separator_p(last) || last == T_BANG || last == T_FUNC)
+        return true;
+    return string_p(last) && !strcmp(last, "time") &&
+           cmdpos_p(tokvec, ntoks - 1);
+}
+
+/* Number of characters an operator consists of. */
+static int oplen(token_t tok) {
+    if (tok == T_HERESTR || tok == T_APPENDALL)
+        return 3;
+    if (tok == T_OR || tok == T_AND || tok == T_APPEND || tok == T_HEREDOC ||
+        tok == T_DUPIN || tok == T_DUPOUT || tok == T_OUTALL)
+        return 2;
+    return 1;
+}
+
+/* Offsets of quoted characters within a word that are special in patterns
+ * or start variable expansion. */
+typedef struct {
+    int* off;
+    int n;
+    int size;
+} quoted_t;
+
+static void markquoted(arena_t* arena, quoted_t* q, int off) {
+    if (q->n == q->size) {
+        int* old = q->off;
+        q->size = q->size ? q->size * 2 : 8;
+        q->off = arena_alloc(arena, sizeof(int) * q->size);
+        if (old)
+            memcpy(q->off, old, sizeof(int) * q->n);
+    }
+    q->off[q->n++] = off;
+}
+
+#define quotable_p(c)                                                          \
+    ((c) == '*' || (c) == '?' || (c) == '[' || (c) == '\\' || (c) == '$')
+
+static bool hasexpansion(const char* s, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '$')
+            return true;
+    return false;
+}
+
+/* Word with unquoted pattern characters or dollars becomes T_EXPAND followed
+ * by its text, in which quoted ones are escaped with a backslash. Dollars
+ * within double quotes are left unescaped, as variables get expanded there
+ * too. Expansion happens each time the command is run, see do_expand. */
+static char* expandword(arena_t* arena, const char* word, size_t len,
+                        quoted_t* q) {
+    char* text = arena_alloc(arena, len + q->n + 1);
+    char* p = text;
+
+    for (int i = 0, last = 0; i <= q->n; i++) {
+        int off = i < q->n ? q->off[i] : (int)len;
+        memcpy(p, word + last, off - last);
+        p += off - last;
+        if (i < q->n)
+            *p++ = '\\';
+        last = off;
+    }
+    *p = '\0';
+    return text;
+}
+
+static token_t* unterminated(token_t* tokvec, int* tokc_p, const char* what) {
+    msg("syntax error: unterminated %s\n", what);
+    last_exitcode = EXIT_SYNTAX;
+    tokvec[0] = T_NULL;
+    *tokc_p = 0;
+    return tokvec;
+}
+
+static token_t* unexpected(token_t* tokvec, int* tokc_p, const char* word) {
+    msg("syntax error near unexpected token '%s'\n", word);
+    last_exitcode = EXIT_SYNTAX;
+    tokvec[0] = T_NULL;
+    *tokc_p = 0;
+    return tokvec;
+}
+
+/* Make sure there's enough space to add n new tokens. */
+static token_t* growtokens(arena_t* arena, token_t* tokvec, int* capacityp,
+                           int ntoks, int n) {
+    if (ntoks + n <= *capacityp)
+        return tokvec;
+    token_t* old = tokvec;
+    *capacityp = max(*capacityp * 2, ntoks + n);
+    tokvec = arena_alloc(arena, sizeof(token_t) * (*capacityp + 1));
+    memcpy(tokvec, old, sizeof(token_t) * ntoks);
+    return tokvec;
+}
+
+/* Splits the line into words and operators in a single pass. Words are
+ * stored in place with quotes and escapes removed, which only shrinks them,
+ * so the write position never overtakes unread characters. Token vector is
+ * allocated from the arena, so caller must not free it. */
+token_t* tokenize(arena_t* arena, char* s, int* tokc_p) {
+    char* end = s + strlen(s);
+    char* r = s;          /* next character to be read */
+    char* w = s;          /* next character of a word goes here */
+    char* pending = NULL; /* where terminator of last word must be put */
+    quoted_t quoted = {};
     int capacity = 10;
     int ntoks = 0;
 
-    token_t* tokvec = malloc(sizeof(token_t) * (capacity + 1));
+    token_t* tokvec = arena_alloc(arena, sizeof(token_t) * (capacity + 1));
+
+    while (true) {
+        /* Consume whitespace characters. Lines of compound commands are
+         * separated by newlines, which act like ';' if a command ends. */
+        bool newline = false;
+        while (cclass(*r) == C_SPACE)
+            if (*r++ == '\n')
+                newline = true;
+
+        /* Terminator may overlap an operator that we haven't read yet. */
+        if (pending && pending < r) {
+            *pending = 0;
+            pending = NULL;
+        }
+
+        if (*r == 0)
+            break;
+
+        tokvec = growtokens(arena, tokvec, &capacity, ntoks, 2);
+
+        token_t prev = ntoks ? tokvec[ntoks - 1] : T_COLON;
+        if (newline && !separator_p(prev) && prev != T_BANG && prev != T_FUNC)
+            tokvec[ntoks++] = T_COLON;
+
+        if (cclass(*r) == C_OPER) {
+            token_t tok;
+
+            if (r[0] == '|') {
+                tok = r[1] == '|' ? T_OR : T_PIPE;
+            } else if (r[0] == '&') {
+                if (r[1] == '>')
+                    tok = r[2] == '>' ? T_APPENDALL : T_OUTALL;
+                else
+                    tok = r[1] == '&' ? T_AND : T_BGJOB;
+            } else if (r[0] == '<') {
+                if (r[1] == '<')
+                    tok = r[2] == '<' ? T_HERESTR : T_HEREDOC;
+                else if (r[1] == '&')
+                    tok = T_DUPIN;
+                else
+                    tok = r[1] == '(' ? T_PSUBIN : T_INPUT;
+            } else if (r[0] == '>') {
+                if (r[1] == '>')
+                    tok = T_APPEND;
+                else if (r[1] == '&')
+                    tok = T_DUPOUT;
+                else
+                    tok = r[1] == '(' ? T_PSUBOUT : T_OUTPUT;
+            } else if (r[0] == ';') {
+                tok = T_COLON;
+            } else if (r[0] == '(') {
+                tok = T_LPAREN;
+            } else {
+                tok = T_RPAREN;
+            }
+
+            tokvec[ntoks++] = tok;
+
+            if (tok != T_PSUBIN && tok != T_PSUBOUT && tok != T_LPAREN) {
+                r += oplen(tok);
+                continue;
+            }
+
+            /* Text of substituted pipeline or subshell is kept verbatim as
+             * next token, it gets tokenized on its own when compiled. */
+            char* text = tok == T_LPAREN ? r + 1 : r + 2;
+            char* close = matchparen(text);
+            if (close == NULL)
+                return unterminated(tokvec, tokc_p, "(");
 
-    while (*s != 0) {
-        /* Consume whitespace characters. */
-        if (isspace(*s)) {
-            *s++ = 0;
+            /* Empty parentheses after name of a command define function. */
+            if (tok == T_LPAREN && ntoks >= 2 && string_p(tokvec[ntoks - 2]) &&
+                cmdpos_p(tokvec, ntoks - 2) &&
+                strspn(text, " \t") == (size_t)(close - text)) {
+                tokvec[ntoks - 1] = T_FUNC;
+                r = close + 1;
+                continue;
+            }
+
+            if (pending) {
+                *pending = 0;
+                pending = NULL;
+            }
+
+            size_t n = close - text;
+            tokvec[ntoks++] = w;
+            memmove(w, text, n);
+            w += n;
+            r = close + 1;
+            pending = w++;
             continue;
         }
 
-        /* Make sure there's enough space to add new token. */
-        if (ntoks == capacity) {
-            capacity *= 2;
-            tokvec = realloc(tokvec, sizeof(token_t) * (capacity + 1));
+        size_t len = cmdpos_p(tokvec, ntoks) ? barelen(r) : 0;
+
+        /* Bare '!' is a reserved word where a pipeline starts and a plain
+         * word anywhere else, as in 'test a != b'. */
+        if (len == 1 && r[0] == '!') {
+            tokvec[ntoks++] = T_BANG;
+            r++;
+            continue;
         }
 
-        size_t l = strcspn(s, " |&<>;!");
-        if (l > 0) {
-            tokvec[ntoks++] = s;
-            s += l;
+        const char* opener = len ? findword(openers, r, len) : NULL;
+
+        /* So is the list of a group. */
+        if (opener == openers[0]) {
+            scan_t sc = {.s = r + 1, .cmdpos = true};
+            size_t n;
+            while ((n = nextpart(&sc)) > 0 && findword(closers, sc.s, n) !=
+                                                   closers[0])
+                skipreserved(&sc, n);
+            if (n == 0)
+                return unterminated(tokvec, tokc_p, "{");
+
+            if (pending) {
+                *pending = 0;
+                pending = NULL;
+            }
+
+            n = sc.s - (r + 1);
+            tokvec[ntoks++] = T_GROUP;
+            tokvec[ntoks++] = w;
+            memmove(w, r + 1, n);
+            w += n;
+            r = sc.s + 1;
+            pending = w++;
             continue;
         }
 
-        token_t tok;
+        /* Lists of other compound commands are kept verbatim as well, each
+         * following the reserved word before it. Lexer only finds where they
+         * are, it's up to the parser to check the order of reserved words. */
+        if (opener) {
+            scan_t sc = {.s = r + len};
+            sc.cmdpos = opener != openers[4]; /* 'for' is followed by name */
 
-        if (s[0] == '|') {
-            if (s[1] == '|') {
-                *s++ = 0;
-                tok = T_OR;
-            } else {
-                tok = T_PIPE;
+            if (pending) {
+                *pending = 0;
+                pending = NULL;
             }
-        } else if (s[0] == '&') {
-            if (s[1] == '&') {
-                *s++ = 0;
-                tok = T_AND;
-            } else {
-                tok = T_BGJOB;
+
+            tokvec[ntoks++] = T_COMPOUND;
+            tokvec[ntoks++] = (token_t)opener;
+            while (true) {
+                size_t n = nextpart(&sc);
+                if (n == 0)
+                    return unterminated(tokvec, tokc_p, opener);
+
+                /* Text is moved towards the start of line, so it never
+                 * reaches the reserved word that follows it. */
+                tokvec = growtokens(arena, tokvec, &capacity, ntoks, 2);
+                size_t tlen = sc.s - r - len;
+                tokvec[ntoks++] = w;
+                memmove(w, r + len, tlen);
+                w[tlen] = '\0';
+                w += tlen + 1;
+
+                const char* word = findword(closers, sc.s, n);
+                if (word == NULL)
+                    word = findword(middles, sc.s, n);
+                tokvec[ntoks++] = (token_t)word;
+                skipreserved(&sc, n);
+                r = sc.s;
+                len = 0;
+                if (findword(closers, word, n))
+                    break;
             }
-        } else if (s[0] == '<') {
-            tok = T_INPUT;
-        } else if (s[0] == '>') {
-            tok = T_OUTPUT;
-        } else if (s[0] == ';') {
-            tok = T_COLON;
-        } else if (s[0] == '!') {
-            tok = T_BANG;
-        } else {
             continue;
         }
 
-        *s++ = 0;
-        tokvec[ntoks++] = tok;
+        /* Other reserved words only make sense within compound commands. */
+        if (len && reserved_p(r, len)) {
+            char* word = arena_strndup(arena, r, len);
+            return unexpected(tokvec, tokc_p, word);
+        }
+
+        /* Single digit glued to redirection operator is a descriptor. */
+        if (isdigit(r[0]) && (r[1] == '<' || r[1] == '>')) {
+            tokvec[ntoks++] = T_IONUM;
+            tokvec[ntoks++] = w;
+            *w++ = *r++;
+            pending = w++;
+            continue;
+        }
+
+        char* word = w;
+        bool expand = false;
+        quoted.n = 0;
+        tokvec[ntoks++] = w;
+
+        while (true) {
+            size_t n = wordspan(r, end);
+            if (w != r)
+                memmove(w, r, n);
+            expand = expand || hasexpansion(w, n);
+            w += n, r += n;
+
+            if (cclass(*r) == C_ESCAPE) {
+                /* Backslash at the end of line stands for itself. */
+                if (*++r == 0)
+                    *w = '\\';
+                else
+                    *w = *r++;
+                if (quotable_p(*w))
+                    markquoted(arena, &quoted, w - word);
+                w++;
+            } else if (cclass(*r) == C_QUOTE) {
+                char quote = *r++;
+                while (*r != quote) {
+                    bool escaped = false;
+                    if (*r == 0)
+                        return unterminated(tokvec, tokc_p,
+                                            quote == '"' ? "\"" : "'");
+                    /* Within double quotes only few characters are special. */
+                    if (quote == '"' && *r == '\\' && r[1] &&
+                        strchr("\"\\$`\n", r[1]))
+                        r++, escaped = true;
+                    if (quote == '"' && *r == '$' && !escaped)
+                        expand = true;
+                    else if (quotable_p(*r))
+                        markquoted(arena, &quoted, w - word);
+                    *w++ = *r++;
+                }
+                r++;
+            } else {
+                break;
+            }
+        }
+
+        if (expand) {
+            tokvec[ntoks - 1] = T_EXPAND;
+            tokvec[ntoks++] = expandword(arena, word, w - word, &quoted);
+        }
+
+        pending = w++;
     }
 
+    if (pending)
+        *pending = 0;
+
     tokvec[ntoks] = NULL;
     *tokc_p = ntoks;
     return tokvec;
@@ -3,6 +3,7 @@
 
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #ifdef LINUX
 #include <sys/sysmacros.h>
 #include <sys/prctl.h>
@@ -21,12 +22,14 @@
 #include <pwd.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdnoreturn.h>
 #include <string.h>
+#include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -47,17 +50,24 @@
 #define powerof2(x) (((x) & ((x)-1)) == 0)
 
 #define __unused __attribute__((unused))
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
 
 extern char **environ;
 
-/* Our own error-handling functions */
+/* Our own error-handling functions, never called on the fast path */
 noreturn void unix_error(const char *fmt, ...)
-  __attribute__((format(printf, 1, 2)));
+  __attribute__((format(printf, 1, 2), cold));
 noreturn void app_error(const char *fmt, ...)
-  __attribute__((format(printf, 1, 2)));
+  __attribute__((format(printf, 1, 2), cold));
 
 /* Signal safe I/O functions */
 void safe_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void safe_dprintf(int fd, const char *fmt, ...)
+  __attribute__((format(printf, 2, 3)));
+size_t safe_snprintf(char *buf, size_t size, const char *fmt, ...)
+  __attribute__((format(printf, 3, 4)));
+size_t safe_vsnprintf(char *buf, size_t size, const char *fmt, va_list ap);
 void safe_error(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 
 /* Decent hashing function. */
@@ -65,14 +75,126 @@ void safe_error(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 
 uint32_t jenkins_hash(const void *key, size_t length, uint32_t initval);
 
+/* Two hashes of key at once, see hash tables of hashtab.h. Seeds are taken
+ * from *pc and *pb, results go there. */
+void jenkins_hash2(const void *key, size_t length, uint32_t *pc, uint32_t *pb);
+
+/* Wrappers of frequently used system calls are defined inline if CSAPP_INLINE
+ * is defined before this header is included, so that each one compiles into
+ * the system call and a branch to unix_error predicted not taken. Otherwise
+ * they're linked from libcsapp like the rest. */
+#ifdef CSAPP_INLINE
+#define __checked(cond, what)                                                  \
+  do {                                                                         \
+    if (unlikely(cond))                                                        \
+      unix_error(what);                                                        \
+  } while (0)
+
+static inline pid_t Fork(void) {
+  pid_t pid = fork();
+  __checked(pid < 0, "Fork error");
+  return pid;
+}
+
+static inline pid_t Waitpid(pid_t pid, int *iptr, int options) {
+  pid_t retpid = waitpid(pid, iptr, options);
+  __checked(retpid < 0, "Waitpid error");
+  return retpid;
+}
+
+static inline void (*Signal(int signum, void (*handler)(int)))(int) {
+  void (*res)(int) = signal(signum, handler);
+  __checked(res == SIG_ERR, "Signal error");
+  return res;
+}
+
+static inline void Kill(pid_t pid, int sig) {
+  __checked(kill(pid, sig) < 0, "Kill error");
+}
+
+static inline void Sigprocmask(int how, const sigset_t *set,
+                               sigset_t *oldset) {
+  __checked(sigprocmask(how, set, oldset) < 0, "Sigprocmask error");
+}
+
+static inline void Sigaction(int signum, const struct sigaction *act,
+                             struct sigaction *oldact) {
+  __checked(sigaction(signum, act, oldact) < 0, "Sigaction error");
+}
+
+static inline void Sigsuspend(const sigset_t *mask) {
+  __checked(sigsuspend(mask) == -1 && errno != EINTR, "Sigsuspend error");
+}
+
+static inline void Setpgid(pid_t pid, pid_t pgid) {
+  __checked(setpgid(pid, pgid) < 0, "Setpgid error");
+}
+
+static inline int Open(const char *pathname, int flags, mode_t mode) {
+  int rc = open(pathname, flags, mode);
+  __checked(rc < 0, "Open error");
+  return rc;
+}
+
+static inline size_t Read(int fd, void *buf, size_t count) {
+  ssize_t rc = read(fd, buf, count);
+  __checked(rc < 0, "Read error");
+  return rc;
+}
+
+static inline size_t Write(int fd, const void *buf, size_t count) {
+  ssize_t rc = write(fd, buf, count);
+  __checked(rc < 0, "Write error");
+  return rc;
+}
+
+static inline size_t Writev(int fd, const struct iovec *iov, int iovcnt) {
+  ssize_t rc = writev(fd, iov, iovcnt);
+  __checked(rc < 0, "Writev error");
+  return rc;
+}
+
+static inline off_t Lseek(int fildes, off_t offset, int whence) {
+  off_t rc = lseek(fildes, offset, whence);
+  __checked(rc < 0, "Lseek error");
+  return rc;
+}
+
+static inline void Close(int fd) {
+  __checked(close(fd) < 0, "Close error");
+}
+
+static inline int Dup(int fd) {
+  int rc = dup(fd);
+  __checked(rc < 0, "Dup error");
+  return rc;
+}
+
+static inline int Dup2(int oldfd, int newfd) {
+  int rc = dup2(oldfd, newfd);
+  __checked(rc < 0, "Dup2 error");
+  return rc;
+}
+
+static inline void Pipe(int fds[2]) {
+  __checked(pipe(fds) < 0, "Pipe error");
+}
+
+static inline void Tcsetpgrp(int fd, pid_t pgrp) {
+  __checked(tcsetpgrp(fd, pgrp) < 0, "Tcsetpgrp error");
+}
+
+static inline pid_t Tcgetpgrp(int fd) {
+  pid_t rc = tcgetpgrp(fd);
+  __checked(rc < 0, "Tcgetpgrp error");
+  return rc;
+}
+
+#undef __checked
+#else
 /* Process control wrappers */
 pid_t Fork(void);
 pid_t Waitpid(pid_t pid, int *iptr, int options);
-#define Wait(iptr) Waitpid(-1, iptr, 0)
-void Prctl(int option, long arg);
-
-/* Process environment */
-char *Getcwd(char *buf, size_t buflen);
 
 /* Signal control wrappers */
 void (*Signal(int sig, void (*func)(int)))(int);
@@ -92,10 +214,27 @@ size_t Write(int fd, const void *buf, size_t count);
 size_t Writev(int fd, const struct iovec *iov, int iovcnt);
 off_t Lseek(int fildes, off_t offset, int whence);
 void Close(int fd);
-void Ftruncate(int fd, off_t length);
 int Dup(int fd);
 int Dup2(int oldfd, int newfd);
 void Pipe(int fds[2]);
+
+/* Terminal control */
+void Tcsetpgrp(int fd, pid_t pgrp);
+pid_t Tcgetpgrp(int fd);
+#endif /* !CSAPP_INLINE */
+
+#define Wait(iptr) Waitpid(-1, iptr, 0)
+void Prctl(int option, long arg);
+
+/* Process environment */
+char *Getcwd(char *buf, size_t buflen);
+
+/* Terminal attributes, changed once per foreground job */
+void Tcgetattr(int fd, struct termios *termios_p);
+void Tcsetattr(int fd, int action, const struct termios *termios_p);
+
+/* Unix I/O wrappers, not worth inlining */
+void Ftruncate(int fd, off_t length);
 void Socketpair(int domain, int type, int protocol, int sv[2]);
 
 /* Directory access (Linux specific) */
@@ -125,10 +264,6 @@ void Mprotect(void *addr, size_t len, int prot);
 void Munmap(void *addr, size_t len);
 void Madvise(void *addr, size_t length, int advice);
 
-/* Terminal control */
-void Tcsetpgrp(int fd, pid_t pgrp);
-pid_t Tcgetpgrp(int fd);
-
 /* Setjmp & longjmp implementation without sigprocmask */
 typedef struct {
   long rbx;
@@ -0,0 +1,259 @@
+#ifndef _HASHTAB_H_
+#define _HASHTAB_H_
+
+/*
+ * This file defines open addressing hash tables of pointers to elements, in
+ * the manner of tree.h: HT_GENERATE makes functions for a given type of
+ * element out of a hash function and a comparison function.  An element to
+ * look for is one that compares equal to the element given as the key.
+ *
+ * Table doesn't own elements nor their keys.  Both may live in an arena, as
+ * long as the table is reset with HT_RESET before the arena is released.
+ *
+ * Slots are grouped by 16 with a control byte each, which tells the slot is
+ * empty, or its element was deleted, or holds 7 bits of the element's hash.
+ * Lookup compares all control bytes of a group at once, with SSE2 where
+ * available, and looks at elements whose bits match only.  Groups are probed
+ * by double hashing, with two hashes that jenkins_hash2 returns for the price
+ * of one: the first one picks the first group, the second one the step.
+ * Steps are odd and the number of groups is a power of two, thus every group
+ * is probed eventually.  Search stops at a group with an empty slot, tables
+ * grow once 7/8 of their slots are taken.
+ *
+ * Hash function stores two hashes of an element's key, e.g. with HT_HASH:
+ *
+ *	static void varhash(const struct var *v, uint32_t h[2]) {
+ *	  HT_HASH(v->name, strlen(v->name), h);
+ *	}
+ *	HT_HEAD(vartab, var) vars = HT_INITIALIZER(&vars);
+ *	HT_GENERATE_STATIC(vartab, var, varhash, varcmp)
+ */
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define HT_GROUP 16        /* slots with control bytes compared at once */
+#define HT_EMPTY (-128)    /* control byte of a slot that was never used */
+#define HT_DELETED (-2)    /* control byte of a slot of removed element */
+
+#define HT_HEAD(name, type)                                                    \
+  struct name {                                                                \
+    int8_t *hth_ctrl;       /* control bytes, aligned to a group */            \
+    struct type **hth_slot; /* elements */                                     \
+    uint32_t hth_mask;      /* number of groups minus one */                   \
+    uint32_t hth_count;     /* number of elements */                           \
+    uint32_t hth_growth;    /* empty slots that may be taken before growing */ \
+  }
+
+#define HT_INITIALIZER(head)                                                   \
+  { NULL, NULL, 0, 0, 0 }
+
+#define HT_INIT(head)                                                          \
+  do {                                                                         \
+    (head)->hth_ctrl = NULL;                                                   \
+    (head)->hth_slot = NULL;                                                   \
+    (head)->hth_mask = (head)->hth_count = (head)->hth_growth = 0;             \
+  } while (/*CONSTCOND*/ 0)
+
+#define HT_COUNT(head) ((head)->hth_count)
+#define HT_EMPTY_P(head) ((head)->hth_count == 0)
+
+/* Two hashes of key of given length, as the hash function must produce. */
+#define HT_HASH(key, len, h)                                                   \
+  ((h)[0] = HASHINIT, (h)[1] = 0, jenkins_hash2((key), (len), &(h)[0], &(h)[1]))
+
+/* Slots of group whose control bytes are equal to c, as a bitmask. */
+static __inline __unused uint32_t ht_match(const int8_t *group, int8_t c) {
+#ifdef __SSE2__
+  __m128i ctrl = _mm_load_si128((const __m128i *)group);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(c)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < HT_GROUP; i++)
+    mask |= (uint32_t)(group[i] == c) << i;
+  return mask;
+#endif
+}
+
+/* Slots of group that are empty or deleted, i.e. may be filled. */
+static __inline __unused uint32_t ht_matchfree(const int8_t *group) {
+#ifdef __SSE2__
+  return _mm_movemask_epi8(_mm_load_si128((const __m128i *)group));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < HT_GROUP; i++)
+    mask |= (uint32_t)(group[i] < 0) << i;
+  return mask;
+#endif
+}
+
+/* Usable slots of a table with given number of groups. */
+#define HT_CAPACITY(ngroups) ((ngroups) * HT_GROUP - (ngroups) * HT_GROUP / 8)
+
+#define HT_PROTOTYPE(name, type, hash, cmp)                                    \
+  HT_PROTOTYPE_INTERNAL(name, type, hash, cmp, )
+#define HT_PROTOTYPE_STATIC(name, type, hash, cmp)                             \
+  HT_PROTOTYPE_INTERNAL(name, type, hash, cmp, __unused static)
+#define HT_PROTOTYPE_INTERNAL(name, type, hash, cmp, attr)                     \
+  attr struct type *name##_HT_FIND(struct name *, struct type *);              \
+  attr struct type *name##_HT_INSERT(struct name *, struct type *);            \
+  attr struct type *name##_HT_REMOVE(struct name *, struct type *);            \
+  attr struct type *name##_HT_NEXT(struct name *, uint32_t *);                 \
+  attr void name##_HT_RESIZE(struct name *, uint32_t);                         \
+  attr void name##_HT_RESET(struct name *);                                    \
+  attr void name##_HT_FREE(struct name *);
+
+#define HT_GENERATE(name, type, hash, cmp)                                     \
+  HT_GENERATE_INTERNAL(name, type, hash, cmp, )
+#define HT_GENERATE_STATIC(name, type, hash, cmp)                              \
+  HT_GENERATE_INTERNAL(name, type, hash, cmp, __unused static)
+#define HT_GENERATE_INTERNAL(name, type, hash, cmp, attr)                      \
+  /* Index of slot holding element equal to elm, or -1. */                     \
+  static __inline __unused long name##_HT_LOOKUP(struct name *head,            \
+                                                 struct type *elm,             \
+                                                 const uint32_t h[2]) {        \
+    if (head->hth_ctrl == NULL)                                                \
+      return -1;                                                               \
+    int8_t tag = h[0] >> 25;                                                   \
+    uint32_t g = h[0] & head->hth_mask, step = h[1] | 1;                       \
+    for (uint32_t n = 0; n <= head->hth_mask; n++) {                           \
+      int8_t *group = head->hth_ctrl + (size_t)g * HT_GROUP;                   \
+      for (uint32_t m = ht_match(group, tag); m; m &= m - 1) {                 \
+        size_t i = (size_t)g * HT_GROUP + __builtin_ctz(m);                    \
+        if (cmp(head->hth_slot[i], elm) == 0)                                  \
+          return i;                                                            \
+      }                                                                        \
+      if (ht_match(group, HT_EMPTY))                                           \
+        return -1;                                                             \
+      g = (g + step) & head->hth_mask;                                         \
+    }                                                                          \
+    return -1;                                                                 \
+  }                                                                            \
+                                                                               \
+  /* Put element into first free slot on its probe sequence, there's one. */  \
+  static __inline __unused void name##_HT_PLACE(struct name *head,             \
+                                                struct type *elm,              \
+                                                const uint32_t h[2]) {         \
+    uint32_t g = h[0] & head->hth_mask, step = h[1] | 1;                       \
+    uint32_t m;                                                                \
+    while ((m = ht_matchfree(head->hth_ctrl + (size_t)g * HT_GROUP)) == 0)     \
+      g = (g + step) & head->hth_mask;                                         \
+    size_t i = (size_t)g * HT_GROUP + __builtin_ctz(m);                        \
+    if (head->hth_ctrl[i] == HT_EMPTY)                                         \
+      head->hth_growth--;                                                      \
+    head->hth_ctrl[i] = h[0] >> 25;                                            \
+    head->hth_slot[i] = elm;                                                   \
+    head->hth_count++;                                                         \
+  }                                                                            \
+                                                                               \
+  attr struct type *name##_HT_FIND(struct name *head, struct type *elm) {      \
+    uint32_t h[2];                                                             \
+    hash(elm, h);                                                              \
+    long i = name##_HT_LOOKUP(head, elm, h);                                   \
+    return i < 0 ? NULL : head->hth_slot[i];                                   \
+  }                                                                            \
+                                                                               \
+  /* Rehash elements into table of ngroups groups, a power of two, which      \
+   * must fit them.  Deleted slots are reclaimed. */                           \
+  attr void name##_HT_RESIZE(struct name *head, uint32_t ngroups) {            \
+    int8_t *ctrl = head->hth_ctrl;                                             \
+    struct type **slot = head->hth_slot;                                       \
+    size_t nslots = ctrl ? ((size_t)head->hth_mask + 1) * HT_GROUP : 0;        \
+                                                                               \
+    head->hth_ctrl = aligned_alloc(HT_GROUP, (size_t)ngroups * HT_GROUP);      \
+    head->hth_slot = malloc(sizeof(struct type *) * ngroups * HT_GROUP);       \
+    memset(head->hth_ctrl, HT_EMPTY, (size_t)ngroups * HT_GROUP);              \
+    head->hth_mask = ngroups - 1;                                              \
+    head->hth_count = 0;                                                       \
+    head->hth_growth = HT_CAPACITY(ngroups);                                   \
+                                                                               \
+    for (size_t i = 0; i < nslots; i++) {                                      \
+      if (ctrl[i] < 0)                                                         \
+        continue;                                                              \
+      uint32_t h[2];                                                           \
+      hash(slot[i], h);                                                        \
+      name##_HT_PLACE(head, slot[i], h);                                       \
+    }                                                                          \
+    free(ctrl);                                                                \
+    free(slot);                                                                \
+  }                                                                            \
+                                                                               \
+  /* Returns element equal to elm that's already there, or NULL once elm      \
+   * has been inserted. */                                                     \
+  attr struct type *name##_HT_INSERT(struct name *head, struct type *elm) {    \
+    uint32_t h[2];                                                             \
+    hash(elm, h);                                                              \
+    long i = name##_HT_LOOKUP(head, elm, h);                                   \
+    if (i >= 0)                                                                \
+      return head->hth_slot[i];                                                \
+    if (head->hth_growth == 0) {                                               \
+      /* Table that's mostly deleted slots merely gets cleaned up. */          \
+      uint32_t ngroups = head->hth_ctrl ? head->hth_mask + 1 : 0;              \
+      if (ngroups == 0 || head->hth_count >= HT_CAPACITY(ngroups) / 2)         \
+        ngroups = ngroups ? ngroups * 2 : 1;                                   \
+      name##_HT_RESIZE(head, ngroups);                                         \
+    }                                                                          \
+    name##_HT_PLACE(head, elm, h);                                             \
+    return NULL;                                                               \
+  }                                                                            \
+                                                                               \
+  /* Returns element equal to elm that was taken out, or NULL. */              \
+  attr struct type *name##_HT_REMOVE(struct name *head, struct type *elm) {    \
+    uint32_t h[2];                                                             \
+    hash(elm, h);                                                              \
+    long i = name##_HT_LOOKUP(head, elm, h);                                   \
+    if (i < 0)                                                                 \
+      return NULL;                                                             \
+    /* Searches never got past a group with an empty slot, so the slot        \
+     * becomes empty again then. */                                            \
+    int8_t *group = head->hth_ctrl + i / HT_GROUP * HT_GROUP;                  \
+    if (ht_match(group, HT_EMPTY)) {                                           \
+      head->hth_ctrl[i] = HT_EMPTY;                                            \
+      head->hth_growth++;                                                      \
+    } else {                                                                   \
+      head->hth_ctrl[i] = HT_DELETED;                                          \
+    }                                                                          \
+    head->hth_count--;                                                         \
+    return head->hth_slot[i];                                                  \
+  }                                                                            \
+                                                                               \
+  /* Element in the first taken slot from *pos on, which is then moved past   \
+   * it, or NULL once there are no more. */                                    \
+  attr struct type *name##_HT_NEXT(struct name *head, uint32_t *pos) {         \
+    size_t nslots = head->hth_ctrl ? ((size_t)head->hth_mask + 1) * HT_GROUP   \
+                                   : 0;                                        \
+    for (; *pos < nslots; (*pos)++)                                            \
+      if (head->hth_ctrl[*pos] >= 0)                                           \
+        return head->hth_slot[(*pos)++];                                       \
+    return NULL;                                                               \
+  }                                                                            \
+                                                                               \
+  /* Forget all elements and keep the slots. */                                \
+  attr void name##_HT_RESET(struct name *head) {                               \
+    if (head->hth_ctrl == NULL)                                                \
+      return;                                                                  \
+    memset(head->hth_ctrl, HT_EMPTY, ((size_t)head->hth_mask + 1) * HT_GROUP); \
+    head->hth_count = 0;                                                       \
+    head->hth_growth = HT_CAPACITY(head->hth_mask + 1);                        \
+  }                                                                            \
+                                                                               \
+  attr void name##_HT_FREE(struct name *head) {                                \
+    free(head->hth_ctrl);                                                      \
+    free(head->hth_slot);                                                      \
+    HT_INIT(head);                                                             \
+  }
+
+#define HT_FIND(name, x, y) name##_HT_FIND(x, y)
+#define HT_INSERT(name, x, y) name##_HT_INSERT(x, y)
+#define HT_REMOVE(name, x, y) name##_HT_REMOVE(x, y)
+#define HT_NEXT(name, x, pos) name##_HT_NEXT(x, pos)
+#define HT_RESET(name, x) name##_HT_RESET(x)
+#define HT_FREE(name, x) name##_HT_FREE(x)
+
+/* Elements come in no particular order.  Current one may be removed, but
+ * nothing may be inserted meanwhile. */
+#define HT_FOREACH(x, name, head, pos)                                         \
+  for ((pos) = 0; ((x) = name##_HT_NEXT(head, &(pos))) != NULL;)
+
+#endif /* !_HASHTAB_H_ */
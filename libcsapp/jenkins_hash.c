@@ -36,6 +36,10 @@ on 1 byte), but shoehorning those bytes into integers efficiently is messy.
 -------------------------------------------------------------------------------
 */
 
+/* Aligned reads of the last word may run past the end of the key, which
+ * AddressSanitizer (just like VALGRIND) reports as an overflow. */
+#define __no_asan __attribute__((no_sanitize_address))
+
 #define rot(x, k) (((x) << (k)) | ((x) >> (32 - (k))))
 
 /*
@@ -222,10 +226,15 @@ code any way you wish, private, educational, or commercial.  It's free.
 
 Use for hash table lookup, or anything where one collision in 2^^32 is
 acceptable.  Do NOT use for cryptographic purposes.
+
+hashlittle2() is the same, except that it returns two 32-bit hashes, *pc
+being the better mixed one, seeded by initial *pc and *pb.  If *pb is 0,
+*pc comes out as hashlittle() would return it.
 -------------------------------------------------------------------------------
 */
 
-uint32_t jenkins_hash(const void *key, size_t length, uint32_t initval) {
+__no_asan void jenkins_hash2(const void *key, size_t length, uint32_t *pc,
+                             uint32_t *pb) {
   uint32_t a, b, c; /* internal state */
   union {
     const void *ptr;
@@ -233,7 +242,8 @@ uint32_t jenkins_hash(const void *key, size_t length, uint32_t initval) {
   } u; /* needed for Mac Powerbook G4 */
 
   /* Set up the internal state */
-  a = b = c = 0xdeadbeef + ((uint32_t)length) + initval;
+  a = b = c = 0xdeadbeef + ((uint32_t)length) + *pc;
+  c += *pb;
 
   u.ptr = key;
   if ((u.i & 0x3) == 0) {
@@ -310,7 +320,9 @@ uint32_t jenkins_hash(const void *key, size_t length, uint32_t initval) {
         a += k[0] & 0xff;
         break;
       case 0:
-        return c; /* zero length strings require no mixing */
+        *pc = c;
+        *pb = b;
+        return; /* zero length strings require no mixing */
     }
 
   } else if ((u.i & 0x1) == 0) {
@@ -368,7 +380,9 @@ uint32_t jenkins_hash(const void *key, size_t length, uint32_t initval) {
         a += k8[0];
         break;
       case 0:
-        return c; /* zero length requires no mixing */
+        *pc = c;
+        *pb = b;
+        return; /* zero length requires no mixing */
     }
 
   } else { /* need to read the key one byte at a time */
@@ -422,11 +436,21 @@ uint32_t jenkins_hash(const void *key, size_t length, uint32_t initval) {
         a += k[0];
         break;
       case 0:
-        return c;
+        *pc = c;
+        *pb = b;
+        return;
     }
   }
 
   final(a, b, c);
+  *pc = c;
+  *pb = b;
+}
+
+__no_asan uint32_t jenkins_hash(const void *key, size_t length,
+                                  uint32_t initval) {
+  uint32_t c = initval, b = 0;
+  jenkins_hash2(key, length, &c, &b);
   return c;
 }
 
@@ -438,7 +462,8 @@ uint32_t jenkins_hash(const void *key, size_t length, uint32_t initval) {
  * from hashlittle() on all machines.  hashbig() takes advantage of
  * big-endian byte ordering.
  */
-uint32_t jenkins_hash(const void *key, size_t length, uint32_t initval) {
+__no_asan uint32_t jenkins_hash(const void *key, size_t length,
+                                  uint32_t initval) {
   uint32_t a, b, c;
   union {
     const void *ptr;
@@ -584,4 +609,13 @@ uint32_t jenkins_hash(const void *key, size_t length, uint32_t initval) {
   final(a, b, c);
   return c;
 }
+
+/* There's no hashbig2(), the second hash is made by seeding the first one
+ * with a value derived from the other seed. */
+void jenkins_hash2(const void *key, size_t length, uint32_t *pc,
+                   uint32_t *pb) {
+  uint32_t c = jenkins_hash(key, length, *pc + *pb);
+  *pb = jenkins_hash(key, length, c);
+  *pc = c;
+}
 #endif
@@ -48,9 +48,7 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n) {
  *    entry, rio_read() refills the internal buffer via a call to
  *    read() if the internal buffer is empty.
  */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
-  int cnt;
-
+static ssize_t rio_fill(rio_t *rp) {
   while (rp->rio_cnt <= 0) { /* Refill if buf is empty */
     rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
     if (rp->rio_cnt < 0) {
@@ -61,6 +59,14 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
     else
       rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
   }
+  return rp->rio_cnt;
+}
+
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
+  int cnt;
+
+  if ((cnt = rio_fill(rp)) <= 0)
+    return cnt;
 
   /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
   cnt = n;
@@ -96,26 +102,80 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
   return (n - nleft); /* return >= 0 */
 }
 
-/* rio_readlineb - Robustly read a text line (buffered) */
+/*
+ * rio_readlineb - Robustly read a text line (buffered). Internal buffer is
+ *    searched for a newline with memchr and whole runs of bytes are copied
+ *    at once.
+ */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
-  int n, rc;
-  char c, *bufp = usrbuf;
-
-  for (n = 1; n < maxlen; n++) {
-    if ((rc = rio_read(rp, &c, 1)) == 1) {
-      *bufp++ = c;
-      if (c == '\n') {
-        n++;
-        break;
-      }
-    } else if (rc == 0) {
-      if (n == 1)
-        return 0; /* EOF, no data read */
-      else
-        break; /* EOF, some data was read */
-    } else
+  size_t n = 0;
+  ssize_t rc;
+  char *bufp = usrbuf;
+
+  while (n + 1 < maxlen) {
+    if ((rc = rio_fill(rp)) < 0)
       return -1; /* Error */
+    if (rc == 0) {
+      if (n == 0)
+        return 0; /* EOF, no data read */
+      break;      /* EOF, some data was read */
+    }
+
+    size_t cnt = min((size_t)rp->rio_cnt, maxlen - 1 - n);
+    char *nl = memchr(rp->rio_bufptr, '\n', cnt);
+    if (nl)
+      cnt = nl - rp->rio_bufptr + 1;
+    memcpy(bufp + n, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    n += cnt;
+    if (nl)
+      break;
   }
-  *bufp = 0;
-  return n - 1;
+  bufp[n] = 0;
+  return n;
+}
+
+/*
+ * rio_readline_view - Read a text line (buffered) without copying it.
+ *    On success *linep points into the internal buffer and the length of
+ *    the line, including trailing newline, is returned. The view is valid
+ *    until the next call on rp. A line that would cross the refill boundary
+ *    is moved to the front of the buffer first. If a line does not fit into
+ *    the buffer at all, it is returned in pieces without trailing newline.
+ *    Returns 0 on EOF and -1 on error.
+ */
+ssize_t rio_readline_view(rio_t *rp, char **linep) {
+  ssize_t rc;
+  size_t scanned = 0;
+  char *nl;
+
+  if ((rc = rio_fill(rp)) <= 0)
+    return rc;
+
+  while (!(nl = memchr(rp->rio_bufptr + scanned, '\n',
+                       rp->rio_cnt - scanned))) {
+    scanned = rp->rio_cnt;
+    if (rp->rio_cnt == RIO_BUFSIZE)
+      break; /* Line longer than buffer */
+
+    memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+    rp->rio_bufptr = rp->rio_buf;
+
+    rc = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+              RIO_BUFSIZE - rp->rio_cnt);
+    if (rc < 0) {
+      if (errno != EINTR) /* Interrupted by sig handler return */
+        return -1;
+    } else if (rc == 0)
+      break; /* EOF, return rest of data */
+    else
+      rp->rio_cnt += rc;
+  }
+
+  size_t len = nl ? (size_t)(nl - rp->rio_bufptr + 1) : (size_t)rp->rio_cnt;
+  *linep = rp->rio_bufptr;
+  rp->rio_bufptr += len;
+  rp->rio_cnt -= len;
+  return len;
 }
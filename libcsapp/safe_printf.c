@@ -5,7 +5,7 @@
 static char const digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
 
 #define MAXNBUF (sizeof(intmax_t) * 8 + 1)
-#define MAXLINE 512
+#define MAXLINE 1024
 
 static char *print_num(char *nbuf, uintmax_t num, int base, int *len_p) {
   char *p = nbuf;
@@ -19,30 +19,42 @@ static char *print_num(char *nbuf, uintmax_t num, int base, int *len_p) {
   return p;
 }
 
-static void safe_vprintf(int fd, const char *fmt, va_list ap) {
-  char line[MAXLINE];
+/* Format into buf of given size, never allocates memory nor takes locks, hence
+ * it's safe to use in signal handlers. Understands %c, %s, %d, %u and %x with
+ * optional 'l' or 'z' modifier, field width and '-' or '0' flags. Output is
+ * truncated to fit and always NUL-terminated. Returns its length. */
+size_t safe_vsnprintf(char *buf, size_t size, const char *fmt, va_list ap) {
   char nbuf[MAXNBUF];
-  int linelen = 0;
+  size_t len = 0;
   int stop = 0;
 
+  if (size == 0)
+    return 0;
+
 #define PCHAR(c)                                                               \
   {                                                                            \
     int _c = (c);                                                              \
-    if (linelen < MAXLINE)                                                     \
-      line[linelen++] = _c;                                                    \
+    if (len < size - 1)                                                        \
+      buf[len++] = _c;                                                         \
+  }
+
+#define PAD(n, c)                                                              \
+  {                                                                            \
+    for (int _n = (n); _n > 0; _n--)                                           \
+      PCHAR(c);                                                                \
   }
 
   if (fmt == NULL)
     fmt = "(null)\n";
 
   for (;;) {
-    int neg = 0, lflag = 0;
+    int neg = 0, lflag = 0, ladjust = 0, zpad = 0, width = 0;
     int ch, n, base, sign;
     uintmax_t num;
 
     while ((ch = *fmt++) != '%' || stop) {
       if (ch == '\0')
-        goto print;
+        goto done;
       PCHAR(ch);
     }
 
@@ -55,12 +67,29 @@ static void safe_vprintf(int fd, const char *fmt, va_list ap) {
         PCHAR(ch);
         break;
 
+      case '-':
+        ladjust = 1;
+        goto again;
+
+      case '0':
+        if (width == 0) {
+          zpad = 1;
+          goto again;
+        }
+        /* FALLTHROUGH */
+      case '1' ... '9':
+        width = width * 10 + ch - '0';
+        goto again;
+
       case 'l':
+      case 'z':
         lflag = 1;
         goto again;
 
       case 'c':
+        PAD(ladjust ? 0 : width - 1, ' ');
         PCHAR(va_arg(ap, int));
+        PAD(ladjust ? width - 1 : 0, ' ');
         break;
 
       case 's':
@@ -68,8 +97,10 @@ static void safe_vprintf(int fd, const char *fmt, va_list ap) {
         if (p == NULL)
           p = "(null)";
         n = strlen(p);
-        while (n--)
-          PCHAR(*p++);
+        PAD(ladjust ? 0 : width - n, ' ');
+        for (int i = 0; i < n; i++)
+          PCHAR(p[i]);
+        PAD(ladjust ? width - n : 0, ' ');
         break;
 
       case 'd':
@@ -81,6 +112,15 @@ static void safe_vprintf(int fd, const char *fmt, va_list ap) {
           num = va_arg(ap, int);
         goto number;
 
+      case 'u':
+        base = 10;
+        sign = 0;
+        if (lflag)
+          num = va_arg(ap, unsigned long);
+        else
+          num = va_arg(ap, unsigned int);
+        goto number;
+
       case 'x':
         base = 16;
         sign = 0;
@@ -95,15 +135,23 @@ static void safe_vprintf(int fd, const char *fmt, va_list ap) {
           neg = 1;
           num = -(intmax_t)num;
         }
+        p = print_num(nbuf, num, base, &n);
+        /* Number of characters besides digits. */
+        int extra = neg + (base == 16 ? 2 : 0);
+        if (!ladjust && !zpad)
+          PAD(width - n - extra, ' ');
         if (neg)
           PCHAR('-');
         if (base == 16) {
           PCHAR('0');
           PCHAR('x');
         }
-        p = print_num(nbuf, num, base, &n);
-        while (n--)
+        if (!ladjust && zpad)
+          PAD(width - n - extra, '0');
+        for (int i = 0; i < n; i++)
           PCHAR(*p--);
+        if (ladjust)
+          PAD(width - n - extra, ' ');
         break;
 
       default:
@@ -113,10 +161,34 @@ static void safe_vprintf(int fd, const char *fmt, va_list ap) {
         break;
     }
   }
+#undef PAD
 #undef PCHAR
 
-print:
-  (void)write(fd, line, linelen);
+done:
+  buf[len] = '\0';
+  return len;
+}
+
+size_t safe_snprintf(char *buf, size_t size, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  size_t len = safe_vsnprintf(buf, size, fmt, ap);
+  va_end(ap);
+  return len;
+}
+
+/* Whole message is written with a single system call. */
+static void safe_vprintf(int fd, const char *fmt, va_list ap) {
+  char line[MAXLINE];
+  size_t len = safe_vsnprintf(line, sizeof(line), fmt, ap);
+  (void)write(fd, line, len);
+}
+
+void safe_dprintf(int fd, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  safe_vprintf(fd, fmt, ap);
+  va_end(ap);
 }
 
 void safe_printf(const char *fmt, ...) {
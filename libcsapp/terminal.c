@@ -13,26 +13,36 @@ int tty_open(void) {
   return Open(dev, O_RDWR | O_NOCTTY, 0);
 }
 
+/* Terminal modes are switched once for the whole query, and reading the
+ * response gives up after a second, so a terminal that doesn't answer or a
+ * slow link can't hang us. Input typed ahead is pushed back afterwards. */
 void tty_curpos(int fd, int *x, int *y) {
   struct termios ts, ots;
 
-  tcgetattr(fd, &ts);
-  memcpy(&ots, &ts, sizeof(struct termios));
-  ts.c_lflag &= ~(ECHO | ICANON | CREAD);
-
+  tcgetattr(fd, &ots);
+  memcpy(&ts, &ots, sizeof(struct termios));
+  ts.c_lflag &= ~(ECHO | ICANON);
+  ts.c_cc[VMIN] = 0;
+  ts.c_cc[VTIME] = 10;
   tcsetattr(fd, TCSADRAIN, &ts);
-  int m;
+
+  int m = 0;
   ioctl(fd, TIOCINQ, &m);
-  char discarded[m];
-  m = Read(fd, discarded, m);
+  char discarded[m + 1];
+  if (m > 0)
+    m = Read(fd, discarded, m);
 
-  Write(fd, CPR(), sizeof(CPR()));
+  Write(fd, CPR(), sizeof(CPR()) - 1);
   char buf[20];
-  int n = Read(fd, buf, 19);
+  size_t n = 0;
+  /* Response may arrive in pieces, it ends with 'R'. */
+  while (n < sizeof(buf) - 1) {
+    ssize_t k = read(fd, buf + n, 1);
+    if (k <= 0 || buf[n++] == 'R')
+      break;
+  }
   buf[n] = '\0';
 
-  ts.c_lflag |= ICANON;
-  tcsetattr(fd, TCSADRAIN, &ts);
   for (int i = 0; i < m; i++)
     ioctl(fd, TIOCSTI, discarded + i);
 
@@ -0,0 +1,248 @@
+#include "shell.h"
+
+/* Priorities and resource limits of jobs, set with 'renice', 'ionice' and
+ * 'limit' builtins. They are applied by the shell to each process as it's
+ * added to a job, so commands start the usual way. Limits of CPU time and
+ * memory are enforced by a cgroup v2 created for the job within that of the
+ * shell, which moves into a leaf of its own for that, and needs the hierarchy
+ * to be delegated to the user. Linux only,
+ * nice values work everywhere. */
+
+const limits_t nolimits = {.nice = NONICE, .ioprio = -1};
+
+bool limited_p(const limits_t* lim) {
+    return lim->nice != NONICE || lim->ioprio >= 0 || lim->cpumax ||
+           lim->memmax;
+}
+
+/* Limits set in src override those of dst. */
+void mergelimits(limits_t* dst, const limits_t* src) {
+    if (src->nice != NONICE)
+        dst->nice = src->nice;
+    if (src->ioprio >= 0)
+        dst->ioprio = src->ioprio;
+    if (src->cpumax)
+        dst->cpumax = src->cpumax;
+    if (src->memmax)
+        dst->memmax = src->memmax;
+}
+
+#ifdef LINUX
+#include <sys/syscall.h>
+
+#define IOPRIO_WHO_PROCESS 1
+
+/* Directory of shell's cgroup in the v2 hierarchy, "" if there's none. */
+static char* cgroup_base = NULL;
+static bool cgroup_ready = false; /* shell has moved into a leaf of it */
+
+static bool readfile(const char* path, strbuf_t* sb) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    char buf[4096];
+    ssize_t n;
+    sb->len = 0;
+    strappn(sb, "", 0);
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        strappn(sb, buf, n);
+    close(fd);
+    return n == 0;
+}
+
+static void splitlines(strbuf_t* sb) {
+    for (size_t i = 0; i < sb->len; i++)
+        if (sb->str[i] == '\n')
+            sb->str[i] = '\0';
+}
+
+static bool writefile(const char* dir, const char* name, const char* text) {
+    char path[PATH_MAX];
+    safe_snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    ssize_t n = write(fd, text, strlen(text));
+    int error = errno;
+    close(fd);
+    errno = error;
+    return n == (ssize_t)strlen(text);
+}
+
+/* Finds where cgroup2 is mounted and which cgroup the shell belongs to. */
+static const char* cgroupbase(void) {
+    if (cgroup_base)
+        return cgroup_base;
+
+    strbuf_t sb = {}, base = {};
+    strappn(&base, "", 0);
+
+    /* Mount point is the fifth field of a line with 'cgroup2' type. */
+    if (readfile("/proc/self/mountinfo", &sb)) {
+        splitlines(&sb);
+        for (char* line = sb.str; line < sb.str + sb.len;
+             line += strlen(line) + 1) {
+            if (!strstr(line, " - cgroup2 "))
+                continue;
+            char* mnt = line;
+            for (int i = 0; i < 4; i++)
+                mnt += strcspn(mnt, " ") + 1;
+            strappn(&base, mnt, strcspn(mnt, " "));
+            break;
+        }
+    }
+
+    /* Unified hierarchy has the line '0::path'. */
+    bool found = false;
+    if (base.len && readfile("/proc/self/cgroup", &sb)) {
+        splitlines(&sb);
+        for (char* line = sb.str; line < sb.str + sb.len && !found;
+             line += strlen(line) + 1) {
+            found = !strncmp(line, "0::", 3);
+            if (found && strcmp(line, "0::/"))
+                strapp(&base, line + 3);
+            else if (found)
+                cgroup_ready = true; /* root may have processes */
+        }
+    }
+    if (!found) {
+        base.len = 0;
+        base.str[0] = '\0';
+    }
+
+    free(sb.str);
+    cgroup_base = base.str;
+    return cgroup_base;
+}
+
+/* Create cgroup for job number num, returns its path or NULL. */
+static char* mkcgroup(int num) {
+    const char* base = cgroupbase();
+    if (*base == '\0') {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    /* Cgroup that has controllers enabled for its children can't have
+     * processes of its own, unless it's the root, so the shell moves into
+     * a leaf first. Jobs started before still keep it busy. Controllers may
+     * already be enabled, which is fine. */
+    if (!cgroup_ready) {
+        char path[PATH_MAX], pid[16];
+        safe_snprintf(path, sizeof(path), "%s/shell", base);
+        safe_snprintf(pid, sizeof(pid), "%d", getpid());
+        if (mkdir(path, 0755) < 0 && errno != EEXIST)
+            return NULL;
+        if (!writefile(path, "cgroup.procs", pid))
+            return NULL;
+        if (!writefile(base, "cgroup.subtree_control", "+cpu +memory"))
+            return NULL;
+        cgroup_ready = true;
+    }
+
+    char path[PATH_MAX];
+    safe_snprintf(path, sizeof(path), "%s/shell-%d-job%d", base, getpid(),
+                  num);
+    if (mkdir(path, 0755) < 0 && errno != EEXIST)
+        return NULL;
+    return strdup(path);
+}
+
+/* Cgroup of a job goes away with the job, it's empty once all of its
+ * processes have been buried. */
+void rmcgroup(const char* path) {
+    (void)rmdir(path);
+}
+
+/* Interface files are missing if controllers aren't enabled for cgroup. */
+static bool writelimit(const char* path, const char* name, const char* text) {
+    if (writefile(path, name, text))
+        return true;
+    if (errno == ENOENT)
+        errno = EOPNOTSUPP;
+    return false;
+}
+
+static bool writelimits(const char* path, const limits_t* lim) {
+    char text[64];
+
+    if (lim->cpumax) {
+        /* Quota is given in microseconds per period of 100ms. */
+        if (lim->cpumax < 0)
+            safe_snprintf(text, sizeof(text), "max 100000");
+        else
+            safe_snprintf(text, sizeof(text), "%d 100000", lim->cpumax * 1000);
+        if (!writelimit(path, "cpu.max", text))
+            return false;
+    }
+    if (lim->memmax) {
+        if (lim->memmax < 0)
+            safe_snprintf(text, sizeof(text), "max");
+        else
+            safe_snprintf(text, sizeof(text), "%ld", (long)lim->memmax);
+        if (!writelimit(path, "memory.max", text))
+            return false;
+    }
+    return true;
+}
+
+/* Write limits into cgroup, creating it first if path is NULL. Cgroup that
+ * can't be limited is removed again. */
+bool setcgroup(char** pathp, int num, const limits_t* lim) {
+    if (!lim->cpumax && !lim->memmax)
+        return true;
+    if (*pathp)
+        return writelimits(*pathp, lim);
+    if ((*pathp = mkcgroup(num)) == NULL)
+        return false;
+    if (writelimits(*pathp, lim))
+        return true;
+
+    int error = errno;
+    rmcgroup(*pathp);
+    free(*pathp);
+    *pathp = NULL;
+    errno = error;
+    return false;
+}
+
+/* Apply priorities to a process and move it into cgroup, unless it's NULL.
+ * Returns false and sets errno if any of those failed. */
+bool applylimits(pid_t pid, const limits_t* lim, const char* cgroup) {
+    bool ok = true;
+
+    if (lim->nice != NONICE && setpriority(PRIO_PROCESS, pid, lim->nice) < 0)
+        ok = false;
+    if (lim->ioprio >= 0 &&
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, lim->ioprio) < 0)
+        ok = false;
+    if (cgroup) {
+        char text[16];
+        safe_snprintf(text, sizeof(text), "%d", pid);
+        ok = writefile(cgroup, "cgroup.procs", text) && ok;
+    }
+    return ok;
+}
+#else
+bool setcgroup(char** pathp, int num, const limits_t* lim) {
+    if (!lim->cpumax && !lim->memmax)
+        return true;
+    errno = ENOSYS;
+    return false;
+}
+
+void rmcgroup(const char* path) {
+}
+
+bool applylimits(pid_t pid, const limits_t* lim, const char* cgroup) {
+    if (lim->nice != NONICE && setpriority(PRIO_PROCESS, pid, lim->nice) < 0)
+        return false;
+    if (lim->ioprio >= 0) {
+        errno = ENOSYS;
+        return false;
+    }
+    return true;
+}
+#endif
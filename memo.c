@@ -0,0 +1,240 @@
+#include "shell.h"
+
+/* Results of commands run by 'memo' are kept in a cache directory, a file
+ * per command named by jenkins_hash of its key. Key is made of words of the
+ * command, working directory, environment variables asked for and identity
+ * of the file on standard input, which includes its mtime. File holds the
+ * whole key, exit code and standard output, so a hit is served from the
+ * mapped file without forking. Entries expire after their time to live or
+ * once the cache is cleared. */
+
+#define MEMO_MAGIC 0x6f6d656d /* "memo" */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t keylen; /* length of key that follows the header */
+    int32_t status;  /* exit code of command */
+    uint32_t unused;
+    int64_t stored;  /* when command was run, in seconds since epoch */
+    uint64_t outlen; /* length of output that follows the key */
+} memohdr_t;
+
+/* Identity of a regular file given as input, changes when it's modified. */
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+} fileid_t;
+
+/* Directory that holds the cache, it's created if it doesn't exist. */
+static bool memodir(char* buf, size_t size) {
+    const char* cache = getvar("XDG_CACHE_HOME");
+    const char* home = getvar("HOME");
+
+    if (cache) {
+        (void)mkdir(cache, 0700);
+        safe_snprintf(buf, size, "%s/shell-memo", cache);
+    } else if (home) {
+        safe_snprintf(buf, size, "%s/.cache", home);
+        (void)mkdir(buf, 0700);
+        safe_snprintf(buf, size, "%s/.cache/shell-memo", home);
+    } else {
+        errno = ENOENT;
+        return false;
+    }
+    if (mkdir(buf, 0700) == 0 || errno == EEXIST)
+        return true;
+
+    /* Commands still run, uncached, so it's said once only. */
+    static bool warned = false;
+    if (!warned)
+        msg("memo: %s: %s\n", buf, strerror(errno));
+    warned = true;
+    return false;
+}
+
+/* Returns false if standard input can't be told apart from other input,
+ * i.e. it's a pipe, then the command isn't memoized. */
+static bool mkkey(strbuf_t* key, char** argv, char** env) {
+    char cwd[PATH_MAX];
+
+    strappn(key, "", 0);
+    for (; *argv; argv++)
+        strappn(key, *argv, strlen(*argv) + 1);
+    if (getcwd(cwd, sizeof(cwd)))
+        strappn(key, cwd, strlen(cwd) + 1);
+    for (; *env; env++) {
+        const char* value = getvar(*env);
+        strappn(key, *env, strlen(*env));
+        if (value) {
+            strappn(key, "=", 1);
+            strappn(key, value, strlen(value));
+        }
+        strappn(key, "", 1);
+    }
+
+    struct stat sb;
+    if (fstat(STDIN_FILENO, &sb) < 0)
+        return true;
+    if (S_ISFIFO(sb.st_mode) || S_ISSOCK(sb.st_mode))
+        return false;
+    if (S_ISREG(sb.st_mode)) {
+        fileid_t id;
+        memset(&id, 0, sizeof(id)); /* padding is part of key as well */
+        id.dev = sb.st_dev;
+        id.ino = sb.st_ino;
+        id.size = sb.st_size;
+        id.mtime = sb.st_mtim;
+        strappn(key, (char*)&id, sizeof(id));
+    }
+    return true;
+}
+
+static bool writeall(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        data += n, len -= n;
+    }
+    return true;
+}
+
+/* Write out output of entry if it's there, has the same key and hasn't
+ * expired. Returns its exit code, or -1 if it must be run. */
+static int lookup(const char* path, const strbuf_t* key, long ttl) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    struct stat sb;
+    Fstat(fd, &sb);
+    size_t size = sb.st_size;
+    if (size < sizeof(memohdr_t)) {
+        Close(fd);
+        return -1;
+    }
+
+    char* base = Mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    Close(fd);
+
+    memohdr_t* hdr = (memohdr_t*)base;
+    int status = -1;
+    if (hdr->magic == MEMO_MAGIC && hdr->keylen == key->len &&
+        sizeof(memohdr_t) + hdr->keylen + hdr->outlen == size &&
+        time(NULL) - hdr->stored < ttl &&
+        !memcmp(base + sizeof(memohdr_t), key->str, key->len)) {
+        (void)writeall(STDOUT_FILENO, base + sizeof(memohdr_t) + key->len,
+                       hdr->outlen);
+        status = hdr->status;
+    }
+
+    Munmap(base, size);
+    return status;
+}
+
+/* Run command as a job with standard output going to fd, unless it's -1.
+ * Returns its exit code, job gets killed if ^C is hit meanwhile. */
+static int runjob(char** argv, int fd, bool* interrupted) {
+    sigset_t mask;
+    Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+    int j = spawnjob(argv, -1, fd, &mask);
+
+    *interrupted = false;
+    while (waitany(&j, 1, &mask, false) < 0) {
+        *interrupted = true;
+        sigint_received = 0;
+        (void)killjob(j);
+    }
+
+    int status;
+    (void)jobstate(j, &status);
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+
+    if (*interrupted)
+        return 128 + SIGINT;
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
+
+/* Run command, or take its result from cache if it's been run with the same
+ * key no more than ttl seconds ago. Variables named by env are part of the
+ * key. Returns the exit code. */
+int memorun(char** argv, char** env, long ttl) {
+    char dir[PATH_MAX], path[PATH_MAX], tmp[PATH_MAX];
+    strbuf_t key = {};
+    bool interrupted;
+
+    if (!mkkey(&key, argv, env) || !memodir(dir, sizeof(dir))) {
+        free(key.str);
+        return runjob(argv, -1, &interrupted);
+    }
+
+    uint32_t hash = jenkins_hash(key.str, key.len, HASHINIT);
+    safe_snprintf(path, sizeof(path), "%s/%u", dir, hash);
+    int status = lookup(path, &key, ttl);
+    if (status >= 0) {
+        free(key.str);
+        return status;
+    }
+
+    /* Output goes into a new entry, which replaces the old one. */
+    safe_snprintf(tmp, sizeof(tmp), "%s/.%u.XXXXXX", dir, hash);
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+        free(key.str);
+        return runjob(argv, -1, &interrupted);
+    }
+    (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    memohdr_t hdr = {.magic = MEMO_MAGIC, .keylen = key.len};
+    bool captured = writeall(fd, (char*)&hdr, sizeof(hdr)) &&
+                    writeall(fd, key.str, key.len);
+    off_t start = sizeof(hdr) + key.len;
+
+    status = runjob(argv, captured ? fd : -1, &interrupted);
+
+    struct stat sb;
+    Fstat(fd, &sb);
+    hdr.status = status;
+    hdr.stored = time(NULL);
+    hdr.outlen = sb.st_size - start;
+
+    /* Commands that were killed aren't remembered. */
+    if (captured && !interrupted && status < 128 &&
+        pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr))
+        Rename(tmp, path);
+    else
+        Unlink(tmp);
+
+    /* Output is shown once the command has finished. */
+    if (captured && hdr.outlen > 0) {
+        char* base = Mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        (void)writeall(STDOUT_FILENO, base + start, hdr.outlen);
+        Munmap(base, sb.st_size);
+    }
+    Close(fd);
+    free(key.str);
+    return status;
+}
+
+/* Remove all entries of the cache. */
+bool memoclear(void) {
+    char dir[PATH_MAX];
+    if (!memodir(dir, sizeof(dir)))
+        return false;
+
+    DIR* d = opendir(dir);
+    if (d == NULL)
+        return false;
+    struct dirent* ent;
+    while ((ent = readdir(d)) != NULL)
+        if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, ".."))
+            (void)unlinkat(dirfd(d), ent->d_name, 0);
+    closedir(d);
+    return true;
+}
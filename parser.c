@@ -0,0 +1,610 @@
+#include "shell.h"
+#include "queue.h"
+
+/* Command lines are compiled into a syntax tree that occupies a single block
+ * of memory together with copies of all words. Trees of recently executed
+ * lines are kept in a cache, so lines repeated in loops or recalled from
+ * history are neither tokenized nor parsed again. */
+
+#define CACHE_SIZE 64     /* number of remembered command lines */
+#define CACHE_BUCKETS 128 /* must be a power of two */
+
+typedef struct entry {
+    TAILQ_ENTRY(entry) lru; /* most recently used entries come first */
+    struct entry* next;     /* next entry in the same bucket */
+    uint32_t hash;          /* jenkins_hash of line */
+    char* line;             /* source text of compiled command line */
+    ast_t ast;
+} entry_t;
+
+static TAILQ_HEAD(entrylist, entry) lru = TAILQ_HEAD_INITIALIZER(lru);
+static entry_t* buckets[CACHE_BUCKETS];
+static int nentries = 0;
+
+/* Number of nodes of each kind needed to represent a command line. */
+typedef struct {
+    int npipe;     /* pipelines */
+    int ncmd;      /* simple commands */
+    int nword;     /* words of all commands */
+    int nredir;    /* redirections */
+    int npsub;     /* process substitutions */
+    int nexpand;   /* words subject to expansion */
+    int nheredoc;  /* here-documents */
+    int nsub;      /* lists of compound commands */
+    size_t nbytes; /* length of all words and file names with terminators */
+} counts_t;
+
+#define redir_p(t)                                                             \
+    ((t) == T_INPUT || (t) == T_OUTPUT || (t) == T_APPEND ||                   \
+     ((t) >= T_HEREDOC && (t) <= T_APPENDALL))
+#define redirstart_p(t) (redir_p(t) || (t) == T_IONUM)
+/* Which redirections take file name that may come from process substitution. */
+#define file_p(t) ((t) == T_INPUT || (t) == T_OUTPUT || (t) == T_APPEND)
+#define psub_p(t) ((t) == T_PSUBIN || (t) == T_PSUBOUT)
+#define word_p(t) (string_p(t) || psub_p(t) || (t) == T_EXPAND)
+#define compound_p(t) ((t) == T_LPAREN || (t) == T_GROUP || (t) == T_COMPOUND)
+/* Reserved words are put by the lexer as they are, thus they're strings. */
+#define reserved_p(t, word) (string_p(t) && !strcmp((t), (word)))
+
+/* Word 'time' is a keyword only if pipeline it prefixes follows. */
+static bool timed_p(token_t* tok) {
+    return string_p(tok[0]) && !strcmp(tok[0], "time") &&
+           (word_p(tok[1]) || redirstart_p(tok[1]) || compound_p(tok[1]) ||
+            tok[1] == T_BANG);
+}
+
+static const char* tokname(token_t t) {
+    static const char* name[] = {
+        [0] = "newline", [1] = "&&", [2] = "||", [3] = "|", [4] = "&",
+        [5] = ";",       [6] = ">",  [7] = "<",  [8] = ">>", [9] = "!",
+        [10] = "(",      [11] = ")", [12] = "<(", [13] = ">(",
+        [14] = "<<",     [15] = "<<<", [16] = "<&", [17] = ">&",
+        [18] = "&>",     [19] = "&>>", [22] = "{", [24] = "()",
+    };
+    return string_p(t) ? t : name[(intptr_t)t];
+}
+
+static bool syntax_error(token_t t) {
+    msg("syntax error near unexpected token '%s'\n", tokname(t));
+    return false;
+}
+
+static bool check(arena_t* arena, token_t* tok, counts_t* cnt);
+
+/* Substituted pipeline is compiled when it's started, but its syntax is
+ * verified together with the command line it's part of. Here-documents would
+ * have to be read along with the line, so they're not allowed there. */
+static token_t* checknested(arena_t* arena, const char* text, token_t close,
+                            const char* what, int* ntokensp) {
+    token_t* token = tokenize(arena, arena_strdup(arena, text), ntokensp);
+    counts_t cnt = {};
+
+    /* Lexer reports its own errors, empty pipeline is ours to report. */
+    if (*ntokensp == 0) {
+        if (strspn(text, " \t\n\v\f\r") == strlen(text))
+            (void)syntax_error(close);
+        return NULL;
+    }
+    if (!check(arena, token, &cnt))
+        return NULL;
+    if (cnt.nheredoc) {
+        msg("syntax error: here-document in %s\n", what);
+        return NULL;
+    }
+    return token;
+}
+
+static bool checkpsub(arena_t* arena, const char* text) {
+    int ntokens;
+    token_t* token =
+        checknested(arena, text, T_RPAREN, "process substitution", &ntokens);
+
+    if (token == NULL)
+        return false;
+    for (int i = 0; i < ntokens; i++) {
+        token_t t = token[i];
+        if (t == T_AND || t == T_OR || t == T_COLON || t == T_BGJOB) {
+            msg("syntax error: process substitution must be a pipeline\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Number of tokens of a compound command. Lexer always puts the text of
+ * a list after '(' or '{', other compound commands consist of reserved words
+ * with texts of lists between them, the last word closes the command. */
+static int compoundlen(token_t* tok) {
+    if (tok[0] != T_COMPOUND)
+        return 2;
+    int n = 3;
+    while (!reserved_p(tok[n], "fi") && !reserved_p(tok[n], "done") &&
+           !reserved_p(tok[n], "}"))
+        n += 2;
+    return n + 1;
+}
+
+/* Verify order of reserved words of a compound command and tell its kind. */
+static bool checkorder(token_t* tok, int len, kind_t* kindp) {
+    if (tok[0] != T_COMPOUND) {
+        *kindp = tok[0] == T_LPAREN ? K_SUBSHELL : K_GROUP;
+        return true;
+    }
+
+    token_t* word = tok + 1; /* reserved words are at even indices */
+    int nwords = len / 2;
+
+    if (reserved_p(word[0], "if")) {
+        *kindp = K_IF;
+        int k = 1;
+        while (true) {
+            if (!reserved_p(word[2 * k], "then"))
+                return syntax_error(word[2 * k]);
+            k++;
+            if (!reserved_p(word[2 * k], "elif"))
+                break;
+            k++;
+        }
+        if (reserved_p(word[2 * k], "else"))
+            k++;
+        if (k != nwords - 1 || !reserved_p(word[2 * k], "fi"))
+            return syntax_error(word[2 * k]);
+        return true;
+    }
+
+    *kindp = reserved_p(word[0], "while")   ? K_WHILE
+             : reserved_p(word[0], "until") ? K_UNTIL
+                                            : K_FOR;
+    if (!reserved_p(word[2], "do"))
+        return syntax_error(word[2]);
+    if (nwords != 3 || !reserved_p(word[4], "done"))
+        return syntax_error(word[4]);
+    return true;
+}
+
+/* Header of 'for' is a name, which may be followed by 'in' and words. */
+static bool checkfor(ast_t* ast) {
+    pipeline_t* pipe = &ast->pipe[0];
+    cmd_t* cmd = &pipe->cmd[0];
+
+    if (ast->npipe > 1 || pipe->ncmd > 1 || pipe->negate || pipe->timed ||
+        pipe->sep == T_BGJOB || cmd->kind != K_SIMPLE || cmd->nredir > 0) {
+        msg("syntax error: bad header of 'for'\n");
+        return false;
+    }
+    if (!varname_p(cmd->argv[0]) || (cmd->nexpand && cmd->expand[0] == 0)) {
+        msg("for: not a valid identifier: %s\n", cmd->argv[0]);
+        return false;
+    }
+    if (cmd->argc > 1 && strcmp(cmd->argv[1], "in"))
+        return syntax_error(cmd->argv[1]);
+    return true;
+}
+
+/* Lists of a compound command are compiled along with the command line,
+ * each into a tree of its own. Here-documents aren't allowed, as they would
+ * have to be read along with it. Returns NULL if a list is invalid. */
+static ast_t* compilepart(arena_t* arena, token_t* tok, int part,
+                          kind_t kind) {
+    token_t text = tok[tok[0] == T_COMPOUND ? 2 * part + 2 : 1];
+    token_t next = tok[0] == T_COMPOUND ? tok[2 * part + 3]
+                   : tok[0] == T_LPAREN ? T_RPAREN
+                                        : "}";
+
+    if (strspn(text, " \t\n\v\f\r") == strlen(text)) {
+        (void)syntax_error(next);
+        return NULL;
+    }
+
+    ast_t* ast = compile(arena, text);
+    if (ast == NULL)
+        return NULL;
+    if (ast->nheredoc) {
+        msg("syntax error: here-document in compound command\n");
+        return NULL;
+    }
+    if (kind == K_FOR && part == 0 && !checkfor(ast))
+        return NULL;
+    return ast;
+}
+
+static int nparts(token_t* tok, int len) {
+    return tok[0] == T_COMPOUND ? (len - 2) / 2 : 1;
+}
+
+/* Compound command is shown the way it was written. Returns size of its
+ * text, which is put at str unless it's NULL. */
+static size_t compoundtext(char* str, token_t* tok, int len) {
+    size_t n = 0;
+
+    for (int i = 0; i <= len; i++) {
+        const char* s = i == len ? (tok[0] == T_LPAREN  ? ")"
+                                    : tok[0] == T_GROUP ? "}"
+                                                        : "")
+                        : tok[i] == T_LPAREN   ? "("
+                        : tok[i] == T_GROUP    ? "{"
+                        : tok[i] == T_COMPOUND ? ""
+                                               : tok[i];
+        size_t slen = strlen(s);
+        if (str)
+            memcpy(str + n, s, slen);
+        n += slen;
+    }
+    if (str)
+        str[n] = '\0';
+    return n + 1;
+}
+
+/* Function is defined with a tree of its compound command, which is compiled
+ * from the text of the command. Returns NULL if it's invalid. */
+static ast_t* compilefunc(arena_t* arena, token_t* tok) {
+    int len = compoundlen(tok);
+    char* text = arena_alloc(arena, compoundtext(NULL, tok, len));
+    (void)compoundtext(text, tok, len);
+    return compile(arena, text);
+}
+
+/* First pass verifies the syntax of command line and counts its nodes:
+ *   list := pipeline { ('&&' | '||' | ';' | '&') pipeline } [';' | '&']
+ *   pipeline := ['time'] ['!'] command { '|' command }
+ *   command := { word | redirection }+
+ *            | compound { redirection }
+ *            | name '()' compound
+ *   compound := '(' list ')' | '{' list (';' | '&') '}'
+ *             | 'if' list 'then' list { 'elif' list 'then' list }
+ *               [ 'else' list ] 'fi'
+ *             | ('while' | 'until') list 'do' list 'done'
+ *             | 'for' name [ 'in' { word } ] (';' | newline) 'do' list 'done'
+
+ *   redirection := [digit] ('<' | '>' | '>>' | '<<' | '<<<' | '<&' | '>&') word
+ *                | ('&>' | '&>>') word
+ *   word := string | ('<(' | '>(') pipeline ')' */
+static bool check(arena_t* arena, token_t* tok, counts_t* cnt) {
+    int i = 0;
+
+    while (true) {
+        cnt->npipe++;
+        if (timed_p(&tok[i]))
+            i++;
+        if (tok[i] == T_BANG)
+            i++;
+
+        while (true) {
+            int nword = 0;
+            cnt->ncmd++;
+
+            /* Text of compound command becomes the only word of command, as
+             * it's shown in listing of jobs. Command that defines function
+             * has its name as the only word. */
+            bool func = string_p(tok[i]) && tok[i + 1] == T_FUNC;
+            bool compound = func || compound_p(tok[i]);
+            if (func) {
+                if (!compound_p(tok[i + 2]))
+                    return syntax_error(tok[i + 2] == T_EXPAND ? tok[i + 3]
+                                                               : tok[i + 2]);
+                if (compilefunc(arena, &tok[i + 2]) == NULL)
+                    return false;
+                cnt->nbytes += strlen(tok[i]) + 1;
+                cnt->nsub++;
+                nword++;
+                i += 2 + compoundlen(&tok[i + 2]);
+            } else if (compound) {
+                int len = compoundlen(&tok[i]);
+                kind_t kind;
+                if (!checkorder(&tok[i], len, &kind))
+                    return false;
+                for (int part = 0; part < nparts(&tok[i], len); part++)
+                    if (compilepart(arena, &tok[i], part, kind) == NULL)
+                        return false;
+                cnt->nbytes += compoundtext(NULL, &tok[i], len);
+                cnt->nsub += nparts(&tok[i], len);
+                nword++;
+                i += len;
+            }
+
+            while (word_p(tok[i]) || redirstart_p(tok[i])) {
+                bool redir = redirstart_p(tok[i]);
+                /* Function gets no redirections, they'd be those of its
+                 * definition. */
+                if ((compound && !redir) || (func && redir))
+                    return syntax_error(tok[i] == T_EXPAND ? tok[i + 1]
+                                                           : tok[i]);
+                if (redir) {
+                    /* Lexer puts redirection after descriptor number. */
+                    if (tok[i] == T_IONUM)
+                        i += 2;
+                    token_t mode = tok[i++];
+                    if (!word_p(tok[i]) || (psub_p(tok[i]) && !file_p(mode)))
+                        return syntax_error(tok[i]);
+                    if (mode == T_HEREDOC)
+                        cnt->nheredoc++;
+                    cnt->nredir++;
+                } else {
+                    nword++;
+                }
+                /* Lexer always puts text of pipeline after '<(' or '>('. */
+                if (psub_p(tok[i])) {
+                    if (!checkpsub(arena, tok[++i]))
+                        return false;
+                    cnt->npsub++;
+                }
+                /* Lexer puts text of word to expand after T_EXPAND. */
+                if (tok[i] == T_EXPAND) {
+                    i++;
+                    if (!redir)
+                        cnt->nexpand++;
+                }
+                cnt->nbytes += strlen(tok[i++]) + 1;
+            }
+
+            if (nword == 0)
+                return syntax_error(tok[i]);
+            cnt->nword += nword;
+
+            if (tok[i] != T_PIPE)
+                break;
+            i++;
+        }
+
+        token_t sep = tok[i];
+        if (sep == T_NULL)
+            return true;
+        if (sep != T_AND && sep != T_OR && sep != T_COLON && sep != T_BGJOB)
+            return syntax_error(sep);
+
+        /* Only '&&' and '||' require another pipeline to follow. */
+        if (tok[++i] == T_NULL) {
+            if (sep == T_AND || sep == T_OR)
+                return syntax_error(tok[i]);
+            return true;
+        }
+    }
+}
+
+static char* copystr(char** strp, const char* s) {
+    size_t len = strlen(s) + 1;
+    char* copy = memcpy(*strp, s, len);
+    *strp += len;
+    return copy;
+}
+
+/* Copy word to expand as plain one, i.e. without escapes of quoted ones. */
+static char* copylit(char** strp, const char* s) {
+    char* copy = *strp;
+    char* w = copy;
+
+    for (; *s; s++) {
+        if (*s == '\\' && s[1])
+            s++;
+        *w++ = *s;
+    }
+    *w++ = '\0';
+    *strp = w;
+    return copy;
+}
+
+/* Descriptor affected by redirection if none was given explicitly. */
+static int defaultfd(token_t mode) {
+    if (mode == T_INPUT || mode == T_HEREDOC || mode == T_HERESTR ||
+        mode == T_DUPIN)
+        return STDIN_FILENO;
+    return STDOUT_FILENO;
+}
+
+/* Trees of lists are compiled again, which finds them in the cache, and
+ * they stay there as long as the tree they're part of. */
+static ast_t* pin(ast_t* ast) {
+    assert(ast != NULL);
+    ast->busy++;
+    return ast;
+}
+
+/* Second pass copies tokens that passed the check into a single block. */
+static entry_t* build(arena_t* arena, token_t* tok, counts_t* cnt,
+                      const char* line) {
+    size_t linelen = strlen(line) + 1;
+    size_t size = sizeof(entry_t) + sizeof(pipeline_t) * cnt->npipe +
+                  sizeof(cmd_t) * cnt->ncmd + sizeof(redir_t) * cnt->nredir +
+                  sizeof(psub_t) * cnt->npsub + sizeof(ast_t*) * cnt->nsub +
+                  sizeof(char*) * cnt->nheredoc + sizeof(int) * cnt->nexpand +
+                  sizeof(char*) * (cnt->nword + cnt->ncmd) + cnt->nbytes +
+                  linelen;
+
+    entry_t* entry = malloc(size);
+    pipeline_t* pipe = (pipeline_t*)(entry + 1);
+    cmd_t* cmd = (cmd_t*)(pipe + cnt->npipe);
+    redir_t* redir = (redir_t*)(cmd + cnt->ncmd);
+    psub_t* psub = (psub_t*)(redir + cnt->nredir);
+    ast_t** sub = (ast_t**)(psub + cnt->npsub);
+    char** heredoc = (char**)(sub + cnt->nsub);
+    char** word = heredoc + cnt->nheredoc;
+    int* expand = (int*)(word + cnt->nword + cnt->ncmd);
+    char* str = (char*)(expand + cnt->nexpand);
+
+    entry->line = copystr(&str, line);
+    entry->ast.pipe = pipe;
+    entry->ast.npipe = cnt->npipe;
+    entry->ast.heredoc = heredoc;
+    entry->ast.nheredoc = cnt->nheredoc;
+    entry->ast.busy = 0;
+
+    int i = 0;
+    do {
+        pipe->cmd = cmd;
+        pipe->ncmd = 0;
+        pipe->timed = timed_p(&tok[i]);
+        if (pipe->timed)
+            i++;
+        pipe->negate = tok[i] == T_BANG;
+        if (pipe->negate)
+            i++;
+
+        while (true) {
+            cmd->argv = word;
+            cmd->argc = 0;
+            cmd->redir = redir;
+            cmd->nredir = 0;
+            cmd->psub = psub;
+            cmd->npsub = 0;
+            cmd->expand = expand;
+            cmd->nexpand = 0;
+            cmd->envp = NULL;
+            cmd->kind = K_SIMPLE;
+            cmd->sub = sub;
+            cmd->nsub = 0;
+
+            if (string_p(tok[i]) && tok[i + 1] == T_FUNC) {
+                cmd->kind = K_FUNCTION;
+                *word++ = copystr(&str, tok[i]);
+                cmd->argc++;
+                *sub++ = pin(compilefunc(arena, &tok[i + 2]));
+                cmd->nsub++;
+                i += 2 + compoundlen(&tok[i + 2]);
+            } else if (compound_p(tok[i])) {
+                int len = compoundlen(&tok[i]);
+                (void)checkorder(&tok[i], len, &cmd->kind);
+                for (int part = 0; part < nparts(&tok[i], len); part++) {
+                    ast_t* ast = compilepart(arena, &tok[i], part, cmd->kind);
+                    *sub++ = pin(ast);
+                    cmd->nsub++;
+                }
+                *word++ = str;
+                str += compoundtext(str, &tok[i], len);
+                cmd->argc++;
+                i += len;
+            }
+
+            while (word_p(tok[i]) || redirstart_p(tok[i])) {
+                int fd = -1;
+                if (tok[i] == T_IONUM) {
+                    fd = atoi(tok[i + 1]);
+                    i += 2;
+                }
+
+                token_t mode = redir_p(tok[i]) ? tok[i++] : NULL;
+                bool expandable = false;
+                char* text;
+
+                if (psub_p(tok[i])) {
+                    psub->output = tok[i++] == T_PSUBOUT;
+                    psub->word = mode ? -1 : cmd->argc;
+                    psub->redir = mode ? cmd->nredir : -1;
+                    psub->cmdline = text = copystr(&str, tok[i++]);
+                    psub++, cmd->npsub++;
+                } else if (tok[i] == T_EXPAND && mode == T_HEREDOC) {
+                    /* Delimiter of here-document is never expanded. */
+                    text = copylit(&str, tok[i + 1]);
+                    i += 2;
+                } else if (tok[i] == T_EXPAND) {
+                    if (!mode) {
+                        *expand++ = cmd->argc;
+                        cmd->nexpand++;
+                    }
+                    expandable = true;
+                    text = copystr(&str, tok[i + 1]);
+                    i += 2;
+                } else {
+                    text = copystr(&str, tok[i++]);
+                }
+
+                if (mode) {
+                    redir->mode = mode;
+                    redir->fd = fd >= 0 ? fd : defaultfd(mode);
+                    redir->heredoc = -1;
+                    redir->expand = expandable;
+                    if (mode == T_HEREDOC) {
+                        redir->heredoc = heredoc - entry->ast.heredoc;
+                        *heredoc++ = text;
+                    }
+                    redir->path = text;
+                    redir++, cmd->nredir++;
+                } else {
+                    *word++ = text;
+                    cmd->argc++;
+                }
+            }
+            *word++ = NULL;
+            cmd++, pipe->ncmd++;
+
+            if (tok[i] != T_PIPE)
+                break;
+            i++;
+        }
+
+        pipe->sep = tok[i];
+        if (tok[i] != T_NULL)
+            i++;
+        pipe++;
+    } while (tok[i] != T_NULL);
+
+    return entry;
+}
+
+/* Remove least recently used entry that isn't being evaluated. */
+static void evict(void) {
+    entry_t* entry = TAILQ_LAST(&lru, entrylist);
+
+    while (entry && entry->ast.busy)
+        entry = TAILQ_PREV(entry, entrylist, lru);
+    if (entry == NULL)
+        return;
+
+    entry_t** ep = &buckets[entry->hash & (CACHE_BUCKETS - 1)];
+
+    while (*ep != entry)
+        ep = &(*ep)->next;
+    *ep = entry->next;
+
+    TAILQ_REMOVE(&lru, entry, lru);
+    nentries--;
+
+    /* Trees of its lists may go as well from now on. */
+    for (int p = 0; p < entry->ast.npipe; p++)
+        for (int c = 0; c < entry->ast.pipe[p].ncmd; c++)
+            for (int s = 0; s < entry->ast.pipe[p].cmd[c].nsub; s++)
+                entry->ast.pipe[p].cmd[c].sub[s]->busy--;
+    free(entry);
+}
+
+/* Returns syntax tree of a command line or NULL if it's empty or invalid.
+ * The tree belongs to the cache and stays valid until next call, unless it's
+ * marked busy. Arena is used to hold working data only if the line has to be
+ * parsed. */
+ast_t* compile(arena_t* arena, const char* line) {
+    size_t len = strlen(line);
+    uint32_t hash = jenkins_hash(line, len, HASHINIT);
+    entry_t** bucket = &buckets[hash & (CACHE_BUCKETS - 1)];
+    entry_t* entry;
+
+    for (entry = *bucket; entry; entry = entry->next) {
+        if (entry->hash == hash && !strcmp(entry->line, line)) {
+            TAILQ_REMOVE(&lru, entry, lru);
+            TAILQ_INSERT_HEAD(&lru, entry, lru);
+            return &entry->ast;
+        }
+    }
+
+    int ntokens;
+    uint64_t start = stamp();
+    token_t* token = tokenize(arena, arena_strndup(arena, line, len), &ntokens);
+    counts_t cnt = {};
+    record(PH_TOKENIZE, start);
+
+    if (ntokens == 0)
+        return NULL;
+    if (!check(arena, token, &cnt)) {
+        last_exitcode = EXIT_SYNTAX;
+        return NULL;
+    }
+
+    entry = build(arena, token, &cnt, line);
+    entry->hash = hash;
+    entry->next = *bucket;
+    *bucket = entry;
+    TAILQ_INSERT_HEAD(&lru, entry, lru);
+
+    if (++nentries > CACHE_SIZE)
+        evict();
+
+    return &entry->ast;
+}
@@ -0,0 +1,625 @@
+#include "shell.h"
+#include "hashtab.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+
+/* Remembers absolute paths of commands found by walking PATH, so that a child
+ * process does a single execve instead of trying every directory in turn.
+ * Directories of PATH are opened once it changes and probed relative to their
+ * descriptors. Names that weren't found anywhere are remembered for a short
+ * while, so that retrying a typo or probing for a missing helper doesn't
+ * hit every directory again. */
+
+#define NBUCKETS 64 /* must be a power of two */
+#define MISS_TTL 1  /* seconds a missing command is remembered for */
+
+typedef struct cmdpath {
+    struct cmdpath* next;    /* next entry in the same bucket */
+    uint32_t hash;           /* jenkins_hash of name */
+    int hits;                /* how many times the entry was used */
+    int dir;                 /* index into PATH directories table */
+    char* name;              /* command name as given by the user */
+    char* path;              /* absolute path of executable, NULL if missing */
+    struct timespec expires; /* when missing command should be looked up */
+} cmdpath_t;
+
+static cmdpath_t* buckets[NBUCKETS];
+static char* hashed_path = NULL; /* value of PATH the table was built for */
+
+/* Directories of PATH in order, with empty entries standing for current
+ * working directory. Those that can't be opened have descriptor -1. Relative
+ * ones refer to other directories after 'cd', so they're never opened and
+ * their commands are looked up by path each time. */
+typedef struct {
+    char* name;
+    int fd;
+    bool relative;
+} pathdir_t;
+
+static pathdir_t* pathdirs = NULL;
+static int npathdirs = 0;
+static bool dirs_open = false;
+static bool relative_dirs = false; /* some directories of PATH are relative */
+
+#ifdef LINUX
+#define DIR_FLAGS (O_PATH | O_DIRECTORY | O_CLOEXEC)
+#else
+#define DIR_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#endif
+
+static uint32_t hashname(const char* name) {
+    return jenkins_hash(name, strlen(name), HASHINIT);
+}
+
+static void closedirs(void) {
+    for (int i = 0; i < npathdirs; i++) {
+        if (pathdirs[i].fd >= 0)
+            Close(pathdirs[i].fd);
+        free(pathdirs[i].name);
+    }
+    free(pathdirs);
+    pathdirs = NULL;
+    npathdirs = 0;
+    dirs_open = false;
+    relative_dirs = false;
+}
+
+static void opendirs(const char* path) {
+    dirs_open = true;
+    if (path == NULL)
+        return;
+
+    int n = 1;
+    for (const char* p = path; *p; p++)
+        n += *p == ':';
+    pathdirs = malloc(sizeof(pathdir_t) * n);
+
+    do {
+        size_t len = strcspn(path, ":");
+        /* Empty entry in PATH stands for current working directory. */
+        char* name = len ? strndup(path, len) : strdup(".");
+        bool relative = name[0] != '/';
+        pathdirs[npathdirs++] = (pathdir_t){
+            .name = name,
+            .fd = relative ? -1 : open(name, DIR_FLAGS),
+            .relative = relative,
+        };
+        relative_dirs |= relative;
+        path += len;
+    } while (*path++);
+}
+
+/* Directories of PATH are read by a thread of its own, which runs at idle
+ * priority with all signals blocked, so neither the prompt nor signal
+ * handlers ever wait for it. The shell asks for an index whenever it shows
+ * a prompt, the thread reads directories again if PATH or any of them has
+ * changed since. Index is handed over by swapping a pointer, no lock is
+ * taken, and belongs to the shell once it's been taken. It tells which
+ * directory each command is in and provides names for completion. */
+
+typedef struct cmdent {
+    const char* name;
+    int dir; /* first directory of PATH that has the command */
+} cmdent_t;
+
+static void cmdenthash(const cmdent_t* ent, uint32_t h[2]) {
+    HT_HASH(ent->name, strlen(ent->name), h);
+}
+
+static int cmdentcmp(const cmdent_t* a, const cmdent_t* b) {
+    return strcmp(a->name, b->name);
+}
+
+HT_HEAD(cmdtab, cmdent);
+HT_GENERATE_STATIC(cmdtab, cmdent, cmdenthash, cmdentcmp)
+
+typedef struct {
+    char* path;              /* value of PATH it was built for */
+    int ndirs;
+    struct timespec* mtimes; /* of directories just before they were read */
+    dirlist_t* dirs;         /* their listings, which hold names of entries */
+    dirlist_t list;          /* builtins and commands, for completion */
+    cmdent_t* ents;
+    struct cmdtab tab;       /* entries by name */
+} cmdindex_t;
+
+static cmdindex_t* published = NULL; /* latest index nobody has taken yet */
+static cmdindex_t* current = NULL;   /* index taken by the shell */
+static char* requested = NULL;       /* PATH the shell asks an index for */
+static uint32_t dropped = 0;         /* times the shell dropped its index */
+static sem_t wakeup;
+static pid_t indexer_pid = 0; /* process that started the thread */
+
+/* State of the thread, which only it touches. */
+static struct {
+    cmdindex_t* last;     /* copy of what was published last */
+    cmdindex_t* building; /* index being built */
+    strbuf_t names;       /* names of its list */
+    char* buf;            /* for reading directories */
+} worker;
+
+static void freeindex(cmdindex_t* ix) {
+    if (ix == NULL)
+        return;
+    for (int i = 0; i < ix->ndirs; i++)
+        freedirlist(&ix->dirs[i]);
+    freedirlist(&ix->list);
+    HT_FREE(cmdtab, &ix->tab);
+    free(ix->dirs);
+    free(ix->mtimes);
+    free(ix->ents);
+    free(ix->path);
+    free(ix);
+}
+
+static struct timespec dirmtime(const char* dir) {
+    struct stat sb;
+    return stat(dir, &sb) == 0 ? sb.st_mtim : (struct timespec){};
+}
+
+static bool samestamp(struct timespec a, struct timespec b) {
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+/* Read directories of PATH, in the order findcmd walks them. Relative ones
+ * would refer to other directories after 'cd', so they're left to findcmd
+ * and completion then, as is the case of no index. */
+static cmdindex_t* buildindex(char* path) {
+    int n = 1;
+    for (const char* p = path; *p; p++)
+        n += *p == ':';
+
+    cmdindex_t* ix = worker.building = calloc(1, sizeof(cmdindex_t));
+    ix->path = path;
+    ix->mtimes = malloc(sizeof(struct timespec) * n);
+    ix->dirs = calloc(n, sizeof(dirlist_t));
+    HT_INIT(&ix->tab);
+
+    strbuf_t* names = &worker.names;
+    *names = (strbuf_t){};
+    for (int i = 0; builtinname(i); i++)
+        addentry(&ix->list, names, builtinname(i), DT_UNKNOWN);
+
+    int nents = 0;
+    for (const char* p = path; ix->ndirs < n; p++) {
+        size_t len = strcspn(p, ":");
+        if (p[0] != '/') {
+            free(names->str);
+            freeindex(ix);
+            worker.names = (strbuf_t){};
+            worker.building = NULL;
+            return NULL;
+        }
+        char* dir = strndup(p, len);
+        int i = ix->ndirs++;
+        ix->mtimes[i] = dirmtime(dir);
+        (void)readdirbuf(AT_FDCWD, dir, &ix->dirs[i], worker.buf);
+        nents += ix->dirs[i].nent;
+        free(dir);
+        p += len;
+    }
+
+    /* Entries are allocated at once, as the table points at them. */
+    ix->ents = malloc(sizeof(cmdent_t) * max(nents, 1));
+    nents = 0;
+    for (int i = 0; i < ix->ndirs; i++) {
+        dirlist_t* dl = &ix->dirs[i];
+        for (int e = 0; e < dl->nent; e++) {
+            int type = dl->ent[e].type;
+            if (type != DT_REG && type != DT_LNK && type != DT_UNKNOWN)
+                continue;
+            addentry(&ix->list, names, dl->ent[e].name, type);
+            cmdent_t* ent = &ix->ents[nents];
+            *ent = (cmdent_t){dl->ent[e].name, i};
+            if (HT_INSERT(cmdtab, &ix->tab, ent) == NULL)
+                nents++;
+        }
+    }
+    finishlist(&ix->list, names);
+    worker.names = (strbuf_t){};
+    return ix;
+}
+
+/* Index that was published last is still good unless PATH or one of its
+ * directories has changed, or the shell dropped it meanwhile. */
+static bool uptodate(cmdindex_t* last, const char* path, uint32_t seen) {
+    if (last == NULL || strcmp(last->path, path) ||
+        seen != __atomic_load_n(&dropped, __ATOMIC_ACQUIRE))
+        return false;
+
+    const char* p = path;
+    for (int i = 0; i < last->ndirs; i++, p++) {
+        size_t len = strcspn(p, ":");
+        char* dir = strndup(p, len);
+        bool same = samestamp(dirmtime(dir), last->mtimes[i]);
+        free(dir);
+        if (!same)
+            return false;
+        p += len;
+    }
+    return true;
+}
+
+static void* indexer(void* arg) {
+#ifdef LINUX
+    struct sched_param param = {};
+    (void)pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+    uint32_t seen = 0;
+    worker.buf = malloc(DENTS_BUF);
+
+    while (true) {
+        while (sem_wait(&wakeup) < 0)
+            continue;
+        char* path = __atomic_exchange_n(&requested, NULL, __ATOMIC_ACQ_REL);
+        if (path == NULL)
+            continue;
+        if (uptodate(worker.last, path, seen)) {
+            free(path);
+            continue;
+        }
+
+        seen = __atomic_load_n(&dropped, __ATOMIC_ACQUIRE);
+        cmdindex_t* ix = buildindex(path);
+        if (ix == NULL)
+            continue;
+
+        /* Shell frees the published one, so a copy is kept. */
+        cmdindex_t* last = worker.last;
+        if (last) {
+            free(last->path);
+            free(last->mtimes);
+        } else {
+            last = worker.last = calloc(1, sizeof(cmdindex_t));
+        }
+        last->path = strdup(ix->path);
+        last->ndirs = ix->ndirs;
+        last->mtimes = malloc(sizeof(struct timespec) * ix->ndirs);
+        memcpy(last->mtimes, ix->mtimes, sizeof(struct timespec) * ix->ndirs);
+
+        freeindex(__atomic_exchange_n(&published, ix, __ATOMIC_ACQ_REL));
+        worker.building = NULL;
+    }
+    return NULL;
+}
+
+/* Called whenever a prompt is shown. Thread is started with the first one,
+ * as non-interactive shells don't need it. */
+void refreshindex(void) {
+    const char* path = getvar("PATH");
+
+    if (!indexer_pid) {
+        indexer_pid = getpid();
+        sigset_t all, mask;
+        pthread_t thread;
+        sigfillset(&all);
+        if (sem_init(&wakeup, 0, 0) < 0)
+            return;
+        pthread_sigmask(SIG_SETMASK, &all, &mask);
+        int error = pthread_create(&thread, NULL, indexer, NULL);
+        pthread_sigmask(SIG_SETMASK, &mask, NULL);
+        if (error)
+            return;
+        pthread_detach(thread);
+    }
+
+    if (path == NULL)
+        return;
+    free(__atomic_exchange_n(&requested, strdup(path), __ATOMIC_ACQ_REL));
+    sem_post(&wakeup);
+}
+
+#ifdef __SANITIZE_ADDRESS__
+/* Forked copies of the shell don't have the thread, which LeakSanitizer
+ * would stop to check for leaks when they exit, and warn that it can't. */
+int __lsan_is_turned_off(void) {
+    return indexer_pid && getpid() != indexer_pid;
+}
+#endif
+
+static bool samepath(const char* a, const char* b) {
+    return a && b ? !strcmp(a, b) : a == b;
+}
+
+/* Take index the thread has published since, if it's for current PATH.
+ * Returns the index in use, or NULL. */
+static cmdindex_t* takeindex(void) {
+    cmdindex_t* ix = __atomic_exchange_n(&published, NULL, __ATOMIC_ACQUIRE);
+    if (ix && samepath(ix->path, hashed_path)) {
+        freeindex(current);
+        current = ix;
+    } else {
+        freeindex(ix);
+    }
+    return current && samepath(current->path, hashed_path) ? current : NULL;
+}
+
+/* Directory of PATH the indexer found command in, or -1. */
+static int indexeddir(const char* name) {
+    cmdindex_t* ix = takeindex();
+    if (ix == NULL)
+        return -1;
+    cmdent_t key = {name};
+    cmdent_t* ent = HT_FIND(cmdtab, &ix->tab, &key);
+    return ent && ent->dir < npathdirs ? ent->dir : -1;
+}
+
+/* Drop all remembered commands. */
+static void forgetall(void) {
+    for (int i = 0; i < NBUCKETS; i++) {
+        cmdpath_t* cp = buckets[i];
+        while (cp) {
+            cmdpath_t* next = cp->next;
+            free(cp->name);
+            free(cp->path);
+            free(cp);
+            cp = next;
+        }
+        buckets[i] = NULL;
+    }
+}
+
+/* Drop all remembered commands and reopen directories of PATH, which might
+ * have been replaced since. */
+void flushcmds(void) {
+    forgetall();
+    freeindex(current);
+    current = NULL;
+    __atomic_add_fetch(&dropped, 1, __ATOMIC_RELEASE);
+    closedirs();
+    free(hashed_path);
+    hashed_path = NULL;
+}
+
+/* Entries become stale as soon as someone modifies PATH. */
+static void checkpath(void) {
+    const char* path = getvar("PATH");
+
+    if (dirs_open && (hashed_path && path ? !strcmp(hashed_path, path)
+                                          : hashed_path == path))
+        return;
+
+    flushcmds();
+    hashed_path = path ? strdup(path) : NULL;
+    opendirs(hashed_path);
+}
+
+static char* joinpath(const char* dir, const char* name) {
+    size_t dirlen = strlen(dir), namelen = strlen(name);
+    char* path = malloc(dirlen + namelen + 2);
+    memcpy(path, dir, dirlen);
+    path[dirlen] = '/';
+    memcpy(path + dirlen + 1, name, namelen + 1);
+    return path;
+}
+
+static bool executable_p(int dirfd, const char* name) {
+    struct stat sb;
+    return fstatat(dirfd, name, &sb, 0) == 0 && S_ISREG(sb.st_mode) &&
+           faccessat(dirfd, name, X_OK, 0) == 0;
+}
+
+/* Tells if directory i of PATH holds executable called name. */
+static bool indir_p(int i, const char* name) {
+    if (!pathdirs[i].relative)
+        return pathdirs[i].fd >= 0 && executable_p(pathdirs[i].fd, name);
+
+    char* path = joinpath(pathdirs[i].name, name);
+    bool found = executable_p(AT_FDCWD, path);
+    free(path);
+    return found;
+}
+
+/* Walk PATH looking for an executable regular file called name. Returns
+ * index of directory it's in or -1. Directory that the indexer found it in
+ * is tried first, since it's where the command most likely is. Thus it may
+ * win over one before it that has gained the command since the last prompt,
+ * as remembered commands do. */
+static int findcmd(const char* name) {
+    int dir = indexeddir(name);
+    if (dir >= 0 && indir_p(dir, name))
+        return dir;
+
+    for (int i = 0; i < npathdirs; i++)
+        if (indir_p(i, name))
+            return i;
+
+    return -1;
+}
+
+static bool expired(struct timespec* when) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > when->tv_sec ||
+           (now.tv_sec == when->tv_sec && now.tv_nsec >= when->tv_nsec);
+}
+
+static cmdpath_t** findentry(const char* name, uint32_t hash) {
+    cmdpath_t** cpp = &buckets[hash & (NBUCKETS - 1)];
+    for (; *cpp; cpp = &(*cpp)->next)
+        if ((*cpp)->hash == hash && !strcmp((*cpp)->name, name))
+            break;
+    return cpp;
+}
+
+/* Returns path of a command or NULL if it cannot be found in PATH. Resolved
+ * paths are remembered until PATH changes or they get forgotten, except for
+ * those in relative directories of PATH, as is the case of missing commands
+ * if PATH has any, for they may be found after 'cd'. */
+const char* lookupcmd(const char* name) {
+    assert(!index(name, '/'));
+
+    checkpath();
+
+    uint32_t hash = hashname(name);
+    cmdpath_t** cpp = findentry(name, hash);
+    cmdpath_t* cp = *cpp;
+
+    if (cp && cp->path == NULL && !expired(&cp->expires))
+        return NULL;
+
+    if (cp && cp->path && pathdirs[cp->dir].relative) {
+        free(cp->path);
+        cp->path = NULL;
+    }
+
+    if (cp == NULL) {
+        cp = malloc(sizeof(cmdpath_t));
+        cp->next = NULL;
+        cp->hash = hash;
+        cp->hits = 0;
+        cp->name = strdup(name);
+        cp->path = NULL;
+        *cpp = cp;
+    }
+
+    if (cp->path == NULL) {
+        cp->dir = findcmd(name);
+        if (cp->dir < 0) {
+            clock_gettime(CLOCK_MONOTONIC, &cp->expires);
+            if (!relative_dirs)
+                cp->expires.tv_sec += MISS_TTL;
+            return NULL;
+        }
+        cp->path = joinpath(pathdirs[cp->dir].name, name);
+    }
+
+    cp->hits++;
+    return cp->path;
+}
+
+/* Returns descriptor of directory holding a command that was found by
+ * lookupcmd, or -1 if it's not remembered. */
+int cmddirfd(const char* name) {
+    cmdpath_t* cp = *findentry(name, hashname(name));
+    return cp && cp->path ? pathdirs[cp->dir].fd : -1;
+}
+
+/* Forget where the command lives, i.e. when its executable went missing.
+ * Commands known to be missing stay so until their entry expires. */
+void forgetcmd(const char* name) {
+    cmdpath_t** cpp = findentry(name, hashname(name));
+    cmdpath_t* cp = *cpp;
+
+    if (cp == NULL || cp->path == NULL)
+        return;
+
+    *cpp = cp->next;
+    free(cp->name);
+    free(cp->path);
+    free(cp);
+}
+
+/* Names of builtins and of all files in PATH directories, that completion
+ * looks up by prefix. It's gathered again if PATH or any of the directories
+ * changes, which is found out from their modification times. */
+static dirlist_t cmdindex;
+static struct timespec* cmdstamp = NULL; /* mtimes of PATH directories */
+static int ncmdstamp = 0;
+static int cmdstamp_size = 0;
+static char* indexed_path = NULL; /* value of PATH the index was built for */
+
+/* Calls fn for every directory in PATH, the way findcmd walks it. */
+static void eachdir(void (*fn)(const char* dir, int i)) {
+    for (int i = 0; i < npathdirs; i++)
+        fn(pathdirs[i].name, i);
+}
+
+static bool stale;
+
+static void checkstamp(const char* dir, int i) {
+    struct stat sb;
+    struct timespec mtime = {};
+
+    if (stat(dir, &sb) == 0)
+        mtime = sb.st_mtim;
+
+    if (i == cmdstamp_size) {
+        cmdstamp_size = cmdstamp_size ? cmdstamp_size * 2 : 16;
+        cmdstamp = realloc(cmdstamp, sizeof(struct timespec) * cmdstamp_size);
+    }
+    if (i >= ncmdstamp || cmdstamp[i].tv_sec != mtime.tv_sec ||
+        cmdstamp[i].tv_nsec != mtime.tv_nsec)
+        stale = true;
+    cmdstamp[i] = mtime;
+    ncmdstamp = i + 1;
+}
+
+static strbuf_t cmdnames;
+
+static void addcmds(const char* dir, int i) {
+    dirlist_t* dl = cachedir(dir);
+    if (dl == NULL)
+        return;
+
+    for (int e = 0; e < dl->nent; e++) {
+        int type = dl->ent[e].type;
+        if (type == DT_REG || type == DT_LNK || type == DT_UNKNOWN)
+            addentry(&cmdindex, &cmdnames, dl->ent[e].name, type);
+    }
+}
+
+/* Returns index of command names, valid until next call. */
+dirlist_t* commandlist(void) {
+    checkpath();
+
+    /* Names the indexer has gathered are as good as if they were gathered
+     * here, if directories haven't changed since. */
+    cmdindex_t* ix = takeindex();
+    if (ix && ix->list.ent) {
+        freedirlist(&cmdindex);
+        cmdindex = ix->list;
+        ix->list = (dirlist_t){};
+        if (cmdstamp_size < ix->ndirs) {
+            cmdstamp_size = ix->ndirs;
+            cmdstamp = realloc(cmdstamp, sizeof(struct timespec) * cmdstamp_size);
+        }
+        memcpy(cmdstamp, ix->mtimes, sizeof(struct timespec) * ix->ndirs);
+        ncmdstamp = ix->ndirs;
+        free(indexed_path);
+        indexed_path = strdup(ix->path);
+    }
+
+    int nstamp = ncmdstamp;
+    stale = false;
+    ncmdstamp = 0;
+    eachdir(checkstamp);
+
+    bool samepath = indexed_path && hashed_path
+                        ? !strcmp(indexed_path, hashed_path)
+                        : indexed_path == hashed_path;
+    if (!stale && nstamp == ncmdstamp && samepath && cmdindex.ent)
+        return &cmdindex;
+
+    freedirlist(&cmdindex);
+    cmdnames = (strbuf_t){};
+    for (int i = 0; builtinname(i); i++)
+        addentry(&cmdindex, &cmdnames, builtinname(i), DT_UNKNOWN);
+    eachdir(addcmds);
+    finishlist(&cmdindex, &cmdnames);
+
+    free(indexed_path);
+    indexed_path = hashed_path ? strdup(hashed_path) : NULL;
+    return &cmdindex;
+}
+
+/* Print all remembered commands in the same format as bash does. */
+void listcmds(void) {
+    bool empty = true;
+
+    for (int i = 0; i < NBUCKETS; i++) {
+        for (cmdpath_t* cp = buckets[i]; cp; cp = cp->next) {
+            if (cp->path == NULL)
+                continue;
+            if (empty)
+                safe_dprintf(STDOUT_FILENO, "hits\tcommand\n");
+            safe_dprintf(STDOUT_FILENO, "%4d\t%s\n", cp->hits, cp->path);
+            empty = false;
+        }
+    }
+
+    if (empty)
+        msg("hash: hash table empty\n");
+}
@@ -0,0 +1,210 @@
+#include "shell.h"
+
+/* Placement of jobs on CPUs and NUMA nodes, set with the 'affinity' builtin.
+ * It's applied by each child between fork and exec, thus placed commands
+ * don't need a wrapper like taskset, which would cost them another exec.
+ * When stages of pipelines are spread, CPUs are handed out in the order of
+ * caches they share, so adjacent stages, which talk over a pipe, run close
+ * to each other. Linux only. */
+
+placement_t placement;
+
+/* Parse list like '0-3,8,10-11' into a set of n bits. */
+bool parseset(const char* s, uint64_t* set, int n) {
+    memset(set, 0, sizeof(uint64_t) * ((n + 63) / 64));
+
+    do {
+        char* end;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s || !isdigit((uint8_t)*s))
+            return false;
+        if (*end == '-') {
+            s = end + 1;
+            hi = strtol(s, &end, 10);
+            if (end == s || !isdigit((uint8_t)*s))
+                return false;
+        }
+        if (lo > hi || hi >= n)
+            return false;
+        for (long i = lo; i <= hi; i++)
+            set[i / 64] |= 1ULL << (i % 64);
+        s = end;
+    } while (*s++ == ',');
+
+    return s[-1] == '\0';
+}
+
+#define inset_p(set, i) (((set)[(i) / 64] >> ((i) % 64)) & 1)
+
+/* Print set of n bits in the form parseset accepts. */
+void printset(int fd, const uint64_t* set, int n) {
+    const char* sep = "";
+    for (int i = 0; i < n; i++) {
+        if (!inset_p(set, i))
+            continue;
+        int j = i;
+        while (j + 1 < n && inset_p(set, j + 1))
+            j++;
+        if (j > i)
+            safe_dprintf(fd, "%s%d-%d", sep, i, j);
+        else
+            safe_dprintf(fd, "%s%d", sep, i);
+        sep = ",";
+        i = j;
+    }
+}
+
+bool placed_p(void) {
+    return placement.ncpus > 0 || placement.nodes || placement.local ||
+           placement.spread;
+}
+
+#ifdef LINUX
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+/* Returns number read from a file in sysfs or -1. */
+static long sysfsnum(const char* fmt, int cpu, int index) {
+    char path[128], buf[32];
+    safe_snprintf(path, sizeof(path), fmt, cpu, index);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    return strtol(buf, NULL, 10);
+}
+
+/* Identifier of cache at given level that CPU uses, or -1. */
+static long cacheid(int cpu, int level) {
+    static const char dir[] = "/sys/devices/system/cpu/cpu%d/cache/index%d/";
+    char fmt[sizeof(dir) + 8];
+
+    for (int index = 0; index < 8; index++) {
+        safe_snprintf(fmt, sizeof(fmt), "%slevel", dir);
+        long l = sysfsnum(fmt, cpu, index);
+        if (l < 0)
+            break;
+        if (l == level) {
+            safe_snprintf(fmt, sizeof(fmt), "%sid", dir);
+            return sysfsnum(fmt, cpu, index);
+        }
+    }
+    return -1;
+}
+
+typedef struct {
+    long key[3]; /* package, last level cache and L2 cache */
+    int cpu;
+} cpukey_t;
+
+static int compare(const void* a, const void* b) {
+    const cpukey_t* x = a;
+    const cpukey_t* y = b;
+    for (int i = 0; i < 3; i++)
+        if (x->key[i] != y->key[i])
+            return x->key[i] < y->key[i] ? -1 : 1;
+    return x->cpu - y->cpu;
+}
+
+/* CPUs of placement sorted by caches they share. */
+static int order[MAXCPUS];
+static int norder;
+
+static void sortcpus(void) {
+    uint64_t allowed[MAXCPUS / 64];
+    uint64_t* set = placement.cpus;
+    int n = placement.ncpus;
+
+    if (n == 0)
+        n = allowedcpus(set = allowed);
+
+    cpukey_t* keys = malloc(sizeof(cpukey_t) * n);
+    norder = 0;
+    for (int cpu = 0; cpu < MAXCPUS && norder < n; cpu++) {
+        if (!inset_p(set, cpu))
+            continue;
+        cpukey_t* k = &keys[norder++];
+        k->key[0] = sysfsnum("/sys/devices/system/cpu/cpu%d/topology/"
+                             "physical_package_id", cpu, 0);
+        k->key[1] = cacheid(cpu, 3);
+        k->key[2] = cacheid(cpu, 2);
+        k->cpu = cpu;
+    }
+    qsort(keys, norder, sizeof(cpukey_t), compare);
+    for (int i = 0; i < norder; i++)
+        order[i] = keys[i].cpu;
+    free(keys);
+}
+
+/* CPUs the shell itself may run on. */
+int allowedcpus(uint64_t* set) {
+    cpu_set_t cs;
+    int n = 0;
+
+    memset(set, 0, sizeof(uint64_t) * MAXCPUS / 64);
+    if (sched_getaffinity(0, sizeof(cs), &cs) < 0)
+        return 0;
+    for (int i = 0; i < MAXCPUS; i++) {
+        if (CPU_ISSET(i, &cs)) {
+            set[i / 64] |= 1ULL << (i % 64);
+            n++;
+        }
+    }
+    return n;
+}
+
+/* Make given placement that of jobs started from now on. Stages are spread
+ * over CPUs of the shell unless a set of CPUs is given. */
+void setplacement(const placement_t* pl) {
+    placement = *pl;
+    if (placement.spread)
+        sortcpus();
+}
+
+/* Called by a child that's going to be stage of n stages of a pipeline.
+ * Failures are ignored, as the command runs fine anywhere. */
+void applyplacement(int stage, int n) {
+    cpu_set_t cs;
+    CPU_ZERO(&cs);
+
+    if (placement.spread && norder > 0) {
+        /* Each stage gets a chunk of CPUs in order, or shares one with
+         * its neighbours if there are more stages than CPUs. */
+        int first = stage * norder / n;
+        int last = max((stage + 1) * norder / n, first + 1);
+        for (int i = first; i < last; i++)
+            CPU_SET(order[i], &cs);
+        (void)sched_setaffinity(0, sizeof(cs), &cs);
+    } else if (placement.ncpus > 0) {
+        for (int i = 0; i < MAXCPUS; i++)
+            if (inset_p(placement.cpus, i))
+                CPU_SET(i, &cs);
+        (void)sched_setaffinity(0, sizeof(cs), &cs);
+    }
+
+    /* Memory comes from nodes given or from the one the process runs on. */
+    if (placement.local)
+        (void)syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0);
+    else if (placement.nodes)
+        (void)syscall(SYS_set_mempolicy, MPOL_BIND, &placement.nodes,
+                      MAXNODES + 1);
+}
+#else
+int allowedcpus(uint64_t* set) {
+    memset(set, 0, sizeof(uint64_t) * MAXCPUS / 64);
+    return 0;
+}
+
+void setplacement(const placement_t* pl) {
+    placement = *pl;
+}
+
+void applyplacement(int stage, int n) {
+}
+#endif
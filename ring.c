@@ -0,0 +1,195 @@
+#include "shell.h"
+
+/* Output of jobs started with '&>ring' goes into a pipe, which the shell
+ * drains into a ring buffer of fixed size whenever it waits for jobs or
+ * for input. Chatty background jobs thus neither clutter the terminal nor
+ * write to disk, and 'joblog' shows the tail of what they've written. Ring
+ * outlives its job, till the job number is taken again or rings of a few
+ * more jobs are gone. Pages of a buffer are mapped on demand, so quiet jobs
+ * cost next to nothing.
+ * Linux only, since the pipe is watched by epoll of jobs. */
+
+#define RINGSIZE (256 * 1024) /* must be a power of two */
+#define KEEPRINGS 8           /* rings kept after their jobs are gone */
+
+struct ring {
+    struct ring* next;
+    int num;      /* number of job writing into it, -1 till it's started */
+    int fd;       /* read end of pipe, -1 once all writers are gone */
+    int wfd;      /* write end held till job is started, -1 after */
+    bool live;    /* job hasn't been deleted yet */
+    uint64_t len; /* number of bytes ever drained into buffer */
+    char* buf;
+};
+
+static ring_t* rings = NULL;   /* most recently started job first */
+static ring_t* pending = NULL; /* ring of job that's being started */
+
+static void freering(ring_t* ring) {
+    if (ring->fd >= 0) {
+        unwatchfd(ring->fd);
+        Close(ring->fd);
+    }
+    if (ring->wfd >= 0)
+        Close(ring->wfd);
+    Munmap(ring->buf, RINGSIZE);
+    free(ring);
+}
+
+#ifdef LINUX
+/* Returns descriptor a command of the job being started writes into, which
+ * the caller has to close. All commands of a job share the same ring. */
+int openring(void) {
+    if (pending == NULL) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0)
+            return -1;
+        (void)fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+        pending = malloc(sizeof(ring_t));
+        *pending = (ring_t){.num = -1, .fd = fds[0], .wfd = fds[1]};
+        pending->buf = Mmap(NULL, RINGSIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        watchfd(pending->fd);
+    }
+    return fcntl(pending->wfd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+}
+#else
+int openring(void) {
+    errno = ENOSYS;
+    return -1;
+}
+#endif
+
+/* Job that's been started gets the ring its commands write into, if any.
+ * Shell lets go of the write end, so that end of file is seen once the
+ * processes of the job are gone. Returns NULL if job has no ring. */
+ring_t* takering(void) {
+    ring_t* ring = pending;
+    if (ring == NULL)
+        return NULL;
+
+    pending = NULL;
+    Close(ring->wfd);
+    ring->wfd = -1;
+    ring->live = true;
+    ring->next = rings;
+    rings = ring;
+    return ring;
+}
+
+/* Rings of deleted jobs go away if they have given number, or if there're
+ * more than kept of them, starting with the oldest. */
+static void droprings(int num, int keep) {
+    for (ring_t** rp = &rings; *rp;) {
+        ring_t* ring = *rp;
+        if (!ring->live && (ring->num == num || keep-- <= 0)) {
+            *rp = ring->next;
+            freering(ring);
+        } else {
+            rp = &ring->next;
+        }
+    }
+}
+
+/* Number of a deleted job is taken by a new one. */
+void dropring(int num) {
+    if (rings)
+        droprings(num, KEEPRINGS);
+}
+
+/* Job that writes into the ring got a number, or a new one. */
+void numberring(ring_t* ring, int num) {
+    ring->num = num;
+}
+
+/* Job of the ring has been deleted. Ring still takes what's written by
+ * processes that outlived it. */
+void endring(ring_t* ring) {
+    ring->live = false;
+    droprings(-1, KEEPRINGS);
+}
+
+/* Move what is in the pipe into the buffer, overwriting the oldest output.
+ * A writer that never pauses can't keep the shell here for longer than it
+ * takes to fill the buffer once. Ring is closed once writers are gone. */
+static void drain(ring_t* ring) {
+    uint64_t start = ring->len;
+
+    while (ring->fd >= 0 && ring->len - start < RINGSIZE) {
+        size_t off = ring->len & (RINGSIZE - 1);
+        ssize_t n = read(ring->fd, ring->buf + off, RINGSIZE - off);
+        if (n > 0) {
+            ring->len += n;
+        } else if (n < 0 && errno == EAGAIN) {
+            break;
+        } else if (n == 0 || errno != EINTR) {
+            unwatchfd(ring->fd);
+            Close(ring->fd);
+            ring->fd = -1;
+        }
+    }
+}
+
+/* Called when some pipe of a ring became readable. */
+void drainrings(void) {
+    for (ring_t* ring = rings; ring; ring = ring->next)
+        drain(ring);
+    if (pending)
+        drain(pending);
+}
+
+/* Forked copy of the shell has no jobs, thus neither their rings. Pipes are
+ * still watched by the parent, so they're just closed. */
+void resetrings(void) {
+    if (pending) {
+        pending->next = rings;
+        rings = pending;
+        pending = NULL;
+    }
+    while (rings) {
+        ring_t* ring = rings;
+        rings = ring->next;
+        if (ring->fd >= 0)
+            Close(ring->fd);
+        ring->fd = -1;
+        freering(ring);
+    }
+}
+
+/* Ring of given job, that of the most recently started one if num is -1,
+ * or NULL if there's none. */
+ring_t* findring(int num) {
+    ring_t* ring = rings;
+    while (ring && num >= 0 && ring->num != num)
+        ring = ring->next;
+    return ring;
+}
+
+/* Write contents of ring from position *posp on and advance the position.
+ * If some of them have been overwritten, what's left starts with the next
+ * line. Returns false once the ring has got everything it ever will. */
+bool showring(ring_t* ring, int fd, uint64_t* posp) {
+    uint64_t pos = *posp;
+
+    if (ring->len > RINGSIZE && pos < ring->len - RINGSIZE) {
+        pos = ring->len - RINGSIZE;
+        for (uint64_t i = pos; i < ring->len; i++) {
+            if (ring->buf[i & (RINGSIZE - 1)] == '\n') {
+                pos = i + 1;
+                break;
+            }
+        }
+    }
+
+    while (pos < ring->len) {
+        size_t off = pos & (RINGSIZE - 1);
+        size_t n = min(ring->len - pos, (uint64_t)(RINGSIZE - off));
+        ssize_t written = write(fd, ring->buf + off, n);
+        if (written < 0 && errno != EINTR)
+            break;
+        pos += max(written, (ssize_t)0);
+    }
+    *posp = ring->len;
+    return ring->fd >= 0;
+}
@@ -1,288 +1,1712 @@
-#include <stdio.h> // to remove compilation errors from readline.h on Arch
-#include <readline/readline.h>
-#include <readline/history.h>
+#include <spawn.h>
 
 #define DEBUG 0
 #include "shell.h"
+#include "rio.h"
+#include "bitstring.h"
+
+#ifdef LINUX
+#include <sys/syscall.h>
+#endif
 
 sigset_t sigchld_mask;
+volatile sig_atomic_t sigint_received;
+int pipe_capacity = 0;
+flow_t flow;
+
+/* Does the shell read commands from a terminal and do job control? */
+static bool interactive;
+
+#ifdef LINUX
+/* Signal mask of the shell, which never changes once SIGCHLD is blocked. */
+static sigset_t shell_mask;
+#endif
 
 static sigjmp_buf loop_env;
+static volatile sig_atomic_t at_prompt;
 
+/* Interrupted line editing starts over with a new prompt. Otherwise just take
+ * a note, so builtins running within the shell can stop at a safe point. */
 static void sigint_handler(int sig) {
-    siglongjmp(loop_env, sig);
-}
-
-/* Consume all tokens related to redirection operators.
- * Put opened file descriptors into inputp & output respectively. */
-static int do_redir(token_t* token, int ntokens, int* inputp, int* outputp) {
-    token_t mode = NULL; /* T_INPUT, T_OUTPUT or NULL */
-    int n = 0;           /* number of tokens after redirections are removed */
-
-    for (int i = 0; i < ntokens && token[i] != T_NULL; i++) {
-    /* DONE: Handle tokens and open files as requested. */
-        if (token[i] == T_INPUT || token[i] == T_OUTPUT) {
-            assert(i+1 != ntokens && string_p(token[i+1]));
-
-            mode = token[i];
-            char* filename = token[i+1];
-    
-            int flags = mode == T_INPUT
-                      ? O_RDONLY
-                      : O_WRONLY | O_CREAT;
-    
-            int* fd = mode == T_INPUT
-                    ? inputp
-                    : outputp;
-
-            mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
-
-            if (*fd != -1) {
-                close(*fd);
-            }
+    if (at_prompt)
+        siglongjmp(loop_env, sig);
+    sigint_received = 1;
+}
+
+/* Holds everything allocated while evaluating a single command line. */
+static arena_t line_arena;
+
+/* Standard streams of a command, as determined by pipes it's connected with
+ * and by its redirections. */
+#define NSTDFD 3
+#define FD_CLOSED -2 /* stream closed by '<&-' or '>&-' */
+
+typedef struct {
+    int fd[NSTDFD]; /* descriptors to become stdin, stdout & stderr,
+                     * -1 to keep those of the shell */
+    int* opened;    /* descriptors opened by redirections */
+    int nopened;
+} fdmap_t;
+
+/* Descriptors the shell opens for commands, i.e. pipe ends and files of
+ * redirections, are tracked, so that a forked copy of the shell can let go
+ * of those that belong to other commands. Exec would close them as they're
+ * close-on-exec, but a copy running a builtin or a compound command lives
+ * on, and pipes it holds never see end of file. Tracked descriptor must be
+ * closed with closefd, or its number could be reused by one that isn't. */
+#define MAXTRACKED 4096
+
+static bitstr_t bit_decl(tracked, MAXTRACKED);
+static int maxtracked = -1; /* highest tracked descriptor so far */
+
+static void trackfd(int fd) {
+    if (fd < NSTDFD || fd >= MAXTRACKED)
+        return;
+    bit_set(tracked, fd);
+    maxtracked = max(maxtracked, fd);
+}
 
-            *fd = open(filename, flags, mode);
+static void untrackfd(int fd) {
+    if (fd >= NSTDFD && fd < MAXTRACKED)
+        bit_clear(tracked, fd);
+}
 
-            for (int j = i+2; j < ntokens; j++) {
-                token[j-2] = token[j];
-            }
+static void closefd(int fd) {
+    untrackfd(fd);
+    close(fd);
+}
 
-            token[ntokens-2] = T_NULL;
-            token[ntokens-1] = T_NULL;
-            i--;
+/* Close descriptors in lo ... hi at once if the kernel can. */
+static void closerange(int lo, int hi) {
+#if defined(LINUX) && defined(SYS_close_range)
+    if (syscall(SYS_close_range, lo, hi, 0) == 0)
+        return;
+#endif
+    for (int fd = lo; fd <= hi; fd++)
+        close(fd);
+}
 
-        } else {
-            n++;
+/* Used in a forked child, closes every tracked descriptor other than n
+ * descriptors in keep. Runs of them go with a single call. */
+static void closetracked(const int* keep, int n) {
+    for (int i = 0; i < n; i++)
+        untrackfd(keep[i]);
+
+    for (int fd = NSTDFD; fd <= maxtracked; fd++) {
+        if (!bit_test(tracked, fd))
+            continue;
+        int lo = fd;
+        while (fd < maxtracked && bit_test(tracked, fd + 1))
+            fd++;
+        closerange(lo, fd);
+        bit_nclear(tracked, lo, fd);
+    }
+    maxtracked = -1;
+}
+
+/* Bodies of here-documents of the line being evaluated. */
+static char** heredocs;
+
+static bool writeall(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return false;
+        data += n, len -= n;
+    }
+    return true;
+}
+
+/* Return descriptor to read given text from. Here-documents and strings
+ * never touch the file system: on Linux they live in anonymous memory,
+ * elsewhere in a pipe, which limits them to its capacity. */
+static int mkinput(const char* text, size_t len) {
+#ifdef LINUX
+    int fd = memfd_create("heredoc", MFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (!writeall(fd, text, len) || lseek(fd, 0, SEEK_SET) < 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+#else
+    int fds[2];
+    if (pipe(fds) < 0)
+        return -1;
+    (void)fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    (void)fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    bool ok = writeall(fds[1], text, len);
+    int error = errno == EAGAIN ? EFBIG : errno;
+    close(fds[1]);
+    if (!ok) {
+        close(fds[0]);
+        errno = error;
+        return -1;
+    }
+    return fds[0];
+#endif
+}
+
+/* Descriptor that 'N<&M' or 'N>&M' makes a copy of. Stream the command
+ * inherits from the shell is duplicated, as the shell's own copy may get
+ * replaced before it's used. Word that isn't a number names a coprocess,
+ * whose socket stays open in the shell. */
+static int dupstream(fdmap_t* map, const char* word) {
+    if (varname_p(word))
+        return coprocfd(word);
+    if (word[0] < '0' || word[0] > '2' || word[1] != '\0')
+        return -1;
+
+    int fd = map->fd[word[0] - '0'];
+    if (fd == -1) {
+        fd = fcntl(word[0] - '0', F_DUPFD_CLOEXEC, NSTDFD);
+        if (fd >= 0) {
+            map->opened[map->nopened++] = fd;
+            trackfd(fd);
         }
     }
+    return fd;
+}
 
-    token[n] = NULL;
-    return n;
+/* Is it '&>ring' or '&>>ring', which sends output into a ring buffer that
+ * the shell keeps for the job? File named ring is written with '&>./ring'. */
+static bool ring_p(redir_t* redir) {
+    return (redir->mode == T_OUTALL || redir->mode == T_APPENDALL) &&
+           !strcmp(redir->path, "ring");
 }
 
-/* Execute internal command within shell's process or execute external command
- * in a subprocess. External command can be run in the background. */
-static int do_job(token_t* token, int ntokens, bool bg) {
-    int input = -1, output = -1;
-    int exitcode = 0;
+static bool ringed_p(cmd_t* cmd) {
+    for (int i = 0; i < cmd->nredir; i++)
+        if (ring_p(&cmd->redir[i]))
+            return true;
+    return false;
+}
 
-    ntokens = do_redir(token, ntokens, &input, &output);
+/* Flags that file named by redirection is opened with, or -1 if it doesn't
+ * name one. */
+static int fileflags(redir_t* redir) {
+    token_t mode = redir->mode;
+    if (ring_p(redir))
+        return -1;
+    if (mode == T_INPUT)
+        return O_RDONLY | O_CLOEXEC;
+    if (mode == T_OUTPUT || mode == T_OUTALL)
+        return O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    if (mode == T_APPEND || mode == T_APPENDALL)
+        return O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+    return -1;
+}
 
-    if ((exitcode = builtin_command(token)) >= 0)
-        return exitcode;
+#define FILE_PERM (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
+
+/* Files that redirections of a pipeline name are opened all at once before
+ * its stages are started, then closed at once after that, see uring.c. */
+typedef struct {
+    openreq_t* reqs;
+    redir_t** redir; /* redirection each request is for */
+    bool* taken;     /* descriptor was handed over to do_redir */
+    int n;
+    int next;        /* request the next redirection is likely to be for */
+    int* closing;    /* descriptors to be closed at the end */
+    int nclosing;
+    int maxclosing;
+    bool active;
+} batch_t;
+
+static batch_t batch;
+
+/* Descriptor opened ahead for redirection goes into fdp, which is -1 with
+ * errno set if the file couldn't be opened. Returns false if it wasn't. */
+static bool prefetched(redir_t* redir, int* fdp) {
+    if (!batch.active)
+        return false;
+
+    int i = batch.next;
+    if (i >= batch.n || batch.redir[i] != redir)
+        for (i = 0; i < batch.n && batch.redir[i] != redir; i++)
+            continue;
+    if (i == batch.n || batch.taken[i])
+        return false;
+
+    batch.taken[i] = true;
+    batch.next = i + 1;
+    *fdp = batch.reqs[i].fd;
+    if (*fdp < 0) {
+        errno = -*fdp;
+        *fdp = -1;
+    }
+    return true;
+}
 
-    sigset_t mask;
-    Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+/* Open files named by redirections of a command in order of appearance.
+ * Standard input & output start as given descriptors, -1 means those of
+ * the shell. Only standard streams can be redirected. Output goes into a
+ * ring only if the command is forked, as a job. */
+static bool do_redir(cmd_t* cmd, int input, int output, fdmap_t* map,
+                     bool forked) {
+    *map = (fdmap_t){.fd = {input, output, -1}};
+    map->opened = arena_alloc(&line_arena, sizeof(int) * cmd->nredir);
+
+    for (int i = 0; i < cmd->nredir; i++) {
+        redir_t* redir = &cmd->redir[i];
+        token_t mode = redir->mode;
+        int flags = fileflags(redir);
+        int fd;
+
+        if (redir->fd >= NSTDFD) {
+            msg("%d: redirection of descriptor not supported\n", redir->fd);
+            return false;
+        }
 
-    /* DONE:: Start a subprocess, create a job and monitor it. */    
-    pid_t pid = Fork();
+        if (mode == T_DUPIN || mode == T_DUPOUT) {
+            if (!strcmp(redir->path, "-")) {
+                map->fd[redir->fd] = FD_CLOSED;
+                continue;
+            }
+            if ((fd = dupstream(map, redir->path)) < 0) {
+                msg("%s: bad file descriptor\n", redir->path);
+                return false;
+            }
+            map->fd[redir->fd] = fd;
+            continue;
+        }
 
-    if (!pid) {
-        sigset_t clear_mask;
-        sigemptyset(&clear_mask);
-        Sigprocmask(SIG_SETMASK, &clear_mask, NULL);
-        Signal(SIGTSTP, SIG_DFL);
-        Signal(SIGTTIN, SIG_DFL);
-        Signal(SIGTTOU, SIG_DFL);
-
-        if (output != -1) {
-            dup2(output, STDOUT_FILENO);
+        if (ring_p(redir) && !forked) {
+            msg("ring: not for commands run within the shell\n");
+            return false;
+        } else if (ring_p(redir)) {
+            fd = openring();
+        } else if (flags >= 0 && !prefetched(redir, &fd)) {
+            fd = open(redir->path, flags, FILE_PERM);
+        } else if (flags >= 0) {
+            /* Opened ahead. */
+        } else if (mode == T_HEREDOC) {
+            char* body = heredocs[redir->heredoc];
+            fd = mkinput(body, strlen(body));
+        } else { /* T_HERESTR */
+            size_t len = strlen(redir->path);
+            char* text = arena_alloc(&line_arena, len + 1);
+            memcpy(text, redir->path, len);
+            text[len] = '\n';
+            fd = mkinput(text, len + 1);
         }
 
-        if (input != -1) {
-            dup2(input, STDIN_FILENO);
+        if (fd < 0) {
+            msg("%s: %s\n", mode == T_HEREDOC ? "here-document" : redir->path,
+                strerror(errno));
+            return false;
         }
-        
-        external_command(token);
+
+        map->opened[map->nopened++] = fd;
+        map->fd[redir->fd] = fd;
+        trackfd(fd);
+        if (mode == T_OUTALL || mode == T_APPENDALL)
+            map->fd[STDERR_FILENO] = fd;
     }
 
-    setpgid(pid, pid);
-    int job = addjob(pid, bg);
-    addproc(job, pid, token);
+    return true;
+}
 
-    if (output != -1) {
-        close(output);
+static void closemap(fdmap_t* map) {
+    for (int i = 0; i < map->nopened; i++) {
+        if (batch.active && batch.nclosing < batch.maxclosing)
+            batch.closing[batch.nclosing++] = map->opened[i];
+        else
+            closefd(map->opened[i]);
     }
+    map->nopened = 0;
+}
 
-    if (input != -1) {
-        close(input);
+/* Pipeline that has a few files to open, and no substitutions, which must
+ * be started in order, gets its commands expanded ahead. */
+static bool batchable_p(pipeline_t* pipeline) {
+    int nfiles = 0;
+    for (int i = 0; i < pipeline->ncmd; i++) {
+        cmd_t* cmd = &pipeline->cmd[i];
+        if (cmd->npsub)
+            return false;
+        for (int j = 0; j < cmd->nredir; j++)
+            nfiles += fileflags(&cmd->redir[j]) >= 0;
     }
+    return nfiles >= 2;
+}
 
-    if (!bg) {
-        exitcode = monitorjob(&mask);
-    } else {
-        msg("[%d] running '%s'\n", job, jobcmd(job));
+/* Open files named by redirections of n commands at once. Those of one
+ * command are linked, so it doesn't open files past one that has failed,
+ * as it wouldn't one by one. Batch isn't started if it can't be. */
+static void startbatch(cmd_t** cmds, int n) {
+    int nfiles = 0, nredir = 0;
+    for (int i = 0; i < n; i++) {
+        nredir += cmds[i]->nredir;
+        for (int j = 0; j < cmds[i]->nredir; j++)
+            nfiles += fileflags(&cmds[i]->redir[j]) >= 0;
     }
+    if (nfiles < 2)
+        return;
+
+    batch = (batch_t){.n = nfiles, .maxclosing = nredir};
+    batch.reqs = arena_alloc(&line_arena, sizeof(openreq_t) * nfiles);
+    batch.redir = arena_alloc(&line_arena, sizeof(redir_t*) * nfiles);
+    batch.taken = arena_alloc(&line_arena, sizeof(bool) * nfiles);
+    batch.closing = arena_alloc(&line_arena, sizeof(int) * nredir);
+
+    int k = 0;
+    for (int i = 0; i < n; i++) {
+        bool first = true;
+        for (int j = 0; j < cmds[i]->nredir; j++) {
+            redir_t* redir = &cmds[i]->redir[j];
+            int flags = fileflags(redir);
+            if (flags < 0)
+                continue;
+            batch.reqs[k] = (openreq_t){redir->path, flags, FILE_PERM, !first};
+            batch.redir[k] = redir;
+            batch.taken[k] = false;
+            first = false;
+            k++;
+        }
+    }
+    batch.active = uring_openall(batch.reqs, nfiles);
+    for (int i = 0; i < nfiles && batch.active; i++)
+        trackfd(batch.reqs[i].fd);
+}
 
-    Sigprocmask(SIG_SETMASK, &mask, NULL);
+/* Descriptors that weren't handed over are closed along with the rest. */
+static void endbatch(void) {
+    if (!batch.active)
+        return;
+    batch.active = false;
+    for (int i = 0; i < batch.n; i++)
+        if (!batch.taken[i] && batch.reqs[i].fd >= 0)
+            closefd(batch.reqs[i].fd);
+    for (int i = 0; i < batch.nclosing; i++)
+        untrackfd(batch.closing[i]);
+    uring_closeall(batch.closing, batch.nclosing);
+}
+
+/* Used in a child process before it executes the command. */
+static void applymap(fdmap_t* map) {
+    for (int fd = 0; fd < NSTDFD; fd++) {
+        if (map->fd[fd] == FD_CLOSED)
+            close(fd);
+        else if (map->fd[fd] != -1)
+            dup2(map->fd[fd], fd);
+    }
+}
+
+static void closeredir(int input, int output) {
+    if (input != -1)
+        closefd(input);
+    if (output != -1)
+        closefd(output);
+}
+
+/* Make fd refer to the same file as newfd, return copy of the original. */
+static int replacefd(int fd, int newfd) {
+    int saved = fcntl(fd, F_DUPFD_CLOEXEC, NSTDFD);
+    if (newfd == FD_CLOSED)
+        close(fd);
+    else
+        Dup2(newfd, fd);
+    return saved;
+}
+
+static void restorefd(int fd, int saved) {
+    if (saved < 0) {
+        close(fd);
+        return;
+    }
+    Dup2(saved, fd);
+    Close(saved);
+}
+
+/* Put standard streams of the shell itself in place according to map,
+ * copies of replaced ones are put into saved. */
+static void swapstreams(fdmap_t* map, int* saved) {
+    for (int fd = 0; fd < NSTDFD; fd++)
+        if (map->fd[fd] != -1)
+            saved[fd] = replacefd(fd, map->fd[fd]);
+}
+
+/* Bring back streams replaced by swapstreams, unless they're to be kept. */
+static void unswapstreams(fdmap_t* map, int* saved, bool keep) {
+    for (int fd = NSTDFD - 1; fd >= 0; fd--) {
+        if (map->fd[fd] == -1)
+            continue;
+        if (!keep)
+            restorefd(fd, saved[fd]);
+        else if (saved[fd] >= 0)
+            Close(saved[fd]);
+    }
+    closemap(map);
+}
+
+/* Environment of the builtin being run, see shell.h. */
+char** builtin_envp = NULL;
+
+/* Execute builtin within shell's process with standard input & output
+ * temporarily replaced by given descriptors (-1 means keep the current one).
+ * Redirections of the command take precedence over them. Those of 'exec'
+ * without a command stay in effect. */
+static int run_builtin(cmd_t* cmd, int input, int output) {
+    int saved[NSTDFD];
+    fdmap_t map;
+    int exitcode;
+
+    if (!do_redir(cmd, input, output, &map, false)) {
+        closemap(&map);
+        return EXIT_FAILURE;
+    }
+
+    swapstreams(&map, saved);
+    builtin_envp = cmd->envp;
+    exitcode = builtin_command(cmd->argv);
+    builtin_envp = NULL;
+    unswapstreams(&map, saved,
+                  cmd->argc == 1 && !strcmp(cmd->argv[0], "exec"));
     return exitcode;
 }
 
+/* Signals the shell ignores, which its children must get back to default
+ * dispositions, as ignored ones survive execve. Signal setup of children is
+ * prepared once, so starting a command doesn't recompute it. */
+#define MAXIGNORED 8
+
+static int ignored[MAXIGNORED];
+static int nignored = 0;
+static sigset_t ignored_set;
+
+static void ignoresig(int sig) {
+    assert(nignored < MAXIGNORED);
+    Signal(sig, SIG_IGN);
+    ignored[nignored++] = sig;
+    sigaddset(&ignored_set, sig);
+}
+
+/* Used in a forked child, handlers other than ignored are reset by exec. */
+static void resetsigs(void) {
+    static const struct sigaction dfl = {.sa_handler = SIG_DFL};
+
+    for (int i = 0; i < nignored; i++)
+        Sigaction(ignored[i], &dfl, NULL);
+}
+
+/* Execute external command in place of the shell, with signals set up the
+ * way they would be in a child. */
+noreturn void replaceshell(char** argv, char** envp) {
+    sigset_t mask;
+    Sigprocmask(SIG_BLOCK, NULL, &mask);
+    sigdelset(&mask, SIGCHLD);
+    resetsigs();
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+    external_command(argv, envp);
+}
+
+/* Attributes of spawned processes that vary are process group and mask. */
+static posix_spawnattr_t spawnattr;
+
+static void initspawn(void) {
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if (interactive)
+        flags |= POSIX_SPAWN_SETPGROUP;
+
+    posix_spawnattr_init(&spawnattr);
+    posix_spawnattr_setflags(&spawnattr, flags);
+    posix_spawnattr_setsigdefault(&spawnattr, &ignored_set);
+}
+
+static int posixspawn(
+    pid_t* pidp,
+    pid_t pgid,
+    const sigset_t* mask,
+    fdmap_t* map,
+    const char* path,
+    token_t* token,
+    char** envp
+) {
+    posix_spawnattr_setpgroup(&spawnattr, pgid);
+    posix_spawnattr_setsigmask(&spawnattr, mask);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    /* Descriptors in map are close-on-exec, their copies are not. */
+    for (int fd = 0; fd < NSTDFD; fd++) {
+        if (map->fd[fd] == FD_CLOSED)
+            posix_spawn_file_actions_addclose(&actions, fd);
+        else if (map->fd[fd] != -1)
+            posix_spawn_file_actions_adddup2(&actions, map->fd[fd], fd);
+    }
+
+    int error = posix_spawn(pidp, path, &actions, &spawnattr, token, envp);
+
+    posix_spawn_file_actions_destroy(&actions);
+    return error;
+}
+
+/* Start external command without duplicating shell's address space, i.e.
+ * posix_spawn uses vfork-like clone where available, or the zygote does it
+ * if it's running. Child process gets moved to process group pgid (0 means
+ * its own) if job control is enabled, has signal mask set to mask,
+ * dispositions of job control signals reset and standard streams replaced
+ * according to map. Descriptors in fds are inherited. Returns -1 if command
+ * could not be started this way, so the caller should fall back to fork. */
+static pid_t spawn(
+    pid_t pgid,
+    const sigset_t* mask,
+    fdmap_t* map,
+    int* fds,
+    int nfds,
+    token_t* token,
+    char** envp
+) {
+    const char* path = token[0];
+    if (!index(path, '/') && !(path = lookupcmd(path)))
+        return -1;
+
+    pid_t pid;
+    int error = zygote_spawn(&pid, path, token, envp, interactive ? pgid : -1,
+                             mask, map->fd, fds, nfds);
+    if (error == ENOSYS)
+        error = posixspawn(&pid, pgid, mask, map, path, token, envp);
+
+    if (error) {
+        /* Executable might have been removed since we remembered its path. */
+        if (error == ENOENT && path != token[0])
+            forgetcmd(token[0]);
+        return -1;
+    }
+
+    return pid;
+}
+
+/* Convert status returned by monitorjob into exit code of a command. */
+static int exitstatus(int status) {
+    /* Loop that runs the command is interrupted as well, rather than
+     * starting it over and over. */
+    if (status < 0) { /* job got stopped */
+        if (flow.loops > 0)
+            sigint_received = 1;
+        return 128 + SIGTSTP;
+    }
+    if (WIFSIGNALED(status)) {
+        if (WTERMSIG(status) == SIGINT)
+            sigint_received = 1;
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+static void mkpipe(int* readp, int* writep) {
+    int fds[2];
+    Pipe(fds);
+    /* Shell may hold pipe ends while starting other stages, which must not
+     * inherit them, otherwise readers would never see end of file. */
+    (void)fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    (void)fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+#ifdef LINUX
+    /* Bigger pipes mean fewer context switches between stages that stream
+     * lots of data. Kernel may refuse the size, default one is fine too. */
+    if (pipe_capacity > 0)
+        (void)fcntl(fds[1], F_SETPIPE_SZ, pipe_capacity);
+#endif
+    trackfd(fds[0]);
+    trackfd(fds[1]);
+    *readp = fds[0];
+    *writep = fds[1];
+}
+
+/* Pipes are created ahead of time between command lines, i.e. while user is
+ * typing, so starting a pipeline doesn't have to wait for them. The pool is
+ * refilled with as many pipes as previous command line needed. */
+#define PIPEPOOL 8
+
+static struct {
+    int input, output;
+    int capacity; /* value of pipe_capacity the pipe was created with */
+} pipepool[PIPEPOOL];
+static int npooled = 0;
+static int ntaken = 0; /* pipes taken since the pool was last filled */
+
+static void takepipe(int* readp, int* writep) {
+    ntaken++;
+
+    while (npooled > 0) {
+        npooled--;
+        if (pipepool[npooled].capacity == pipe_capacity) {
+            *readp = pipepool[npooled].input;
+            *writep = pipepool[npooled].output;
+            return;
+        }
+        /* Pipe size was changed in the meantime. */
+        closeredir(pipepool[npooled].input, pipepool[npooled].output);
+    }
+
+    mkpipe(readp, writep);
+}
+
+static void fillpipes(void) {
+    int want = min(ntaken, PIPEPOOL);
+
+    while (npooled < want) {
+        mkpipe(&pipepool[npooled].input, &pipepool[npooled].output);
+        pipepool[npooled++].capacity = pipe_capacity;
+    }
+
+    ntaken = 0;
+}
+
+/* Descriptors passed to a command that the shell closes once it's started. */
+typedef struct {
+    int* fd;
+    int n;
+} fdlist_t;
+
+static void closefds(fdlist_t* fds) {
+    for (int i = 0; i < fds->n; i++)
+        closefd(fds->fd[i]);
+    fds->n = 0;
+}
+
+/* Stage of a pipeline that runs as a builtin within shell's process. */
+typedef struct {
+    cmd_t* cmd;
+    int input, output;
+    fdlist_t fds; /* ends of substituted pipelines */
+    int index;    /* position within pipeline */
+} stage_t;
+
+/* Job that's being started. Processes of a pipeline and those of process
+ * substitutions within it all belong to it. */
+typedef struct {
+    int job;        /* -1 until first process is started */
+    pid_t pgid;     /* process group of job, 0 until first process */
+    bool bg;        /* job will run in the background */
+    sigset_t* mask; /* signal mask to restore when waiting */
+    stage_t* held;  /* builtins to be run within the shell later */
+    int nheld;
+    int stage;      /* position of process being started in its pipeline */
+    int nstages;    /* and the number of commands there */
+    timeout_t timeout; /* earliest deadline of its commands, see do_timeout */
+} launch_t;
+
+/* Processes of substitutions are not part of job's command. */
+static void joinjob(launch_t* launch, pid_t pid, char** argv) {
+    if (launch->job == -1) {
+        launch->pgid = pid;
+        launch->job = addjob(pid, launch->bg);
+    }
+    addproc(launch->job, pid, argv);
+}
+
+static noreturn void runbody(cmd_t* cmd);
+
+/* Commands that run within the shell's process unless they're forked. */
+static bool shellcmd_p(cmd_t* cmd) {
+    return cmd->kind != K_SIMPLE || findfunc(cmd->argv[0]) ||
+           builtin_p(cmd->argv[0]);
+}
+
+/* Is it 'fanout HOSTFILE -- command...', which the shell starts as a job of
+ * its own rather than running the builtin? Within a pipeline
+ * it's a job of a forked copy of the shell. */
+static bool fanout_p(cmd_t* cmd) {
+    return cmd->kind == K_SIMPLE && !strcmp(cmd->argv[0], "fanout") &&
+           !findfunc("fanout") && fanoutcmd(cmd->argv + 1);
+}
+
+/* Builtin that isn't shadowed by a function and runs within the shell when
+ * it's not part of a pipeline. */
+static bool builtincmd_p(cmd_t* cmd) {
+    return cmd->kind == K_SIMPLE && !findfunc(cmd->argv[0]) &&
+           builtin_p(cmd->argv[0]) && !wrapper_p(cmd->argv) && !fanout_p(cmd);
+}
+
 /* Start internal or external command in a subprocess that belongs to pipeline.
- * All subprocesses in pipeline must belong to the same process group. */
+ * All subprocesses in pipeline must belong to the same process group. Files
+ * opened by redirections replace pipe ends given as input & output. Other
+ * descriptors the shell tracks are closed in children, ends of substituted
+ * pipelines in fds are inherited. */
 static pid_t do_stage(
-    pid_t pgid, 
-    sigset_t* mask, 
+    launch_t* launch,
     int input, 
     int output,
-    token_t* token, 
-    int ntokens
+    cmd_t* cmd,
+    fdlist_t* fds
 ) {
-    ntokens = do_redir(token, ntokens, &input, &output);
+    char** argv = cmd->argv;
+    char** envp = cmd->envp ? cmd->envp : envblock();
+    fdmap_t map;
+    bool redir_ok = do_redir(cmd, input, output, &map, true);
+
+    for (int i = 0; i < fds->n; i++)
+        (void)fcntl(fds->fd[i], F_SETFD, 0);
+
+    /* Shell may keep SIGCHLD blocked all the time, children must not. */
+    sigset_t child_mask = *launch->mask;
+    sigdelset(&child_mask, SIGCHLD);
+
+    /* Builtins, functions and compound commands must run in a forked copy
+     * of the shell. So do placed commands, which place themselves. */
+    pid_t pid = -1;
+    uint64_t start = stamp();
+    bool inshell = shellcmd_p(cmd);
+    if (redir_ok && !inshell && !placed_p())
+        pid = spawn(launch->pgid, &child_mask, &map, fds->fd, fds->n, argv,
+                    envp);
+
+    if (pid >= 0) {
+        record(PH_SPAWN, start);
+        closemap(&map);
+        return pid;
+    }
+
+    /* When tracing, the child lets us know it has executed the command by
+     * closing its end of a close-on-exec pipe. */
+    int handshake[2] = {-1, -1};
+    if (tracing) {
+        Pipe(handshake);
+        (void)fcntl(handshake[0], F_SETFD, FD_CLOEXEC);
+        (void)fcntl(handshake[1], F_SETFD, FD_CLOEXEC);
+    }
 
     /* DONE: Start a subprocess and make sure it's moved to a process group. */
-    pid_t pid = Fork();
+    start = stamp();
+    pid = Fork();
 
     if (!pid) {
-        Sigprocmask(SIG_SETMASK, mask, NULL);
-        Signal(SIGTSTP, SIG_DFL);
-        Signal(SIGTTIN, SIG_DFL);
-        Signal(SIGTTOU, SIG_DFL);
-
-        if (input != -1) {
-            dup2(input, STDIN_FILENO);
+        Sigprocmask(SIG_SETMASK, &child_mask, NULL);
+        resetsigs();
+
+        /* Failed redirection fails the stage but not the whole pipeline. */
+        if (!redir_ok)
+            exit(EXIT_FAILURE);
+
+        /* Exec would close the rest, but builtins don't exec. Pipes of
+         * other stages, those in the pool and files of the batch are only
+         * held by the shell. */
+        applymap(&map);
+        closetracked(fds->fd, fds->n);
+        resetcoprocs();
+        npooled = 0;
+        batch.active = false;
+        if (placed_p())
+            applyplacement(launch->stage, launch->nstages);
+
+        if (tracing) {
+            close(handshake[0]);
+            if (inshell)
+                close(handshake[1]);
         }
 
-        if (output != -1) {
-            dup2(output, STDOUT_FILENO);
-        }
+        if (cmd->kind != K_SIMPLE || findfunc(argv[0]) || fanout_p(cmd))
+            runbody(cmd);
 
         int exitcode;
-        if ((exitcode = builtin_command(token)) >= 0) {
+        builtin_envp = cmd->envp;
+        if ((exitcode = builtin_command(argv)) >= 0) {
             exit(exitcode);
         }
 
-        external_command(token);
+        external_command(argv, envp);
+    }
+
+    record(PH_FORK, start);
+    if (tracing) {
+        uint64_t forked = stamp();
+        char c;
+        close(handshake[1]);
+        while (read(handshake[0], &c, 1) < 0 && errno == EINTR)
+            continue;
+        close(handshake[0]);
+        record(PH_EXEC, forked);
     }
-    
-    setpgid(pid, pgid);
+
+    if (interactive)
+        setpgid(pid, launch->pgid ? launch->pgid : pid);
+    closemap(&map);
     return pid;
 }
 
-static void mkpipe(int* readp, int* writep) {
-    int fds[2];
-    Pipe(fds);
-    *readp = fds[0];
-    *writep = fds[1];
+static cmd_t* do_expand(launch_t* launch, cmd_t* cmd, fdlist_t* fds);
+
+/* Command run by 'timeout' is started as usual, with the shell keeping the
+ * deadline of its job, so no helper process is needed. Builtins, functions
+ * and compound commands run in a forked copy of the shell then, as they do
+ * in pipelines. Returns the command without 'timeout' and its options, or
+ * cmd itself if the builtin has to run and complain about them. Earliest
+ * deadline of commands of a job applies to all of its processes. */
+static cmd_t* do_timeout(launch_t* launch, cmd_t* cmd) {
+    if (cmd->kind != K_SIMPLE || strcmp(cmd->argv[0], "timeout") ||
+        findfunc("timeout"))
+        return cmd;
+
+    timeout_t t;
+    char** argv = parsetimeout(cmd->argv + 1, &t);
+    if (argv == NULL)
+        return cmd;
+
+    cmd_t* copy = arena_alloc(&line_arena, sizeof(cmd_t));
+    *copy = *cmd;
+    copy->argc -= argv - cmd->argv;
+    copy->argv = argv;
+
+    /* Commands may be given more than one deadline. */
+    cmd_t* inner = do_timeout(launch, copy);
+    if (launch->timeout.after == 0 || t.after < launch->timeout.after)
+        launch->timeout = t;
+    return inner;
+}
+
+/* Start all commands of a substituted pipeline, either input or output is
+ * the pipe connecting it with the command it's part of. */
+static void startpsub(launch_t* launch, pipeline_t* pipeline, int input,
+                      int output) {
+    int stage_input = input;
+
+    for (int i = 0; i < pipeline->ncmd; i++) {
+        int stage_output = output, next_input = -1;
+        fdlist_t fds = {};
+
+        if (i < pipeline->ncmd - 1)
+            takepipe(&next_input, &stage_output);
+
+        cmd_t* cmd = do_expand(launch, &pipeline->cmd[i], &fds);
+        cmd = do_timeout(launch, cmd);
+        launch->stage = i;
+        launch->nstages = pipeline->ncmd;
+        pid_t pid = do_stage(launch, stage_input, stage_output, cmd, &fds);
+
+        if (stage_input != input)
+            closefd(stage_input);
+        if (stage_output != output)
+            closefd(stage_output);
+        closefds(&fds);
+
+        joinjob(launch, pid, NULL);
+        stage_input = next_input;
+    }
+}
+
+/* Start process substitutions of a command and return its copy with words
+ * and file names replaced by /dev/fd/N, where N is a pipe end connected to
+ * substituted pipeline. Descriptors are put into fds. */
+static cmd_t* do_psubs(launch_t* launch, cmd_t* cmd, fdlist_t* fds) {
+    if (cmd->npsub == 0)
+        return cmd;
+
+    cmd_t* copy = arena_alloc(&line_arena, sizeof(cmd_t));
+    *copy = *cmd;
+    copy->argv = arena_alloc(&line_arena, sizeof(char*) * (cmd->argc + 1));
+    memcpy(copy->argv, cmd->argv, sizeof(char*) * (cmd->argc + 1));
+    copy->redir = arena_alloc(&line_arena, sizeof(redir_t) * cmd->nredir);
+    memcpy(copy->redir, cmd->redir, sizeof(redir_t) * cmd->nredir);
+    copy->npsub = 0;
+
+    fds->fd = arena_alloc(&line_arena, sizeof(int) * cmd->npsub);
+    fds->n = 0;
+
+    for (int i = 0; i < cmd->npsub; i++) {
+        psub_t* psub = &cmd->psub[i];
+        int input, output;
+
+        /* Syntax of substituted pipeline was checked with the command. */
+        ast_t* ast = compile(&line_arena, psub->cmdline);
+        assert(ast != NULL && ast->npipe == 1);
+
+        takepipe(&input, &output);
+        ast->busy++;
+        if (psub->output) {
+            startpsub(launch, &ast->pipe[0], input, -1);
+            closefd(input);
+            fds->fd[fds->n++] = output;
+        } else {
+            startpsub(launch, &ast->pipe[0], -1, output);
+            closefd(output);
+            fds->fd[fds->n++] = input;
+        }
+        ast->busy--;
+
+        char* path = arena_alloc(&line_arena, 32);
+        safe_snprintf(path, 32, "/dev/fd/%d", fds->fd[fds->n - 1]);
+        if (psub->word >= 0)
+            copy->argv[psub->word] = path;
+        else
+            copy->redir[psub->redir].path = path;
+    }
+
+    return copy;
+}
+
+/* Returns command with process substitutions started, variables expanded
+ * and patterns replaced with names they match. Assignments that precede
+ * external command make up its environment, builtins ignore them. Syntax
+ * tree isn't modified, copy is made if anything changes. */
+static cmd_t* do_expand(launch_t* launch, cmd_t* cmd, fdlist_t* fds) {
+    cmd = do_psubs(launch, cmd, fds);
+
+    bool expand = cmd->nexpand > 0 || assignment_p(cmd->argv[0]);
+    for (int i = 0; i < cmd->nredir && !expand; i++)
+        expand = cmd->redir[i].expand;
+    if (!expand)
+        return cmd;
+
+    cmd_t* copy = arena_alloc(&line_arena, sizeof(cmd_t));
+    *copy = *cmd;
+    copy->nexpand = 0;
+    if (cmd->nexpand)
+        copy->argv = expandwords(&line_arena, cmd, &copy->argc);
+
+    for (int i = 0; i < cmd->nredir; i++) {
+        if (!cmd->redir[i].expand)
+            continue;
+        if (copy->redir == cmd->redir) {
+            copy->redir = arena_alloc(&line_arena, sizeof(redir_t) * cmd->nredir);
+            memcpy(copy->redir, cmd->redir, sizeof(redir_t) * cmd->nredir);
+        }
+        /* File names are not matched as patterns. */
+        redir_t* redir = &copy->redir[i];
+        char* path = expandvars(&line_arena, redir->path);
+        redir->path = unescape(&line_arena, path, strlen(path));
+        redir->expand = false;
+    }
+
+    /* Command consisting of assignments only is run as a builtin. Builtins
+     * that execute commands pass on the environment as well. */
+    int nassign = 0;
+    while (nassign < copy->argc && assignment_p(copy->argv[nassign]))
+        nassign++;
+    if (nassign > 0 && nassign < copy->argc) {
+        copy->envp = overlayenv(&line_arena, copy->argv, nassign);
+        copy->argv += nassign;
+        copy->argc -= nassign;
+    }
+    return copy;
 }
 
-/* Pipeline execution creates a multiprocess job. Both internal and external
- * commands are executed in subprocesses. */
-static int do_pipeline(token_t* token, int ntokens, bool bg) {
-    pid_t pid, pgid = 0;
-    int job = -1;
+/* Last command of a script has nothing to come back to, so it's executed in
+ * place of the shell, unless it has to be waited for or its redirections
+ * fail. */
+static void tailexec(cmd_t* cmd) {
+    fdmap_t map;
+
+    if (!do_redir(cmd, -1, -1, &map, false)) {
+        closemap(&map);
+        return;
+    }
+    applymap(&map);
+    replaceshell(cmd->argv, cmd->envp ? cmd->envp : envblock());
+}
+
+static int evallist(ast_t* ast, sigset_t* mask, bool last);
+
+/* Evaluation of lists stops early once it's been interrupted or one of
+ * 'break', 'continue' and 'return' is pending. */
+static bool unwinding(void) {
+    return sigint_received || flow.breaks || flow.ret;
+}
+
+/* Tells if a loop stops after its condition or body was evaluated, i.e. it's
+ * broken out of, or it continues with next iteration of an outer loop. */
+static bool endloop(void) {
+    if (sigint_received || flow.ret)
+        return true;
+    if (flow.breaks == 0)
+        return false;
+    if (--flow.breaks > 0 || !flow.next)
+        return true;
+    flow.next = false;
+    return false;
+}
+
+/* Loops evaluate the same trees over and over. Memory used by an iteration
+ * is released once it's done, so that long loops run in constant space. */
+static void enditeration(arena_mark_t mark) {
+    flushglobs();
+    arena_release(&line_arena, mark);
+}
+
+static int evalwhile(cmd_t* cmd, sigset_t* mask) {
+    arena_mark_t mark = arena_mark(&line_arena);
+    bool until = cmd->kind == K_UNTIL;
     int exitcode = 0;
 
-    int input = -1, output = -1, next_input = -1;
+    flow.loops++;
+    while (true) {
+        int status = evallist(cmd->sub[0], mask, false);
+        if (endloop() || (status == 0) == until)
+            break;
+        exitcode = evallist(cmd->sub[1], mask, false);
+        if (endloop())
+            break;
+        enditeration(mark);
+    }
+    flow.loops--;
+    return exitcode;
+}
+
+/* Words of 'for' are expanded once, before the first iteration. Without
+ * them the loop goes over positional parameters. */
+static int evalfor(cmd_t* cmd, sigset_t* mask) {
+    cmd_t* header = &cmd->sub[0]->pipe[0].cmd[0];
+    char** words = params.argv;
+    int nwords = params.argc;
+    int exitcode = 0;
 
-    mkpipe(&next_input, &output);
+    if (header->argc > 1) {
+        int argc = header->argc;
+        words = header->argv;
+        if (header->nexpand)
+            words = expandwords(&line_arena, header, &argc);
+        words += 2;
+        nwords = argc - 2;
+    }
 
-    sigset_t mask;
-    Sigprocmask(SIG_BLOCK, &sigchld_mask, &mask);
+    arena_mark_t mark = arena_mark(&line_arena);
+    flow.loops++;
+    for (int i = 0; i < nwords; i++) {
+        setvar(header->argv[0], words[i], false);
+        exitcode = evallist(cmd->sub[1], mask, false);
+        if (endloop())
+            break;
+        enditeration(mark);
+    }
+    flow.loops--;
+    return exitcode;
+}
 
-    /* DONE: Start pipeline subprocesses, create a job and monitor it.
-     * Remember to close unused pipe ends! */
-    size_t stage_start = 0;
-    while (stage_start < ntokens) {
-        size_t stage_end;
-        bool is_last = true;
-        for (stage_end = stage_start; stage_end < ntokens; stage_end++) {
-            if (token[stage_end] == T_PIPE) {
-                token[stage_end] = T_NULL;
-                is_last = false;
-                break;
-            }
+/* Evaluate lists of compound command within current process, its
+ * redirections are already in effect. If tail is set, nothing follows the
+ * command. */
+static int evalcompound(cmd_t* cmd, bool tail, sigset_t* mask) {
+    ast_t** sub = cmd->sub;
+
+    switch (cmd->kind) {
+    case K_SUBSHELL:
+    case K_GROUP:
+        return evallist(sub[0], mask, tail);
+    case K_IF:
+        for (int i = 0; i + 1 < cmd->nsub; i += 2) {
+            int status = evallist(sub[i], mask, false);
+            if (unwinding())
+                return status;
+            if (status == 0)
+                return evallist(sub[i + 1], mask, tail);
         }
+        /* Odd list is that of 'else'. */
+        return cmd->nsub % 2 ? evallist(sub[cmd->nsub - 1], mask, tail) : 0;
+    case K_WHILE:
+    case K_UNTIL:
+        return evalwhile(cmd, mask);
+    case K_FOR:
+        return evalfor(cmd, mask);
+    case K_FUNCTION:
+        definefunc(cmd->argv[0], sub[0]);
+        return 0;
+    default:
+        assert(false);
+        return EXIT_FAILURE;
+    }
+}
 
-        token_t* stage_tokens = token + stage_start;
-        size_t tok_len = stage_end - stage_start;
+/* Functions may call themselves, but not forever. */
+#define MAXFUNCNEST 256
 
-        if (is_last) {
-            output = -1;
-        }
+/* Function runs within the shell with words of the command, except the first
+ * one, as positional parameters. Loops of the caller can't be broken out of
+ * from within. */
+static int callfunc(ast_t* body, cmd_t* cmd, bool tail, sigset_t* mask) {
+    if (flow.funcs >= MAXFUNCNEST) {
+        msg("%s: maximum function nesting level exceeded\n", cmd->argv[0]);
+        return EXIT_FAILURE;
+    }
 
-        pid = do_stage(pgid, &mask, input, output, stage_tokens, tok_len);
+    params_t caller = params;
+    flow_t outer = flow;
+    params = (params_t){cmd->argv + 1, cmd->argc - 1};
+    flow = (flow_t){.funcs = outer.funcs + 1};
 
-        if (output != -1) {
-            close(output);
-        }
+    /* Function may get redefined while it runs. */
+    body->busy++;
+    int exitcode = evallist(body, mask, tail);
+    body->busy--;
 
-        if (input != -1) {
-            close(input);
-        }
+    flow = outer;
+    params = caller;
+    return exitcode;
+}
 
-        if (job == -1) {
-            pgid = pid;
-            job = addjob(pgid, bg);
-        }
+/* Compound commands and functions are evaluated within the shell, thus their
+ * commands may change the state of the shell. Redirections of the command
+ * are in effect for all of them, like those of a builtin. Subshell only runs
+ * this way if it has nothing to come back to. */
+static int run_inshell(cmd_t* cmd, ast_t* func, bool tail, sigset_t* mask) {
+    int saved[NSTDFD];
+    fdmap_t map;
+
+    if (!do_redir(cmd, -1, -1, &map, false)) {
+        closemap(&map);
+        return EXIT_FAILURE;
+    }
 
-        addproc(job, pid, stage_tokens);
+    swapstreams(&map, saved);
+    int exitcode = func ? callfunc(func, cmd, tail, mask)
+                        : evalcompound(cmd, tail, mask);
+    unswapstreams(&map, saved, false);
+    return exitcode;
+}
 
-        input = next_input;
-        if (!is_last) {
-            mkpipe(&next_input, &output);
+/* Start ssh for each host of 'fanout' as a process of a single job. Their
+ * standard output and error go into pipes of a fleet, which prefixes lines
+ * with the host, and then into standard output of the command as given by
+ * map. Returns NULL if no process could be started. */
+static fleet_t* startfleet(launch_t* launch, cmd_t* cmd, char** hosts,
+                           int nhosts, fdmap_t* map) {
+    int out = map->fd[STDOUT_FILENO];
+    out = fcntl(out >= 0 ? out : STDOUT_FILENO, F_DUPFD_CLOEXEC, NSTDFD);
+    fleet_t* fleet = mkfleet(out, nhosts);
+    char** command = fanoutcmd(cmd->argv + 1);
+    redir_t merge = {.mode = T_DUPOUT, .fd = STDERR_FILENO, .path = "1"};
+    int started = 0;
+
+    for (int i = 0; i < nhosts; i++) {
+        int output = fleetpipe(fleet, hosts[i]);
+        if (output < 0) {
+            msg("fanout: %s: %s\n", hosts[i], strerror(errno));
+            break;
         }
+        char** argv = sshargv(hosts[i], command);
+        cmd_t remote = {.kind = K_SIMPLE, .argv = argv, .redir = &merge,
+                        .nredir = 1};
+        while (argv[remote.argc])
+            remote.argc++;
+        fdlist_t none = {};
+        pid_t pid = do_stage(launch, -1, output, &remote, &none);
+        close(output);
+        joinjob(launch, pid, argv);
+        free(argv);
+        started++;
+    }
+
+    /* Fleet without streams goes away once it's drained. */
+    if (started == 0) {
+        drainfleets();
+        return NULL;
+    }
+    return fleet;
+}
 
-        stage_start = stage_end + 1;
+/* 'fanout HOSTFILE -- command...' is a job of ssh processes, one for each
+ * host. Exit code is the number of hosts where command has failed. */
+static int do_fanout(launch_t* launch, cmd_t* cmd, fdlist_t* fds) {
+    const char* path = cmd->argv[1];
+    int nhosts = 0;
+    char** hosts = readhosts(path, &nhosts);
+    fleet_t* fleet = NULL;
+    fdmap_t map;
+
+    /* Substituted pipelines may only provide the host file. */
+    closefds(fds);
+    if (hosts == NULL) {
+        msg("fanout: %s: %s\n", path, strerror(errno));
+    } else if (nhosts == 0) {
+        msg("fanout: %s: no hosts\n", path);
+    } else {
+        if (do_redir(cmd, -1, -1, &map, false))
+            fleet = startfleet(launch, cmd, hosts, nhosts, &map);
+        closemap(&map);
+    }
+    free(hosts);
+
+    if (launch->job == -1)
+        return EXIT_FAILURE;
+    if (fleet == NULL) {
+        /* Wait for substituted pipelines, they've lost their readers. */
+        (void)monitorjob(launch->mask, NULL);
+        return EXIT_FAILURE;
     }
 
-    close(next_input);
+    fleetjob(launch->job, cmd->argv);
+    setdeadline(launch->job, &launch->timeout);
+    if (launch->bg) {
+        announcejob(launch->job);
+        return 0;
+    }
+    int status = monitorjob(launch->mask, NULL);
+    if (status >= 0)
+        endfleet(fleet);
+    return exitstatus(status);
+}
+
+/* Execute internal command within shell's process or execute external command
+ * in a subprocess. External command can be run in the background. Caller
+ * must block SIGCHLD, mask is the one to restore when waiting. Exit code is
+ * also stored in codes[0]. If tail is set, the shell has nothing left to do
+ * once the command finishes. */
+static int do_job(cmd_t* cmd, bool bg, bool tail, sigset_t* mask,
+                  int* codes) {
+    launch_t launch = {.job = -1, .bg = bg, .mask = mask, .nstages = 1};
+    fdlist_t fds = {};
+    int exitcode = 0;
+
+    cmd = do_expand(&launch, cmd, &fds);
+    char** words = cmd->argv;
+    cmd = do_timeout(&launch, cmd);
+
+    /* Substituted pipelines have left their positions behind. */
+    launch.stage = 0;
+    launch.nstages = 1;
+
+    if (fanout_p(cmd)) {
+        exitcode = do_fanout(&launch, cmd, &fds);
+        codes[0] = exitcode;
+        return exitcode;
+    }
+
+    /* Commands of a compound command or function would become jobs while
+     * those of substitutions aren't finished, so it runs in a subprocess
+     * then. */
+    ast_t* func = cmd->kind == K_SIMPLE ? findfunc(cmd->argv[0]) : NULL;
+    if ((func || cmd->kind != K_SIMPLE) && !bg && launch.job == -1 &&
+        !launch.timeout.after &&
+        (cmd->kind != K_SUBSHELL || (tail && !ringed_p(cmd)))) {
+        exitcode = run_inshell(cmd, func, tail, mask);
+        codes[0] = exitcode;
+        return exitcode;
+    }
+
+    /* Process substitutions are jobs of the shell, they must be waited for,
+     * so is a command with a deadline. Output of a ring needs the shell. */
+    if (tail && launch.job == -1 && !launch.timeout.after &&
+        !shellcmd_p(cmd) && !ringed_p(cmd)) {
+        tailexec(cmd);
+        codes[0] = EXIT_FAILURE;
+        return EXIT_FAILURE;
+    }
+
+    if (builtincmd_p(cmd) && !launch.timeout.after) {
+        exitcode = run_builtin(cmd, -1, -1);
+        closefds(&fds);
+        /* Wait for substituted pipelines, they've lost their reader or
+         * writer by now, so they're about to finish. */
+        if (launch.job != -1) {
+            ringjob(launch.job, takering());
+            setdeadline(launch.job, &launch.timeout);
+            (void)monitorjob(mask, NULL);
+        }
+        codes[0] = exitcode;
+        return exitcode;
+    }
+
+    /* DONE:: Start a subprocess, create a job and monitor it. */    
+    pid_t pid = do_stage(&launch, -1, -1, cmd, &fds);
+    closefds(&fds);
+    joinjob(&launch, pid, words);
+    ringjob(launch.job, takering());
+    setdeadline(launch.job, &launch.timeout);
 
     if (!bg) {
-        monitorjob(&mask);
+        exitcode = exitstatus(monitorjob(mask, NULL));
+        /* Executable might have been removed since we remembered its path. */
+        if (exitcode == EXIT_NOTFOUND)
+            forgetcmd(cmd->argv[0]);
     } else {
-        msg("[%d] running '%s'\n", job, jobcmd(job));
+        announcejob(launch.job);
     }
 
-    Sigprocmask(SIG_SETMASK, &mask, NULL);
+    codes[0] = exitcode;
     return exitcode;
 }
 
-static bool is_pipeline(token_t* token, int ntokens) {
-    for (int i = 0; i < ntokens; i++)
-        if (token[i] == T_PIPE)
+/* Start command as a background job on behalf of a builtin, which collects
+ * the job itself, hence it isn't announced. Standard input & output are
+ * given descriptors, -1 means those of the shell. Returns the job number. */
+int spawnjob(char** argv, int input, int output, sigset_t* mask) {
+    launch_t launch = {.job = -1, .bg = true, .mask = mask, .nstages = 1};
+    cmd_t cmd = {.argv = argv};
+    fdlist_t fds = {};
+
+    while (argv[cmd.argc])
+        cmd.argc++;
+
+    pid_t pid = do_stage(&launch, input, output, &cmd, &fds);
+    joinjob(&launch, pid, argv);
+    return launch.job;
+}
+
+/* Does any of held builtins read standard input of the shell, which may be
+ * the terminal? */
+static bool readstty(stage_t* held, int n) {
+    for (int i = 0; i < n; i++)
+        if (held[i].input < 0 && filter_p(held[i].cmd->argv[0]))
             return true;
     return false;
 }
 
-static void eval(char* cmdline) {
-    bool bg = false;
-    int ntokens;
-    token_t* token = tokenize(cmdline, &ntokens);
+/* Pipeline execution creates a multiprocess job. External commands are
+ * executed in subprocesses. Builtins of a foreground pipeline run within
+ * the shell after all subprocesses have been started, so they write directly
+ * into pipes that are being read. They're run from last to first, hence the
+ * reader of a builtin's output is either running or has already finished.
+ * Exit code is that of last command, codes of all of them are put into
+ * codes unless pipeline runs in the background. */
+static int do_pipeline(pipeline_t* pipeline, bool bg, sigset_t* mask,
+                       int* codes) {
+    launch_t launch = {.job = -1, .bg = bg, .mask = mask, .nstages = 1};
+    int input = -1;
+    bool deferred = false; /* previous stage is a builtin that was deferred */
+    int* spawned = arena_alloc(&line_arena, sizeof(int) * pipeline->ncmd);
+    int nspawned = 0;      /* stages run by subprocesses, in order */
+
+    launch.held = arena_alloc(&line_arena, sizeof(stage_t) * pipeline->ncmd);
+
+    /* Files of wide pipelines are opened before any stage is started. */
+    cmd_t** expanded = NULL;
+    if (batchable_p(pipeline)) {
+        expanded = arena_alloc(&line_arena, sizeof(cmd_t*) * pipeline->ncmd);
+        for (int i = 0; i < pipeline->ncmd; i++) {
+            fdlist_t none = {};
+            expanded[i] = do_expand(&launch, &pipeline->cmd[i], &none);
+        }
+        startbatch(expanded, pipeline->ncmd);
+    }
+
+    /* DONE: Start pipeline subprocesses, create a job and monitor it.
+     * Remember to close unused pipe ends! */
+    for (int i = 0; i < pipeline->ncmd; i++) {
+        int output = -1, next_input = -1;
+        fdlist_t fds = {};
+
+        if (i < pipeline->ncmd - 1)
+            takepipe(&next_input, &output);
+
+        cmd_t* cmd = expanded ? expanded[i]
+                              : do_expand(&launch, &pipeline->cmd[i], &fds);
+        char** words = cmd->argv;
+        cmd = do_timeout(&launch, cmd);
+
+        /* Builtin reading output of another deferred builtin would wait
+         * forever, since the writer only runs after the reader. */
+        deferred = !bg && builtincmd_p(cmd) &&
+                   !(filter_p(cmd->argv[0]) && deferred);
+
+        if (deferred) {
+            launch.held[launch.nheld++] =
+                (stage_t){cmd, input, output, fds, i};
+            input = next_input;
+            continue;
+        }
+
+        launch.stage = i;
+        launch.nstages = pipeline->ncmd;
+        pid_t pid = do_stage(&launch, input, output, cmd, &fds);
+
+        closeredir(input, output);
+        closefds(&fds);
+
+        joinjob(&launch, pid, words);
+        spawned[nspawned++] = i;
 
-    if (ntokens > 0 && token[ntokens - 1] == T_BGJOB) {
-        token[--ntokens] = NULL;
-        bg = true;
+        input = next_input;
+    }
+
+    if (launch.job != -1) {
+        ringjob(launch.job, takering());
+        setdeadline(launch.job, &launch.timeout);
+    }
+
+    /* Processes that read the terminal would be stopped while builtins run,
+     * unless those read it themselves. */
+    if (launch.job != -1 && !bg && !readstty(launch.held, launch.nheld))
+        handoffjob();
+
+    while (launch.nheld > 0) {
+        stage_t* stage = &launch.held[--launch.nheld];
+        codes[stage->index] =
+            run_builtin(stage->cmd, stage->input, stage->output);
+        closeredir(stage->input, stage->output);
+        closefds(&stage->fds);
+    }
+    endbatch();
+
+    /* Pipeline might have consisted of builtins only. */
+    if (launch.job == -1)
+        return codes[pipeline->ncmd - 1];
+
+    if (bg) {
+        announcejob(launch.job);
+        return 0;
     }
 
-    if (ntokens > 0) {
-        if (is_pipeline(token, ntokens)) {
-            do_pipeline(token, ntokens, bg);
+    /* Stopped job has no statuses yet. */
+    int* statuses = arena_alloc(&line_arena, sizeof(int) * pipeline->ncmd);
+    for (int k = 0; k < nspawned; k++)
+        statuses[k] = -1;
+    (void)monitorjob(mask, statuses);
+    for (int k = 0; k < nspawned; k++)
+        codes[spawned[k]] = exitstatus(statuses[k]);
+
+    return codes[pipeline->ncmd - 1];
+}
+
+/* Measures time & resources used by a pipeline preceded by 'time'. Its
+ * processes are accounted as children of the shell once they're buried,
+ * builtins that ran within the shell as the shell itself. */
+typedef struct {
+    struct timespec real;
+    struct rusage self, children;
+} stopwatch_t;
+
+static void startwatch(stopwatch_t* sw) {
+    clock_gettime(CLOCK_MONOTONIC, &sw->real);
+    getrusage(RUSAGE_SELF, &sw->self);
+    getrusage(RUSAGE_CHILDREN, &sw->children);
+}
+
+static long usecs(struct timeval tv) {
+    return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+static void printtime(const char* label, long usec) {
+    long msec = usec / 1000;
+    msg("%s\t%ldm%ld.%03lds\n", label, msec / 60000, msec / 1000 % 60,
+        msec % 1000);
+}
+
+static void stopwatch(stopwatch_t* sw) {
+    stopwatch_t now;
+    startwatch(&now);
+
+    long real = (now.real.tv_sec - sw->real.tv_sec) * 1000000L +
+                (now.real.tv_nsec - sw->real.tv_nsec) / 1000;
+    long user = usecs(now.self.ru_utime) - usecs(sw->self.ru_utime) +
+                usecs(now.children.ru_utime) - usecs(sw->children.ru_utime);
+    long sys = usecs(now.self.ru_stime) - usecs(sw->self.ru_stime) +
+               usecs(now.children.ru_stime) - usecs(sw->children.ru_stime);
+
+    msg("\n");
+    printtime("real", real);
+    printtime("user", user);
+    printtime("sys", sys);
+}
+
+/* Reads another line of input that follows the command line being evaluated.
+ * Returns false at end of input. Trailing newline is dropped. */
+typedef bool (*reader_t)(strbuf_t* line);
+
+/* Here-documents are read from the same input as command lines, in order of
+ * appearance, each ends with a line that is equal to its delimiter. */
+static void readheredocs(ast_t* ast, reader_t readmore) {
+    strbuf_t body = {}, line = {};
+
+    heredocs = arena_alloc(&line_arena, sizeof(char*) * ast->nheredoc);
+
+    for (int i = 0; i < ast->nheredoc; i++) {
+        body.len = 0;
+        strappn(&body, "", 0);
+
+        while (true) {
+            if (!readmore(&line)) {
+                msg("warning: here-document delimited by end of file "
+                    "(wanted '%s')\n", ast->heredoc[i]);
+                break;
+            }
+            if (!strcmp(line.str, ast->heredoc[i]))
+                break;
+            strappn(&body, line.str, line.len);
+            strappn(&body, "\n", 1);
+        }
+
+        heredocs[i] = arena_strndup(&line_arena, body.str, body.len);
+    }
+
+    free(body.str);
+    free(line.str);
+}
+
+/* Exit codes of stages of last pipeline are kept in PIPESTATUS variable. They
+ * were saved when stages were buried, so reading them costs no system call. */
+static void setpipestatus(int* codes, int n) {
+    static strbuf_t value;
+
+    value.len = 0;
+    strappn(&value, "", 0);
+    for (int i = 0; i < n; i++) {
+        char code[16];
+        safe_snprintf(code, sizeof(code), i ? " %d" : "%d", codes[i]);
+        strapp(&value, code);
+    }
+    setvar("PIPESTATUS", value.str, false);
+}
+
+/* Tells if there's nothing to read after current line, NULL if the shell is
+ * interactive. */
+static bool (*atend)(void);
+
+/* Evaluate pipelines of a list, caller must block SIGCHLD and mask is the
+ * one to restore when waiting. If last is set, nothing follows the list.
+ * Returns exit code of the list, which is also that of last pipeline. */
+static int evallist(ast_t* ast, sigset_t* mask, bool last) {
+    int exitcode = 0;
+    token_t sep = T_NULL; /* operator preceding current pipeline */
+
+    for (int i = 0; i < ast->npipe && !unwinding(); i++) {
+        pipeline_t* pipeline = &ast->pipe[i];
+        bool bg = pipeline->sep == T_BGJOB;
+
+        /* Skip pipelines whose outcome would not change the result of list,
+         * i.e. in 'false && a || b' we skip 'a' and then execute 'b'. */
+        bool skip = (sep == T_AND && exitcode != 0) ||
+                    (sep == T_OR && exitcode == 0);
+        sep = pipeline->sep;
+        if (skip)
+            continue;
+
+        stopwatch_t sw;
+        if (pipeline->timed)
+            startwatch(&sw);
+
+        int* codes = arena_alloc(&line_arena, sizeof(int) * pipeline->ncmd);
+        memset(codes, 0, sizeof(int) * pipeline->ncmd);
+
+        if (pipeline->ncmd > 1) {
+            exitcode = do_pipeline(pipeline, bg, mask, codes);
         } else {
-            do_job(token, ntokens, bg);
+            bool tail = last && i == ast->npipe - 1 && !bg &&
+                        !pipeline->negate && !pipeline->timed;
+            exitcode = do_job(&pipeline->cmd[0], bg, tail, mask, codes);
         }
+        setpipestatus(codes, pipeline->ncmd);
+
+        /* Background job is still running, nothing to report. */
+        if (pipeline->timed && !bg)
+            stopwatch(&sw);
+
+        if (pipeline->negate)
+            exitcode = !exitcode;
+        last_exitcode = exitcode;
     }
 
-    free(token);
+    return exitcode;
 }
 
-int main(int argc, char* argv[]) {
-    rl_initialize();
+/* Signal mask of the shell with SIGCHLD blocked, the previous one is kept in
+ * mask. On Linux the signal is blocked all the time, so there's nothing to
+ * change. */
+static void blocksigchld(sigset_t* mask) {
+#ifdef LINUX
+    *mask = shell_mask;
+#else
+    Sigprocmask(SIG_BLOCK, &sigchld_mask, mask);
+#endif
+}
 
-    sigemptyset(&sigchld_mask);
-    sigaddset(&sigchld_mask, SIGCHLD);
+/* Compound command may span several lines, which are joined together with
+ * newlines. Returns line that is complete or ends the input. */
+static const char* joinlines(const char* line, reader_t readmore) {
+    static strbuf_t joined;
+    strbuf_t more = {};
+
+    if (!continued_p(line))
+        return line;
 
-    initjobs();
+    joined.len = 0;
+    strapp(&joined, line);
+    while (continued_p(joined.str) && !sigint_received && readmore(&more)) {
+        strappn(&joined, "\n", 1);
+        strappn(&joined, more.str, more.len);
+    }
+    free(more.str);
+    return joined.str;
+}
+
+static void eval(const char* line, reader_t readmore) {
+    /* Evaluation of previous line might have been interrupted by SIGINT,
+     * so release its memory before we start rather than when we're done. */
+    flushglobs();
+    arena_reset(&line_arena);
+    sigint_received = 0;
+    line = joinlines(line, readmore);
+
+    /* Line has just been read. */
+    uint64_t start = stamp();
+    ast_t* ast = compile(&line_arena, line);
+    record(PH_COMPILE, start);
+    if (ast == NULL)
+        return;
+
+    /* Nothing else is compiled until here-documents have been read. */
+    if (ast->nheredoc) {
+        readheredocs(ast, readmore);
+        if (sigint_received)
+            return;
+    }
+    ast->busy++;
+
+    /* Shell that has nothing else to do may execute last command in its
+     * place, unless it has to report on jobs or to dump statistics. */
+    bool last = atend && atend() && !tracing && countjobs() == 0;
 
-    Signal(SIGINT, sigint_handler);
-    Signal(SIGTSTP, SIG_IGN);
-    Signal(SIGTTIN, SIG_IGN);
-    Signal(SIGTTOU, SIG_IGN);
+    /* Whole list runs in a single critical section protecting against
+     * SIGCHLD, waiting for jobs lets the signal in temporarily. */
+    sigset_t mask;
+    blocksigchld(&mask);
+    (void)evallist(ast, &mask, last);
+
+    ast->busy--;
+#ifndef LINUX
+    Sigprocmask(SIG_SETMASK, &mask, NULL);
+#endif
+    record(PH_LINE, start);
+}
+
+/* Subshell, and other compound command or function that's part of a pipeline
+ * or runs in the background, is evaluated by a forked copy of the shell. So
+ * is 'fanout' that's part of a pipeline. It starts with no jobs and does no
+ * job control, and nothing follows it. */
+static noreturn void runbody(cmd_t* cmd) {
+    interactive = false;
+    Signal(SIGINT, SIG_DFL);
+    resetjobs();
+    posix_spawnattr_destroy(&spawnattr);
+    initspawn();
+
+    sigset_t mask;
+    blocksigchld(&mask);
+    if (fanout_p(cmd)) {
+        launch_t launch = {.job = -1, .mask = &mask, .nstages = 1};
+        fdlist_t fds = {};
+        exit(do_fanout(&launch, cmd, &fds));
+    }
+    ast_t* func = cmd->kind == K_SIMPLE ? findfunc(cmd->argv[0]) : NULL;
+    exit(func ? callfunc(func, cmd, !tracing, &mask)
+              : evalcompound(cmd, !tracing, &mask));
+}
+
+/* Continuation lines of interactive input get a different prompt. */
+static bool readprompt(strbuf_t* line) {
+    char* s = editline("> ");
+    if (s == NULL)
+        return false;
+
+    line->len = 0;
+    strapp(line, s);
+    free(s);
+    return true;
+}
 
+/* Read commands from terminal with line editing and history. */
+static void interact(void) {
     char* line;
     while (true) {
         if (!sigsetjmp(loop_env, 1)) {
-            line = readline("# ");
+            refreshindex();
+            at_prompt = true;
+            line = editline("# ");
+            at_prompt = false;
         } else {
             msg("\n");
             continue;
@@ -292,15 +1716,151 @@ int main(int argc, char* argv[]) {
             break;
 
         if (strlen(line)) {
-            add_history(line);
-            eval(line);
+            addhistory(line);
+            eval(line, readprompt);
         }
         free(line);
         watchjobs(FINISHED);
+        fillpipes();
     }
 
     msg("\n");
+}
+
+/* Read next line of a script of any length. Trailing newline is dropped. */
+static bool readscript(rio_t* rio, strbuf_t* line) {
+    char* view;
+    ssize_t n;
+
+    line->len = 0;
+    strappn(line, "", 0);
+
+    while ((n = rio_readline_view(rio, &view)) > 0) {
+        bool eol = view[n - 1] == '\n';
+        strappn(line, view, n - eol);
+        if (eol)
+            return true;
+    }
+
+    if (n < 0)
+        unix_error("Read error");
+    return line->len > 0;
+}
+
+static rio_t script_rio;
+
+static bool readnext(strbuf_t* line) {
+    return readscript(&script_rio, line);
+}
+
+/* Script that is a regular file has ended if everything has been read. */
+static bool scriptend(void) {
+    struct stat sb;
+    int fd = script_rio.rio_fd;
+
+    if (script_rio.rio_cnt > 0 || fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode))
+        return false;
+    return lseek(fd, 0, SEEK_CUR) >= sb.st_size;
+}
+
+/* Execute commands from a file, one line at a time. */
+static void runscript(int fd) {
+    strbuf_t line = {};
+
+    atend = scriptend;
+    rio_readinitb(&script_rio, fd);
+    while (readnext(&line)) {
+        if (line.len)
+            eval(line.str, readnext);
+        watchjobs(FINISHED);
+        fillpipes();
+    }
+    free(line.str);
+}
+
+static const char* nextcmds; /* rest of 'shell -c' argument */
+
+static bool readstring(strbuf_t* line) {
+    if (*nextcmds == '\0')
+        return false;
+
+    size_t len = strcspn(nextcmds, "\n");
+    line->len = 0;
+    strappn(line, nextcmds, len);
+    nextcmds += len;
+    if (*nextcmds)
+        nextcmds++;
+    return true;
+}
+
+static bool stringend(void) {
+    return *nextcmds == '\0';
+}
+
+/* Execute commands given as 'shell -c', lines are separated by newlines. */
+static void runstring(const char* cmds) {
+    strbuf_t line = {};
+
+    atend = stringend;
+    nextcmds = cmds;
+    while (readstring(&line)) {
+        if (line.len)
+            eval(line.str, readstring);
+        watchjobs(FINISHED);
+        fillpipes();
+    }
+    free(line.str);
+}
+
+int main(int argc, char* argv[]) {
+    const char* cmds = NULL;
+    int script = STDIN_FILENO;
+
+    if (argc > 1 && !strcmp(argv[1], "-c")) {
+        if (argc < 3)
+            app_error("usage: %s [-c command | script]", argv[0]);
+        cmds = argv[2];
+    } else if (argc > 1) {
+        script = Open(argv[1], O_RDONLY | O_CLOEXEC, 0);
+        params = (params_t){argv + 2, argc - 2};
+    }
+
+    /* Without a terminal there is no one to do job control for. */
+    interactive = !cmds && script == STDIN_FILENO && isatty(STDIN_FILENO);
+
+    sigemptyset(&sigchld_mask);
+    sigaddset(&sigchld_mask, SIGCHLD);
+
+    initvars(environ);
+    inittrace();
+
+    initjobs(interactive);
+#ifdef LINUX
+    Sigprocmask(SIG_BLOCK, NULL, &shell_mask);
+#endif
+
+    /* Builtins running within the shell may write into pipes whose readers
+     * are gone, which must not kill us. Children get default disposition. */
+    ignoresig(SIGPIPE);
+
+    if (interactive) {
+        Signal(SIGINT, sigint_handler);
+        ignoresig(SIGTSTP);
+        ignoresig(SIGTTIN);
+        ignoresig(SIGTTOU);
+    }
+    initspawn();
+
+    if (interactive) {
+        interact();
+    } else if (cmds) {
+        runstring(cmds);
+    } else {
+        runscript(script);
+    }
+
     shutdownjobs();
 
-    return 0;
+    /* Same as if the last command had been executed in place of the shell. */
+    return last_exitcode;
 }
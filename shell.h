@@ -1,12 +1,22 @@
 #ifndef _SHELL_H_
 #define _SHELL_H_
 
+/* Hot system call wrappers are compiled into the shell. */
+#define CSAPP_INLINE
 #include "csapp.h"
+#include <dirent.h>
 
-#define msg(...) dprintf(STDERR_FILENO, __VA_ARGS__)
+/* Exit status of a child that could not find the command to execute. */
+#define EXIT_NOTFOUND 127
+/* Exit status of a job that was killed because its deadline passed. */
+#define EXIT_TIMEDOUT 124
+/* Exit status of a command line that could not be parsed. */
+#define EXIT_SYNTAX 2
+
+#define msg(...) safe_dprintf(STDERR_FILENO, __VA_ARGS__)
 
 #if DEBUG > 0
-#define debug(...) dprintf(STDERR_FILENO, __VA_ARGS__)
+#define debug(...) safe_dprintf(STDERR_FILENO, __VA_ARGS__)
 #else
 #define debug(...)
 #endif
@@ -23,11 +33,129 @@ typedef char* token_t;
 #define T_INPUT ((token_t)7)
 #define T_APPEND ((token_t)8)
 #define T_BANG ((token_t)9)
+#define T_LPAREN ((token_t)10) /* '(' followed by text of subshell's list */
+#define T_RPAREN ((token_t)11)
+#define T_PSUBIN ((token_t)12)  /* '<(' followed by text of pipeline */
+#define T_PSUBOUT ((token_t)13) /* '>(' followed by text of pipeline */
+#define T_HEREDOC ((token_t)14)  /* '<<' */
+#define T_HERESTR ((token_t)15)  /* '<<<' */
+#define T_DUPIN ((token_t)16)    /* '<&' */
+#define T_DUPOUT ((token_t)17)   /* '>&' */
+#define T_OUTALL ((token_t)18)   /* '&>' */
+#define T_APPENDALL ((token_t)19) /* '&>>' */
+#define T_IONUM ((token_t)20)    /* followed by descriptor number of redirection */
+#define T_EXPAND ((token_t)21)   /* followed by word to expand, see tokenize */
+#define T_GROUP ((token_t)22)    /* '{' followed by text of group's list */
+#define T_COMPOUND ((token_t)23) /* followed by reserved words and texts of
+                                  * lists between them, e.g. 'if', text,
+                                  * 'then', text, 'fi' */
+#define T_FUNC ((token_t)24)     /* '()' after name of function */
+#define T_MAXOP T_FUNC
 #define separator_p(t) ((t) <= T_COLON)
-#define string_p(t) ((t) > T_BANG)
+#define string_p(t) ((t) > T_MAXOP)
+
+/* Growable string that remembers its length, so appending takes time
+ * proportional to the length of appended text. */
+typedef struct {
+    char* str;   /* NUL-terminated contents, NULL if nothing appended yet */
+    size_t len;  /* length of contents */
+    size_t size; /* size of allocated buffer */
+} strbuf_t;
+
+void strapp(strbuf_t* sb, const char* src);
+void strappn(strbuf_t* sb, const char* src, size_t n);
+
+/* Memory that is released all at once, e.g. when command line finishes. */
+typedef struct {
+    struct arena_chunk* first; /* list of chunks owned by the arena */
+    struct arena_chunk* cur;   /* chunk we're allocating from */
+    size_t used;               /* number of bytes used in current chunk */
+} arena_t;
+
+void* arena_alloc(arena_t* arena, size_t n);
+char* arena_strdup(arena_t* arena, const char* s);
+char* arena_strndup(arena_t* arena, const char* s, size_t n);
+void arena_reset(arena_t* arena);
+
+/* Position within an arena, memory allocated after it can be released. */
+typedef struct {
+    struct arena_chunk* cur;
+    size_t used;
+} arena_mark_t;
+
+arena_mark_t arena_mark(arena_t* arena);
+void arena_release(arena_t* arena, arena_mark_t mark);
+
+token_t* tokenize(arena_t* arena, char* s, int* tokc_p);
+bool continued_p(const char* line);
 
-void strapp(char** dstp, const char* src);
-token_t* tokenize(char* s, int* tokc_p);
+/* Syntax tree of a command line. It's shared by all executions of the same
+ * line, so it must never be modified while evaluating it. */
+typedef struct {
+    token_t mode; /* T_INPUT, T_OUTPUT, T_APPEND, T_HEREDOC, T_DUPOUT, ... */
+    int fd;       /* descriptor being redirected */
+    int heredoc;  /* number of here-document within line or -1 */
+    char* path;   /* file name, descriptor to duplicate or here-string */
+    bool expand;  /* path is subject to variable expansion */
+} redir_t;
+
+/* Process substitution, i.e. '<(pipeline)' or '>(pipeline)'. */
+typedef struct {
+    int word;      /* index of argv word to be replaced or -1 */
+    int redir;     /* index of redirection to be replaced or -1 */
+    bool output;   /* command writes into the pipeline */
+    char* cmdline; /* text of the pipeline, compiled when it's started */
+} psub_t;
+
+/* Compound commands consist of lists, which are compiled into trees of their
+ * own when the command is. */
+typedef enum {
+    K_SIMPLE,   /* words and redirections */
+    K_SUBSHELL, /* '( list )' */
+    K_GROUP,    /* '{ list; }' */
+    K_IF,       /* 'if list; then list; [elif list; then list;]...
+                 *  [else list;] fi' */
+    K_WHILE,    /* 'while list; do list; done' */
+    K_UNTIL,    /* 'until list; do list; done' */
+    K_FOR,      /* 'for name [in word...]; do list; done' */
+    K_FUNCTION, /* 'name() compound-command' */
+} kind_t;
+
+typedef struct {
+    char** argv;    /* NULL-terminated vector of words */
+    int argc;       /* number of words, always positive */
+    redir_t* redir; /* redirections in order of appearance */
+    int nredir;
+    psub_t* psub;   /* words and file names to be replaced with /dev/fd/N */
+    int npsub;
+    int* expand;    /* indices of argv words subject to expansion */
+    int nexpand;
+    char** envp;    /* environment of external command, NULL if shell's */
+    kind_t kind;
+    struct ast** sub; /* trees of lists in order of appearance, header of
+                       * 'for' or compound command of function */
+    int nsub;
+} cmd_t;
+
+typedef struct {
+    cmd_t* cmd;  /* commands connected with pipes */
+    int ncmd;
+    bool negate; /* pipeline preceded by '!' */
+    bool timed;  /* pipeline preceded by 'time' */
+    token_t sep; /* T_AND, T_OR, T_COLON, T_BGJOB or T_NULL if last one */
+} pipeline_t;
+
+typedef struct ast {
+    pipeline_t* pipe; /* pipelines in order of appearance */
+    int npipe;
+    char** heredoc;   /* delimiters of here-documents that follow the line */
+    int nheredoc;
+    int busy;         /* tree is used, belongs to a compound command of
+                       * another one or to a function, so it must not be
+                       * evicted from cache */
+} ast_t;
+
+ast_t* compile(arena_t* arena, const char* line);
 
 /* Do not change those values or code will break! */
 enum {
@@ -43,22 +171,309 @@ enum {
     STOPPED = 2,  /* jobs that have been suspended by SIGTSTP / SIGSTOP */
 };
 
-void initjobs(void);
+void initjobs(bool jobcontrol);
+void resetjobs(void);
 void shutdownjobs(void);
 
 int addjob(pid_t pgid, int bg);
 void addproc(int job, pid_t pid, char** argv);
 bool killjob(int job);
 void watchjobs(int state);
+void listjobs(bool verbose);
+void exportjobs(int format);
+void announcejob(int job);
 int jobstate(int job, int* exitcodep);
+int pgidjob(pid_t pgid);
 char* jobcmd(int job);
 bool resumejob(int job, int bg, sigset_t* mask);
-int monitorjob(sigset_t* mask);
+int monitorjob(sigset_t* mask, int* statuses);
+void handoffjob(void);
+int waitany(int* jobs, int njobs, sigset_t* mask, bool stopped);
+int* bgjobs(int* countp);
+int countjobs(void);
+int spawnjob(char** argv, int input, int output, sigset_t* mask);
+
+/* Formats of 'jobs --format', which monitors read instead of the listing. */
+enum {
+    JOBS_BINARY = 0, /* records below, in byte order of the host */
+    JOBS_JSON = 1,   /* one object per line, for each job */
+};
+
+/* Binary export is a jobshdr_t, then for each job a jobrec_t followed by
+ * nproc procrec_t and cmdlen bytes of its command, with no NUL. Layout
+ * only grows at the end of records, so readers skip by their sizes. */
+#define JOBS_MAGIC 0x4a4f4253 /* "JOBS" */
+#define JOBS_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t procsize; /* size of procrec_t */
+    uint32_t njobs;
+    uint32_t jobsize;  /* size of jobrec_t */
+} jobshdr_t;
+
+typedef struct {
+    uint32_t size;   /* of the whole record, its processes and command */
+    int32_t num;     /* job number */
+    int32_t pgid;
+    uint8_t state;   /* RUNNING, STOPPED or FINISHED */
+    uint8_t pad[3];
+    uint32_t nproc;
+    uint32_t cmdlen;
+} jobrec_t;
+
+typedef struct {
+    int32_t pid;
+    uint8_t state;     /* RUNNING, STOPPED or FINISHED */
+    uint8_t pad[3];
+    int32_t status;    /* as waitpid returns it, -1 until FINISHED */
+    uint32_t pad2;
+    int64_t realns;    /* time it has been running or ran for */
+    int64_t userus;    /* rest is valid once FINISHED, 0 till then */
+    int64_t sysus;
+    int64_t maxrsskb;
+    int64_t nvcsw;
+    int64_t nivcsw;
+} procrec_t;
+
+/* Priorities and resource limits of a job, see limits.c. */
+#define NONICE INT_MIN
+
+typedef struct {
+    int nice;       /* niceness of processes or NONICE */
+    int ioprio;     /* I/O class and level as ioprio_set takes them or -1 */
+    int cpumax;     /* percent of a CPU, -1 if unlimited, 0 if not set */
+    int64_t memmax; /* bytes of memory, -1 if unlimited, 0 if not set */
+} limits_t;
+
+extern const limits_t nolimits;
+
+bool limited_p(const limits_t* lim);
+void mergelimits(limits_t* dst, const limits_t* src);
+bool setcgroup(char** pathp, int num, const limits_t* lim);
+void rmcgroup(const char* path);
+bool applylimits(pid_t pid, const limits_t* lim, const char* cgroup);
+bool limitjob(int job, const limits_t* lim);
+void limitbg(const limits_t* lim);
+
+/* Deadline of a job started by 'timeout'. */
+typedef struct {
+    uint64_t after;     /* nanoseconds till the job is signalled, 0 if never */
+    int sig;            /* signal it gets then */
+    uint64_t killafter; /* nanoseconds till SIGKILL follows, 0 if never */
+} timeout_t;
+
+char** parsetimeout(char** argv, timeout_t* t);
+void setdeadline(int job, const timeout_t* t);
+int jobsfd(void);
+void jobevents(void);
+void watchfd(int fd);
+void unwatchfd(int fd);
+
+/* Ring buffer that output of a job goes into, see ring.c. */
+typedef struct ring ring_t;
+
+int openring(void);
+ring_t* takering(void);
+void ringjob(int job, ring_t* ring);
+void numberring(ring_t* ring, int num);
+void dropring(int num);
+void endring(ring_t* ring);
+void drainrings(void);
+void resetrings(void);
+ring_t* findring(int num);
+bool showring(ring_t* ring, int fd, uint64_t* posp);
+
+/* Output of processes of a 'fanout' job, see fanout.c. */
+typedef struct fleet fleet_t;
+
+char** fanoutcmd(char** argv);
+char** readhosts(const char* path, int* countp);
+char** sshargv(const char* host, char** cmd);
+fleet_t* mkfleet(int fd, int nhosts);
+int fleetpipe(fleet_t* fleet, const char* host);
+void fleetjob(int job, char** argv);
+void drainfleets(void);
+void endfleet(fleet_t* fleet);
+void resetfleets(void);
+void writeiov(int fd, struct iovec* iov, int n);
+
+/* File to be opened by a batch, see uring.c. */
+typedef struct {
+    const char* path;
+    int flags;
+    mode_t mode;
+    bool linked; /* cancelled if the previous one has failed */
+    int fd;      /* descriptor once opened or -errno */
+} openreq_t;
+
+bool uring_openall(openreq_t* reqs, int n);
+void uring_closeall(const int* fds, int n);
+
+int coprocfd(const char* name);
+int startcoproc(const char* name, char** argv, sigset_t* mask);
+bool endcoproc(const char* name);
+bool dropcoproc(const char* name);
+void listcoprocs(void);
+void resetcoprocs(void);
+
+int memorun(char** argv, char** env, long ttl);
+bool memoclear(void);
+
+void initzygote(void);
+void dropzygote(void);
+int zygote_spawn(pid_t* pidp, const char* path, char** argv, char** envp,
+                 pid_t pgid, const sigset_t* mask, const int* stdfd,
+                 const int* fds, int nfds);
+
+char* editline(const char* prompt);
+void addhistory(const char* line);
+
+void openhistory(void);
+void loadhistory(void (*add)(const char*), int max);
+void savehistory(const char* line);
+
+/* Shell functions, see func.c. */
+void definefunc(const char* name, ast_t* body);
+ast_t* findfunc(const char* name);
+bool unsetfunc(const char* name);
+
+/* Pending 'break', 'continue' or 'return'. Evaluation of lists stops until
+ * the loop or function they apply to is reached. */
+typedef struct {
+    int loops;  /* loops being executed by current function */
+    int funcs;  /* functions being executed */
+    int breaks; /* loops left to break out of */
+    bool next;  /* last of them goes on with next iteration */
+    bool ret;   /* function returns */
+} flow_t;
+
+extern flow_t flow;
+
+/* Placement of jobs on CPUs and NUMA nodes, see place.c. */
+#define MAXCPUS 1024
+#define MAXNODES 64
+
+typedef struct {
+    uint64_t cpus[MAXCPUS / 64]; /* CPUs jobs run on */
+    int ncpus;                   /* number of them, 0 if jobs run anywhere */
+    uint64_t nodes;              /* NUMA nodes memory is bound to, 0 if any */
+    bool local;                  /* memory comes from node job runs on */
+    bool spread;                 /* stages of pipelines get CPUs of their own */
+} placement_t;
+
+extern placement_t placement;
+
+bool parseset(const char* s, uint64_t* set, int n);
+void printset(int fd, const uint64_t* set, int n);
+int allowedcpus(uint64_t* set);
+void setplacement(const placement_t* pl);
+bool placed_p(void);
+void applyplacement(int stage, int n);
 
 int builtin_command(char** argv);
-noreturn void external_command(char** argv);
+bool builtin_p(const char* name);
+bool filter_p(const char* name);
+bool wrapper_p(char** argv);
+noreturn void external_command(char** argv, char** envp);
+noreturn void replaceshell(char** argv, char** envp);
+
+/* Sorted listing of a directory, see dir.c. */
+typedef struct {
+    char* name;
+    unsigned char type; /* DT_REG, DT_DIR, ... or DT_UNKNOWN */
+} dentry_t;
+
+typedef struct {
+    dentry_t* ent; /* entries sorted by name */
+    int nent;
+    int size;      /* number of allocated entries */
+    char* names;   /* block holding all names */
+} dirlist_t;
+
+#define DENTS_BUF (256 << 10) /* bytes read by single getdents */
+
+void addentry(dirlist_t* dl, strbuf_t* names, const char* name, int type);
+void finishlist(dirlist_t* dl, strbuf_t* names);
+bool readdirbuf(int dirfd, const char* path, dirlist_t* dl, char* buf);
+bool readdirlist(int dirfd, const char* path, dirlist_t* dl);
+void freedirlist(dirlist_t* dl);
+int prefixrange(dirlist_t* dl, const char* prefix, int* countp);
+dirlist_t* cachedir(const char* path);
+
+char** expandwords(arena_t* arena, cmd_t* cmd, int* argcp);
+char* unescape(arena_t* arena, const char* s, size_t len);
+void flushglobs(void);
+
+/* Exit code of the last pipeline, i.e. value of '$?'. */
+extern int last_exitcode;
+
+/* Environment of the builtin being run, with assignments its command line
+ * starts with, or NULL if there are none. */
+extern char** builtin_envp;
+
+/* Positional parameters, i.e. '$1', '$2', ... and their number '$#'. */
+typedef struct {
+    char** argv;
+    int argc;
+} params_t;
+
+extern params_t params;
+
+void initvars(char** env);
+const char* getvar(const char* name);
+void setvar(const char* name, const char* value, bool export);
+void unsetvar(const char* name);
+bool varname_p(const char* s);
+size_t assignment_p(const char* word);
+void assign(const char* word, bool export);
+char** envblock(void);
+char** overlayenv(arena_t* arena, char** assigns, int n);
+void listvars(bool exported);
+char* expandvars(arena_t* arena, const char* word);
+
+char* completecmd(const char* text, int state);
+char* completefile(const char* text, int state);
+
+const char* builtinname(int i);
+
+const char* lookupcmd(const char* name);
+int cmddirfd(const char* name);
+void forgetcmd(const char* name);
+void flushcmds(void);
+void listcmds(void);
+dirlist_t* commandlist(void);
+void refreshindex(void);
+
+/* Phases of command execution whose latencies are measured. */
+typedef enum {
+    PH_LINE,     /* evaluation of whole command line */
+    PH_COMPILE,  /* looking up or building syntax tree */
+    PH_TOKENIZE, /* splitting line into tokens if it's not cached */
+    PH_SPAWN,    /* posix_spawn, which returns once child has executed */
+    PH_FORK,     /* fork, as seen by the parent */
+    PH_EXEC,     /* from return of fork till child has executed */
+    PH_SIGCHLD,  /* waiting for first SIGCHLD from foreground job */
+    PH_MONITOR,  /* waiting for foreground job to finish or stop */
+    NPHASES
+} phase_t;
+
+/* Set if latencies are being measured, see stats.c. */
+extern bool tracing;
+
+void inittrace(void);
+uint64_t stamp(void);
+void record(phase_t phase, uint64_t start);
+void dumpstats(int fd);
 
 /* Used by Sigprocmask to enter critical section protecting against SIGCHLD. */
 extern sigset_t sigchld_mask;
 
+/* Set when user hits ^C while the shell is executing a command line. */
+extern volatile sig_atomic_t sigint_received;
+
+/* Capacity of pipes created for pipelines in bytes, 0 for system default. */
+extern int pipe_capacity;
+
 #endif /* !_SHELL_H_ */
@@ -0,0 +1,96 @@
+#include "shell.h"
+
+/* Opt-in instrumentation of shell's own latencies. When SHELL_STATS is set
+ * in the environment, durations of phases of command execution are put into
+ * histograms with power of two buckets of nanoseconds. SHELL_STATS=trace
+ * also reports every measurement as it's taken. When disabled, stamp does
+ * not even read the clock. */
+
+#define NBUCKETS 64
+
+typedef struct {
+    uint64_t count;
+    uint64_t total; /* sum of durations in nanoseconds */
+    uint64_t min, max;
+    uint64_t bucket[NBUCKETS]; /* bucket b counts durations in [2^b, 2^b+1) */
+} histogram_t;
+
+bool tracing = false;
+static bool verbose = false;
+static histogram_t histogram[NPHASES];
+
+static const char* phasename[NPHASES] = {
+    [PH_LINE] = "line",         [PH_COMPILE] = "compile",
+    [PH_TOKENIZE] = "tokenize", [PH_SPAWN] = "spawn",
+    [PH_FORK] = "fork",         [PH_EXEC] = "exec",
+    [PH_SIGCHLD] = "sigchld",   [PH_MONITOR] = "monitor",
+};
+
+void inittrace(void) {
+    const char* value = getvar("SHELL_STATS");
+    tracing = value != NULL;
+    verbose = tracing && !strcmp(value, "trace");
+}
+
+uint64_t stamp(void) {
+    if (!tracing)
+        return 0;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Account duration of a phase that began at start, as returned by stamp. */
+void record(phase_t phase, uint64_t start) {
+    if (!tracing || !start)
+        return;
+
+    uint64_t ns = stamp() - start;
+    histogram_t* h = &histogram[phase];
+
+    if (h->count == 0 || ns < h->min)
+        h->min = ns;
+    if (ns > h->max)
+        h->max = ns;
+    h->count++;
+    h->total += ns;
+    h->bucket[63 - __builtin_clzll(ns | 1)]++;
+
+    if (verbose)
+        msg("trace: %s %luns\n", phasename[phase], (unsigned long)ns);
+}
+
+/* Microseconds are fine for humans, nanoseconds for short phases. */
+static void printns(char* buf, size_t size, uint64_t ns) {
+    if (ns < 10000)
+        safe_snprintf(buf, size, "%luns", (unsigned long)ns);
+    else if (ns < 10000000)
+        safe_snprintf(buf, size, "%luus", (unsigned long)(ns / 1000));
+    else
+        safe_snprintf(buf, size, "%lums", (unsigned long)(ns / 1000000));
+}
+
+void dumpstats(int fd) {
+    char lo[16], hi[16], avg[16];
+
+    for (int p = 0; p < NPHASES; p++) {
+        histogram_t* h = &histogram[p];
+        if (h->count == 0)
+            continue;
+
+        printns(lo, sizeof(lo), h->min);
+        printns(avg, sizeof(avg), h->total / h->count);
+        printns(hi, sizeof(hi), h->max);
+        safe_dprintf(fd, "%-8s count %lu  min %s  avg %s  max %s\n",
+                     phasename[p], (unsigned long)h->count, lo, avg, hi);
+
+        for (int b = 0; b < NBUCKETS; b++) {
+            if (h->bucket[b] == 0)
+                continue;
+            printns(lo, sizeof(lo), 1ULL << b);
+            safe_dprintf(fd, "  >= %-8s %8lu\n", lo,
+                         (unsigned long)h->bucket[b]);
+        }
+    }
+}
@@ -0,0 +1,222 @@
+#include "shell.h"
+
+/* Files of redirections of a pipeline are opened by a single io_uring
+ * submission, so the kernel opens them side by side while the shell waits
+ * once, rather than once per file, which adds up on network filesystems.
+ * Their descriptors are closed the same way once all stages have started.
+ * Ring is set up when it's first needed, needs Linux 5.19 and is used by
+ * the process that set it up only, as its queues are shared with forked
+ * children otherwise. Callers fall back to plain system calls without it. */
+
+#ifdef LINUX
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(LINUX) && defined(IORING_SETUP_COOP_TASKRUN)
+
+#define URING_ENTRIES 64
+
+static struct {
+    int fd;       /* -1 until set up */
+    pid_t pid;    /* process that set it up */
+    bool broken;  /* can't be set up */
+    unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    unsigned entries;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* rings;
+    size_t ringsize, sqesize;
+} uring = {.fd = -1};
+
+static void dropuring(void) {
+    Munmap(uring.rings, uring.ringsize);
+    Munmap(uring.sqes, uring.sqesize);
+    Close(uring.fd);
+    uring.fd = -1;
+}
+
+static bool setupuring(void) {
+    if (uring.fd >= 0 && uring.pid == getpid())
+        return true;
+    if (uring.fd >= 0)
+        dropuring();
+    if (uring.broken)
+        return false;
+
+    /* Completions are run when the shell waits for them, which is all it
+     * does while the ring is busy. */
+    struct io_uring_params p = {
+        .flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN};
+    int fd = syscall(SYS_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0 || !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        if (fd >= 0)
+            close(fd);
+        uring.broken = true;
+        return false;
+    }
+
+    size_t sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    uring.ringsize = max(sqsize, cqsize);
+    uring.sqesize = p.sq_entries * sizeof(struct io_uring_sqe);
+    uring.rings = Mmap(NULL, uring.ringsize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    uring.sqes = Mmap(NULL, uring.sqesize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    char* base = uring.rings;
+    uring.sqhead = (unsigned*)(base + p.sq_off.head);
+    uring.sqtail = (unsigned*)(base + p.sq_off.tail);
+    uring.sqmask = (unsigned*)(base + p.sq_off.ring_mask);
+    uring.sqarray = (unsigned*)(base + p.sq_off.array);
+    uring.cqhead = (unsigned*)(base + p.cq_off.head);
+    uring.cqtail = (unsigned*)(base + p.cq_off.tail);
+    uring.cqmask = (unsigned*)(base + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe*)(base + p.cq_off.cqes);
+    uring.entries = p.sq_entries;
+    uring.fd = fd;
+    uring.pid = getpid();
+    return true;
+}
+
+/* Queue is empty whenever a batch is started, as each of them is waited
+ * for till it completes. */
+static struct io_uring_sqe* queuesqe(unsigned i, uint64_t id) {
+    unsigned tail = *uring.sqtail + i;
+    unsigned index = tail & *uring.sqmask;
+    struct io_uring_sqe* sqe = &uring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = id;
+    uring.sqarray[index] = index;
+    return sqe;
+}
+
+/* Submit n queued entries, wait for their completions and pass results on
+ * to done. Returns false if they couldn't be submitted, then the ring is
+ * given up on. */
+static bool runbatch(unsigned n, void (*done)(void* arg, uint64_t id,
+                                               int res), void* arg) {
+    __atomic_store_n(uring.sqtail, *uring.sqtail + n, __ATOMIC_RELEASE);
+
+    unsigned completed = 0, submitted = 0;
+    while (completed < n) {
+        int r = syscall(SYS_io_uring_enter, uring.fd, n - submitted,
+                        n - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && submitted == 0) {
+            dropuring();
+            uring.broken = true;
+            return false;
+        }
+        if (r < 0)
+            unix_error("io_uring_enter error");
+        submitted = n;
+
+        unsigned head = *uring.cqhead;
+        unsigned tail = __atomic_load_n(uring.cqtail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++, completed++) {
+            struct io_uring_cqe* cqe = &uring.cqes[head & *uring.cqmask];
+            done(arg, cqe->user_data, cqe->res);
+        }
+        __atomic_store_n(uring.cqhead, head, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+static void opened(void* arg, uint64_t id, int res) {
+    ((openreq_t*)arg)[id].fd = res;
+}
+
+/* Open files of requests from i on one by one. */
+static void openeach(openreq_t* reqs, int i, int n) {
+    for (; i < n; i++) {
+        if (reqs[i].linked && i > 0 && reqs[i - 1].fd < 0)
+            reqs[i].fd = -ECANCELED;
+        else if ((reqs[i].fd = open(reqs[i].path, reqs[i].flags,
+                                    reqs[i].mode)) < 0)
+            reqs[i].fd = -errno;
+    }
+}
+
+/* Open files of n requests at once. Request that's linked to the previous
+ * one is cancelled with ECANCELED if that has failed, so opens of a command
+ * stop at its first failure, as they would one by one. Returns false if
+ * io_uring can't be used, then none of them has been opened. */
+bool uring_openall(openreq_t* reqs, int n) {
+    if (!setupuring())
+        return false;
+
+    /* Chains are never split between batches. */
+    int chain = 0;
+    for (int i = 0; i < n; i++) {
+        chain = reqs[i].linked ? chain + 1 : 1;
+        if (chain > (int)uring.entries)
+            return false;
+    }
+
+    for (int start = 0; start < n;) {
+        int end = start;
+        while (end < n) {
+            int next = end + 1;
+            while (next < n && reqs[next].linked)
+                next++;
+            if (next - start > (int)uring.entries)
+                break;
+            end = next;
+        }
+
+        for (int i = start; i < end; i++) {
+            struct io_uring_sqe* sqe = queuesqe(i - start, i);
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t)(uintptr_t)reqs[i].path;
+            sqe->len = reqs[i].mode;
+            sqe->open_flags = reqs[i].flags;
+            if (i + 1 < end && reqs[i + 1].linked)
+                sqe->flags |= IOSQE_IO_LINK;
+        }
+        if (!runbatch(end - start, opened, reqs)) {
+            if (start == 0)
+                return false;
+            openeach(reqs, start, n);
+            break;
+        }
+        start = end;
+    }
+    return true;
+}
+
+static void closed(void* arg, uint64_t id, int res) {
+}
+
+/* Close n descriptors at once. */
+void uring_closeall(const int* fds, int n) {
+    int start = 0;
+    if (setupuring()) {
+        for (; start < n; start += min(n - start, (int)uring.entries)) {
+            int count = min(n - start, (int)uring.entries);
+            for (int i = 0; i < count; i++) {
+                struct io_uring_sqe* sqe = queuesqe(i, i);
+                sqe->opcode = IORING_OP_CLOSE;
+                sqe->fd = fds[start + i];
+            }
+            if (!runbatch(count, closed, NULL))
+                break;
+        }
+    }
+    for (; start < n; start++)
+        close(fds[start]);
+}
+#else
+bool uring_openall(openreq_t* reqs, int n) {
+    return false;
+}
+
+void uring_closeall(const int* fds, int n) {
+    for (int i = 0; i < n; i++)
+        close(fds[i]);
+}
+#endif
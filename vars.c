@@ -0,0 +1,337 @@
+#include "shell.h"
+
+/* Shell variables live in a hash table; each one is a single string in
+ * 'NAME=value' form, which is exactly what the environment of a child
+ * consists of. Environment block is an array of pointers to the strings of
+ * exported variables, rebuilt only when one of them changes, thus starting
+ * a command doesn't depend on the size of the environment. */
+
+typedef struct var {
+    struct var* next; /* next variable in the same bucket */
+    uint32_t hash;    /* jenkins_hash of name */
+    size_t namelen;
+    bool exported;
+    char* entry; /* 'NAME=value' */
+} var_t;
+
+static var_t** buckets = NULL;
+static int nbuckets = 0; /* power of two */
+static int nvars = 0;
+static int nexported = 0;
+
+static char** envp = NULL; /* environment block, NULL-terminated */
+static int envp_size = 0;
+static bool envp_stale = true;
+
+/* Exit code of the last pipeline, i.e. value of '$?'. */
+int last_exitcode = 0;
+
+/* Arguments of a script or of the function being executed. */
+params_t params;
+
+#define name_start_p(c) (isalpha((uint8_t)(c)) || (c) == '_')
+#define name_char_p(c) (isalnum((uint8_t)(c)) || (c) == '_')
+
+/* Returns length of variable name at the beginning of s, 0 if there's none. */
+static size_t namelen(const char* s) {
+    size_t n = 0;
+    if (name_start_p(s[0]))
+        while (name_char_p(s[n]))
+            n++;
+    return n;
+}
+
+bool varname_p(const char* s) {
+    size_t n = namelen(s);
+    return n > 0 && s[n] == '\0';
+}
+
+/* Returns length of name if word has 'NAME=value' form, 0 otherwise. */
+size_t assignment_p(const char* word) {
+    size_t n = namelen(word);
+    return n && word[n] == '=' ? n : 0;
+}
+
+static var_t** findvar(const char* name, size_t len, uint32_t hash) {
+    var_t** vp = &buckets[hash & (nbuckets - 1)];
+    for (; *vp; vp = &(*vp)->next)
+        if ((*vp)->hash == hash && (*vp)->namelen == len &&
+            !memcmp((*vp)->entry, name, len))
+            break;
+    return vp;
+}
+
+static void rehash(int size) {
+    var_t** old = buckets;
+    int nold = nbuckets;
+
+    buckets = calloc(size, sizeof(var_t*));
+    nbuckets = size;
+
+    for (int i = 0; i < nold; i++) {
+        for (var_t* v = old[i]; v;) {
+            var_t* next = v->next;
+            var_t** vp = &buckets[v->hash & (nbuckets - 1)];
+            v->next = *vp;
+            *vp = v;
+            v = next;
+        }
+    }
+    free(old);
+}
+
+static const char* lookupvar(const char* name, size_t len) {
+    if (nvars == 0)
+        return NULL;
+    var_t* v = *findvar(name, len, jenkins_hash(name, len, HASHINIT));
+    return v ? v->entry + len + 1 : NULL;
+}
+
+/* Returns value of variable or NULL if it isn't set. */
+const char* getvar(const char* name) {
+    return lookupvar(name, strlen(name));
+}
+
+/* Set variable given as name and its length, which keeps being exported
+ * if it was already. */
+static var_t* putvar(const char* name, size_t len, const char* value,
+                     bool export) {
+    uint32_t hash = jenkins_hash(name, len, HASHINIT);
+    if (nbuckets == 0)
+        rehash(256);
+    var_t** vp = findvar(name, len, hash);
+    var_t* v = *vp;
+    size_t vlen = strlen(value);
+
+    if (v == NULL) {
+        if (nvars >= nbuckets) {
+            rehash(nbuckets * 2);
+            vp = findvar(name, len, hash);
+        }
+        v = malloc(sizeof(var_t));
+        v->next = NULL;
+        v->hash = hash;
+        v->namelen = len;
+        v->exported = false;
+        v->entry = NULL;
+        *vp = v;
+        nvars++;
+    }
+
+    /* Values like PIPESTATUS are mostly set to what they already are. */
+    if (v->entry && !strcmp(v->entry + len + 1, value)) {
+        if (export && !v->exported) {
+            v->exported = true;
+            nexported++;
+            envp_stale = true;
+        }
+        return v;
+    }
+
+    char* entry = malloc(len + vlen + 2);
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    memcpy(entry + len + 1, value, vlen + 1);
+    free(v->entry);
+    v->entry = entry;
+
+    if (export && !v->exported) {
+        v->exported = true;
+        nexported++;
+    }
+    if (v->exported)
+        envp_stale = true;
+    return v;
+}
+
+void setvar(const char* name, const char* value, bool export) {
+    (void)putvar(name, strlen(name), value, export);
+}
+
+/* Perform assignment given as 'NAME=value'. */
+void assign(const char* word, bool export) {
+    size_t len = assignment_p(word);
+    assert(len > 0);
+    (void)putvar(word, len, word + len + 1, export);
+}
+
+void unsetvar(const char* name) {
+    size_t len = strlen(name);
+    if (nvars == 0)
+        return;
+    var_t** vp = findvar(name, len, jenkins_hash(name, len, HASHINIT));
+    var_t* v = *vp;
+
+    if (v == NULL)
+        return;
+
+    *vp = v->next;
+    if (v->exported) {
+        nexported--;
+        envp_stale = true;
+    }
+    free(v->entry);
+    free(v);
+    nvars--;
+}
+
+/* Import environment the shell was started with. */
+void initvars(char** env) {
+    for (; *env; env++) {
+        const char* eq = strchr(*env, '=');
+        if (eq && eq > *env)
+            (void)putvar(*env, eq - *env, eq + 1, true);
+    }
+}
+
+/* Returns environment for children, which stays valid until an exported
+ * variable changes. */
+char** envblock(void) {
+    if (!envp_stale)
+        return envp;
+
+    if (nexported + 1 > envp_size) {
+        envp_size = max(envp_size * 2, nexported + 1);
+        envp = realloc(envp, sizeof(char*) * envp_size);
+    }
+
+    int n = 0;
+    for (int i = 0; i < nbuckets; i++)
+        for (var_t* v = buckets[i]; v; v = v->next)
+            if (v->exported)
+                envp[n++] = v->entry;
+    envp[n] = NULL;
+
+    envp_stale = false;
+    return envp;
+}
+
+/* Environment of a command preceded by n assignments, allocated from arena.
+ * Entries of variables being assigned are left out of shell's environment. */
+char** overlayenv(arena_t* arena, char** assigns, int n) {
+    char** env = envblock();
+    int nenv = 0;
+
+    while (env[nenv])
+        nenv++;
+
+    char** overlay = arena_alloc(arena, sizeof(char*) * (nenv + n + 1));
+    int k = 0;
+
+    for (int i = 0; i < nenv; i++) {
+        size_t len = strchr(env[i], '=') - env[i] + 1;
+        bool replaced = false;
+        for (int j = 0; j < n && !replaced; j++)
+            replaced = !strncmp(env[i], assigns[j], len);
+        if (!replaced)
+            overlay[k++] = env[i];
+    }
+    memcpy(&overlay[k], assigns, sizeof(char*) * n);
+    overlay[k + n] = NULL;
+    return overlay;
+}
+
+static int compare(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/* Print variables in the form they can be entered again, sorted by name. */
+void listvars(bool exported) {
+    char** entries = malloc(sizeof(char*) * (nvars + 1));
+    int n = 0;
+
+    for (int i = 0; i < nbuckets; i++)
+        for (var_t* v = buckets[i]; v; v = v->next)
+            if (v->exported || !exported)
+                entries[n++] = v->entry;
+    qsort(entries, n, sizeof(char*), compare);
+
+    for (int i = 0; i < n; i++)
+        safe_dprintf(STDOUT_FILENO, "%s%s\n", exported ? "export " : "",
+                     entries[i]);
+    free(entries);
+}
+
+/* Append value to a word that's going to be matched as a pattern, escaping
+ * characters that would be special in it. */
+static void appendvalue(strbuf_t* sb, const char* value) {
+    while (*value) {
+        size_t n = strcspn(value, "*?[\\");
+        strappn(sb, value, n);
+        value += n;
+        if (*value) {
+            strappn(sb, "\\", 1);
+            strappn(sb, value++, 1);
+        }
+    }
+}
+
+/* Substitute '$NAME', '${NAME}', '$?', '$#' and positional parameters, i.e.
+ * '$1' to '$9' or '${N}', in a word as marked by the lexer, see tokenize.
+ * Values are quoted, i.e. they're neither split nor matched as patterns.
+ * Result is allocated from arena. */
+char* expandvars(arena_t* arena, const char* word) {
+    static strbuf_t sb;
+    const char* p = word;
+
+    if (!strchr(word, '$'))
+        return (char*)word;
+
+    sb.len = 0;
+    strappn(&sb, "", 0);
+
+    while (*p) {
+        size_t n = strcspn(p, "$\\");
+        strappn(&sb, p, n);
+        p += n;
+
+        if (*p == '\\') {
+            strappn(&sb, p, p[1] ? 2 : 1);
+            p += p[1] ? 2 : 1;
+            continue;
+        }
+        if (*p == '\0')
+            break;
+
+        /* Dollar that doesn't start expansion stands for itself. */
+        const char* name = p + 1;
+        bool braced = *name == '{';
+        size_t len;
+
+        if (braced)
+            name++;
+        if (*name >= '1' && *name <= '9') {
+            /* Only braced number may have more than one digit. */
+            int n = 0;
+            for (len = 0; isdigit((uint8_t)name[len]) && (braced || !len);)
+                n = min(n * 10 + name[len++] - '0', INT_MAX / 10);
+            if (!braced || name[len] == '}') {
+                if (n >= 1 && n <= params.argc)
+                    appendvalue(&sb, params.argv[n - 1]);
+                p = name + len + braced;
+                continue;
+            }
+        } else if (*name == '?' || *name == '#') {
+            char code[16];
+            safe_snprintf(code, sizeof(code), "%d",
+                          *name == '?' ? last_exitcode : params.argc);
+            len = 1;
+            if (!braced || name[len] == '}') {
+                strapp(&sb, code);
+                p = name + len + braced;
+                continue;
+            }
+        } else if ((len = namelen(name)) && (!braced || name[len] == '}')) {
+            const char* value = lookupvar(name, len);
+            if (value)
+                appendvalue(&sb, value);
+            p = name + len + braced;
+            continue;
+        }
+
+        strappn(&sb, "$", 1);
+        p++;
+    }
+
+    return arena_strndup(arena, sb.str, sb.len);
+}
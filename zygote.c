@@ -0,0 +1,247 @@
+#include "shell.h"
+
+/* Optional spawn server, enabled by setting SHELL_ZYGOTE. It's forked when
+ * the shell starts, before history, caches and line editing fill its address
+ * space, and starts external commands on shell's behalf, so their start-up
+ * cost doesn't grow with the shell. Children are cloned with CLONE_PARENT,
+ * which makes them children of the shell, thus they're buried and controlled
+ * like any other. Requests go over a datagram socket, descriptors that the
+ * command gets are passed along with SCM_RIGHTS. Linux only. */
+
+#ifdef LINUX
+#include <sched.h>
+#include <sys/syscall.h>
+
+#define ZYGOTE_MSG 65536 /* longest request, including strings */
+#define ZYGOTE_FDS 16    /* most descriptors passed with a request */
+#define ZYGOTE_IOV 1024  /* most strings in a request, plus header */
+
+typedef struct {
+    pid_t pgid;     /* process group to join, 0 for own, -1 to keep */
+    sigset_t mask;  /* signal mask of the command */
+    int nfds;       /* descriptors passed along with request */
+    int target[ZYGOTE_FDS]; /* where each of them goes in the command */
+    int closed;     /* bitmask of standard streams to be closed */
+    int argc, envc; /* number of strings after path */
+} request_t;
+
+typedef struct {
+    pid_t pid;
+    int error; /* errno of failed clone or execve, 0 if command started */
+} reply_t;
+
+static int zygote_fd = -1; /* shell's end of the socket */
+
+/* Signals the zygote ignores and its children get back to default. */
+static const int zygote_sigs[] = {SIGINT,  SIGQUIT, SIGTSTP, SIGTTIN,
+                                   SIGTTOU, SIGHUP,  SIGPIPE};
+
+static noreturn void child(request_t* req, int* fds, char** argv,
+                           char** envp, int report) {
+    static const struct sigaction dfl = {.sa_handler = SIG_DFL};
+
+    for (size_t i = 0; i < sizeof(zygote_sigs) / sizeof(int); i++)
+        (void)sigaction(zygote_sigs[i], &dfl, NULL);
+    if (req->pgid >= 0)
+        (void)setpgid(0, req->pgid);
+    (void)sigprocmask(SIG_SETMASK, &req->mask, NULL);
+
+    /* Received descriptors are moved above the targets first, so that
+     * putting one in place doesn't overwrite another one. */
+    int base = 0;
+    for (int i = 0; i < req->nfds; i++)
+        base = max(base, max(fds[i], req->target[i]) + 1);
+    for (int i = 0; i < req->nfds; i++)
+        fds[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, base);
+    for (int fd = 0; fd < 3; fd++)
+        if (req->closed & (1 << fd))
+            (void)close(fd);
+    for (int i = 0; i < req->nfds; i++)
+        (void)dup2(fds[i], req->target[i]);
+
+    (void)execve(argv[-1], argv, envp);
+    int error = errno;
+    (void)write(report, &error, sizeof(error));
+    _exit(EXIT_NOTFOUND);
+}
+
+/* Carry out a single request, returns false when shell has gone away. */
+static bool serve(int sock) {
+    static char buf[ZYGOTE_MSG];
+    char cbuf[CMSG_SPACE(sizeof(int) * ZYGOTE_FDS)];
+    struct iovec iov = {.iov_base = buf, .iov_len = sizeof(buf)};
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = cbuf,
+                         .msg_controllen = sizeof(cbuf)};
+
+    ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0 && errno == EINTR)
+        return true;
+    if (n <= 0)
+        return false;
+
+    request_t* req = (request_t*)buf;
+    int fds[ZYGOTE_FDS];
+    int nfds = 0;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS) {
+        nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+    }
+    assert(nfds == req->nfds);
+
+    /* Path, arguments and environment follow the header in that order. */
+    char** vec = malloc(sizeof(char*) * (req->argc + req->envc + 3));
+    char* s = buf + sizeof(request_t);
+    for (int i = 0; i < req->argc + req->envc + 1; i++) {
+        vec[i + (i > req->argc)] = s;
+        s += strlen(s) + 1;
+    }
+    vec[req->argc + 1] = NULL;
+    vec[req->argc + req->envc + 2] = NULL;
+
+    reply_t reply = {.pid = -1};
+    int report[2];
+    if (pipe2(report, O_CLOEXEC) < 0) {
+        reply.error = errno;
+    } else {
+        reply.pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+        if (reply.pid == 0)
+            child(req, fds, vec + 1, vec + req->argc + 2, report[1]);
+        if (reply.pid < 0)
+            reply.error = errno;
+        close(report[1]);
+        /* Nothing is read once the command has been executed. */
+        while (reply.pid > 0 &&
+               read(report[0], &reply.error, sizeof(reply.error)) < 0 &&
+               errno == EINTR)
+            continue;
+        close(report[0]);
+    }
+
+    for (int i = 0; i < nfds; i++)
+        close(fds[i]);
+    free(vec);
+
+    while (send(sock, &reply, sizeof(reply), 0) < 0)
+        if (errno != EINTR)
+            return false;
+    return true;
+}
+
+void initzygote(void) {
+    if (getvar("SHELL_ZYGOTE") == NULL)
+        return;
+
+    int sv[2];
+    Socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv);
+
+    if (Fork()) {
+        Close(sv[1]);
+        zygote_fd = sv[0];
+        return;
+    }
+
+    Close(sv[0]);
+    for (size_t i = 0; i < sizeof(zygote_sigs) / sizeof(int); i++)
+        Signal(zygote_sigs[i], SIG_IGN);
+    while (serve(sv[1]))
+        continue;
+    _exit(0);
+}
+
+/* Forked copy of the shell must not use the zygote, as it's not the parent
+ * of commands that are cloned. */
+void dropzygote(void) {
+    if (zygote_fd >= 0)
+        close(zygote_fd);
+    zygote_fd = -1;
+}
+
+/* Start a command through the zygote. Standard stream i of the command
+ * becomes stdfd[i], or stays that of the shell if it's -1, or gets closed if
+ * it's any other negative number. Descriptors in fds are inherited under the
+ * same numbers. Returns 0 and pid of the command through pidp, error code of
+ * execve or ENOSYS if the command should be started in some other way. */
+int zygote_spawn(pid_t* pidp, const char* path, char** argv, char** envp,
+                 pid_t pgid, const sigset_t* mask, const int* stdfd,
+                 const int* fds, int nfds) {
+    if (zygote_fd < 0 || nfds + 3 > ZYGOTE_FDS)
+        return ENOSYS;
+
+    request_t req = {.pgid = pgid, .mask = *mask};
+    int sent[ZYGOTE_FDS];
+    for (int fd = 0; fd < 3; fd++) {
+        if (stdfd[fd] < -1) {
+            req.closed |= 1 << fd;
+            continue;
+        }
+        sent[req.nfds] = stdfd[fd] >= 0 ? stdfd[fd] : fd;
+        req.target[req.nfds++] = fd;
+    }
+    for (int i = 0; i < nfds; i++) {
+        sent[req.nfds] = fds[i];
+        req.target[req.nfds++] = fds[i];
+    }
+
+    static struct iovec iov[ZYGOTE_IOV];
+    size_t len = sizeof(req);
+    int niov = 0;
+    iov[niov++] = (struct iovec){.iov_base = &req, .iov_len = sizeof(req)};
+    iov[niov++] = (struct iovec){.iov_base = (char*)path,
+                                 .iov_len = strlen(path) + 1};
+    for (char** v = argv; *v && niov < ZYGOTE_IOV; v++, req.argc++)
+        iov[niov++] = (struct iovec){.iov_base = *v, .iov_len = strlen(*v) + 1};
+    for (char** v = envp; *v && niov < ZYGOTE_IOV; v++, req.envc++)
+        iov[niov++] = (struct iovec){.iov_base = *v, .iov_len = strlen(*v) + 1};
+    for (int i = 1; i < niov; i++)
+        len += iov[i].iov_len;
+    /* Huge command lines go the usual way. */
+    if (niov == ZYGOTE_IOV || len > ZYGOTE_MSG)
+        return ENOSYS;
+
+    char cbuf[CMSG_SPACE(sizeof(int) * ZYGOTE_FDS)] = {};
+    struct msghdr msg = {.msg_iov = iov,
+                         .msg_iovlen = niov,
+                         .msg_control = cbuf,
+                         .msg_controllen = CMSG_SPACE(sizeof(int) * req.nfds)};
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * req.nfds);
+    memcpy(CMSG_DATA(cmsg), sent, sizeof(int) * req.nfds);
+
+    reply_t reply;
+    ssize_t n;
+    while ((n = sendmsg(zygote_fd, &msg, 0)) < 0 && errno == EINTR)
+        continue;
+    if (n >= 0)
+        while ((n = recv(zygote_fd, &reply, sizeof(reply), 0)) < 0 &&
+               errno == EINTR)
+            continue;
+
+    /* Zygote is gone, the shell carries on without it. */
+    if (n != sizeof(reply)) {
+        close(zygote_fd);
+        zygote_fd = -1;
+        return ENOSYS;
+    }
+
+    *pidp = reply.pid;
+    return reply.error;
+}
+#else
+void initzygote(void) {
+}
+
+void dropzygote(void) {
+}
+
+int zygote_spawn(pid_t* pidp, const char* path, char** argv, char** envp,
+                 pid_t pgid, const sigset_t* mask, const int* stdfd,
+                 const int* fds, int nfds) {
+    return ENOSYS;
+}
+#endif